@@ -2,6 +2,7 @@
 #include <fstream>
 #include <filesystem>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <algorithm>
 #include <numeric>
@@ -9,7 +10,46 @@
 #include <chrono>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <array>
+#include <memory>
 #include <iomanip>
+#include <string_view>
+#include <charconv>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <csignal>
+#include <limits>
+#include <cctype>
+#include <tuple>
+#include <functional>
+#include <system_error>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/vfs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fnmatch.h>
+#include <time.h>
 #include "picosha2.h"
 namespace fs = std::filesystem;
 
@@ -26,6 +66,7 @@ std::unordered_map<std::string, FileType> fileTypeMap = {
     {".mp4", FileType::Video},
     {".avi", FileType::Video},
     {".jpg", FileType::Image},
+    {".jpeg", FileType::Image},
     {".png", FileType::Image},
     {".docx", FileType::Document},
     // Add more mappings for other file types
@@ -34,10 +75,13 @@ std::unordered_map<std::string, FileType> fileTypeMap = {
 struct FileExtension
 {
     std::string extension;
-    unsigned long long size;
+    unsigned long long size = 0;
+    unsigned long long files = 0;
+    unsigned long long allocated = 0; // disk space of the files' blocks
 };
 // Global variable to store the temporary directory name
 const std::string TRASH_DIR_NAME = "Trash";
+const std::string DELETION_JOURNAL_NAME = ".deletion-plan";
 
 // Function to convert std::filesystem::file_time_type to time_t
 std::time_t to_time_t(const std::filesystem::file_time_type &ftime)
@@ -46,238 +90,2713 @@ std::time_t to_time_t(const std::filesystem::file_time_type &ftime)
     return std::chrono::system_clock::to_time_t(sctp);
 }
 
-std::string sizeToString(unsigned long long sizeInBytes) {
-    static const char* suffixes[] = {"bytes", "KB", "MB", "GB"};
+// Function to write a human readable size ("12.34 MB") into buf without allocating.
+// buf must hold at least 32 characters; returns the number of characters written.
+size_t formatSize(unsigned long long sizeInBytes, char *buf)
+{
+    static const char *suffixes[] = {"bytes", "KB", "MB", "GB"};
     const int numSuffixes = sizeof(suffixes) / sizeof(suffixes[0]);
 
     int suffixIndex = 0;
-    double size = static_cast<double>(sizeInBytes);
-
-    while (size >= 1024 && suffixIndex < numSuffixes - 1) {
-        size /= 1024;
+    while (suffixIndex < numSuffixes - 1 && (sizeInBytes >> (10 * suffixIndex)) >= 1024)
+    {
         suffixIndex++;
     }
 
-    std::string result;
-    // if (suffixIndex == 0) {
-    //     result = std::to_string(size);
-    // } else {
-        std::ostringstream oss;
-        oss << std::fixed << std::setprecision(2) << size;
-        result = oss.str();
-   // }
+    // Fixed point with two decimals: the remainder is below 2^30, so rem * 100 cannot overflow
+    const unsigned shift = 10 * suffixIndex;
+    unsigned long long whole = sizeInBytes >> shift;
+    unsigned long long fraction = 0;
+    if (shift != 0)
+    {
+        const unsigned long long rem = sizeInBytes - (whole << shift);
+        fraction = (rem * 100 + (1ULL << (shift - 1))) >> shift;
+        if (fraction == 100)
+        {
+            ++whole;
+            fraction = 0;
+        }
+    }
 
-    return result + " " + suffixes[suffixIndex];
+    char *out = std::to_chars(buf, buf + 20, whole).ptr;
+    *out++ = '.';
+    *out++ = static_cast<char>('0' + fraction / 10);
+    *out++ = static_cast<char>('0' + fraction % 10);
+    *out++ = ' ';
+    const size_t suffixLength = std::strlen(suffixes[suffixIndex]);
+    std::memcpy(out, suffixes[suffixIndex], suffixLength);
+    return static_cast<size_t>(out - buf) + suffixLength;
 }
 
-// Function to perform manual cleanup of the Trash directory
-void manualCleanupTrashDirectory()
+std::string sizeToString(unsigned long long sizeInBytes) {
+    char buf[32];
+    return std::string(buf, formatSize(sizeInBytes, buf));
+}
+
+// Buffered writer for batch reports. Records are streamed as NDJSON or CSV into a fixed
+// buffer that is flushed with write(2), so emitting a record never allocates.
+class ReportWriter
 {
-    fs::path trashPath = fs::current_path() / TRASH_DIR_NAME;
-    if (fs::exists(trashPath) && fs::is_directory(trashPath))
+public:
+    enum class Format
     {
-        std::time_t now = std::time(nullptr);
-        bool deletedFiles = false;
+        Ndjson,
+        Csv
+    };
 
-        for (const auto &entry : fs::directory_iterator(trashPath))
+    static constexpr size_t MAX_COLUMNS = 16;
+
+    ReportWriter(int fd, Format format) : fd_(fd), format_(format) {}
+    ~ReportWriter() { flush(); }
+    ReportWriter(const ReportWriter &) = delete;
+    ReportWriter &operator=(const ReportWriter &) = delete;
+
+    // Declare the record schema; in CSV mode this also emits the header line
+    void setColumns(std::initializer_list<const char *> columns)
+    {
+        numColumns_ = 0;
+        for (const char *column : columns)
         {
-            if (fs::is_regular_file(entry))
+            if (numColumns_ < MAX_COLUMNS)
             {
-                std::time_t fileTime = to_time_t(fs::last_write_time(entry));
-                double timeDiffDays = std::difftime(now, fileTime) / (60 * 60 * 24);
-                if (timeDiffDays >= 7)
-                {
-                    fs::remove(entry.path());
-                    std::cout << "Deleted: " << entry.path().filename().string() << " from Trash directory (File exceeded 7 days).\n";
-                    deletedFiles = true;
-                }
+                columns_[numColumns_++] = column;
             }
         }
+        writeHeader();
+    }
 
-        if (!deletedFiles)
+    // Same for a schema known only at run time; the strings must outlive the records written
+    void setColumns(const std::vector<std::string> &columns)
+    {
+        numColumns_ = 0;
+        for (const auto &column : columns)
         {
-            std::cout << "No files found in the Trash directory that have not been recovered before 7 days.\n";
+            if (numColumns_ < MAX_COLUMNS)
+            {
+                columns_[numColumns_++] = column.c_str();
+            }
         }
+        writeHeader();
     }
-    else
+
+    void beginRecord()
     {
-        std::cout << "Trash directory does not exist or is empty. Nothing to clean up.\n";
+        column_ = 0;
+        if (format_ == Format::Ndjson)
+        {
+            put('{');
+        }
     }
-}
-// Function to move a file to the Trash directory
-void moveToTrash(const fs::path &filePath)
-{
-    fs::create_directory(TRASH_DIR_NAME);
-    fs::path trashPath = fs::current_path() / TRASH_DIR_NAME;
-    fs::rename(filePath, trashPath / filePath.filename());
-}
-// Function to recover a deleted file from the Trash directory
-void recoverDeletedFile()
-{
-    fs::path trashPath = fs::current_path() / TRASH_DIR_NAME;
 
-    if (!fs::exists(trashPath) || !fs::is_directory(trashPath))
+    void addString(std::string_view value)
     {
-        std::cout << "Trash directory is empty. No files to recover.\n";
-        return;
+        beginField();
+        if (format_ == Format::Ndjson)
+        {
+            putJsonString(value);
+        }
+        else
+        {
+            putCsvString(value);
+        }
     }
 
-    std::cout << "Files available in Trash directory:\n";
-    int fileNumber = 1;
-    std::vector<fs::path> filesToRecover;
+    void addNumber(unsigned long long value)
+    {
+        beginField();
+        char digits[24];
+        put(std::string_view(digits, std::to_chars(digits, digits + sizeof(digits), value).ptr - digits));
+    }
 
-    for (const auto &entry : fs::directory_iterator(trashPath))
+    void addSignedNumber(long long value)
     {
-        if (fs::is_regular_file(entry))
+        beginField();
+        char digits[24];
+        put(std::string_view(digits, std::to_chars(digits, digits + sizeof(digits), value).ptr - digits));
+    }
+
+    void addDouble(double value, int precision)
+    {
+        beginField();
+        char digits[64];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value, std::chars_format::fixed, precision);
+        put(std::string_view(digits, result.ec == std::errc() ? result.ptr - digits : 0));
+    }
+
+    void endRecord()
+    {
+        if (format_ == Format::Ndjson)
         {
-            std::cout << fileNumber << ". " << entry.path().filename().string() << '\n';
-            ++fileNumber;
-            filesToRecover.push_back(entry.path());
+            put('}');
         }
+        put('\n');
     }
 
-    std::cout << "Enter the numbers of the files you want to recover (space-separated), or 0 to cancel: ";
-    int fileToRecover;
-    while (std::cin >> fileToRecover && fileToRecover != 0)
+    void flush()
     {
-        if (fileToRecover >= 1 && fileToRecover <= fileNumber - 1)
+        writeAll(buffer_, used_);
+        used_ = 0;
+    }
+
+    bool failed() const { return failed_; }
+
+private:
+    void writeHeader()
+    {
+        if (format_ == Format::Csv)
         {
-            fs::path recoveredFilePath = filesToRecover[fileToRecover - 1];
-            fs::rename(recoveredFilePath, fs::current_path() / recoveredFilePath.filename());
-            std::cout << "File " << recoveredFilePath.filename().string() << " successfully recovered.\n";
+            for (size_t i = 0; i < numColumns_; ++i)
+            {
+                if (i != 0)
+                {
+                    put(',');
+                }
+                put(columns_[i]);
+            }
+            put('\n');
         }
-        else
+    }
+
+    void beginField()
+    {
+        if (column_ != 0)
         {
-            std::cout << "Invalid file number. Please enter a valid number or 0 to cancel.\n";
+            put(',');
         }
-        std::cout << "Enter more file numbers to recover, or 0 to cancel: ";
+        if (format_ == Format::Ndjson)
+        {
+            put('"');
+            put(column_ < numColumns_ ? columns_[column_] : "");
+            put("\":");
+        }
+        ++column_;
     }
-    std::cout << "File recovery process completed.\n";
-}
 
-
-void displayDuplicateFiles(const std::unordered_map<std::string, std::vector<fs::path>>& duplicateFiles) {
-    std::cout << "\nDuplicate Files:\n";
-    int groupNumber = 1;
-    for (const auto& [md5Hash, files] : duplicateFiles) { // Use std::string as the key type
-        std::cout << "Group " << groupNumber << " (MD5 Hash: " << md5Hash << "):\n";
-        for (size_t i = 0; i < files.size(); ++i) {
-            std::cout << i + 1 << ". " << files[i].filename().string() << '\n';
+    void put(char c)
+    {
+        if (used_ == sizeof(buffer_))
+        {
+            flush();
         }
-        ++groupNumber;
+        buffer_[used_++] = c;
     }
-}
-
-
-void deleteDuplicateFiles(const std::unordered_map<std::string, std::vector<fs::path>>& duplicateFiles) {
-    std::cout << "\nChoose group in which duplicate files to be deleted (0 to keep all): ";
-    int groupToDelete;
-    std::cin >> groupToDelete;
 
-    if (groupToDelete <= 0 || groupToDelete > static_cast<int>(duplicateFiles.size())) {
-        std::cout << "Invalid choice. No files deleted.\n";
-        return;
+    void put(std::string_view text)
+    {
+        if (used_ + text.size() > sizeof(buffer_))
+        {
+            flush();
+            if (text.size() > sizeof(buffer_))
+            {
+                writeAll(text.data(), text.size());
+                return;
+            }
+        }
+        std::memcpy(buffer_ + used_, text.data(), text.size());
+        used_ += text.size();
     }
 
-    auto it = duplicateFiles.begin();
-    std::advance(it, groupToDelete - 1);
-
-    std::cout << "Files in Group " << groupToDelete << ":\n";
-    for (size_t i = 0; i < it->second.size(); ++i) {
-        std::cout << i + 1 << ". " << it->second[i].filename().string() << '\n';
+    void writeAll(const char *data, size_t length)
+    {
+        size_t offset = 0;
+        while (offset < length && !failed_)
+        {
+            ssize_t written = ::write(fd_, data + offset, length - offset);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                failed_ = true;
+                break;
+            }
+            offset += static_cast<size_t>(written);
+        }
     }
 
-    std::cout << "Enter the serial numbers of files to KEEP (space-separated) followed by 0 at end, or 0 to delete all: ";
-    std::vector<int> filesToKeep;
-    int fileToKeep;
-    std::cin >> fileToKeep;
-    //if ( && fileToKeep != 0) {
-        if (fileToKeep >= 1 && fileToKeep <= static_cast<int>(it->second.size())) {
-            filesToKeep.push_back(fileToKeep);
-        } else {
-            std::cout << "Invalid file number. Please enter a valid number or 0 to delete all.\n";
+    // Paths are written byte for byte; only quotes, backslashes and control characters are escaped
+    void putJsonString(std::string_view value)
+    {
+        static const char hex[] = "0123456789abcdef";
+        put('"');
+        size_t runStart = 0;
+        for (size_t i = 0; i < value.size(); ++i)
+        {
+            const unsigned char c = static_cast<unsigned char>(value[i]);
+            if (c >= 0x20 && c != '"' && c != '\\')
+            {
+                continue;
+            }
+            put(value.substr(runStart, i - runStart));
+            runStart = i + 1;
+            if (c == '"' || c == '\\')
+            {
+                put('\\');
+                put(static_cast<char>(c));
+            }
+            else
+            {
+                const char escaped[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+                put(std::string_view(escaped, sizeof(escaped)));
+            }
         }
-    //}
+        put(value.substr(runStart));
+        put('"');
+    }
 
-    if (filesToKeep.empty()) {
-        // Delete all files in the group
-        for (size_t i = 0; i < it->second.size(); ++i) {
-            std::cout << "Moving to Trash: " << it->second[i].filename().string() << '\n';
-            moveToTrash(it->second[i]);
+    void putCsvString(std::string_view value)
+    {
+        if (value.find_first_of(",\"\r\n") == std::string_view::npos)
+        {
+            put(value);
+            return;
         }
-        std::cout << "All files in Group " << groupToDelete << " moved to Trash directory.\n";
-    } else {
-        // Delete files not marked to keep
-        for (size_t i = 0; i < it->second.size(); ++i) {
-            if (std::find(filesToKeep.begin(), filesToKeep.end(), i + 1) == filesToKeep.end()) {
-                std::cout << "Moving to Trash: " << it->second[i].filename().string() << '\n';
-                moveToTrash(it->second[i]);
+        put('"');
+        size_t runStart = 0;
+        for (size_t i = 0; i < value.size(); ++i)
+        {
+            if (value[i] == '"')
+            {
+                put(value.substr(runStart, i + 1 - runStart));
+                put('"');
+                runStart = i + 1;
             }
         }
-        std::cout << "Files moved to Trash directory.\n";
+        put(value.substr(runStart));
+        put('"');
     }
+
+    int fd_;
+    Format format_;
+    char buffer_[1 << 16];
+    size_t used_ = 0;
+    bool failed_ = false;
+    const char *columns_[MAX_COLUMNS] = {};
+    size_t numColumns_ = 0;
+    size_t column_ = 0;
+};
+
+// Hot-path metrics. Every thread owns a cache-line aligned block of counters that only it
+// writes (plain relaxed load/store, no locked instructions); readers sum all blocks.
+enum class Metric : unsigned
+{
+    Directories,
+    Files,
+    BytesRead,
+    BytesHashed,
+    Errors,
+    Pruned,    // directories skipped by scan rules without being opened
+    DirQueue,  // gauge: directories discovered but not yet read
+    HashQueue, // gauge: files waiting to be hashed
+    ReaddirNs,
+    StatNs,
+    ReadNs,
+    HashNs,
+    Count
+};
+
+struct alignas(64) ThreadMetrics
+{
+    std::atomic<unsigned long long> values[static_cast<unsigned>(Metric::Count)] = {};
+    // One tick per metric: with a shared tick, interleaved timers (one readdir per 16 stats)
+    // would alias and always sample the same kind of call
+    unsigned sampleTick[static_cast<unsigned>(Metric::Count)] = {};
+};
+
+std::mutex metricsRegistryMutex;
+std::deque<ThreadMetrics> metricsRegistry; // deque keeps blocks at stable addresses
+
+ThreadMetrics &threadMetrics()
+{
+    thread_local ThreadMetrics *block = []
+    {
+        std::lock_guard<std::mutex> lock(metricsRegistryMutex);
+        return &metricsRegistry.emplace_back();
+    }();
+    return *block;
 }
 
+// Function to add delta to a counter; gauges pass a negated delta and rely on wraparound
+inline void countMetric(Metric metric, unsigned long long delta = 1)
+{
+    auto &value = threadMetrics().values[static_cast<unsigned>(metric)];
+    value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
 
-void deleteLargeFiles(const std::vector<fs::path> &largeFiles)
+// Function to sum a counter over all threads
+unsigned long long readMetric(Metric metric)
 {
-    if (largeFiles.empty())
+    std::lock_guard<std::mutex> lock(metricsRegistryMutex);
+    unsigned long long total = 0;
+    for (const auto &block : metricsRegistry)
     {
-        std::cout << "No large files to delete.\n";
-        return;
+        total += block.values[static_cast<unsigned>(metric)].load(std::memory_order_relaxed);
     }
+    return total;
+}
 
-    while (true)
-    {
-        std::cout << "Choose which large file to delete (0 to keep all, -1 to exit): ";
-        int fileToDelete;
-        std::cin >> fileToDelete;
+inline unsigned long long monotonicNanos()
+{
+    return static_cast<unsigned long long>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
 
-        if (fileToDelete == -1)
+// Times one in every 2^shift operations and scales the sample up, so cheap syscalls such as
+// stat are not dominated by clock reads. Use shift 0 for large operations like 1 MB reads.
+class SampledTimer
+{
+public:
+    SampledTimer(Metric metric, unsigned shift) : metric_(metric), shift_(shift)
+    {
+        active_ = (threadMetrics().sampleTick[static_cast<unsigned>(metric)]++ & ((1u << shift) - 1)) == 0;
+        if (active_)
         {
-            std::cout << "Exiting delete mode.\n";
-            break;
+            start_ = monotonicNanos();
+        }
+    }
+    ~SampledTimer()
+    {
+        if (active_)
+        {
+            countMetric(metric_, (monotonicNanos() - start_) << shift_);
         }
+    }
+    SampledTimer(const SampledTimer &) = delete;
+    SampledTimer &operator=(const SampledTimer &) = delete;
 
-        if (fileToDelete == 0)
+private:
+    Metric metric_;
+    unsigned shift_;
+    bool active_;
+    unsigned long long start_ = 0;
+};
+
+inline double processCpuSeconds()
+{
+    timespec ts;
+    ::clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Wall and CPU time of one named phase (traversal, hashing, ...)
+struct PhaseTiming
+{
+    std::string name;
+    double wallSeconds;
+    double cpuSeconds;
+};
+
+std::mutex phaseTimingsMutex;
+std::vector<PhaseTiming> phaseTimings;
+
+// Records the wall and process CPU time spent between construction and destruction
+class MetricsPhase
+{
+public:
+    explicit MetricsPhase(const char *name)
+        : name_(name), wallStart_(std::chrono::steady_clock::now()), cpuStart_(processCpuSeconds()) {}
+    ~MetricsPhase()
+    {
+        const double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart_).count();
+        const double cpu = processCpuSeconds() - cpuStart_;
+        std::lock_guard<std::mutex> lock(phaseTimingsMutex);
+        // Phases that run once per batch add up under one name
+        auto it = std::find_if(phaseTimings.begin(), phaseTimings.end(), [&](const PhaseTiming &timing)
+                               { return timing.name == name_; });
+        if (it != phaseTimings.end())
         {
-            std::cout << "Keeping all large files.\n";
+            it->wallSeconds += wall;
+            it->cpuSeconds += cpu;
             return;
         }
+        phaseTimings.push_back({name_, wall, cpu});
+    }
+    MetricsPhase(const MetricsPhase &) = delete;
+    MetricsPhase &operator=(const MetricsPhase &) = delete;
 
-        if (fileToDelete < 1 || fileToDelete > static_cast<int>(largeFiles.size()))
+private:
+    const char *name_;
+    std::chrono::steady_clock::time_point wallStart_;
+    double cpuStart_;
+};
+
+// Background thread that redraws a one-line progress summary on stderr
+class ProgressReporter
+{
+public:
+    explicit ProgressReporter(std::chrono::milliseconds interval = std::chrono::milliseconds(500))
+        : interval_(interval), thread_([this]
+                                       { run(); }) {}
+    ~ProgressReporter()
+    {
         {
-            std::cout << "Invalid choice. Please enter a valid number or 0 to keep all.\n";
-            continue;
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
         }
+        wake_.notify_one();
+        thread_.join();
+        std::cerr << "\r\033[K";
+    }
+    ProgressReporter(const ProgressReporter &) = delete;
+    ProgressReporter &operator=(const ProgressReporter &) = delete;
 
-        auto it = largeFiles.begin() + fileToDelete - 1;
-        std::cout << "Deleting: " << fs::path(*it).filename().string() << '\n';
-        // Move the file to the Trash directory instead of deleting it
-        moveToTrash(*it);
+private:
+    void run()
+    {
+        auto last = std::chrono::steady_clock::now();
+        unsigned long long lastDirs = 0, lastFiles = 0, lastRead = 0;
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!wake_.wait_for(lock, interval_, [this]
+                               { return stopping_; }))
+        {
+            const auto now = std::chrono::steady_clock::now();
+            const double seconds = std::chrono::duration<double>(now - last).count();
+            const unsigned long long dirs = readMetric(Metric::Directories);
+            const unsigned long long files = readMetric(Metric::Files);
+            const unsigned long long bytesRead = readMetric(Metric::BytesRead);
+            char line[256];
+            char readText[32], rateText[32];
+            readText[formatSize(bytesRead, readText)] = '\0';
+            rateText[formatSize(static_cast<unsigned long long>((bytesRead - lastRead) / seconds), rateText)] = '\0';
+            std::snprintf(line, sizeof(line),
+                          "\r\033[Kdirs %llu (%.0f/s)  files %llu (%.0f/s)  read %s (%s/s)  queue dir=%lld hash=%lld  errors %llu",
+                          dirs, (dirs - lastDirs) / seconds, files, (files - lastFiles) / seconds, readText, rateText,
+                          static_cast<long long>(readMetric(Metric::DirQueue)),
+                          static_cast<long long>(readMetric(Metric::HashQueue)), readMetric(Metric::Errors));
+            std::cerr << line << std::flush;
+            last = now;
+            lastDirs = dirs;
+            lastFiles = files;
+            lastRead = bytesRead;
+        }
     }
-}
 
-// Function to compute MD5 hash of a file's content
-std::string computeFileMD5(const fs::path& filePath) {
-    std::ifstream file(filePath, std::ios::binary);
-    if (!file) {
-        return ""; // Return an empty string to indicate failure
+    std::chrono::milliseconds interval_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+// Function to write the final metrics summary: one totals record followed by one record per phase
+void writeMetricsSummary(ReportWriter &writer, double wallSeconds, double cpuSeconds)
+{
+    const unsigned long long dirs = readMetric(Metric::Directories);
+    const unsigned long long files = readMetric(Metric::Files);
+    writer.setColumns({"phase", "wall_seconds", "cpu_seconds", "directories", "files", "bytes_read", "bytes_hashed", "errors",
+                       "pruned_dirs", "dirs_per_sec", "files_per_sec", "readdir_seconds", "stat_seconds", "read_seconds", "hash_seconds"});
+    writer.beginRecord();
+    writer.addString("total");
+    writer.addDouble(wallSeconds, 6);
+    writer.addDouble(cpuSeconds, 6);
+    writer.addNumber(dirs);
+    writer.addNumber(files);
+    writer.addNumber(readMetric(Metric::BytesRead));
+    writer.addNumber(readMetric(Metric::BytesHashed));
+    writer.addNumber(readMetric(Metric::Errors));
+    writer.addNumber(readMetric(Metric::Pruned));
+    writer.addDouble(wallSeconds > 0 ? dirs / wallSeconds : 0.0, 1);
+    writer.addDouble(wallSeconds > 0 ? files / wallSeconds : 0.0, 1);
+    writer.addDouble(readMetric(Metric::ReaddirNs) / 1e9, 6);
+    writer.addDouble(readMetric(Metric::StatNs) / 1e9, 6);
+    writer.addDouble(readMetric(Metric::ReadNs) / 1e9, 6);
+    writer.addDouble(readMetric(Metric::HashNs) / 1e9, 6);
+    writer.endRecord();
+
+    std::lock_guard<std::mutex> lock(phaseTimingsMutex);
+    for (const auto &phase : phaseTimings)
+    {
+        writer.beginRecord();
+        writer.addString(phase.name);
+        writer.addDouble(phase.wallSeconds, 6);
+        writer.addDouble(phase.cpuSeconds, 6);
+        writer.endRecord();
     }
+}
 
-    std::string content(std::istreambuf_iterator<char>(file), {});
-    file.close();
+// System call that failed on a path, recorded next to its errno
+enum class ScanOp : unsigned char
+{
+    Stat,    // stat of a root or a directory entry
+    OpenDir, // opening or listing a directory
+    Read,    // opening or reading file contents
+    Statfs,  // capacity of a mount
+    Move,    // moving a file to the Trash directory
+    Write,   // creating files, history or spill data
+    Connect, // reaching the query daemon's socket
+};
 
-    return picosha2::hash256_hex_string(content);
+const char *scanOpName(ScanOp op)
+{
+    switch (op)
+    {
+    case ScanOp::Stat:
+        return "stat";
+    case ScanOp::OpenDir:
+        return "opendir";
+    case ScanOp::Read:
+        return "read";
+    case ScanOp::Statfs:
+        return "statfs";
+    case ScanOp::Move:
+        return "move";
+    case ScanOp::Connect:
+        return "connect";
+    default:
+        return "write";
+    }
 }
-// // Function to detect duplicate files using MD5 hashing
-// std::unordered_map<uintmax_t, std::vector<fs::path>> findDuplicateFiles(const fs::path &rootPath)
-// {
-//     std::unordered_map<uintmax_t, std::vector<fs::path>> duplicateFiles;
 
-//     for (const auto &entry : fs::recursive_directory_iterator(rootPath))
-//     {
-//         if (fs::is_regular_file(entry))
+// Failed system calls of one scan, deduplicated on (path, errno, operation). Paths are
+// interned once and referenced by a 32-bit id, so the same failure hit again and again costs
+// a counter increment instead of another string. Workers fill tables of their own and the
+// results are merged when they finish; nothing is printed until summarize().
+class ErrorTable
+{
+public:
+    struct Entry
+    {
+        uint32_t pathId;
+        int error; // errno, 0 when the call does not report one
+        ScanOp op;
+        unsigned long long count;
+    };
+
+    // paths_ points into ids_, so a copy would point into the original's map. A move keeps the
+    // map's nodes, and with them the pointers.
+    ErrorTable() = default;
+    ErrorTable(const ErrorTable &) = delete;
+    ErrorTable &operator=(const ErrorTable &) = delete;
+    ErrorTable(ErrorTable &&) = default;
+    ErrorTable &operator=(ErrorTable &&) = default;
+
+    // Function to record one failure and count it in the Errors metric
+    void record(std::string_view path, int error, ScanOp op)
+    {
+        countMetric(Metric::Errors);
+        insert(path, error, op, 1);
+    }
+
+    // Function to fold another table into this one; its failures were counted when recorded
+    void merge(const ErrorTable &other)
+    {
+        for (const Entry &entry : other.entries_)
+        {
+            insert(other.path(entry.pathId), entry.error, entry.op, entry.count);
+        }
+    }
+
+    bool empty() const { return entries_.empty(); }
+    size_t size() const { return entries_.size(); }
+    const std::vector<Entry> &entries() const { return entries_; }
+    std::string_view path(uint32_t id) const { return *paths_[id]; }
+
+    // Function to print one line per (operation, errno) with up to examples paths under each,
+    // largest groups first
+    void summarize(std::ostream &out, size_t examples = 10) const
+    {
+        if (entries_.empty())
+        {
+            return;
+        }
+        std::vector<size_t> order(entries_.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::unordered_map<uint64_t, unsigned long long> groupTotals;
+        auto groupOf = [&](size_t i)
+        { return static_cast<uint64_t>(static_cast<uint32_t>(entries_[i].error)) << 8 | static_cast<uint64_t>(entries_[i].op); };
+        for (size_t i = 0; i < entries_.size(); ++i)
+        {
+            groupTotals[groupOf(i)] += 1;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+                         {
+                             const uint64_t ga = groupOf(a), gb = groupOf(b);
+                             const unsigned long long ta = groupTotals[ga], tb = groupTotals[gb];
+                             return ta != tb ? ta > tb : ga < gb; });
+
+        out << entries_.size() << " inaccessible entries:\n";
+        for (size_t begin = 0; begin < order.size();)
+        {
+            const uint64_t group = groupOf(order[begin]);
+            size_t end = begin;
+            while (end < order.size() && groupOf(order[end]) == group)
+            {
+                ++end;
+            }
+            const Entry &first = entries_[order[begin]];
+            out << "  " << scanOpName(first.op) << ": " << (first.error ? std::strerror(first.error) : "failed") << " ("
+                << end - begin << (end - begin == 1 ? " path)\n" : " paths)\n");
+            for (size_t i = begin; i < end && i < begin + examples; ++i)
+            {
+                const Entry &entry = entries_[order[i]];
+                out << "    " << path(entry.pathId);
+                if (entry.count > 1)
+                {
+                    out << " (x" << entry.count << ')';
+                }
+                out << '\n';
+            }
+            if (end - begin > examples)
+            {
+                out << "    ... and " << end - begin - examples << " more\n";
+            }
+            begin = end;
+        }
+    }
+
+private:
+    void insert(std::string_view path, int error, ScanOp op, unsigned long long count)
+    {
+        auto [idIt, newPath] = ids_.try_emplace(std::string(path), static_cast<uint32_t>(paths_.size()));
+        if (newPath)
+        {
+            paths_.push_back(&idIt->first);
+        }
+        const uint64_t key = static_cast<uint64_t>(idIt->second) << 32 |
+                             static_cast<uint64_t>(static_cast<uint32_t>(error) & 0xffffff) << 8 | static_cast<uint64_t>(op);
+        auto [slot, newEntry] = index_.try_emplace(key, entries_.size());
+        if (newEntry)
+        {
+            entries_.push_back({idIt->second, error, op, count});
+        }
+        else
+        {
+            entries_[slot->second].count += count;
+        }
+    }
+
+    std::unordered_map<std::string, uint32_t> ids_;
+    std::vector<const std::string *> paths_; // keys of ids_, which stay put while the map grows
+    std::unordered_map<uint64_t, size_t> index_;
+    std::vector<Entry> entries_;
+};
+
+// Seconds this thread has spent sleeping in token buckets, so workers can tell how fast
+// they would run unthrottled
+thread_local double throttleWaitSeconds = 0.0;
+
+// Token bucket with a debt model: acquire() always succeeds immediately and the caller then
+// sleeps exactly as long as it takes to repay what it overdrew, so pacing stays smooth
+// instead of stalling in coarse chunks. A rate of 0 means unlimited.
+class TokenBucket
+{
+public:
+    void setRate(double perSecond)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        rate_ = perSecond;
+        tokens_ = std::min(tokens_, burst());
+        last_ = std::chrono::steady_clock::now();
+    }
+
+    double rate() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return rate_;
+    }
+
+    void acquire(double count)
+    {
+        double waitSeconds;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (rate_ <= 0)
+            {
+                return;
+            }
+            const auto now = std::chrono::steady_clock::now();
+            tokens_ = std::min(burst(), tokens_ + std::chrono::duration<double>(now - last_).count() * rate_);
+            last_ = now;
+            tokens_ -= count;
+            if (tokens_ >= 0)
+            {
+                return;
+            }
+            waitSeconds = -tokens_ / rate_;
+        }
+        std::this_thread::sleep_for(std::chrono::duration<double>(waitSeconds));
+        throttleWaitSeconds += waitSeconds;
+    }
+
+private:
+    double burst() const { return rate_ * 0.1; } // at most 100 ms worth of work in one burst
+
+    mutable std::mutex mutex_;
+    double rate_ = 0.0;
+    double tokens_ = 0.0;
+    std::chrono::steady_clock::time_point last_ = std::chrono::steady_clock::now();
+};
+
+// Limits a throttled scan runs under; 0 means unlimited
+struct ThrottleLimits
+{
+    double readBytesPerSecond = 0;
+    double metadataOpsPerSecond = 0;
+    unsigned workers = 0;
+};
+
+std::atomic<bool> throttleReloadRequested{false};
+
+extern "C" void requestThrottleReload(int)
+{
+    throttleReloadRequested.store(true, std::memory_order_relaxed);
+}
+
+// Function to parse sizes such as "512K", "50M" or "1G" (powers of 1024)
+double parseScaledNumber(const std::string &text)
+{
+    char *end = nullptr;
+    double value = std::strtod(text.c_str(), &end);
+    switch (end && *end ? std::toupper(static_cast<unsigned char>(*end)) : 0)
+    {
+    case 'G':
+        value *= 1024;
+        [[fallthrough]];
+    case 'M':
+        value *= 1024;
+        [[fallthrough]];
+    case 'K':
+        value *= 1024;
+        break;
+    default:
+        break;
+    }
+    return value;
+}
+
+// I/O and CPU throttle shared by the traversal and hashing engines. Limits can be changed
+// while a scan runs by editing the control file (checked every second) or sending SIGHUP.
+// Hash workers park themselves when the limits mean fewer of them can be kept busy.
+class Throttle
+{
+public:
+    Throttle(const ThrottleLimits &limits, std::string controlPath) : controlPath_(std::move(controlPath))
+    {
+        apply(limits);
+        if (!controlPath_.empty())
+        {
+            std::signal(SIGHUP, requestThrottleReload);
+            reloadControlFile();
+        }
+    }
+
+    void acquireBytes(unsigned long long count)
+    {
+        pollControl();
+        bytes_.acquire(static_cast<double>(count));
+    }
+
+    void acquireMetadata()
+    {
+        pollControl();
+        metadata_.acquire(1.0);
+    }
+
+    // Read size that keeps pacing fine grained: about 20 ms of the byte budget per read
+    size_t readSize(size_t maximum) const
+    {
+        const double rate = bytes_.rate();
+        if (rate <= 0)
+        {
+            return maximum;
+        }
+        const size_t size = static_cast<size_t>(rate / 50) & ~size_t(4095);
+        return std::clamp<size_t>(size, 64 * 1024, maximum);
+    }
+
+    // Threads to start for a pool that would otherwise run workers of them. With a control
+    // file the pool starts at the core count so a later workers= can raise concurrency too;
+    // the threads above the current limit stay parked in admitWorker until then
+    unsigned poolSize(unsigned workers) const
+    {
+        if (controlPath_.empty())
+        {
+            return workers;
+        }
+        return std::max(workers, std::max(1u, std::thread::hardware_concurrency()));
+    }
+
+    // Blocks worker number index while it is above the current concurrency, which is the
+    // workers limit or the pool's own default when none is set; returns false once stop()
+    // has been called or done() reports the work is finished
+    template <typename Done>
+    bool admitWorker(unsigned index, unsigned defaultWorkers, Done &&done)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stopped_ && !done() && index >= effectiveWorkersLocked(defaultWorkers))
+        {
+            lock.unlock();
+            pollControl();
+            lock.lock();
+            workersChanged_.wait_for(lock, std::chrono::milliseconds(200));
+        }
+        return !stopped_ && !done();
+    }
+
+    // Workers report how fast they hash while not waiting for tokens; the byte limit divided
+    // by that rate is the number of workers worth keeping awake
+    void reportWorkerThroughput(unsigned long long bytes, double busySeconds)
+    {
+        if (busySeconds <= 0 || bytes == 0)
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        const double rate = bytes / busySeconds;
+        perWorkerRate_ = perWorkerRate_ > 0 ? 0.8 * perWorkerRate_ + 0.2 * rate : rate;
+    }
+
+    void stop()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopped_ = true;
+        workersChanged_.notify_all();
+    }
+
+private:
+    unsigned effectiveWorkersLocked(unsigned defaultWorkers) const
+    {
+        unsigned workers = limits_.workers ? limits_.workers : defaultWorkers;
+        if (limits_.readBytesPerSecond > 0 && perWorkerRate_ > 0)
+        {
+            const double needed = std::ceil(limits_.readBytesPerSecond / perWorkerRate_);
+            workers = std::min<unsigned>(workers, static_cast<unsigned>(std::max(1.0, needed)));
+        }
+        return workers;
+    }
+
+    void apply(const ThrottleLimits &limits)
+    {
+        bytes_.setRate(limits.readBytesPerSecond);
+        metadata_.setRate(limits.metadataOpsPerSecond);
+        std::lock_guard<std::mutex> lock(mutex_);
+        limits_ = limits;
+        workersChanged_.notify_all();
+    }
+
+    void pollControl()
+    {
+        if (controlPath_.empty())
+        {
+            return;
+        }
+        const unsigned long long now = monotonicNanos();
+        if (!throttleReloadRequested.exchange(false, std::memory_order_relaxed))
+        {
+            unsigned long long due = nextControlCheck_.load(std::memory_order_relaxed);
+            if (now < due || !nextControlCheck_.compare_exchange_strong(due, now + 1000000000ULL))
+            {
+                return;
+            }
+            struct stat st;
+            if (::stat(controlPath_.c_str(), &st) != 0 || st.st_mtime == controlMtime_.load())
+            {
+                return;
+            }
+        }
+        reloadControlFile();
+    }
+
+    // Control file lines: read_rate=50M, metadata_rate=2000, workers=2
+    void reloadControlFile()
+    {
+        std::ifstream control(controlPath_);
+        struct stat st;
+        if (!control || ::stat(controlPath_.c_str(), &st) != 0)
+        {
+            return;
+        }
+        controlMtime_.store(st.st_mtime);
+        ThrottleLimits limits;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            limits = limits_;
+        }
+        std::string line;
+        while (std::getline(control, line))
+        {
+            const size_t equals = line.find('=');
+            if (equals == std::string::npos || line[0] == '#')
+            {
+                continue;
+            }
+            const std::string key = line.substr(0, equals);
+            const double value = parseScaledNumber(line.substr(equals + 1));
+            if (key == "read_rate")
+            {
+                limits.readBytesPerSecond = value;
+            }
+            else if (key == "metadata_rate")
+            {
+                limits.metadataOpsPerSecond = value;
+            }
+            else if (key == "workers")
+            {
+                limits.workers = static_cast<unsigned>(value);
+            }
+        }
+        apply(limits);
+    }
+
+    TokenBucket bytes_;
+    TokenBucket metadata_;
+    std::string controlPath_;
+    std::atomic<long long> controlMtime_{0};
+    std::atomic<unsigned long long> nextControlCheck_{0};
+    std::mutex mutex_;
+    std::condition_variable workersChanged_;
+    ThrottleLimits limits_;
+    double perWorkerRate_ = 0.0;
+    bool stopped_ = false;
+};
+
+std::atomic<bool> scanInterruptRequested{false};
+std::atomic<bool> scanPauseRequested{false};
+
+// Ctrl-C stops the scan at the next directory or file; a second Ctrl-C ends the process
+extern "C" void requestScanInterrupt(int)
+{
+    scanInterruptRequested.store(true, std::memory_order_relaxed);
+    std::signal(SIGINT, SIG_DFL);
+}
+
+extern "C" void requestScanPause(int)
+{
+    scanPauseRequested.store(true, std::memory_order_relaxed);
+}
+
+extern "C" void requestScanResume(int)
+{
+    scanPauseRequested.store(false, std::memory_order_relaxed);
+}
+
+// Cooperative cancellation, pause and budgets for one run. The walkers ask proceed() before
+// opening each directory and the worker pools before each file, so a stop never cuts a system
+// call short: every directory is either listed completely or left for the checkpoint, and
+// every file is either hashed or untouched. SIGINT cancels, SIGUSR1 pauses, SIGUSR2 resumes.
+class ScanControl
+{
+public:
+    enum class Stop
+    {
+        None,
+        Cancelled,
+        TimeBudget,
+        ByteBudget,
+    };
+
+    // Function to route SIGINT, SIGUSR1 and SIGUSR2 to the control flags
+    static void installSignalHandlers()
+    {
+        scanInterruptRequested.store(false, std::memory_order_relaxed);
+        std::signal(SIGINT, requestScanInterrupt);
+        std::signal(SIGUSR1, requestScanPause);
+        std::signal(SIGUSR2, requestScanResume);
+    }
+
+    static void restoreSignalHandlers()
+    {
+        std::signal(SIGINT, SIG_DFL);
+        std::signal(SIGUSR1, SIG_DFL);
+        std::signal(SIGUSR2, SIG_DFL);
+    }
+
+    // Wall-clock budget from now; time spent paused counts, so a maintenance window ends on time
+    void setTimeBudget(double seconds)
+    {
+        deadline_ = monotonicNanos() + static_cast<unsigned long long>(seconds * 1e9);
+    }
+
+    // Budget of file content bytes read from now on
+    void setByteBudget(unsigned long long bytes)
+    {
+        byteLimit_ = readMetric(Metric::BytesRead) + bytes;
+    }
+
+    void cancel() { requestStop(Stop::Cancelled); }
+    void pause() { paused_.store(true, std::memory_order_relaxed); }
+    void resume() { paused_.store(false, std::memory_order_relaxed); }
+
+    // Function to check, without waiting, whether the run has to stop
+    bool stopped()
+    {
+        if (stop_.load(std::memory_order_relaxed) != Stop::None)
+        {
+            return true;
+        }
+        if (scanInterruptRequested.load(std::memory_order_relaxed))
+        {
+            return requestStop(Stop::Cancelled);
+        }
+        if (deadline_ != 0 && monotonicNanos() >= deadline_)
+        {
+            return requestStop(Stop::TimeBudget);
+        }
+        if (byteLimit_ != 0)
+        {
+            // Summing the per-thread counters takes a lock, so the byte budget is checked every 10 ms
+            const unsigned long long now = monotonicNanos();
+            unsigned long long due = nextByteCheck_.load(std::memory_order_relaxed);
+            if (now >= due && nextByteCheck_.compare_exchange_strong(due, now + 10000000ULL) &&
+                readMetric(Metric::BytesRead) >= byteLimit_)
+            {
+                return requestStop(Stop::ByteBudget);
+            }
+        }
+        return false;
+    }
+
+    // Function to wait while the run is paused; returns false once it has to stop
+    bool proceed()
+    {
+        while (paused_.load(std::memory_order_relaxed) || scanPauseRequested.load(std::memory_order_relaxed))
+        {
+            if (stopped())
+            {
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        return !stopped();
+    }
+
+    Stop reason() const { return stop_.load(std::memory_order_relaxed); }
+
+    const char *reasonName() const
+    {
+        switch (reason())
+        {
+        case Stop::Cancelled:
+            return "cancelled";
+        case Stop::TimeBudget:
+            return "time budget used up";
+        case Stop::ByteBudget:
+            return "I/O budget used up";
+        default:
+            return "finished";
+        }
+    }
+
+    // Function to remember a directory a walker skipped because of the stop
+    void deferDirectory(std::string_view path)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        deferred_.emplace_back(path);
+    }
+
+    std::vector<std::string> takeDeferred()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return std::move(deferred_);
+    }
+
+private:
+    bool requestStop(Stop reason)
+    {
+        Stop expected = Stop::None;
+        stop_.compare_exchange_strong(expected, reason);
+        return true;
+    }
+
+    std::atomic<Stop> stop_{Stop::None};
+    std::atomic<bool> paused_{false};
+    unsigned long long deadline_ = 0;
+    unsigned long long byteLimit_ = 0;
+    std::atomic<unsigned long long> nextByteCheck_{0};
+    std::mutex mutex_;
+    std::vector<std::string> deferred_;
+};
+
+// Content hash of a file as it was when a stopped run hashed it
+struct CheckpointHash
+{
+    unsigned long long size;
+    long long mtime;
+    unsigned char digest[32];
+};
+
+// Progress of one root: the directories still to list and, for breakdown, the totals so far
+struct CheckpointRoot
+{
+    std::string path;
+    std::vector<std::string> pending; // empty once the root is done
+    std::vector<FileExtension> totals;
+};
+
+// Partial result of a run stopped by Ctrl-C or a budget, kept in the --checkpoint file so the
+// next run continues instead of starting over. Records are runs of NUL-terminated fields, so
+// any path is stored as it is:
+//   C command          the command that wrote the checkpoint
+//   R root             a root; the P and T records after it belong to it
+//   P directory        a directory not listed yet
+//   T extension files bytes
+//   A allocated        allocated bytes of the T record before it
+//   H size mtime sha256 path   a file dupes has already hashed
+class ScanCheckpoint
+{
+public:
+    std::string command;
+    std::vector<CheckpointRoot> roots;
+    std::unordered_map<std::string, CheckpointHash> hashes;
+
+    // Function to read a checkpoint; a missing file leaves it empty and succeeds
+    bool load(const std::string &path, std::string &error)
+    {
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == ENOENT)
+            {
+                return true;
+            }
+            error = "cannot open " + path + ": " + std::strerror(errno);
+            return false;
+        }
+        std::string contents;
+        char buffer[1 << 16];
+        ssize_t got;
+        while ((got = ::read(fd, buffer, sizeof(buffer))) != 0)
+        {
+            if (got < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (got < 0)
+            {
+                error = "cannot read " + path + ": " + std::strerror(errno);
+                ::close(fd);
+                return false;
+            }
+            contents.append(buffer, static_cast<size_t>(got));
+        }
+        ::close(fd);
+        size_t position = 0;
+        auto field = [&](std::string &out)
+        {
+            const size_t end = contents.find('\0', position);
+            if (end == std::string::npos)
+            {
+                return false;
+            }
+            out.assign(contents, position, end - position);
+            position = end + 1;
+            return true;
+        };
+        auto number = [&](unsigned long long &out)
+        {
+            std::string text;
+            return field(text) && std::from_chars(text.data(), text.data() + text.size(), out).ec == std::errc();
+        };
+
+        std::string type;
+        if (!field(type) || type != MAGIC)
+        {
+            error = path + " is not a checkpoint";
+            return false;
+        }
+        while (position < contents.size())
+        {
+            bool ok = field(type) && type.size() == 1;
+            std::string text;
+            if (ok && type[0] == 'C')
+            {
+                ok = field(command);
+            }
+            else if (ok && type[0] == 'R')
+            {
+                roots.emplace_back();
+                ok = field(roots.back().path);
+            }
+            else if (ok && type[0] == 'P' && !roots.empty())
+            {
+                ok = field(text);
+                roots.back().pending.push_back(std::move(text));
+            }
+            else if (ok && type[0] == 'T' && !roots.empty())
+            {
+                FileExtension ft;
+                ok = field(ft.extension) && number(ft.files) && number(ft.size);
+                // Checkpoints written before allocated sizes were tracked have no A records
+                ft.allocated = ft.size;
+                roots.back().totals.push_back(std::move(ft));
+            }
+            else if (ok && type[0] == 'A' && !roots.empty() && !roots.back().totals.empty())
+            {
+                ok = number(roots.back().totals.back().allocated);
+            }
+            else if (ok && type[0] == 'H')
+            {
+                CheckpointHash hash;
+                unsigned long long mtime = 0;
+                std::string hex;
+                ok = number(hash.size) && number(mtime) && field(hex) && hex.size() == 64 && field(text);
+                for (size_t b = 0; ok && b < sizeof(hash.digest); ++b)
+                {
+                    ok = std::from_chars(hex.data() + 2 * b, hex.data() + 2 * b + 2, hash.digest[b], 16).ec == std::errc();
+                }
+                hash.mtime = static_cast<long long>(mtime);
+                hashes.emplace(std::move(text), hash);
+            }
+            else
+            {
+                ok = false;
+            }
+            if (!ok)
+            {
+                error = path + " is damaged";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Function to replace the checkpoint file; it is written beside the old one and renamed
+    // over it, so a crash leaves either checkpoint intact
+    bool save(const std::string &path, std::string &error) const
+    {
+        std::string out = MAGIC;
+        out += '\0';
+        auto put = [&](std::string_view text)
+        {
+            out.append(text.data(), text.size());
+            out += '\0';
+        };
+        put("C");
+        put(command);
+        for (const auto &root : roots)
+        {
+            put("R");
+            put(root.path);
+            for (const auto &directory : root.pending)
+            {
+                put("P");
+                put(directory);
+            }
+            for (const auto &ft : root.totals)
+            {
+                put("T");
+                put(ft.extension);
+                put(std::to_string(ft.files));
+                put(std::to_string(ft.size));
+                put("A");
+                put(std::to_string(ft.allocated));
+            }
+        }
+        for (const auto &[file, hash] : hashes)
+        {
+            put("H");
+            put(std::to_string(hash.size));
+            put(std::to_string(static_cast<unsigned long long>(hash.mtime)));
+            put(picosha2::bytes_to_hex_string(std::begin(hash.digest), std::end(hash.digest)));
+            put(file);
+        }
+
+        const std::string temporary = path + ".tmp";
+        const int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            error = "cannot create " + temporary + ": " + std::strerror(errno);
+            return false;
+        }
+        size_t done = 0;
+        while (done < out.size())
+        {
+            const ssize_t written = ::write(fd, out.data() + done, out.size() - done);
+            if (written < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (written < 0)
+            {
+                error = "cannot write " + temporary + ": " + std::strerror(errno);
+                ::close(fd);
+                return false;
+            }
+            done += written;
+        }
+        const bool synced = ::fsync(fd) == 0;
+        ::close(fd);
+        if (!synced || ::rename(temporary.c_str(), path.c_str()) != 0)
+        {
+            error = "cannot save " + path + ": " + std::strerror(errno);
+            return false;
+        }
+        return true;
+    }
+
+    CheckpointRoot *findRoot(const std::string &path)
+    {
+        auto it = std::find_if(roots.begin(), roots.end(), [&](const CheckpointRoot &root)
+                               { return root.path == path; });
+        return it != roots.end() ? &*it : nullptr;
+    }
+
+private:
+    inline static const std::string MAGIC = "DMCKPT1";
+};
+
+// Function to lower the process' I/O and CPU priority before any worker threads are started,
+// so they inherit it. ioprioClass is "idle", "be:<0-7>" or empty to leave it unchanged.
+void applyProcessPriority(const std::string &ioprioClass, int niceLevel)
+{
+#ifdef __linux__
+    if (!ioprioClass.empty())
+    {
+        const int IOPRIO_CLASS_SHIFT = 13;
+        const int IOPRIO_CLASS_BE = 2;
+        const int IOPRIO_CLASS_IDLE = 3;
+        const int IOPRIO_WHO_PROCESS = 1;
+        int value = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+        if (ioprioClass.rfind("be:", 0) == 0)
+        {
+            value = (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | std::clamp(std::atoi(ioprioClass.c_str() + 3), 0, 7);
+        }
+        if (::syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, value) != 0)
+        {
+            std::cerr << "ioprio_set failed: " << std::strerror(errno) << '\n';
+        }
+    }
+#else
+    (void)ioprioClass;
+#endif
+    if (niceLevel != 0 && ::setpriority(PRIO_PROCESS, 0, niceLevel) != 0)
+    {
+        std::cerr << "setpriority failed: " << std::strerror(errno) << '\n';
+    }
+}
+
+// Function to perform manual cleanup of the Trash directory
+void manualCleanupTrashDirectory()
+{
+    fs::path trashPath = fs::current_path() / TRASH_DIR_NAME;
+    if (fs::exists(trashPath) && fs::is_directory(trashPath))
+    {
+        std::time_t now = std::time(nullptr);
+        bool deletedFiles = false;
+
+        for (const auto &entry : fs::directory_iterator(trashPath))
+        {
+            if (fs::is_regular_file(entry) && entry.path().filename() != DELETION_JOURNAL_NAME)
+            {
+                std::time_t fileTime = to_time_t(fs::last_write_time(entry));
+                double timeDiffDays = std::difftime(now, fileTime) / (60 * 60 * 24);
+                if (timeDiffDays >= 7)
+                {
+                    fs::remove(entry.path());
+                    std::cout << "Deleted: " << entry.path().filename().string() << " from Trash directory (File exceeded 7 days).\n";
+                    deletedFiles = true;
+                }
+            }
+        }
+
+        if (!deletedFiles)
+        {
+            std::cout << "No files found in the Trash directory that have not been recovered before 7 days.\n";
+        }
+    }
+    else
+    {
+        std::cout << "Trash directory does not exist or is empty. Nothing to clean up.\n";
+    }
+}
+
+// Function to append an unsigned LEB128 varint
+void putVarint(std::string &out, unsigned long long value)
+{
+    while (value >= 0x80)
+    {
+        out += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+// Function to read a varint, returns false on truncated input
+bool getVarint(const unsigned char *&p, const unsigned char *end, unsigned long long &value)
+{
+    value = 0;
+    for (unsigned shift = 0; p < end && shift < 64; shift += 7)
+    {
+        const unsigned char byte = *p++;
+        value |= static_cast<unsigned long long>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline unsigned long long zigzagEncode(long long value)
+{
+    return (static_cast<unsigned long long>(value) << 1) ^ static_cast<unsigned long long>(value >> 63);
+}
+
+inline long long zigzagDecode(unsigned long long value)
+{
+    return static_cast<long long>(value >> 1) ^ -static_cast<long long>(value & 1);
+}
+
+// FNV-1a, enough to spot a torn or damaged record
+uint32_t recordChecksum(const unsigned char *data, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; ++i)
+    {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Function to append payload to out as a record: varint length, payload, checksum
+void frameRecord(std::string &out, const std::string &payload)
+{
+    putVarint(out, payload.size());
+    out += payload;
+    const uint32_t sum = recordChecksum(reinterpret_cast<const unsigned char *>(payload.data()), payload.size());
+    out.append(reinterpret_cast<const char *>(&sum), 4);
+}
+
+// Function to write all of data to fd, retrying short writes; leaves errno set on failure
+bool writeFully(int fd, const std::string &data)
+{
+    for (size_t done = 0; done < data.size();)
+    {
+        const ssize_t written = ::write(fd, data.data() + done, data.size() - done);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written < 0)
+        {
+            return false;
+        }
+        done += written;
+    }
+    return true;
+}
+
+// One file of a deletion plan
+struct PlannedMove
+{
+    enum class State : unsigned char
+    {
+        Pending,
+        Moved,
+        Skipped, // changed since it was planned, left in place
+        Failed,
+        Restored,
+    };
+
+    std::string source;
+    std::string target; // unique name in the Trash directory
+    unsigned long long size = 0;
+    long long mtime = 0;
+    State state = State::Pending;
+    int error = 0; // errno of the last failed rename
+};
+
+const char *moveStateName(PlannedMove::State state)
+{
+    switch (state)
+    {
+    case PlannedMove::State::Pending:
+        return "pending";
+    case PlannedMove::State::Moved:
+        return "moved";
+    case PlannedMove::State::Skipped:
+        return "skipped";
+    case PlannedMove::State::Failed:
+        return "failed";
+    case PlannedMove::State::Restored:
+        return "restored";
+    }
+    return "unknown";
+}
+
+// Plan of files to move to the Trash directory, kept in a write-ahead journal
+// (Trash/.deletion-plan) so a cleanup cut short by a crash or Ctrl-C can be finished or undone.
+// The whole plan is synced before the first file moves. Files then move in batches: a batch
+// renames its files, syncs the directories it changed and commits the outcome with one journal
+// record and one sync, instead of syncing per file. Moves after the last committed batch are
+// settled from the filesystem on restart, so none is repeated or lost. The journal is removed
+// once the plan has been carried out or rolled back.
+class DeletionPlan
+{
+public:
+    explicit DeletionPlan(size_t batchSize = 256) : batchSize_(std::max<size_t>(batchSize, 1)) {}
+    DeletionPlan(const DeletionPlan &) = delete;
+    DeletionPlan &operator=(const DeletionPlan &) = delete;
+
+    ~DeletionPlan()
+    {
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+        }
+    }
+
+    static std::string journalPath()
+    {
+        return (fs::current_path() / TRASH_DIR_NAME / DELETION_JOURNAL_NAME).string();
+    }
+
+    // Function to check for a plan an earlier run left unfinished
+    static bool interrupted()
+    {
+        struct stat st;
+        return ::lstat(journalPath().c_str(), &st) == 0;
+    }
+
+    // Function to add a file, picking a Trash name that clashes neither with the files already in
+    // the Trash directory nor with the rest of the plan
+    bool add(const fs::path &path, std::error_code &ec)
+    {
+        PlannedMove move;
+        move.source = fs::absolute(path, ec).lexically_normal().string();
+        if (ec)
+        {
+            return false;
+        }
+        struct stat st;
+        if (::lstat(move.source.c_str(), &st) != 0)
+        {
+            ec.assign(errno, std::generic_category());
+            return false;
+        }
+        const fs::path trash = fs::current_path() / TRASH_DIR_NAME;
+        if (fs::path(move.source).parent_path() == trash || !sources_.insert(move.source).second)
+        {
+            return true; // already in the Trash or in the plan
+        }
+        move.size = st.st_size;
+        move.mtime = st.st_mtime;
+
+        const fs::path name = fs::path(move.source).filename();
+        move.target = (trash / name).string();
+        for (unsigned n = 1; targets_.count(move.target) != 0 || ::lstat(move.target.c_str(), &st) == 0; ++n)
+        {
+            move.target = (trash / (name.stem().string() + " (" + std::to_string(n) + ")" + name.extension().string())).string();
+        }
+        targets_.insert(move.target);
+        moves_.push_back(std::move(move));
+        committed_.push_back(false);
+        return true;
+    }
+
+    bool empty() const { return moves_.empty(); }
+    const std::vector<PlannedMove> &moves() const { return moves_; }
+
+    // Function to write the plan to a new journal; refuses while an earlier plan is unfinished
+    bool begin(std::string &error)
+    {
+        if (interrupted())
+        {
+            error = "an interrupted deletion plan is waiting in " + journalPath() +
+                    "; finish it with 'diskmanager plan replay' or undo it with 'diskmanager plan rollback'";
+            return false;
+        }
+        const std::string trash = (fs::current_path() / TRASH_DIR_NAME).string();
+        if (::mkdir(trash.c_str(), 0755) == 0)
+        {
+            syncDirectory(fs::current_path().string());
+        }
+        else if (errno != EEXIST)
+        {
+            error = "cannot create " + trash + ": " + std::strerror(errno);
+            return false;
+        }
+        fd_ = ::open(journalPath().c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+        if (fd_ < 0)
+        {
+            error = "cannot create " + journalPath() + ": " + std::strerror(errno);
+            return false;
+        }
+        std::string payload(1, 'P');
+        putVarint(payload, moves_.size());
+        for (const auto &move : moves_)
+        {
+            putString(payload, move.source);
+            putString(payload, move.target);
+            putVarint(payload, move.size);
+            putVarint(payload, zigzagEncode(move.mtime));
+        }
+        if (!writeAll(JOURNAL_MAGIC, error) || !appendRecord(payload, error))
+        {
+            return false;
+        }
+        syncDirectory(trash);
+        return true;
+    }
+
+    // Function to load the unfinished plan and settle the moves its journal has no outcome for:
+    // a file found in the Trash but gone from its place was moved just before the interruption,
+    // and a moved file back in its place but gone from the Trash was restored by a cut-short rollback
+    bool load(std::string &error)
+    {
+        std::ifstream in(journalPath(), std::ios::binary);
+        if (!in)
+        {
+            error = "no interrupted deletion plan in " + journalPath();
+            return false;
+        }
+        const std::string journal((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (journal.compare(0, JOURNAL_MAGIC.size(), JOURNAL_MAGIC) != 0)
+        {
+            error = journalPath() + " is not a deletion plan";
+            return false;
+        }
+        const auto *p = reinterpret_cast<const unsigned char *>(journal.data()) + JOURNAL_MAGIC.size();
+        const auto *end = reinterpret_cast<const unsigned char *>(journal.data()) + journal.size();
+        bool planned = false;
+        while (p < end)
+        {
+            unsigned long long length;
+            if (!getVarint(p, end, length) || length > static_cast<unsigned long long>(end - p) ||
+                static_cast<unsigned long long>(end - p) - length < 4)
+            {
+                break; // torn by the interruption
+            }
+            uint32_t stored;
+            std::memcpy(&stored, p + length, 4);
+            const bool valid = stored == recordChecksum(p, length) && length > 0 &&
+                               (planned ? *p == 'B' && applyOutcomes(p + 1, p + length)
+                                        : *p == 'P' && readPlan(p + 1, p + length));
+            if (!valid)
+            {
+                break;
+            }
+            planned = true;
+            p += length + 4;
+        }
+        if (!planned)
+        {
+            error = journalPath() + " holds no complete plan";
+            return false;
+        }
+        for (auto &move : moves_)
+        {
+            struct stat st;
+            if (move.state == PlannedMove::State::Moved)
+            {
+                if (::lstat(move.target.c_str(), &st) != 0 && ::lstat(move.source.c_str(), &st) == 0)
+                {
+                    move.state = PlannedMove::State::Restored;
+                }
+                continue;
+            }
+            if (move.state != PlannedMove::State::Pending)
+            {
+                continue;
+            }
+            if (::lstat(move.source.c_str(), &st) == 0)
+            {
+                continue;
+            }
+            move.state = ::lstat(move.target.c_str(), &st) == 0 ? PlannedMove::State::Moved : PlannedMove::State::Failed;
+            move.error = move.state == PlannedMove::State::Failed ? ENOENT : 0;
+        }
+        fd_ = ::open(journalPath().c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd_ < 0)
+        {
+            error = "cannot open " + journalPath() + ": " + std::strerror(errno);
+            return false;
+        }
+        return true;
+    }
+
+    // Function to carry out the pending moves; stops between batches when control says so,
+    // leaving the journal for a replay
+    bool execute(std::string &error, ScanControl *control = nullptr)
+    {
+        return runBatches(error, control, false, [](PlannedMove &move)
+                          {
+                              if (move.state != PlannedMove::State::Pending)
+                              {
+                                  return;
+                              }
+                              struct stat st;
+                              if (::lstat(move.source.c_str(), &st) != 0)
+                              {
+                                  move.state = PlannedMove::State::Failed;
+                                  move.error = errno;
+                                  return;
+                              }
+                              if (static_cast<unsigned long long>(st.st_size) != move.size || st.st_mtime != move.mtime)
+                              {
+                                  move.state = PlannedMove::State::Skipped;
+                                  return;
+                              }
+                              move.error = renameNoReplace(move.source, move.target);
+                              move.state = move.error == 0 ? PlannedMove::State::Moved : PlannedMove::State::Failed;
+                          });
+    }
+
+    // Function to put every moved file back where it was; a file whose place has been taken
+    // again stays in the Trash and keeps the journal
+    bool rollback(std::string &error)
+    {
+        for (size_t i = 0; i < moves_.size(); ++i)
+        {
+            committed_[i] = committed_[i] && moves_[i].state != PlannedMove::State::Moved;
+        }
+        return runBatches(error, nullptr, true, [](PlannedMove &move)
+                          {
+                              if (move.state == PlannedMove::State::Pending)
+                              {
+                                  move.state = PlannedMove::State::Skipped;
+                              }
+                              else if (move.state == PlannedMove::State::Moved)
+                              {
+                                  move.error = renameNoReplace(move.target, move.source);
+                                  move.state = move.error == 0 ? PlannedMove::State::Restored : PlannedMove::State::Moved;
+                              }
+                          });
+    }
+
+private:
+    inline static const std::string JOURNAL_MAGIC = "DMPLAN1\n";
+
+    size_t batchSize_;
+    std::vector<PlannedMove> moves_;
+    std::vector<bool> committed_; // outcome durable in the journal
+    std::unordered_set<std::string> sources_;
+    std::unordered_set<std::string> targets_;
+    int fd_ = -1;
+
+    template <typename Step>
+    bool runBatches(std::string &error, ScanControl *control, bool rollingBack, Step step)
+    {
+        std::vector<size_t> batch;
+        std::unordered_set<std::string> directories;
+        for (size_t next = 0; next < moves_.size();)
+        {
+            if (control != nullptr && !control->proceed())
+            {
+                error = "deletion plan stopped (" + std::string(control->reasonName()) + "); finish it with " +
+                        "'diskmanager plan replay' or undo it with 'diskmanager plan rollback'";
+                return false;
+            }
+            batch.clear();
+            directories.clear();
+            for (; next < moves_.size() && batch.size() < batchSize_; ++next)
+            {
+                if (committed_[next])
+                {
+                    continue;
+                }
+                const PlannedMove::State before = moves_[next].state;
+                step(moves_[next]);
+                if (moves_[next].state != before || before == PlannedMove::State::Moved)
+                {
+                    directories.insert(fs::path(moves_[next].source).parent_path().string());
+                }
+                batch.push_back(next);
+            }
+            if (batch.empty())
+            {
+                continue;
+            }
+
+            // The renames are made durable before the record that commits them
+            if (!directories.empty())
+            {
+                directories.insert((fs::current_path() / TRASH_DIR_NAME).string());
+            }
+            for (const auto &directory : directories)
+            {
+                syncDirectory(directory);
+            }
+            std::string payload(1, 'B');
+            putVarint(payload, batch.size());
+            for (size_t i : batch)
+            {
+                putVarint(payload, i);
+                payload += static_cast<char>(moves_[i].state);
+                putVarint(payload, moves_[i].error);
+            }
+            if (!appendRecord(payload, error))
+            {
+                return false;
+            }
+            for (size_t i : batch)
+            {
+                committed_[i] = true;
+            }
+        }
+        return finish(error, rollingBack);
+    }
+
+    // Function to remove the journal once no file is left half way
+    bool finish(std::string &error, bool rollingBack)
+    {
+        for (const auto &move : moves_)
+        {
+            if (move.state == PlannedMove::State::Pending || (rollingBack && move.state == PlannedMove::State::Moved))
+            {
+                return true;
+            }
+        }
+        ::close(fd_);
+        fd_ = -1;
+        if (::unlink(journalPath().c_str()) != 0)
+        {
+            error = "cannot remove " + journalPath() + ": " + std::strerror(errno);
+            return false;
+        }
+        syncDirectory((fs::current_path() / TRASH_DIR_NAME).string());
+        return true;
+    }
+
+    bool readPlan(const unsigned char *p, const unsigned char *end)
+    {
+        unsigned long long count, size, mtime;
+        if (!getVarint(p, end, count))
+        {
+            return false;
+        }
+        for (unsigned long long i = 0; i < count; ++i)
+        {
+            PlannedMove move;
+            if (!getString(p, end, move.source) || !getString(p, end, move.target) || !getVarint(p, end, size) ||
+                !getVarint(p, end, mtime))
+            {
+                return false;
+            }
+            move.size = size;
+            move.mtime = zigzagDecode(mtime);
+            moves_.push_back(std::move(move));
+        }
+        committed_.assign(moves_.size(), false);
+        return true;
+    }
+
+    bool applyOutcomes(const unsigned char *p, const unsigned char *end)
+    {
+        unsigned long long count, index, err;
+        if (!getVarint(p, end, count))
+        {
+            return false;
+        }
+        for (unsigned long long i = 0; i < count; ++i)
+        {
+            if (!getVarint(p, end, index) || index >= moves_.size() || p >= end || *p > static_cast<unsigned char>(PlannedMove::State::Restored))
+            {
+                return false;
+            }
+            moves_[index].state = static_cast<PlannedMove::State>(*p++);
+            if (!getVarint(p, end, err))
+            {
+                return false;
+            }
+            moves_[index].error = static_cast<int>(err);
+            committed_[index] = true;
+        }
+        return true;
+    }
+
+    static void putString(std::string &out, const std::string &value)
+    {
+        putVarint(out, value.size());
+        out += value;
+    }
+
+    static bool getString(const unsigned char *&p, const unsigned char *end, std::string &value)
+    {
+        unsigned long long length;
+        if (!getVarint(p, end, length) || length > static_cast<unsigned long long>(end - p))
+        {
+            return false;
+        }
+        value.assign(reinterpret_cast<const char *>(p), length);
+        p += length;
+        return true;
+    }
+
+    // Function to rename without replacing an existing file; returns the errno of a failure
+    static int renameNoReplace(const std::string &from, const std::string &to)
+    {
+        if (::renameat2(AT_FDCWD, from.c_str(), AT_FDCWD, to.c_str(), RENAME_NOREPLACE) == 0)
+        {
+            return 0;
+        }
+        if (errno != EINVAL && errno != ENOSYS)
+        {
+            return errno;
+        }
+        // The filesystem cannot refuse to replace, so check first
+        struct stat st;
+        if (::lstat(to.c_str(), &st) == 0)
+        {
+            return EEXIST;
+        }
+        return ::rename(from.c_str(), to.c_str()) == 0 ? 0 : errno;
+    }
+
+    static void syncDirectory(const std::string &path)
+    {
+        const int fd = ::open(path.empty() ? "/" : path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0)
+        {
+            ::fsync(fd);
+            ::close(fd);
+        }
+    }
+
+    bool writeAll(const std::string &data, std::string &error)
+    {
+        if (!writeFully(fd_, data))
+        {
+            error = "cannot write " + journalPath() + ": " + std::strerror(errno);
+            return false;
+        }
+        return true;
+    }
+
+    // Function to append a checksummed record and sync it: the commit point of a batch
+    bool appendRecord(const std::string &payload, std::string &error)
+    {
+        std::string record;
+        frameRecord(record, payload);
+        if (!writeAll(record, error))
+        {
+            return false;
+        }
+        if (::fdatasync(fd_) != 0)
+        {
+            error = "cannot sync " + journalPath() + ": " + std::strerror(errno);
+            return false;
+        }
+        return true;
+    }
+};
+
+// Function to move files to the Trash directory through a deletion plan, reporting failures on stderr.
+// Returns how many files were moved; none when the plan is refused, e.g. while an interrupted one exists.
+size_t moveToTrash(const std::vector<fs::path> &paths)
+{
+    DeletionPlan plan;
+    std::error_code ec;
+    for (const auto &path : paths)
+    {
+        if (!plan.add(path, ec))
+        {
+            std::cerr << "Cannot move " << path << " to Trash: " << ec.message() << '\n';
+        }
+    }
+    std::string error;
+    if (!plan.empty() && (!plan.begin(error) || !plan.execute(error)))
+    {
+        std::cerr << "Error: " << error << '\n';
+    }
+    size_t moved = 0;
+    for (const auto &move : plan.moves())
+    {
+        moved += move.state == PlannedMove::State::Moved;
+        if (move.state == PlannedMove::State::Failed)
+        {
+            std::cerr << "Cannot move " << move.source << " to Trash: " << std::strerror(move.error) << '\n';
+        }
+        else if (move.state == PlannedMove::State::Skipped)
+        {
+            std::cerr << "Not moving " << move.source << " to Trash: it changed after it was chosen\n";
+        }
+    }
+    return moved;
+}
+// Function to recover a deleted file from the Trash directory
+void recoverDeletedFile()
+{
+    fs::path trashPath = fs::current_path() / TRASH_DIR_NAME;
+
+    if (!fs::exists(trashPath) || !fs::is_directory(trashPath))
+    {
+        std::cout << "Trash directory is empty. No files to recover.\n";
+        return;
+    }
+
+    std::cout << "Files available in Trash directory:\n";
+    int fileNumber = 1;
+    std::vector<fs::path> filesToRecover;
+
+    for (const auto &entry : fs::directory_iterator(trashPath))
+    {
+        if (fs::is_regular_file(entry) && entry.path().filename() != DELETION_JOURNAL_NAME)
+        {
+            std::cout << fileNumber << ". " << entry.path().filename().string() << '\n';
+            ++fileNumber;
+            filesToRecover.push_back(entry.path());
+        }
+    }
+
+    std::cout << "Enter the numbers of the files you want to recover (space-separated), or 0 to cancel: ";
+    int fileToRecover;
+    while (std::cin >> fileToRecover && fileToRecover != 0)
+    {
+        if (fileToRecover >= 1 && fileToRecover <= fileNumber - 1)
+        {
+            fs::path recoveredFilePath = filesToRecover[fileToRecover - 1];
+            fs::rename(recoveredFilePath, fs::current_path() / recoveredFilePath.filename());
+            std::cout << "File " << recoveredFilePath.filename().string() << " successfully recovered.\n";
+        }
+        else
+        {
+            std::cout << "Invalid file number. Please enter a valid number or 0 to cancel.\n";
+        }
+        std::cout << "Enter more file numbers to recover, or 0 to cancel: ";
+    }
+    std::cout << "File recovery process completed.\n";
+}
+
+
+void displayDuplicateFiles(const std::unordered_map<std::string, std::vector<fs::path>>& duplicateFiles) {
+    std::cout << "\nDuplicate Files:\n";
+    int groupNumber = 1;
+    for (const auto& [md5Hash, files] : duplicateFiles) { // Use std::string as the key type
+        std::cout << "Group " << groupNumber << " (MD5 Hash: " << md5Hash << "):\n";
+        for (size_t i = 0; i < files.size(); ++i) {
+            std::cout << i + 1 << ". " << files[i].filename().string() << '\n';
+        }
+        ++groupNumber;
+    }
+}
+
+
+void deleteDuplicateFiles(const std::unordered_map<std::string, std::vector<fs::path>>& duplicateFiles) {
+    std::cout << "\nChoose group in which duplicate files to be deleted (0 to keep all): ";
+    int groupToDelete;
+    std::cin >> groupToDelete;
+
+    if (groupToDelete <= 0 || groupToDelete > static_cast<int>(duplicateFiles.size())) {
+        std::cout << "Invalid choice. No files deleted.\n";
+        return;
+    }
+
+    auto it = duplicateFiles.begin();
+    std::advance(it, groupToDelete - 1);
+
+    std::cout << "Files in Group " << groupToDelete << ":\n";
+    for (size_t i = 0; i < it->second.size(); ++i) {
+        std::cout << i + 1 << ". " << it->second[i].filename().string() << '\n';
+    }
+
+    std::cout << "Enter the serial numbers of files to KEEP (space-separated) followed by 0 at end, or 0 to delete all: ";
+    std::vector<int> filesToKeep;
+    int fileToKeep;
+    std::cin >> fileToKeep;
+    //if ( && fileToKeep != 0) {
+        if (fileToKeep >= 1 && fileToKeep <= static_cast<int>(it->second.size())) {
+            filesToKeep.push_back(fileToKeep);
+        } else {
+            std::cout << "Invalid file number. Please enter a valid number or 0 to delete all.\n";
+        }
+    //}
+
+    std::vector<fs::path> filesToMove;
+    if (filesToKeep.empty()) {
+        // Delete all files in the group
+        for (size_t i = 0; i < it->second.size(); ++i) {
+            std::cout << "Moving to Trash: " << it->second[i].filename().string() << '\n';
+            filesToMove.push_back(it->second[i]);
+        }
+        const size_t moved = moveToTrash(filesToMove);
+        if (moved == filesToMove.size()) {
+            std::cout << "All files in Group " << groupToDelete << " moved to Trash directory.\n";
+        } else {
+            std::cout << moved << " of " << filesToMove.size() << " files in Group " << groupToDelete << " moved to Trash directory.\n";
+        }
+    } else {
+        // Delete files not marked to keep
+        for (size_t i = 0; i < it->second.size(); ++i) {
+            if (std::find(filesToKeep.begin(), filesToKeep.end(), i + 1) == filesToKeep.end()) {
+                std::cout << "Moving to Trash: " << it->second[i].filename().string() << '\n';
+                filesToMove.push_back(it->second[i]);
+            }
+        }
+        const size_t moved = moveToTrash(filesToMove);
+        std::cout << moved << " of " << filesToMove.size() << " files moved to Trash directory.\n";
+    }
+}
+
+
+void deleteLargeFiles(const std::vector<fs::path> &largeFiles)
+{
+    if (largeFiles.empty())
+    {
+        std::cout << "No large files to delete.\n";
+        return;
+    }
+
+    while (true)
+    {
+        std::cout << "Choose which large file to delete (0 to keep all, -1 to exit): ";
+        int fileToDelete;
+        std::cin >> fileToDelete;
+
+        if (fileToDelete == -1)
+        {
+            std::cout << "Exiting delete mode.\n";
+            break;
+        }
+
+        if (fileToDelete == 0)
+        {
+            std::cout << "Keeping all large files.\n";
+            return;
+        }
+
+        if (fileToDelete < 1 || fileToDelete > static_cast<int>(largeFiles.size()))
+        {
+            std::cout << "Invalid choice. Please enter a valid number or 0 to keep all.\n";
+            continue;
+        }
+
+        auto it = largeFiles.begin() + fileToDelete - 1;
+        // Move the file to the Trash directory instead of deleting it
+        if (moveToTrash({*it}) == 1)
+        {
+            std::cout << "Moved to Trash: " << fs::path(*it).filename().string() << '\n';
+        }
+        else
+        {
+            std::cout << "Not deleted: " << fs::path(*it).filename().string() << '\n';
+        }
+    }
+}
+
+// Include/exclude rules for the walkers, compiled once into a trie over path components.
+// Patterns use glob syntax per component:
+//   name, *.tmp      any file or directory with that name, at any depth
+//   a/b              that sequence of components, at any depth
+//   /var/lib/docker  anchored at the filesystem root
+//   **               any number of components; a trailing / matches directories only
+// The walker keeps the set of trie nodes its current directory has reached and advances it by
+// one component per entry, so an excluded directory is dropped before it is opened and an
+// excluded file before it is stat'ed. Size and mtime cutoffs apply to files after the stat.
+class ScanRules
+{
+public:
+    static const uint32_t NONE = ~0u;
+
+    // Position of a directory in the trie
+    struct Cursor
+    {
+        std::vector<uint32_t> states;
+        bool included = false; // below a directory matched by an include pattern
+    };
+
+    unsigned long long minSize = 0;
+    unsigned long long maxSize = std::numeric_limits<unsigned long long>::max();
+    long long modifiedAfter = std::numeric_limits<long long>::min();
+    long long modifiedBefore = std::numeric_limits<long long>::max();
+
+    ScanRules() : nodes_(1) {}
+
+    // Function to add an exclude or include pattern; returns false for an empty pattern
+    bool addPattern(std::string pattern, bool include)
+    {
+        const bool directoryOnly = pattern.size() > 1 && pattern.back() == '/';
+        while (pattern.size() > 1 && pattern.back() == '/')
+        {
+            pattern.pop_back();
+        }
+        if (pattern.empty() || pattern == "/")
+        {
+            return false;
+        }
+        uint32_t node = 0;
+        if (pattern[0] != '/')
+        {
+            node = anyDepthChild(0); // unanchored patterns match at any depth
+        }
+        size_t start = 0;
+        while (start < pattern.size())
+        {
+            size_t end = pattern.find('/', start);
+            if (end == std::string::npos)
+            {
+                end = pattern.size();
+            }
+            const std::string component = pattern.substr(start, end - start);
+            start = end + 1;
+            if (component.empty() || component == ".")
+            {
+                continue;
+            }
+            if (component == "**")
+            {
+                node = anyDepthChild(node);
+            }
+            else if (component.find_first_of("*?[\\") == std::string::npos)
+            {
+                node = literalChild(node, component);
+            }
+            else
+            {
+                node = globChild(node, component);
+            }
+        }
+        nodes_[node].flags |= include ? INCLUDE : directoryOnly ? EXCLUDE_DIRECTORY : EXCLUDE_DIRECTORY | EXCLUDE_FILE;
+        hasIncludes_ |= include;
+        return true;
+    }
+
+    // Function to exclude one directory by its exact absolute path
+    void excludeDirectory(const std::string &path) { nodes_[literalPath(path)].flags |= EXCLUDE_DIRECTORY; }
+
+    // Function to record a mount point, pruned by one-file-system walks started on another device
+    void addMountPoint(const std::string &path, dev_t device)
+    {
+        const uint32_t node = literalPath(path);
+        nodes_[node].flags |= MOUNT_POINT;
+        nodes_[node].device = device;
+    }
+
+    bool hasFileFilters() const
+    {
+        return hasIncludes_ || minSize != 0 || maxSize != std::numeric_limits<unsigned long long>::max() ||
+               modifiedAfter != std::numeric_limits<long long>::min() ||
+               modifiedBefore != std::numeric_limits<long long>::max();
+    }
+
+    // Function to position a cursor at a walk's root directory. The root itself is never
+    // excluded: naming it explicitly overrides the rules.
+    Cursor start(const std::string &rootPath) const
+    {
+        std::error_code ec;
+        std::string path = fs::absolute(rootPath, ec).lexically_normal().string();
+        Cursor cursor;
+        addState(cursor.states, 0);
+        cursor.included = nodes_[0].flags & INCLUDE;
+        size_t begin = 0;
+        while (begin < path.size())
+        {
+            size_t end = path.find('/', begin);
+            if (end == std::string::npos)
+            {
+                end = path.size();
+            }
+            if (end > begin)
+            {
+                path[end] = '\0'; // fnmatch needs a terminated component; restored below
+                Cursor next;
+                step(cursor, path.c_str() + begin, end - begin, next.states);
+                next.included = cursor.included || (flagsOf(next.states) & INCLUDE);
+                cursor = std::move(next);
+                if (end < path.size())
+                {
+                    path[end] = '/';
+                }
+            }
+            begin = end + 1;
+        }
+        return cursor;
+    }
+
+    // Function to advance the cursor into subdirectory name (NUL-terminated); returns false
+    // when the subtree is excluded. With oneFileSystem, known mount points of other devices
+    // are excluded too, so they are never opened (which would trigger an automount).
+    bool enterDirectory(const Cursor &parent, const char *name, size_t length, Cursor &child, bool oneFileSystem,
+                        dev_t rootDevice) const
+    {
+        child.states.clear();
+        step(parent, name, length, child.states);
+        const uint8_t flags = flagsOf(child.states);
+        if (flags & EXCLUDE_DIRECTORY)
+        {
+            return false;
+        }
+        if (oneFileSystem && (flags & MOUNT_POINT))
+        {
+            for (uint32_t state : child.states)
+            {
+                if ((nodes_[state].flags & MOUNT_POINT) && nodes_[state].device != rootDevice)
+                {
+                    return false;
+                }
+            }
+        }
+        child.included = parent.included || (flags & INCLUDE);
+        return true;
+    }
+
+    // Function to apply the name patterns to a file in the cursor's directory
+    bool acceptsName(const Cursor &directory, const char *name, size_t length) const
+    {
+        if (directory.states.empty())
+        {
+            return !hasIncludes_ || directory.included;
+        }
+        uint8_t flags = 0;
+        forEachStep(directory, name, length, [&](uint32_t state)
+                    { flags |= nodes_[state].flags; });
+        if (flags & EXCLUDE_FILE)
+        {
+            return false;
+        }
+        return !hasIncludes_ || directory.included || (flags & INCLUDE);
+    }
+
+    // Function to apply the size and mtime cutoffs
+    bool acceptsStat(unsigned long long size, long long mtime) const
+    {
+        return size >= minSize && size <= maxSize && mtime >= modifiedAfter && mtime < modifiedBefore;
+    }
+
+    // Function to tell whether a directory, given by its full path, lies in an excluded subtree
+    bool excludesPath(const std::string &path) const
+    {
+        std::error_code ec;
+        const std::string absolute = fs::absolute(path, ec).lexically_normal().string();
+        Cursor cursor;
+        addState(cursor.states, 0);
+        Cursor next;
+        std::string component;
+        size_t begin = 0;
+        while (begin < absolute.size())
+        {
+            size_t end = absolute.find('/', begin);
+            if (end == std::string::npos)
+            {
+                end = absolute.size();
+            }
+            if (end > begin)
+            {
+                component.assign(absolute, begin, end - begin);
+                if (!enterDirectory(cursor, component.c_str(), component.size(), next, false, 0))
+                {
+                    return true;
+                }
+                std::swap(cursor, next);
+            }
+            begin = end + 1;
+        }
+        return false;
+    }
+
+private:
+    enum : uint8_t
+    {
+        EXCLUDE_FILE = 1,
+        EXCLUDE_DIRECTORY = 2,
+        INCLUDE = 4,
+        MOUNT_POINT = 8,
+    };
+
+    struct Glob
+    {
+        std::string pattern;
+        std::string suffix; // "*.ext" style patterns are a plain suffix test
+        bool suffixOnly;
+        uint32_t target;
+    };
+
+    struct Node
+    {
+        std::vector<std::pair<std::string, uint32_t>> literals; // sorted by name
+        std::vector<Glob> globs;
+        uint32_t anyDepth = NONE; // child standing for "**"
+        bool selfLoop = false;    // this node is a "**": it also matches any further component
+        uint8_t flags = 0;
+        dev_t device = 0;
+    };
+
+    uint32_t newNode()
+    {
+        nodes_.emplace_back();
+        return static_cast<uint32_t>(nodes_.size() - 1);
+    }
+
+    uint32_t anyDepthChild(uint32_t node)
+    {
+        if (nodes_[node].selfLoop)
+        {
+            return node; // "**/**" is one "**"
+        }
+        if (nodes_[node].anyDepth == NONE)
+        {
+            const uint32_t child = newNode();
+            nodes_[child].selfLoop = true;
+            nodes_[node].anyDepth = child;
+        }
+        return nodes_[node].anyDepth;
+    }
+
+    uint32_t literalChild(uint32_t node, const std::string &name)
+    {
+        auto &literals = nodes_[node].literals;
+        auto it = std::lower_bound(literals.begin(), literals.end(), name,
+                                   [](const std::pair<std::string, uint32_t> &entry, const std::string &key)
+                                   { return entry.first < key; });
+        if (it != literals.end() && it->first == name)
+        {
+            return it->second;
+        }
+        const size_t index = it - literals.begin();
+        const uint32_t child = newNode();
+        nodes_[node].literals.insert(nodes_[node].literals.begin() + index, {name, child});
+        return child;
+    }
+
+    uint32_t globChild(uint32_t node, const std::string &pattern)
+    {
+        for (const Glob &glob : nodes_[node].globs)
+        {
+            if (glob.pattern == pattern)
+            {
+                return glob.target;
+            }
+        }
+        const uint32_t child = newNode();
+        const bool suffixOnly = pattern[0] == '*' && pattern.find_first_of("*?[\\", 1) == std::string::npos;
+        nodes_[node].globs.push_back({pattern, suffixOnly ? pattern.substr(1) : std::string(), suffixOnly, child});
+        return child;
+    }
+
+    uint32_t literalPath(const std::string &path)
+    {
+        uint32_t node = 0;
+        size_t begin = 0;
+        while (begin < path.size())
+        {
+            size_t end = path.find('/', begin);
+            if (end == std::string::npos)
+            {
+                end = path.size();
+            }
+            if (end > begin)
+            {
+                node = literalChild(node, path.substr(begin, end - begin));
+            }
+            begin = end + 1;
+        }
+        return node;
+    }
+
+    // Function to add a node and, since "**" also matches zero components, its "**" child
+    void addState(std::vector<uint32_t> &states, uint32_t node) const
+    {
+        for (; node != NONE; node = nodes_[node].anyDepth)
+        {
+            if (std::find(states.begin(), states.end(), node) != states.end())
+            {
+                return;
+            }
+            states.push_back(node);
+        }
+    }
+
+    template <typename OnState>
+    void forEachStep(const Cursor &from, const char *name, size_t length, OnState &&onState) const
+    {
+        const std::string_view key(name, length);
+        for (uint32_t state : from.states)
+        {
+            const Node &node = nodes_[state];
+            if (node.selfLoop)
+            {
+                onState(state);
+            }
+            auto it = std::lower_bound(node.literals.begin(), node.literals.end(), key,
+                                       [](const std::pair<std::string, uint32_t> &entry, std::string_view k)
+                                       { return std::string_view(entry.first) < k; });
+            if (it != node.literals.end() && it->first == key)
+            {
+                onState(it->second);
+            }
+            for (const Glob &glob : node.globs)
+            {
+                const bool match = glob.suffixOnly
+                                       ? length >= glob.suffix.size() &&
+                                             key.substr(length - glob.suffix.size()) == glob.suffix
+                                       : ::fnmatch(glob.pattern.c_str(), name, 0) == 0;
+                if (match)
+                {
+                    onState(glob.target);
+                }
+            }
+        }
+    }
+
+    void step(const Cursor &from, const char *name, size_t length, std::vector<uint32_t> &to) const
+    {
+        forEachStep(from, name, length, [&](uint32_t state)
+                    { addState(to, state); });
+    }
+
+    uint8_t flagsOf(const std::vector<uint32_t> &states) const
+    {
+        uint8_t flags = 0;
+        for (uint32_t state : states)
+        {
+            flags |= nodes_[state].flags;
+        }
+        return flags;
+    }
+
+    std::vector<Node> nodes_;
+    bool hasIncludes_ = false;
+};
+
+// How hash reads interact with the page cache
+enum class CachePolicy
+{
+    Buffered, // plain reads; hashed files stay cached
+    DontNeed, // sequential hint, then drop the pages we pulled in behind the read cursor
+    Direct,   // O_DIRECT with aligned buffers; falls back to DontNeed where unsupported
+};
+
+const size_t HASH_READ_SIZE = 1 << 20;       // 1 MiB per read, a multiple of any logical block size
+const off_t DONTNEED_WINDOW = 8 << 20;       // drop cached pages every 8 MiB behind the cursor
+const size_t RESIDENCY_SAMPLE = 64 << 20;    // bytes checked with mincore before dropping pages
+
+// Function to return this thread's read buffer, aligned for O_DIRECT and reused across files
+unsigned char *hashReadBuffer()
+{
+    struct AlignedBuffer
+    {
+        unsigned char *data = nullptr;
+        AlignedBuffer()
+        {
+            void *memory = nullptr;
+            if (::posix_memalign(&memory, 4096, HASH_READ_SIZE) == 0)
+            {
+                data = static_cast<unsigned char *>(memory);
+            }
+        }
+        ~AlignedBuffer() { std::free(data); }
+    };
+    thread_local AlignedBuffer buffer;
+    return buffer.data;
+}
+
+// Function to tell whether a file (or the part from a page-aligned offset on) was already
+// mostly in the page cache before we read it. Such files belong to someone else's working
+// set, so their pages must not be dropped.
+bool isMostlyCached(int fd, unsigned long long size, off_t offset = 0)
+{
+    const unsigned long long start = static_cast<unsigned long long>(offset);
+    const size_t length = static_cast<size_t>(std::min<unsigned long long>(size > start ? size - start : 0, RESIDENCY_SAMPLE));
+    if (length == 0)
+    {
+        return false;
+    }
+    void *mapping = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, offset);
+    if (mapping == MAP_FAILED)
+    {
+        return false;
+    }
+    const long pageSize = ::sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> residency((length + pageSize - 1) / pageSize);
+    size_t resident = 0;
+    if (::mincore(mapping, length, residency.data()) == 0)
+    {
+        for (unsigned char page : residency)
+        {
+            resident += page & 1;
+        }
+    }
+    ::munmap(mapping, length);
+    return resident * 2 > residency.size();
+}
+
+// Function to compute MD5 hash of a file's content
+// Returns an empty string on failure and stores the errno in *error when given.
+std::string computeFileMD5(const fs::path& filePath, CachePolicy policy = CachePolicy::Buffered, Throttle* throttle = nullptr,
+                           int* error = nullptr) {
+    int fd = -1;
+#ifdef O_DIRECT
+    if (policy == CachePolicy::Direct) {
+        fd = ::open(filePath.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+        if (fd < 0 && errno == EINVAL) {
+            policy = CachePolicy::DontNeed; // tmpfs and some FUSE filesystems reject O_DIRECT
+        }
+    }
+#else
+    if (policy == CachePolicy::Direct) {
+        policy = CachePolicy::DontNeed;
+    }
+#endif
+    if (fd < 0) {
+        fd = ::open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    unsigned char *buffer = hashReadBuffer();
+    if (fd < 0 || buffer == nullptr) {
+        if (error) {
+            *error = fd < 0 ? errno : ENOMEM;
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return ""; // Return an empty string to indicate failure
+    }
+
+    bool dropPages = false;
+    if (policy == CachePolicy::DontNeed) {
+        struct stat st;
+        dropPages = ::fstat(fd, &st) == 0 && !isMostlyCached(fd, static_cast<unsigned long long>(st.st_size));
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    picosha2::hash256_one_by_one hasher;
+    off_t offset = 0;
+    off_t droppedUpTo = 0;
+    bool ok = true;
+    const size_t readSize = throttle ? throttle->readSize(HASH_READ_SIZE) : HASH_READ_SIZE;
+    while (true) {
+        ssize_t bytesRead;
+        {
+            SampledTimer timer(Metric::ReadNs, 0);
+            bytesRead = ::read(fd, buffer, readSize);
+        }
+        if (bytesRead < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (error) {
+                *error = errno;
+            }
+            ok = false;
+            break;
+        }
+        if (bytesRead == 0) {
+            break;
+        }
+        countMetric(Metric::BytesRead, bytesRead);
+        if (throttle) {
+            throttle->acquireBytes(bytesRead); // pay for what was read; the bucket's debt paces the next read
+        }
+        {
+            SampledTimer timer(Metric::HashNs, 0);
+            hasher.process(buffer, buffer + bytesRead);
+        }
+        countMetric(Metric::BytesHashed, bytesRead);
+        offset += bytesRead;
+        if (dropPages && offset - droppedUpTo >= DONTNEED_WINDOW) {
+            ::posix_fadvise(fd, droppedUpTo, offset - droppedUpTo, POSIX_FADV_DONTNEED);
+            droppedUpTo = offset;
+        }
+    }
+    if (dropPages) {
+        ::posix_fadvise(fd, droppedUpTo, 0, POSIX_FADV_DONTNEED);
+    }
+    ::close(fd);
+    if (!ok) {
+        return "";
+    }
+
+    hasher.finish();
+    return picosha2::get_hash_hex_string(hasher);
+}
+// // Function to detect duplicate files using MD5 hashing
+// std::unordered_map<uintmax_t, std::vector<fs::path>> findDuplicateFiles(const fs::path &rootPath)
+// {
+//     std::unordered_map<uintmax_t, std::vector<fs::path>> duplicateFiles;
+
+//     for (const auto &entry : fs::recursive_directory_iterator(rootPath))
+//     {
+//         if (fs::is_regular_file(entry))
 //         {
 //             const auto fileSize = fs::file_size(entry);
 //             if (fileSize == 0)
@@ -285,333 +2804,10715 @@ std::string computeFileMD5(const fs::path& filePath) {
 //                 continue; // Ignore empty files
 //             }
 
-//             duplicateFiles[fileSize].push_back(entry.path());
-//         }
-//     }
+//             duplicateFiles[fileSize].push_back(entry.path());
+//         }
+//     }
+
+//     // Remove entries with a single file (no duplicates based on size)
+//     for (auto it = duplicateFiles.begin(); it != duplicateFiles.end();)
+//     {
+//         if (it->second.size() < 2)
+//         {
+//             it = duplicateFiles.erase(it);
+//         }
+//         else
+//         {
+//             ++it;
+//         }
+//     }
+
+//     // Compare files with the same size based on content (if needed)
+//     for (auto &[size, files] : duplicateFiles)
+//     {
+//         if (files.size() > 1)
+//         {
+//             std::sort(files.begin(), files.end());
+
+//             auto last = std::unique(files.begin(), files.end());
+//             files.erase(last, files.end());
+//         }
+//     }
+
+//     return duplicateFiles;
+// }
+// Function to calculate mean
+double calculateMean(const std::vector<uintmax_t> &fileSizes)
+{
+    double total = std::accumulate(fileSizes.begin(), fileSizes.end(), 0.0);
+    return total / fileSizes.size();
+}
+
+// Function to calculate standard deviation
+double calculateStandardDeviation(const std::vector<uintmax_t> &fileSizes, double mean)
+{
+    double sumSquaredDifferences = 0.0;
+    for (uintmax_t size : fileSizes)
+    {
+        double diff = static_cast<double>(size) - mean;
+        sumSquaredDifferences += diff * diff;
+    }
+    double variance = sumSquaredDifferences / fileSizes.size();
+    return std::sqrt(variance);
+}
+
+bool sortBySize(const FileExtension &a, const FileExtension &b)
+{
+    return a.size > b.size;
+}
+bool sortByAllocated(const FileExtension &a, const FileExtension &b)
+{
+    return a.allocated > b.allocated;
+}
+// Function to categorize a lowercase extension such as ".mp4"
+FileType categorizeExtension(const std::string &extension)
+{
+    auto it = fileTypeMap.find(extension);
+    if (it != fileTypeMap.end())
+    {
+        return it->second;
+    }
+    return FileType::Unknown;
+}
+
+// Function to categorize files based on their extensions
+FileType categorizeFile(const fs::path &filePath)
+{
+    auto extension = filePath.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower); // Convert extension to lowercase
+    return categorizeExtension(extension);
+}
+
+// Function to get the name of the file type as a string
+const char *getFileTypeName(FileType type)
+{
+    switch (type)
+    {
+    case FileType::Video:
+        return "Video";
+    case FileType::Image:
+        return "Image";
+    case FileType::Document:
+        return "Document";
+    // Add more cases for other file types
+    default:
+        return "Unknown";
+    }
+}
+
+// Data structure describing one regular file reported by scanTree.
+// The views point into the walker's path buffer and are only valid during the callback.
+struct ScanEntry
+{
+    std::string_view path;
+    std::string_view name;
+    unsigned long long size;
+    unsigned long long allocated; // st_blocks * 512; below size for sparse files
+    long long mtime;
+    long long atime;
+    long long ctime;
+    dev_t device;
+    unsigned long long inode;
+};
+
+// Which size of a file ranks and totals it: its length, or the disk space its blocks occupy.
+// The two differ for sparse files (holes take no blocks), compressed filesystems and small
+// files rounded up to a block.
+enum class SizeBasis
+{
+    Apparent,
+    Allocated,
+};
+
+inline unsigned long long sizeFor(const ScanEntry &entry, SizeBasis basis)
+{
+    return basis == SizeBasis::Allocated ? entry.allocated : entry.size;
+}
+
+// Function to flag a file whose blocks cover less than its length, the only files worth a
+// hole search; the rest cost nothing beyond the stat the walker already made
+inline bool isSparseCandidate(unsigned long long size, unsigned long long allocated)
+{
+    return allocated < size;
+}
+
+// Fields a scan reads from a directory entry
+constexpr unsigned SCAN_STATX_MASK = STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE | STATX_BLOCKS | STATX_ATIME | STATX_MTIME | STATX_CTIME;
+
+// Function to stat a directory entry without following symbolic links; returns 0 or an errno.
+// statx returns atime, mtime and ctime in one call and only fetches the fields in the mask.
+// AT_STATX_DONT_SYNC lets network filesystems answer from their attribute cache. Kernels
+// without statx fall back to fstatat.
+int statEntry(int dirFd, const char *name, struct statx &stx)
+{
+    static std::atomic<bool> useFstatat{false};
+    if (!useFstatat.load(std::memory_order_relaxed))
+    {
+        if (::statx(dirFd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, SCAN_STATX_MASK, &stx) == 0)
+        {
+            return 0;
+        }
+        if (errno != ENOSYS)
+        {
+            return errno;
+        }
+        useFstatat.store(true, std::memory_order_relaxed);
+    }
+    struct stat st;
+    if (::fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+        return errno;
+    }
+    stx = {};
+    stx.stx_mask = SCAN_STATX_MASK;
+    stx.stx_mode = static_cast<uint16_t>(st.st_mode);
+    stx.stx_ino = st.st_ino;
+    stx.stx_size = static_cast<uint64_t>(st.st_size);
+    stx.stx_blocks = static_cast<uint64_t>(st.st_blocks);
+    stx.stx_atime.tv_sec = st.st_atime;
+    stx.stx_mtime.tv_sec = st.st_mtime;
+    stx.stx_ctime.tv_sec = st.st_ctime;
+    stx.stx_dev_major = major(st.st_dev);
+    stx.stx_dev_minor = minor(st.st_dev);
+    return 0;
+}
+
+// Function to return the extension of a file name the way fs::path::extension does
+std::string_view extensionOf(std::string_view name)
+{
+    const size_t dot = name.rfind('.');
+    if (dot == std::string_view::npos || dot == 0)
+    {
+        return {};
+    }
+    return name.substr(dot);
+}
+
+// Function to copy an extension into a reusable buffer in lowercase
+void lowercaseInto(std::string_view text, std::string &out)
+{
+    out.assign(text.data(), text.size());
+    std::transform(out.begin(), out.end(), out.begin(), ::tolower);
+}
+
+// Selection of files by name for type deletion. Patterns are extensions (".log" or "log", any
+// case) and shell globs over the file name ("core.*", "*~", "*.tar.gz"). Extensions cost one
+// hash lookup per file. Each glob is keyed on its longest literal run, and one Aho-Corasick pass
+// over the name finds the globs whose literal occurs, so fnmatch only runs on those. A file
+// counts against the first pattern in the list that matches it.
+class NameMatcher
+{
+public:
+    static constexpr size_t NO_MATCH = static_cast<size_t>(-1);
+
+    // Function to add comma-separated patterns; returns false on an empty one
+    bool add(const std::string &list, std::string &error)
+    {
+        size_t begin = 0;
+        while (begin <= list.size())
+        {
+            size_t end = list.find(',', begin);
+            if (end == std::string::npos)
+            {
+                end = list.size();
+            }
+            std::string pattern = list.substr(begin, end - begin);
+            begin = end + 1;
+            if (pattern.empty())
+            {
+                error = "empty pattern in '" + list + "'";
+                return false;
+            }
+            const bool glob = pattern.find_first_of("*?[") != std::string::npos;
+            if (!glob && pattern[0] != '.')
+            {
+                pattern.insert(pattern.begin(), '.');
+            }
+            const size_t index = patterns_.size();
+            patterns_.push_back(pattern);
+            if (!glob && pattern.find('.', 1) == std::string::npos)
+            {
+                std::transform(pattern.begin(), pattern.end(), pattern.begin(), ::tolower);
+                extensions_.emplace(pattern, index); // an earlier duplicate keeps the files
+            }
+            else
+            {
+                // ".tar.gz" spans more than the extension, so it is matched as "*.tar.gz"
+                globs_.push_back({glob ? pattern : "*" + pattern, index});
+            }
+        }
+        return true;
+    }
+
+    size_t size() const { return patterns_.size(); }
+    const std::string &pattern(size_t index) const { return patterns_[index]; }
+
+    // Function to build the automaton over the literal runs of the globs
+    void compile()
+    {
+        nodes_.assign(1, Node());
+        unanchored_.clear();
+        for (size_t g = 0; g < globs_.size(); ++g)
+        {
+            const std::string literal = longestLiteral(globs_[g].pattern);
+            if (literal.empty())
+            {
+                unanchored_.push_back(g);
+                continue;
+            }
+            uint32_t node = 0;
+            for (unsigned char c : literal)
+            {
+                if (nodes_[node].next[c] == 0)
+                {
+                    nodes_[node].next[c] = static_cast<uint32_t>(nodes_.size());
+                    nodes_.emplace_back();
+                }
+                node = nodes_[node].next[c];
+            }
+            nodes_[node].globs.push_back(g);
+        }
+
+        // Breadth-first, turning the trie into a DFA: missing edges follow the failure links,
+        // and every node also reports the globs of its failure node
+        std::deque<uint32_t> queue;
+        for (uint32_t &child : nodes_[0].next)
+        {
+            if (child != 0)
+            {
+                queue.push_back(child);
+            }
+        }
+        while (!queue.empty())
+        {
+            const uint32_t node = queue.front();
+            queue.pop_front();
+            const Node &fail = nodes_[nodes_[node].fail];
+            nodes_[node].globs.insert(nodes_[node].globs.end(), fail.globs.begin(), fail.globs.end());
+            for (int c = 0; c < 256; ++c)
+            {
+                const uint32_t child = nodes_[node].next[c];
+                if (child != 0)
+                {
+                    nodes_[child].fail = nodes_[nodes_[node].fail].next[c];
+                    queue.push_back(child);
+                }
+                else
+                {
+                    nodes_[node].next[c] = nodes_[nodes_[node].fail].next[c];
+                }
+            }
+        }
+    }
+
+    // Function to return the first pattern matching name, or NO_MATCH; name has to end a
+    // NUL-terminated string, as the names of ScanEntry do
+    size_t match(std::string_view name, std::string &lowered) const
+    {
+        size_t best = NO_MATCH;
+        if (!extensions_.empty())
+        {
+            lowercaseInto(extensionOf(name), lowered);
+            auto it = extensions_.find(lowered);
+            if (it != extensions_.end())
+            {
+                best = it->second;
+            }
+        }
+        auto tryGlob = [&](size_t g)
+        {
+            if (globs_[g].index < best && ::fnmatch(globs_[g].pattern.c_str(), name.data(), 0) == 0)
+            {
+                best = globs_[g].index;
+            }
+        };
+        for (size_t g : unanchored_)
+        {
+            tryGlob(g);
+        }
+        if (nodes_.size() > 1)
+        {
+            uint32_t node = 0;
+            for (unsigned char c : name)
+            {
+                node = nodes_[node].next[c];
+                for (size_t g : nodes_[node].globs)
+                {
+                    tryGlob(g);
+                }
+            }
+        }
+        return best;
+    }
+
+private:
+    struct Glob
+    {
+        std::string pattern;
+        size_t index; // position in the pattern list
+    };
+
+    struct Node
+    {
+        std::array<uint32_t, 256> next{};
+        uint32_t fail = 0;
+        std::vector<size_t> globs; // globs whose literal ends here
+    };
+
+    // Function to return the longest run of ordinary characters, which every matching name contains
+    static std::string longestLiteral(const std::string &pattern)
+    {
+        std::string best, run;
+        for (size_t i = 0; i <= pattern.size(); ++i)
+        {
+            const char c = i < pattern.size() ? pattern[i] : '*';
+            if (c != '*' && c != '?' && c != '[' && c != '\\')
+            {
+                run += c;
+                continue;
+            }
+            if (run.size() > best.size())
+            {
+                best = run;
+            }
+            run.clear();
+            if (c == '[')
+            {
+                // A bracket expression is one character; "[]...]" and "[!]...]" start with a literal ]
+                size_t close = i + 1;
+                close += close < pattern.size() && (pattern[close] == '!' || pattern[close] == '^');
+                close = pattern.find(']', close + 1);
+                if (close == std::string::npos)
+                {
+                    break;
+                }
+                i = close;
+            }
+            else if (c == '\\')
+            {
+                ++i;
+            }
+        }
+        return best;
+    }
+
+    std::vector<std::string> patterns_;
+    std::unordered_map<std::string, size_t> extensions_;
+    std::vector<Glob> globs_;
+    std::vector<size_t> unanchored_; // globs without a literal, tried on every name
+    std::vector<Node> nodes_;
+};
+
+// Function to print how many files and bytes each selection pattern matched
+void printSelectionSummary(std::ostream &out, const NameMatcher &matcher,
+                           const std::vector<std::pair<unsigned long long, unsigned long long>> &totals)
+{
+    out << "Selected files by pattern:\n";
+    for (size_t i = 0; i < matcher.size(); ++i)
+    {
+        out << "  " << std::left << std::setw(16) << matcher.pattern(i) << std::right << std::setw(10) << totals[i].first
+            << " files  " << sizeToString(totals[i].second) << '\n';
+    }
+}
+
+// Options controlling how far scanTree descends
+struct ScanOptions
+{
+    bool oneFileSystem = false; // do not descend into directories on another device
+    Throttle *throttle = nullptr; // paces opendir and stat calls against the metadata budget
+    const ScanRules *rules = nullptr; // include/exclude patterns and size/age cutoffs
+    ScanControl *control = nullptr; // cancellation, pause and budgets; receives the unlisted directories
+    bool counted = true; // false for an extra walk that must not add to the file and directory counters
+};
+
+template <typename Visitor>
+void scanDirectory(std::string &path, Visitor &onFile, ErrorTable &errors, const ScanOptions &options,
+                   dev_t rootDevice, const ScanRules::Cursor &cursor)
+{
+    const ScanRules *rules = options.rules;
+    if (options.control && !options.control->proceed())
+    {
+        options.control->deferDirectory(path);
+        return;
+    }
+    if (options.throttle)
+    {
+        options.throttle->acquireMetadata();
+    }
+    int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0 && options.oneFileSystem)
+    {
+        // Mount points are only recognisable after opening them, which costs one fstat per directory
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && st.st_dev != rootDevice)
+        {
+            ::close(fd);
+            return;
+        }
+    }
+    DIR *dir = fd >= 0 ? ::fdopendir(fd) : nullptr;
+    if (dir == nullptr)
+    {
+        const int error = errno;
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        errors.record(path, error, ScanOp::OpenDir);
+        return;
+    }
+    if (options.counted)
+    {
+        countMetric(Metric::Directories);
+    }
+
+    const size_t baseLength = path.size();
+    if (path.back() != '/')
+    {
+        path += '/';
+    }
+    const size_t nameOffset = path.size();
+
+    // Subdirectories are visited after the handle is closed so deep trees do not pin descriptors
+    std::vector<std::string> subdirs;
+    while (true)
+    {
+        dirent *de;
+        {
+            SampledTimer timer(Metric::ReaddirNs, 4);
+            de = ::readdir(dir);
+        }
+        if (de == nullptr)
+        {
+            break;
+        }
+        const char *name = de->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        {
+            continue;
+        }
+        if (de->d_type == DT_DIR)
+        {
+            subdirs.emplace_back(name);
+            continue;
+        }
+        if (de->d_type != DT_REG && de->d_type != DT_UNKNOWN)
+        {
+            continue; // symlinks, devices, sockets and fifos are not counted
+        }
+        const size_t nameLength = std::strlen(name);
+        if (rules && de->d_type == DT_REG && !rules->acceptsName(cursor, name, nameLength))
+        {
+            continue; // excluded by name, no stat needed
+        }
+
+        path.resize(nameOffset);
+        path += name;
+        struct statx stx;
+        int statError;
+        if (options.throttle)
+        {
+            options.throttle->acquireMetadata();
+        }
+        {
+            SampledTimer timer(Metric::StatNs, 4);
+            statError = statEntry(::dirfd(dir), name, stx);
+        }
+        if (statError != 0)
+        {
+            errors.record(path, statError, ScanOp::Stat);
+            continue;
+        }
+        if (S_ISDIR(stx.stx_mode))
+        {
+            subdirs.emplace_back(name);
+            continue;
+        }
+        if (!S_ISREG(stx.stx_mode))
+        {
+            continue;
+        }
+        if (rules && ((de->d_type == DT_UNKNOWN && !rules->acceptsName(cursor, name, nameLength)) ||
+                      !rules->acceptsStat(stx.stx_size, static_cast<long long>(stx.stx_mtime.tv_sec))))
+        {
+            continue;
+        }
+
+        if (options.counted)
+        {
+            countMetric(Metric::Files);
+        }
+        ScanEntry entry;
+        entry.path = path;
+        entry.name = std::string_view(path).substr(nameOffset);
+        entry.size = stx.stx_size;
+        entry.allocated = stx.stx_blocks * 512;
+        entry.mtime = static_cast<long long>(stx.stx_mtime.tv_sec);
+        entry.atime = static_cast<long long>(stx.stx_atime.tv_sec);
+        entry.ctime = static_cast<long long>(stx.stx_ctime.tv_sec);
+        entry.device = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+        entry.inode = stx.stx_ino;
+        onFile(entry);
+    }
+    ::closedir(dir);
+
+    countMetric(Metric::DirQueue, subdirs.size());
+    ScanRules::Cursor child;
+    for (const auto &subdir : subdirs)
+    {
+        countMetric(Metric::DirQueue, -1ULL);
+        if (rules && !rules->enterDirectory(cursor, subdir.c_str(), subdir.size(), child, options.oneFileSystem, rootDevice))
+        {
+            countMetric(Metric::Pruned);
+            continue;
+        }
+        path.resize(nameOffset);
+        path += subdir;
+        scanDirectory(path, onFile, errors, options, rootDevice, child);
+    }
+    path.resize(baseLength);
+}
+
+// Function to stream every regular file below root to onFile without building a file list.
+// Symbolic links are not followed; failed opendir and stat calls are recorded in errors.
+template <typename Visitor>
+void scanTree(const fs::path &root, Visitor &&onFile, ErrorTable &errors, const ScanOptions &options = ScanOptions())
+{
+    std::string path = root.string();
+    while (path.size() > 1 && path.back() == '/')
+    {
+        path.pop_back();
+    }
+
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0)
+    {
+        errors.record(path, errno, ScanOp::Stat);
+        return;
+    }
+    if (S_ISREG(st.st_mode))
+    {
+        if (options.rules && !options.rules->acceptsStat(static_cast<unsigned long long>(st.st_size), static_cast<long long>(st.st_mtime)))
+        {
+            return;
+        }
+        ScanEntry entry;
+        entry.path = path;
+        entry.name = std::string_view(path).substr(path.rfind('/') == std::string::npos ? 0 : path.rfind('/') + 1);
+        entry.size = static_cast<unsigned long long>(st.st_size);
+        entry.allocated = static_cast<unsigned long long>(st.st_blocks) * 512;
+        entry.mtime = static_cast<long long>(st.st_mtime);
+        entry.atime = static_cast<long long>(st.st_atime);
+        entry.ctime = static_cast<long long>(st.st_ctime);
+        entry.device = st.st_dev;
+        entry.inode = static_cast<unsigned long long>(st.st_ino);
+        onFile(entry);
+        return;
+    }
+    if (S_ISDIR(st.st_mode))
+    {
+        scanDirectory(path, onFile, errors, options, st.st_dev,
+                      options.rules ? options.rules->start(path) : ScanRules::Cursor());
+    }
+}
+
+// Function to walk root, or with a checkpoint entry only the directories the stopped run left
+// unlisted, and return the directories this run leaves unlisted in turn
+template <typename Visitor>
+std::vector<std::string> walkRoot(const std::string &root, const CheckpointRoot *saved, Visitor &&onFile, ErrorTable &errors,
+                                  const ScanOptions &options)
+{
+    if (saved == nullptr)
+    {
+        scanTree(root, onFile, errors, options);
+    }
+    else
+    {
+        struct stat rootStat;
+        const bool haveRoot = ::stat(root.c_str(), &rootStat) == 0;
+        for (const auto &directory : saved->pending)
+        {
+            // A deferred directory was never opened, so it may still be a mount point
+            struct stat st;
+            if (options.oneFileSystem && haveRoot && ::stat(directory.c_str(), &st) == 0 && st.st_dev != rootStat.st_dev)
+            {
+                continue;
+            }
+            scanTree(directory, onFile, errors, options);
+        }
+    }
+    return options.control ? options.control->takeDeferred() : std::vector<std::string>();
+}
+
+// Function to return the top-level directory below root that path lies in; files directly in
+// the root count as the root. root has no trailing slash unless it is "/".
+inline std::string_view topLevelGroup(std::string_view root, std::string_view path)
+{
+    const size_t start = root.size() == 1 ? 1 : root.size() + 1;
+    const size_t slash = path.find('/', start);
+    return slash == std::string_view::npos ? root : path.substr(0, slash);
+}
+
+// Remembers the directory the walker is in and what it maps to. The walker lists a
+// directory's files together, so only a change of parent needs a lookup.
+template <typename Id>
+class ParentCache
+{
+public:
+    // Function to return the id of entry's parent directory (no trailing slash except for "/"),
+    // calling lookup(parent) only when the parent changed
+    template <typename Lookup>
+    Id get(const ScanEntry &entry, Lookup &&lookup)
+    {
+        std::string_view parent = entry.path.substr(0, entry.path.size() - entry.name.size());
+        if (parent.size() > 1 && parent.back() == '/')
+        {
+            parent.remove_suffix(1);
+        }
+        if (!valid_ || path_ != parent)
+        {
+            path_.assign(parent.data(), parent.size());
+            id_ = lookup(parent);
+            valid_ = true;
+        }
+        return id_;
+    }
+
+    // Function to forget the cached parent, e.g. after the ids it maps to were invalidated
+    void reset() { valid_ = false; }
+
+private:
+    std::string path_;
+    Id id_{};
+    bool valid_ = false;
+};
+
+// Function to count the bytes of a file that lie in holes, walking its extent map with
+// SEEK_DATA/SEEK_HOLE. Only called for sparse candidates. A filesystem without hole support
+// reports the whole file as data, so the result is 0 there; failures are recorded in errors.
+unsigned long long measureHoleBytes(const std::string &path, unsigned long long size, ErrorTable &errors)
+{
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0)
+    {
+        errors.record(path, errno, ScanOp::Read);
+        return 0;
+    }
+    unsigned long long holes = 0;
+    off_t offset = 0;
+    while (static_cast<unsigned long long>(offset) < size)
+    {
+        const off_t data = ::lseek(fd, offset, SEEK_DATA);
+        if (data < 0)
+        {
+            // ENXIO: no data after offset, the rest of the file is one hole
+            if (errno == ENXIO)
+            {
+                holes += size - static_cast<unsigned long long>(offset);
+            }
+            else
+            {
+                errors.record(path, errno, ScanOp::Read);
+            }
+            break;
+        }
+        holes += static_cast<unsigned long long>(data - offset);
+        offset = ::lseek(fd, data, SEEK_HOLE);
+        if (offset < 0)
+        {
+            errors.record(path, errno, ScanOp::Read);
+            break;
+        }
+    }
+    ::close(fd);
+    return holes;
+}
+
+// A file picked by findLargeFiles, with both of its sizes
+struct LargeFile
+{
+    std::string path;
+    unsigned long long size;
+    unsigned long long allocated;
+};
+
+// Function to identify large files: those more than one standard deviation above the mean of
+// the chosen size, largest first
+std::vector<LargeFile> findLargeFiles(const fs::path &rootPath, double mean, double stdDev, SizeBasis basis = SizeBasis::Apparent)
+{
+    std::vector<LargeFile> largeFiles;
+    ErrorTable errors;
+    scanTree(rootPath, [&](const ScanEntry &entry)
+             {
+                 if (sizeFor(entry, basis) > mean + stdDev)
+                 {
+                     largeFiles.push_back({std::string(entry.path), entry.size, entry.allocated});
+                 }
+             },
+             errors);
+    // Sort in descending order of the sizes seen during the scan
+    std::sort(largeFiles.begin(), largeFiles.end(), [basis](const LargeFile &a, const LargeFile &b)
+              { return basis == SizeBasis::Allocated ? a.allocated > b.allocated : a.size > b.size; });
+    return largeFiles;
+}
+
+// case 3
+void traverse_directories(const std::string &directory, std::vector<FileExtension> &file_types, ErrorTable &errors,
+                          const ScanRules &rules)
+{
+    ScanOptions options;
+    options.rules = &rules;
+    std::string extension;
+    scanTree(directory, [&](const ScanEntry &entry)
+             {
+                 // Extensions are compared in lowercase for case-insensitivity
+                 lowercaseInto(extensionOf(entry.name), extension);
+
+                 // Accumulate space utilization by file type
+                 auto it = std::find_if(file_types.begin(), file_types.end(),
+                                        [&extension](const FileExtension &ft)
+                                        { return ft.extension == extension; });
+                 if (it != file_types.end())
+                 {
+                     it->size += entry.size;
+                     it->allocated += entry.allocated;
+                     ++it->files;
+                 }
+                 else
+                 {
+                     FileExtension ft;
+                     ft.extension = extension;
+                     ft.size = entry.size;
+                     ft.files = 1;
+                     ft.allocated = entry.allocated;
+                     file_types.push_back(ft);
+                 }
+             },
+             errors, options);
+}
+
+// Function to calculate the space utilization breakdown for specific file types
+void calculateSpaceUtilization(const std::string &drive, const ScanRules &rules)
+{
+    std::vector<FileExtension> file_types;
+    ErrorTable errors;
+    {
+        ProgressReporter progress;
+        traverse_directories(drive, file_types, errors, rules);
+    }
+    std::sort(file_types.begin(), file_types.end(), sortBySize);
+
+    // Display the breakdown of space utilization
+    std::cout << "Space Utilization Breakdown:\n";
+    for (const auto &ft : file_types)
+    {
+        std::cout << "File Type: " << ft.extension << ", Size: " << sizeToString(ft.size) << ", Allocated: " << sizeToString(ft.allocated) << " \n";
+    }
+    std::cout << "\n";
+
+    // Display inaccessible directories once, after the breakdown
+    errors.summarize(std::cout);
+}
+
+// Custom recursive directory traversal function
+void traverseDirectory(const fs::path &dirPath, const std::vector<FileType> &fileTypesToScan, std::unordered_map<FileType, FileExtension> &fileTypeUsage, ErrorTable &errors,
+                       const ScanRules &rules)
+{
+    ScanOptions options;
+    options.rules = &rules;
+    std::string extension;
+    scanTree(dirPath, [&](const ScanEntry &entry)
+             {
+                 lowercaseInto(extensionOf(entry.name), extension);
+                 FileType fileType = categorizeExtension(extension);
+                 if (fileType != FileType::Unknown && std::find(fileTypesToScan.begin(), fileTypesToScan.end(), fileType) != fileTypesToScan.end())
+                 {
+                     FileExtension &usage = fileTypeUsage[fileType];
+                     usage.size += entry.size;
+                     usage.allocated += entry.allocated;
+                     ++usage.files;
+                 }
+             },
+             errors, options);
+}
+
+// Function to calculate the space utilization breakdown for specific file types
+void calculateSpaceUtilization(const fs::path &drive, const std::vector<FileType> &fileTypesToScan, const ScanRules &rules)
+{
+    std::error_code ec;
+    const fs::space_info spaceInfo = fs::space(drive, ec);
+    if (ec)
+    {
+        // Handle the error while accessing the main directory
+        std::cerr << "Error accessing the drive: " << drive << " - " << ec.message() << "\n";
+        return;
+    }
+
+    std::cout << "Drive: " << drive << "\n";
+    std::cout << "Total Space: " << sizeToString( spaceInfo.capacity) << " \n";
+    std::cout << "Free Space: " << sizeToString( spaceInfo.free) << " \n";
+
+    // Data structure to store space utilization breakdown by file type
+    std::unordered_map<FileType, FileExtension> fileTypeUsage;
+
+    ErrorTable errors;
+
+    // Perform custom recursive directory traversal
+    traverseDirectory(drive, fileTypesToScan, fileTypeUsage, errors, rules);
+
+    // Display space utilization breakdown by file type
+    for (const auto &[type, usage] : fileTypeUsage)
+    {
+        std::cout << getFileTypeName(type) << ": " << sizeToString(usage.size) << ", Allocated: " << sizeToString(usage.allocated) << " \n";
+    }
+
+    std::cout << "\n";
+
+    // Display inaccessible directories
+    if (!errors.empty())
+    {
+        errors.summarize(std::cout);
+        std::cout << "\n";
+    }
+}
+
+// Data structure describing one mounted filesystem
+struct MountInfo
+{
+    std::string mountPoint;
+    std::string fsType;
+    std::string source;
+    std::string root; // directory of the filesystem mounted here, "/" unless a bind mount or subvolume
+    unsigned major = 0;
+    unsigned minor = 0;
+    std::string backingDevice; // whole disk ("sda", "nvme0n1"), or the source for network and pool filesystems
+};
+
+// Capacity figures for one filesystem
+struct SpaceStats
+{
+    bool valid = false;
+    unsigned long long capacity = 0;
+    unsigned long long free = 0;      // free blocks, including those reserved for root
+    unsigned long long available = 0; // free blocks usable by unprivileged users
+    int error = 0;                    // errno when the query failed
+};
+
+// Function to read capacity and free space of the filesystem containing path
+SpaceStats querySpace(const std::string &path)
+{
+    SpaceStats stats;
+#ifdef __linux__
+    struct statfs fsStats;
+    if (::statfs(path.c_str(), &fsStats) == 0)
+    {
+        const unsigned long long blockSize = fsStats.f_frsize ? fsStats.f_frsize : fsStats.f_bsize;
+        stats.valid = true;
+        stats.capacity = fsStats.f_blocks * blockSize;
+        stats.free = fsStats.f_bfree * blockSize;
+        stats.available = fsStats.f_bavail * blockSize;
+    }
+    else
+    {
+        stats.error = errno;
+    }
+#else
+    std::error_code ec;
+    const fs::space_info spaceInfo = fs::space(path, ec);
+    if (!ec)
+    {
+        stats.valid = true;
+        stats.capacity = spaceInfo.capacity;
+        stats.free = spaceInfo.free;
+        stats.available = spaceInfo.available;
+    }
+    else
+    {
+        stats.error = ec.value();
+    }
+#endif
+    return stats;
+}
+
+// Function to decode the octal escapes (\040 for space, ...) used in /proc/self/mountinfo
+std::string unescapeMountField(const std::string &field)
+{
+    std::string result;
+    result.reserve(field.size());
+    for (size_t i = 0; i < field.size(); ++i)
+    {
+        if (field[i] == '\\' && i + 3 < field.size() && std::isdigit(static_cast<unsigned char>(field[i + 1])) &&
+            std::isdigit(static_cast<unsigned char>(field[i + 2])) && std::isdigit(static_cast<unsigned char>(field[i + 3])))
+        {
+            result += static_cast<char>(((field[i + 1] - '0') << 6) | ((field[i + 2] - '0') << 3) | (field[i + 3] - '0'));
+            i += 3;
+        }
+        else
+        {
+            result += field[i];
+        }
+    }
+    return result;
+}
+
+// Function to map a device number to the whole-disk block device behind it via sysfs
+std::string resolveBackingDevice(unsigned major, unsigned minor)
+{
+    char link[64];
+    std::snprintf(link, sizeof(link), "/sys/dev/block/%u:%u", major, minor);
+    std::error_code ec;
+    fs::path device = fs::canonical(link, ec);
+    if (ec)
+    {
+        return {};
+    }
+    // Partitions live below their disk (.../block/sda/sda1) and carry a "partition" attribute
+    if (fs::exists(device / "partition", ec))
+    {
+        device = device.parent_path();
+    }
+    return device.filename().string();
+}
+
+// Kernel filesystems whose files take no disk space; reading some of them blocks or never ends
+const std::vector<std::string> &pseudoFileSystems()
+{
+    static const std::vector<std::string> types = {
+        "proc", "sysfs", "devtmpfs", "devpts", "tmpfs", "ramfs", "cgroup", "cgroup2", "securityfs", "debugfs",
+        "tracefs", "pstore", "bpf", "mqueue", "hugetlbfs", "autofs", "configfs", "fusectl", "binfmt_misc",
+        "nsfs", "efivarfs", "rpc_pipefs", "selinuxfs", "squashfs", "fuse.gvfsd-fuse", "fuse.portal"};
+    return types;
+}
+
+bool isPseudoFileSystem(const std::string &fsType)
+{
+    const auto &types = pseudoFileSystems();
+    return std::find(types.begin(), types.end(), fsType) != types.end();
+}
+
+// Function to tell filesystems whose source names a server ("host:/export", "//host/share")
+bool isNetworkFileSystem(const std::string &fsType)
+{
+    static const std::vector<std::string> types = {"nfs", "nfs4", "cifs", "smb3", "smbfs", "ceph", "glusterfs",
+                                                   "fuse.glusterfs", "fuse.sshfs", "9p", "afs", "lustre"};
+    return std::find(types.begin(), types.end(), fsType) != types.end();
+}
+
+// Function to name what a mount without a block device of its own sits on: the server of a
+// network share, the disk of a device node source (btrfs subvolumes, device-mapper links),
+// or else the pool of a pooled filesystem ("tank/home" is on "tank")
+std::string resolveMountSource(const MountInfo &mount)
+{
+    const std::string &source = mount.source;
+    if (isNetworkFileSystem(mount.fsType))
+    {
+        if (source.compare(0, 2, "//") == 0)
+        {
+            return source.substr(0, source.find('/', 2));
+        }
+        return source.substr(0, source.find(':'));
+    }
+    struct stat st;
+    if (!source.empty() && source[0] == '/' && ::stat(source.c_str(), &st) == 0 && S_ISBLK(st.st_mode))
+    {
+        std::string disk = resolveBackingDevice(major(st.st_rdev), minor(st.st_rdev));
+        if (!disk.empty())
+        {
+            return disk;
+        }
+    }
+    const std::string pool = source.substr(0, source.find('/'));
+    return pool.empty() ? source : pool;
+}
+
+// Function to read every line of the mount table, pseudo filesystems and bind mounts included
+std::vector<MountInfo> readMountTable()
+{
+    std::vector<MountInfo> mounts;
+#ifdef __linux__
+    std::ifstream mountInfo("/proc/self/mountinfo");
+    std::string line;
+    while (std::getline(mountInfo, line))
+    {
+        // <id> <parent> <major>:<minor> <root> <mount point> <options> [optional...] - <fstype> <source> <super options>
+        std::istringstream fields(line);
+        std::string id, parent, device, root, mountPoint, options, field;
+        fields >> id >> parent >> device >> root >> mountPoint >> options;
+        while (fields >> field && field != "-")
+        {
+        }
+        MountInfo mount;
+        fields >> mount.fsType >> mount.source;
+        if (mount.fsType.empty() || std::sscanf(device.c_str(), "%u:%u", &mount.major, &mount.minor) != 2)
+        {
+            continue;
+        }
+        mount.mountPoint = unescapeMountField(mountPoint);
+        mount.source = unescapeMountField(mount.source);
+        mount.root = unescapeMountField(root);
+        mounts.push_back(mount);
+    }
+#endif
+    return mounts;
+}
+
+// Function to discover real (non-pseudo) filesystems, one entry per device
+std::vector<MountInfo> discoverMounts()
+{
+    std::vector<MountInfo> mounts;
+#ifdef __linux__
+    std::unordered_map<uint64_t, size_t> seenDevices; // major:minor -> index in mounts
+    for (MountInfo &mount : readMountTable())
+    {
+        if (isPseudoFileSystem(mount.fsType))
+        {
+            continue;
+        }
+        // Bind mounts repeat a device that is already being scanned. Keep the mount of the
+        // filesystem's root, which covers the others, even when a bind mount is listed first.
+        auto [seen, first] = seenDevices.try_emplace(static_cast<uint64_t>(mount.major) << 32 | mount.minor, mounts.size());
+        if (!first && (mount.root != "/" || mounts[seen->second].root == "/"))
+        {
+            continue;
+        }
+
+        if (mount.major != 0)
+        {
+            mount.backingDevice = resolveBackingDevice(mount.major, mount.minor);
+        }
+        if (mount.backingDevice.empty())
+        {
+            mount.backingDevice = resolveMountSource(mount);
+        }
+        if (first)
+        {
+            mounts.push_back(mount);
+        }
+        else
+        {
+            mounts[seen->second] = mount;
+        }
+    }
+#else
+    for (const char *drive : {"C:/", "D:/", "F:/"})
+    {
+        MountInfo mount;
+        mount.mountPoint = drive;
+        mount.backingDevice = drive;
+        mounts.push_back(mount);
+    }
+#endif
+    return mounts;
+}
+
+// Function to compile the mount table into scan rules: every mount point is recorded for
+// one-file-system walks, and with excludePseudo the mounts of kernel filesystems (/proc, /sys,
+// cgroups, ...) and container overlays are pruned. tmpfs and ramfs stay, since files on them
+// still use memory a user may want to find.
+void addMountRules(ScanRules &rules, bool excludePseudo)
+{
+    for (const MountInfo &mount : readMountTable())
+    {
+        rules.addMountPoint(mount.mountPoint, makedev(mount.major, mount.minor));
+        const bool memoryBacked = mount.fsType == "tmpfs" || mount.fsType == "ramfs";
+        if (excludePseudo && mount.mountPoint != "/" &&
+            ((isPseudoFileSystem(mount.fsType) && !memoryBacked) || mount.fsType == "overlay"))
+        {
+            rules.excludeDirectory(mount.mountPoint);
+        }
+    }
+}
+
+// Function to return the rules used by the interactive menu: pseudo filesystems are skipped
+const ScanRules &interactiveScanRules()
+{
+    static const ScanRules rules = []
+    {
+        ScanRules compiled;
+        addMountRules(compiled, true);
+        return compiled;
+    }();
+    return rules;
+}
+
+// Function to delete files matching a comma-separated list of extensions and name globs: one
+// walk selects them all, and they are moved in one deletion plan once the user confirms
+void delete_files_of_type(const fs::path&  directory, const std::string& file_types) {
+    NameMatcher matcher;
+    std::string error;
+    if (!matcher.add(file_types, error)) {
+        std::cout << "Invalid file types: " << error << '\n';
+        return;
+    }
+    matcher.compile();
+
+    std::vector<fs::path> matches;
+    std::vector<std::pair<unsigned long long, unsigned long long>> totals(matcher.size());
+    ErrorTable errors;
+    ScanOptions options;
+    options.rules = &interactiveScanRules();
+    std::string lowered;
+    {
+        ProgressReporter progress;
+        scanTree(directory, [&](const ScanEntry &entry) {
+            const size_t index = matcher.match(entry.name, lowered);
+            if (index != NameMatcher::NO_MATCH) {
+                matches.emplace_back(std::string(entry.path));
+                ++totals[index].first;
+                totals[index].second += entry.size;
+            }
+        }, errors, options);
+    }
+    errors.summarize(std::cout);
+    printSelectionSummary(std::cout, matcher, totals);
+    if (matches.empty()) {
+        std::cout << "No matching files found.\n";
+        return;
+    }
+
+    std::cout << "Move these " << matches.size() << " files to Trash (y / n)? ";
+    char confirm;
+    std::cin >> confirm;
+    if (confirm != 'y') {
+        std::cout << "No files deleted.\n";
+        return;
+    }
+    for (const auto &path : matches) {
+        std::cout << "Moving to Trash: " << path << '\n';
+    }
+    const size_t moved = moveToTrash(matches);
+    std::cout << moved << " of " << matches.size() << " files moved to Trash.\n";
+}
+
+// Result of scanning one mount for the space utilization breakdown
+struct MountScanResult
+{
+    MountInfo mount;
+    SpaceStats space;
+    std::vector<FileExtension> fileTypes; // sorted by size, largest first
+    ErrorTable errors;
+};
+
+// Function to build the per-extension breakdown of every mount. Mounts on the same backing
+// device are scanned one after another; independent devices are scanned in parallel, so the
+// wall time is that of the slowest device rather than the sum.
+std::vector<MountScanResult> scanMountsInParallel(const std::vector<MountInfo> &mounts, const ScanOptions &baseOptions = ScanOptions())
+{
+    std::vector<MountScanResult> results(mounts.size());
+    std::unordered_map<std::string, std::vector<size_t>> mountsByDevice;
+    for (size_t i = 0; i < mounts.size(); ++i)
+    {
+        mountsByDevice[mounts[i].backingDevice].push_back(i);
+    }
+
+    ScanOptions options = baseOptions;
+    options.oneFileSystem = true;
+    std::vector<std::thread> workers;
+    for (const auto &[device, indexes] : mountsByDevice)
+    {
+        workers.emplace_back([&results, &mounts, &options, indexes = indexes]
+                             {
+                                 std::string extension;
+                                 for (size_t index : indexes)
+                                 {
+                                     MountScanResult &result = results[index];
+                                     result.mount = mounts[index];
+                                     result.space = querySpace(result.mount.mountPoint);
+                                     std::unordered_map<std::string, FileExtension> totals;
+                                     scanTree(result.mount.mountPoint, [&](const ScanEntry &entry)
+                                              {
+                                                  lowercaseInto(extensionOf(entry.name), extension);
+                                                  FileExtension &ft = totals[extension];
+                                                  ft.size += entry.size;
+                                                  ft.allocated += entry.allocated;
+                                                  ++ft.files;
+                                              },
+                                              result.errors, options);
+                                     for (auto &[ext, ft] : totals)
+                                     {
+                                         ft.extension = ext;
+                                         result.fileTypes.push_back(std::move(ft));
+                                     }
+                                     std::sort(result.fileTypes.begin(), result.fileTypes.end(), sortBySize);
+                                 }
+                             });
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+    return results;
+}
+
+// Temporary file holding spilled records. It is unlinked as soon as it is created, so nothing
+// is left behind if the process dies; the open descriptor keeps the data until it is closed.
+class SpillFile
+{
+public:
+    explicit SpillFile(const std::string &directory)
+    {
+        std::string pattern = directory + "/diskmanager-spill-XXXXXX";
+        fd_ = ::mkstemp(pattern.data());
+        if (fd_ < 0)
+        {
+            throw std::system_error(errno, std::generic_category(), "cannot create spill file in " + directory);
+        }
+        ::unlink(pattern.c_str());
+    }
+    ~SpillFile()
+    {
+        ::close(fd_);
+    }
+    SpillFile(const SpillFile &) = delete;
+    SpillFile &operator=(const SpillFile &) = delete;
+
+    unsigned long long size() const { return size_; }
+
+    // Function to append bytes at the end of the file
+    void append(const void *data, size_t length)
+    {
+        const char *bytes = static_cast<const char *>(data);
+        while (length > 0)
+        {
+            const ssize_t written = ::pwrite(fd_, bytes, length, size_);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                throw std::system_error(errno, std::generic_category(), "cannot write spill file");
+            }
+            bytes += written;
+            length -= written;
+            size_ += written;
+        }
+    }
+
+    // Function to read exactly length bytes at offset
+    void readAt(void *data, size_t length, unsigned long long offset) const
+    {
+        char *bytes = static_cast<char *>(data);
+        while (length > 0)
+        {
+            const ssize_t got = ::pread(fd_, bytes, length, offset);
+            if (got <= 0)
+            {
+                if (got < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                throw std::system_error(got < 0 ? errno : EIO, std::generic_category(), "cannot read spill file");
+            }
+            bytes += got;
+            length -= got;
+            offset += got;
+        }
+    }
+
+private:
+    int fd_ = -1;
+    unsigned long long size_ = 0;
+};
+
+// Sorts a stream of fixed-size records within a memory budget. Records are buffered; when the
+// buffer is full it is sorted and written out as a run, and next() k-way merges the runs with
+// a min-heap. Without a budget, or while everything fits, nothing touches the disk.
+template <typename Record>
+class ExternalSorter
+{
+    static_assert(std::is_trivially_copyable<Record>::value, "records are spilled as raw bytes");
+
+public:
+    static constexpr size_t MAX_FAN_IN = 64;                          // runs merged at once
+    static constexpr size_t READ_BLOCK = (64 * 1024) / sizeof(Record); // records read per run refill
+
+    // memoryBytes == 0 means unlimited
+    ExternalSorter(size_t memoryBytes, std::string tempDir)
+        : capacity_(memoryBytes == 0 ? std::numeric_limits<size_t>::max()
+                                     : std::max<size_t>(memoryBytes / sizeof(Record), READ_BLOCK)),
+          tempDir_(std::move(tempDir)) {}
+
+    void add(const Record &record)
+    {
+        buffer_.push_back(record);
+        if (buffer_.size() >= capacity_)
+        {
+            spill();
+        }
+    }
+
+    size_t runCount() const { return runs_.size(); }
+
+    // Function to end the input; next() returns the records in ascending order afterwards
+    void finish()
+    {
+        if (runs_.empty())
+        {
+            std::sort(buffer_.begin(), buffer_.end());
+            return;
+        }
+        spill();
+        buffer_ = std::vector<Record>();
+        // Merge in passes so no more than MAX_FAN_IN runs are open at once
+        while (runs_.size() > MAX_FAN_IN)
+        {
+            auto merged = std::make_unique<SpillFile>(tempDir_);
+            {
+                Merger merger(runs_.begin(), runs_.begin() + MAX_FAN_IN);
+                std::vector<Record> block;
+                block.reserve(READ_BLOCK);
+                Record record;
+                while (merger.next(record))
+                {
+                    block.push_back(record);
+                    if (block.size() == READ_BLOCK)
+                    {
+                        merged->append(block.data(), block.size() * sizeof(Record));
+                        block.clear();
+                    }
+                }
+                merged->append(block.data(), block.size() * sizeof(Record));
+            }
+            runs_.erase(runs_.begin(), runs_.begin() + MAX_FAN_IN);
+            runs_.push_back(std::move(merged));
+        }
+        merger_ = std::make_unique<Merger>(runs_.begin(), runs_.end());
+    }
+
+    bool next(Record &record)
+    {
+        if (merger_)
+        {
+            return merger_->next(record);
+        }
+        if (position_ >= buffer_.size())
+        {
+            return false;
+        }
+        record = buffer_[position_++];
+        return true;
+    }
+
+private:
+    using RunList = std::vector<std::unique_ptr<SpillFile>>;
+
+    // Sequential reader over one sorted run
+    struct RunReader
+    {
+        const SpillFile *file = nullptr;
+        unsigned long long offset = 0;
+        std::vector<Record> block;
+        size_t position = 0;
+
+        bool next(Record &record)
+        {
+            if (position == block.size())
+            {
+                const unsigned long long remaining = (file->size() - offset) / sizeof(Record);
+                if (remaining == 0)
+                {
+                    return false;
+                }
+                block.resize(std::min<unsigned long long>(remaining, READ_BLOCK));
+                file->readAt(block.data(), block.size() * sizeof(Record), offset);
+                offset += block.size() * sizeof(Record);
+                position = 0;
+            }
+            record = block[position++];
+            return true;
+        }
+    };
+
+    // k-way merge of runs using a min-heap keyed on each run's current record
+    class Merger
+    {
+    public:
+        Merger(typename RunList::iterator first, typename RunList::iterator last)
+        {
+            for (auto it = first; it != last; ++it)
+            {
+                readers_.emplace_back();
+                readers_.back().file = it->get();
+            }
+            for (size_t i = 0; i < readers_.size(); ++i)
+            {
+                Record record;
+                if (readers_[i].next(record))
+                {
+                    heap_.emplace_back(record, i);
+                }
+            }
+            std::make_heap(heap_.begin(), heap_.end(), greater);
+        }
+
+        bool next(Record &record)
+        {
+            if (heap_.empty())
+            {
+                return false;
+            }
+            std::pop_heap(heap_.begin(), heap_.end(), greater);
+            record = heap_.back().first;
+            const size_t run = heap_.back().second;
+            heap_.pop_back();
+            Record following;
+            if (readers_[run].next(following))
+            {
+                heap_.emplace_back(following, run);
+                std::push_heap(heap_.begin(), heap_.end(), greater);
+            }
+            return true;
+        }
+
+    private:
+        static bool greater(const std::pair<Record, size_t> &a, const std::pair<Record, size_t> &b)
+        {
+            return b.first < a.first;
+        }
+
+        std::vector<RunReader> readers_;
+        std::vector<std::pair<Record, size_t>> heap_;
+    };
+
+    // Function to sort the buffer and write it out as a new run
+    void spill()
+    {
+        if (buffer_.empty())
+        {
+            return;
+        }
+        std::sort(buffer_.begin(), buffer_.end());
+        auto run = std::make_unique<SpillFile>(tempDir_);
+        run->append(buffer_.data(), buffer_.size() * sizeof(Record));
+        runs_.push_back(std::move(run));
+        buffer_.clear();
+    }
+
+    size_t capacity_;
+    std::string tempDir_;
+    std::vector<Record> buffer_;
+    size_t position_ = 0;
+    RunList runs_;
+    std::unique_ptr<Merger> merger_;
+};
+
+// Append-only store of paths addressed by entry id (the byte offset of the entry). Paths stay
+// in memory up to the budget and are then appended to a spill file; ids stay valid either way.
+class PathStore
+{
+public:
+    PathStore(size_t memoryBytes, std::string tempDir) : capacity_(memoryBytes), tempDir_(std::move(tempDir)) {}
+
+    unsigned long long add(std::string_view path)
+    {
+        const unsigned long long id = spilled_ + arena_.size();
+        const uint32_t length = static_cast<uint32_t>(path.size());
+        arena_.append(reinterpret_cast<const char *>(&length), sizeof(length));
+        arena_.append(path);
+        if (capacity_ != 0 && arena_.size() >= capacity_)
+        {
+            if (!file_)
+            {
+                file_ = std::make_unique<SpillFile>(tempDir_);
+            }
+            file_->append(arena_.data(), arena_.size());
+            spilled_ += arena_.size();
+            arena_.clear();
+        }
+        return id;
+    }
+
+    std::string get(unsigned long long id) const
+    {
+        uint32_t length;
+        if (id >= spilled_)
+        {
+            const char *entry = arena_.data() + (id - spilled_);
+            std::memcpy(&length, entry, sizeof(length));
+            return std::string(entry + sizeof(length), length);
+        }
+        file_->readAt(&length, sizeof(length), id);
+        std::string path(length, '\0');
+        file_->readAt(path.data(), length, id + sizeof(length));
+        return path;
+    }
+
+private:
+    size_t capacity_; // 0 means unlimited
+    std::string tempDir_;
+    std::string arena_;
+    unsigned long long spilled_ = 0;
+    std::unique_ptr<SpillFile> file_;
+};
+
+// Order in which duplicate candidates are read for hashing
+enum class ReadOrder
+{
+    Auto,      // physical order on rotational devices, discovery order elsewhere
+    Physical,  // always sort by first physical extent (FIEMAP) or inode number
+    Directory, // discovery order
+};
+
+// Options for findDuplicateFiles
+struct DuplicateScanOptions
+{
+    ReadOrder readOrder = ReadOrder::Auto;
+    CachePolicy cachePolicy = CachePolicy::DontNeed;
+    long readaheadKb = -1;                                   // applied to every disk read from; -1 leaves it alone
+    std::unordered_map<std::string, long> readaheadByDisk; // per-disk overrides, e.g. sda -> 4096
+    unsigned workers = 0; // hashing threads; 0 picks one for rotational disks, else one per core
+    unsigned long long memoryBudget = 0; // bytes for the size/hash catalogs before spilling; 0 = unlimited
+    std::string tempDir;                 // where spilled runs go; empty uses $TMPDIR or /tmp
+    ScanOptions scanOptions;
+    ScanCheckpoint *checkpoint = nullptr; // hashes of earlier stopped runs to reuse, and this run's to keep
+    bool keepUsedHashesOnly = false;      // drop checkpoint hashes this run did not need (a cache across rescans)
+    bool includeUnique = false;           // also hash files of unshared sizes and report them as groups of one
+    bool prefilter = false;               // walk twice, cataloguing only sizes a Bloom filter saw more than once
+};
+
+// Sets queue/read_ahead_kb of the disks a scan reads from and restores the previous values
+// when destroyed. Writing the sysfs attribute needs root; failures are reported once per disk.
+class ReadaheadTuner
+{
+public:
+    explicit ReadaheadTuner(const DuplicateScanOptions &options) : options_(options) {}
+    ~ReadaheadTuner()
+    {
+        for (const auto &[attribute, value] : saved_)
+        {
+            std::ofstream(attribute) << value;
+        }
+    }
+    ReadaheadTuner(const ReadaheadTuner &) = delete;
+    ReadaheadTuner &operator=(const ReadaheadTuner &) = delete;
+
+    void apply(dev_t device)
+    {
+        if (std::find(seen_.begin(), seen_.end(), device) != seen_.end())
+        {
+            return;
+        }
+        seen_.push_back(device);
+#ifdef __linux__
+        const std::string disk = resolveBackingDevice(major(device), minor(device));
+        auto it = options_.readaheadByDisk.find(disk);
+        const long kb = it != options_.readaheadByDisk.end() ? it->second : options_.readaheadKb;
+        if (disk.empty() || kb < 0)
+        {
+            return;
+        }
+        const std::string attribute = "/sys/block/" + disk + "/queue/read_ahead_kb";
+        std::string previous;
+        if (!(std::ifstream(attribute) >> previous))
+        {
+            return;
+        }
+        std::ofstream update(attribute);
+        if (!(update << kb << std::flush))
+        {
+            std::cerr << "Cannot set read_ahead_kb for " << disk << " (needs root)\n";
+            return;
+        }
+        saved_.emplace_back(attribute, previous);
+#endif
+    }
+
+private:
+    const DuplicateScanOptions &options_;
+    std::vector<dev_t> seen_;
+    std::vector<std::pair<std::string, std::string>> saved_;
+};
+
+// Function to tell whether the block device holding files of st_dev is rotational (an HDD).
+// Answers are cached per device since every candidate file asks.
+bool isRotationalDevice(dev_t device)
+{
+    static std::mutex cacheMutex;
+    static std::unordered_map<dev_t, bool> cache;
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    auto it = cache.find(device);
+    if (it != cache.end())
+    {
+        return it->second;
+    }
+
+    bool rotational = false;
+#ifdef __linux__
+    const std::string disk = resolveBackingDevice(major(device), minor(device));
+    if (!disk.empty())
+    {
+        std::ifstream flag("/sys/block/" + disk + "/queue/rotational");
+        int value = 0;
+        rotational = (flag >> value) && value == 1;
+    }
+#endif
+    cache.emplace(device, rotational);
+    return rotational;
+}
+
+// Function to find where a file's data starts on disk. Uses the first extent reported by
+// FIEMAP; files without extents or on filesystems without FIEMAP fall back to the inode
+// number, which most filesystems allocate close to the data.
+unsigned long long physicalReadKey(const std::string &path, unsigned long long inode)
+{
+#ifdef __linux__
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOATIME);
+    if (fd < 0 && errno == EPERM)
+    {
+        fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC); // O_NOATIME needs ownership
+    }
+    if (fd >= 0)
+    {
+        // struct fiemap ends in a flexible array; reserve room for exactly one extent after it
+        alignas(struct fiemap) unsigned char buffer[sizeof(struct fiemap) + sizeof(struct fiemap_extent)] = {};
+        auto *map = reinterpret_cast<struct fiemap *>(buffer);
+        map->fm_start = 0;
+        map->fm_length = FIEMAP_MAX_OFFSET;
+        map->fm_extent_count = 1;
+        const bool mapped = ::ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents > 0 &&
+                            !(map->fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN);
+        ::close(fd);
+        if (mapped)
+        {
+            return map->fm_extents[0].fe_physical;
+        }
+    }
+#else
+    (void)path;
+#endif
+    return inode;
+}
+
+// Function to mix a 64-bit value into an unrelated one (splitmix64 finalizer)
+inline uint64_t mix64(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Blocked Bloom filter: each key sets one bit in every 64-bit word of a single 64-byte block,
+// so an insert or a lookup touches one cache line. At 8 bits per key about 3% of absent keys
+// test as present.
+class BlockedBloomFilter
+{
+public:
+    explicit BlockedBloomFilter(unsigned long long bits) : blocks_(std::max<unsigned long long>((bits + 511) / 512, 1)) {}
+
+    // Function to add a key; returns true when it was (probably) present already
+    bool insert(uint64_t key)
+    {
+        uint64_t masks[8];
+        Block &block = blocks_[locate(key, masks)];
+        bool present = true;
+        for (int w = 0; w < 8; ++w)
+        {
+            present = present && (block.words[w] & masks[w]) == masks[w];
+            block.words[w] |= masks[w];
+        }
+        return present;
+    }
+
+    bool contains(uint64_t key) const
+    {
+        uint64_t masks[8];
+        const Block &block = blocks_[locate(key, masks)];
+        for (int w = 0; w < 8; ++w)
+        {
+            if ((block.words[w] & masks[w]) != masks[w])
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    size_t bytes() const { return blocks_.size() * sizeof(Block); }
+
+private:
+    struct alignas(64) Block
+    {
+        uint64_t words[8] = {};
+    };
+
+    size_t locate(uint64_t key, uint64_t masks[8]) const
+    {
+        const uint64_t h = mix64(key);
+        uint64_t bits = mix64(h ^ 0x9e3779b97f4a7c15ULL);
+        for (int w = 0; w < 8; ++w, bits >>= 6)
+        {
+            masks[w] = 1ULL << (bits & 63);
+        }
+        return static_cast<size_t>((static_cast<unsigned __int128>(h) * blocks_.size()) >> 64);
+    }
+
+    std::vector<Block> blocks_;
+};
+
+// Function to estimate how many files the roots can hold from the used inodes of their
+// filesystems; 0 when none of them counts inodes
+unsigned long long estimateFileCount(const std::vector<fs::path> &roots)
+{
+    std::vector<dev_t> devices;
+    unsigned long long files = 0;
+    for (const auto &root : roots)
+    {
+        struct stat st;
+        struct statfs fsInfo;
+        if (::stat(root.c_str(), &st) != 0 || std::find(devices.begin(), devices.end(), st.st_dev) != devices.end() ||
+            ::statfs(root.c_str(), &fsInfo) != 0)
+        {
+            continue;
+        }
+        devices.push_back(st.st_dev);
+        files += fsInfo.f_files > fsInfo.f_ffree ? fsInfo.f_files - fsInfo.f_ffree : 0;
+    }
+    return files;
+}
+
+// Catalog records of the duplicate engine; entry ids are PathStore offsets
+struct SizeRecord
+{
+    unsigned long long size;
+    unsigned long long id;
+    unsigned long long device;
+    unsigned long long inode;
+    long long mtime; // lets a checkpointed hash be reused while the file is unchanged
+
+    bool operator<(const SizeRecord &other) const
+    {
+        return size != other.size ? size < other.size : id < other.id;
+    }
+};
+
+struct HashRecord
+{
+    unsigned long long size;
+    unsigned char digest[32];
+    unsigned long long id;
+
+    bool operator<(const HashRecord &other) const
+    {
+        if (size != other.size)
+        {
+            return size < other.size;
+        }
+        const int order = std::memcmp(digest, other.digest, sizeof(digest));
+        return order != 0 ? order < 0 : id < other.id;
+    }
+};
+
+// A file whose size is shared by at least one other file
+struct DuplicateCandidate
+{
+    std::string path;
+    unsigned long long size;
+    unsigned long long id;
+    dev_t device;
+    unsigned long long inode;
+    unsigned long long readKey;
+    long long mtime = 0;
+    int error = 0; // errno of a failed hash; 0 when a stop left the file unread
+};
+
+// Function to hash a batch of candidates into hashes (empty on failure, with the errno left
+// in the candidate). On rotational devices the reads are issued in ascending physical order
+// so the disk head sweeps across the platter instead of seeking back and forth.
+void hashCandidateBatch(std::vector<DuplicateCandidate>& candidates, std::vector<std::string>& hashes,
+                        const DuplicateScanOptions& options, ReadaheadTuner& readahead) {
+    bool physicalOrder = false;
+    {
+        MetricsPhase phase("scheduling");
+        for (auto& candidate : candidates) {
+            readahead.apply(candidate.device);
+            const bool rotational = options.readOrder == ReadOrder::Physical ||
+                                    (options.readOrder == ReadOrder::Auto && isRotationalDevice(candidate.device));
+            if (rotational) {
+                candidate.readKey = physicalReadKey(candidate.path, candidate.inode);
+                physicalOrder = true;
+            }
+        }
+        if (physicalOrder) {
+            std::stable_sort(candidates.begin(), candidates.end(), [](const DuplicateCandidate& a, const DuplicateCandidate& b) {
+                return a.device != b.device ? a.device < b.device : a.readKey < b.readKey;
+            });
+        }
+    }
+
+    // Workers claim candidates in schedule order, so physically ordered reads stay mostly
+    // sequential; the throttle may park some of them to honour the read budget
+    hashes.assign(candidates.size(), std::string());
+    MetricsPhase phase("hashing");
+    Throttle* throttle = options.scanOptions.throttle;
+    unsigned workers = options.workers;
+    if (workers == 0) {
+        workers = physicalOrder ? 1 : std::max(1u, std::thread::hardware_concurrency());
+    }
+    const unsigned poolSize = throttle ? throttle->poolSize(workers) : workers;
+    countMetric(Metric::HashQueue, candidates.size());
+    std::atomic<size_t> next{0};
+    ScanControl* control = options.scanOptions.control;
+    auto hashWorker = [&](unsigned index) {
+        auto finished = [&] { return next.load() >= candidates.size() || (control && control->stopped()); };
+        while (!throttle || throttle->admitWorker(index, workers, finished)) {
+            if (control && !control->proceed()) {
+                break;
+            }
+            const size_t i = next.fetch_add(1);
+            if (i >= candidates.size()) {
+                break;
+            }
+            const auto start = std::chrono::steady_clock::now();
+            const double waitedBefore = throttleWaitSeconds;
+            hashes[i] = computeFileMD5(candidates[i].path, options.cachePolicy, throttle, &candidates[i].error);
+            countMetric(Metric::HashQueue, -1ULL);
+            if (throttle) {
+                const double busy = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() -
+                                    (throttleWaitSeconds - waitedBefore);
+                throttle->reportWorkerThroughput(candidates[i].size, busy);
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned w = 1; w < poolSize && w < candidates.size(); ++w) {
+        pool.emplace_back(hashWorker, w);
+    }
+    hashWorker(0);
+    for (auto& thread : pool) {
+        thread.join();
+    }
+}
+
+// Function to find groups of identical files among those walk(onFile) passes to onFile, and
+// pass each complete group to onGroup(hash, size, paths), in ascending (size, hash) order.
+// Taking a walk lets a caller that lists the files anyway, such as serve building its
+// catalog, feed the engine from that same walk. Files are first bucketed by size and only
+// sizes shared by two or more files are hashed (every size with includeUnique); with
+// sharedSizes, files whose size it does not hold are skipped. With a memory budget, the size
+// and hash catalogs are spilled to the temp directory as sorted runs of (size, hash, entry id)
+// and the groups are found by k-way merging the runs, so memory stays flat however many files
+// the volume holds; paths are spilled too and only read back for candidates and results.
+template <typename Walk, typename OnGroup>
+void forEachDuplicateGroupOf(Walk&& walk, ErrorTable &errors, const DuplicateScanOptions& options, OnGroup&& onGroup,
+                             const BlockedBloomFilter* sharedSizes = nullptr) {
+    std::string tempDir = options.tempDir;
+    if (tempDir.empty()) {
+        const char* environment = std::getenv("TMPDIR");
+        tempDir = environment && *environment ? environment : "/tmp";
+    }
+    size_t budget = static_cast<size_t>(options.memoryBudget);
+    // The shared-sizes filter lives through the whole scan, so it comes out of the budget
+    if (sharedSizes && budget > sharedSizes->bytes()) {
+        budget -= sharedSizes->bytes();
+    }
+
+    // Budget split: size catalog 2/5, paths 1/5, hash catalog 1/5, hashing batch 1/5
+    PathStore paths(budget / 5, tempDir);
+    ExternalSorter<SizeRecord> sizes(budget / 5 * 2, tempDir);
+    ExternalSorter<HashRecord> digests(budget / 5, tempDir);
+    const size_t batchLimit = budget == 0 ? std::numeric_limits<size_t>::max()
+                                          : std::max<size_t>(budget / 5 / (sizeof(DuplicateCandidate) + 128), 1024);
+    walk([&](const ScanEntry& entry) {
+        if (sharedSizes && !sharedSizes->contains(entry.size)) {
+            return;
+        }
+        sizes.add({entry.size, paths.add(entry.path), static_cast<unsigned long long>(entry.device), entry.inode,
+                   entry.mtime});
+    });
+    sizes.finish();
+
+    ReadaheadTuner readahead(options);
+    std::vector<DuplicateCandidate> batch;
+    std::vector<std::string> hashes;
+    // Hashes of deleted or no longer shared files are left behind when the cache is pruned
+    std::unordered_map<std::string, CheckpointHash> usedHashes;
+    std::unordered_map<std::string, CheckpointHash>* keptHashes = nullptr;
+    if (options.checkpoint) {
+        keptHashes = options.keepUsedHashesOnly ? &usedHashes : &options.checkpoint->hashes;
+    }
+    auto hashBatch = [&] {
+        if (options.checkpoint) {
+            // Files an earlier stopped run hashed are taken from the checkpoint while unchanged
+            size_t kept = 0;
+            for (size_t i = 0; i < batch.size(); ++i) {
+                auto it = options.checkpoint->hashes.find(batch[i].path);
+                if (it != options.checkpoint->hashes.end() && it->second.size == batch[i].size &&
+                    it->second.mtime == batch[i].mtime) {
+                    HashRecord record{batch[i].size, {}, batch[i].id};
+                    std::memcpy(record.digest, it->second.digest, sizeof(record.digest));
+                    digests.add(record);
+                    if (options.keepUsedHashesOnly) {
+                        usedHashes.insert(*it);
+                    }
+                    continue;
+                }
+                if (kept != i) {
+                    batch[kept] = std::move(batch[i]);
+                }
+                ++kept;
+            }
+            batch.resize(kept);
+        }
+        hashCandidateBatch(batch, hashes, options, readahead);
+        for (size_t i = 0; i < batch.size(); ++i) {
+            HashRecord record{batch[i].size, {}, batch[i].id};
+            if (hashes[i].size() != 2 * sizeof(record.digest)) {
+                if (batch[i].error != 0) {
+                    errors.record(batch[i].path, batch[i].error, ScanOp::Read);
+                }
+                continue;
+            }
+            for (size_t b = 0; b < sizeof(record.digest); ++b) {
+                std::from_chars(hashes[i].data() + 2 * b, hashes[i].data() + 2 * b + 2, record.digest[b], 16);
+            }
+            digests.add(record);
+            if (keptHashes) {
+                CheckpointHash& kept = (*keptHashes)[batch[i].path];
+                kept.size = batch[i].size;
+                kept.mtime = batch[i].mtime;
+                std::memcpy(kept.digest, record.digest, sizeof(record.digest));
+            }
+        }
+        batch.clear();
+    };
+    auto addCandidate = [&](const SizeRecord& record) {
+        batch.push_back({paths.get(record.id), record.size, record.id, static_cast<dev_t>(record.device), record.inode, 0,
+                         record.mtime});
+        if (batch.size() >= batchLimit) {
+            hashBatch();
+        }
+    };
+
+    // Only files whose size is shared can have duplicates; the size-ordered stream makes
+    // every size group contiguous, so one record of lookbehind is enough to find them
+    SizeRecord previous{};
+    bool havePrevious = false;
+    bool previousAdded = false;
+    SizeRecord record;
+    while (sizes.next(record)) {
+        if (options.includeUnique) {
+            addCandidate(record);
+            continue;
+        }
+        if (havePrevious && record.size == previous.size) {
+            if (!previousAdded) {
+                addCandidate(previous);
+            }
+            addCandidate(record);
+            previousAdded = true;
+        } else {
+            previousAdded = false;
+        }
+        previous = record;
+        havePrevious = true;
+    }
+    hashBatch();
+    digests.finish();
+    if (options.keepUsedHashesOnly && options.checkpoint) {
+        options.checkpoint->hashes.swap(usedHashes);
+        usedHashes.clear();
+    }
+
+    // Equal (size, hash) records are adjacent in the merged stream
+    MetricsPhase phase("grouping");
+    std::vector<unsigned long long> ids;
+    HashRecord first{};
+    auto emitGroup = [&] {
+        if (ids.size() < (options.includeUnique ? 1u : 2u)) {
+            return;
+        }
+        std::vector<std::string> groupPaths;
+        groupPaths.reserve(ids.size());
+        for (unsigned long long id : ids) {
+            groupPaths.push_back(paths.get(id));
+        }
+        onGroup(picosha2::bytes_to_hex_string(std::begin(first.digest), std::end(first.digest)), first.size, groupPaths);
+    };
+    HashRecord digest;
+    while (digests.next(digest)) {
+        if (ids.empty() || digest.size != first.size ||
+            std::memcmp(digest.digest, first.digest, sizeof(first.digest)) != 0) {
+            emitGroup();
+            ids.clear();
+            first = digest;
+        }
+        ids.push_back(digest.id);
+    }
+    emitGroup();
+}
+
+// Function to find groups of identical files under several root directories (see
+// forEachDuplicateGroupOf), optionally after a prefilter walk
+template <typename OnGroup>
+void forEachDuplicateGroup(const std::vector<fs::path>& rootPaths, ErrorTable &errors,
+                           const DuplicateScanOptions& options, OnGroup&& onGroup) {
+    const size_t budget = static_cast<size_t>(options.memoryBudget);
+
+    // The prefilter walk only notes which sizes occur twice, in two Bloom filters of a byte per
+    // file each, so files of unique sizes never reach the size catalog or the path store. A
+    // false positive only adds a candidate; the exact grouping still decides.
+    std::unique_ptr<BlockedBloomFilter> sharedSizes;
+    if (options.prefilter && !options.includeUnique) {
+        MetricsPhase phase("prefilter");
+        unsigned long long bits = std::max(estimateFileCount(rootPaths), 1ULL << 20) * 8;
+        if (budget != 0) {
+            bits = std::min<unsigned long long>(bits, budget); // budget/8 bytes each, both in a quarter of the budget
+        }
+        BlockedBloomFilter seen(bits);
+        sharedSizes = std::make_unique<BlockedBloomFilter>(bits);
+        ErrorTable firstWalkErrors; // the second walk reports them
+        ScanOptions firstWalk = options.scanOptions;
+        firstWalk.counted = false; // the files and directories are counted by the real walk
+        for (const auto& rootPath : rootPaths) {
+            scanTree(rootPath, [&](const ScanEntry& entry) {
+                if (seen.insert(entry.size)) {
+                    sharedSizes->insert(entry.size);
+                }
+            }, firstWalkErrors, firstWalk);
+        }
+        // Directories a stop left unlisted belong to the real walk, which defers its roots now
+        if (ScanControl* control = options.scanOptions.control; control && control->stopped()) {
+            control->takeDeferred();
+        }
+    }
+
+    forEachDuplicateGroupOf([&](auto&& onFile) {
+        MetricsPhase phase("traversal");
+        for (const auto& rootPath : rootPaths) {
+            scanTree(rootPath, onFile, errors, options.scanOptions);
+        }
+    }, errors, options, std::forward<OnGroup>(onGroup), sharedSizes.get());
+}
+
+// Function to detect duplicate files using MD5 hashing across several root directories
+std::unordered_map<std::string, std::vector<fs::path>> findDuplicateFiles(const std::vector<fs::path>& rootPaths,
+                                                                          ErrorTable &errors,
+                                                                          const DuplicateScanOptions& options) {
+    std::unordered_map<std::string, std::vector<fs::path>> duplicateFiles;
+    forEachDuplicateGroup(rootPaths, errors, options,
+                          [&](const std::string& hash, unsigned long long, const std::vector<std::string>& files) {
+        auto& group = duplicateFiles[hash];
+        group.insert(group.end(), files.begin(), files.end());
+    });
+    return duplicateFiles;
+}
+// Function to detect duplicate files using MD5 hashing; unreadable entries are recorded in errors
+std::unordered_map<std::string, std::vector<fs::path>> findDuplicateFiles(const fs::path& rootPath, ErrorTable &errors) {
+    DuplicateScanOptions options;
+    options.scanOptions.rules = &interactiveScanRules();
+    return findDuplicateFiles({rootPath}, errors, options);
+}
+
+// Host catalogs are the files export writes and merge reads. They list every file of a host as
+// (size, content hash, path), sorted by size and hash, so catalogs of many hosts can be merged as
+// streams. After the magic come checksummed records (varint length, payload, FNV-1a):
+//   'H' header: format version, host id, export time, roots
+//   'E' up to ~64 KiB of entries: size as a delta from the previous entry, a flag byte and the
+//       32-byte hash unless it repeats the previous one, the path front-coded against the
+//       previous path. The deltas restart in every record so each decodes on its own.
+//   'T' trailer: file and byte counts; a catalog without it was cut short
+// Readers refuse versions newer than theirs.
+const std::string HOST_CATALOG_MAGIC = "DMCATLG\n";
+constexpr unsigned HOST_CATALOG_VERSION = 1;
+
+struct HostCatalogEntry
+{
+    unsigned long long size = 0;
+    unsigned char digest[32] = {};
+    std::string path;
+};
+
+class HostCatalogWriter
+{
+public:
+    static constexpr size_t BLOCK_BYTES = 64 * 1024;
+
+    HostCatalogWriter() = default;
+    HostCatalogWriter(const HostCatalogWriter &) = delete;
+    HostCatalogWriter &operator=(const HostCatalogWriter &) = delete;
+
+    // An unfinished catalog is thrown away
+    ~HostCatalogWriter()
+    {
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+            ::unlink(temporaryPath().c_str());
+        }
+    }
+
+    // Function to start a catalog; it is written beside path and only renamed over it by finish()
+    bool open(const std::string &path, const std::string &host, const std::vector<std::string> &roots, std::string &error)
+    {
+        path_ = path;
+        fd_ = ::open(temporaryPath().c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd_ < 0)
+        {
+            error = "cannot create " + temporaryPath() + ": " + std::strerror(errno);
+            return false;
+        }
+        std::string header(1, 'H');
+        putVarint(header, HOST_CATALOG_VERSION);
+        putString(header, host);
+        putVarint(header, zigzagEncode(static_cast<long long>(std::time(nullptr))));
+        putVarint(header, roots.size());
+        for (const auto &root : roots)
+        {
+            putString(header, root);
+        }
+        out_ = HOST_CATALOG_MAGIC;
+        frameRecord(out_, header);
+        return flush(error);
+    }
+
+    // Function to add an entry; entries have to come in ascending (size, hash) order
+    bool add(unsigned long long size, const unsigned char *digest, const std::string &path, std::string &error)
+    {
+        if (block_.empty())
+        {
+            block_ = "E";
+            previousSize_ = 0;
+            previousPath_.clear();
+            haveDigest_ = false;
+        }
+        putVarint(block_, size - previousSize_);
+        const bool sameDigest = haveDigest_ && std::memcmp(previousDigest_, digest, sizeof(previousDigest_)) == 0;
+        block_ += static_cast<char>(sameDigest ? 0 : 1);
+        if (!sameDigest)
+        {
+            block_.append(reinterpret_cast<const char *>(digest), sizeof(previousDigest_));
+            std::memcpy(previousDigest_, digest, sizeof(previousDigest_));
+            haveDigest_ = true;
+        }
+        size_t shared = 0;
+        while (shared < path.size() && shared < previousPath_.size() && path[shared] == previousPath_[shared])
+        {
+            ++shared;
+        }
+        putVarint(block_, shared);
+        putString(block_, path.substr(shared));
+        previousSize_ = size;
+        previousPath_ = path;
+        ++files_;
+        bytes_ += size;
+        if (block_.size() >= BLOCK_BYTES)
+        {
+            frameRecord(out_, block_);
+            block_.clear();
+            return flush(error);
+        }
+        return true;
+    }
+
+    unsigned long long files() const { return files_; }
+    unsigned long long bytes() const { return bytes_; }
+    unsigned long long catalogBytes() const { return written_; }
+
+    // Function to write the trailer, sync the catalog and move it into place
+    bool finish(std::string &error)
+    {
+        if (!block_.empty())
+        {
+            frameRecord(out_, block_);
+            block_.clear();
+        }
+        std::string trailer(1, 'T');
+        putVarint(trailer, files_);
+        putVarint(trailer, bytes_);
+        frameRecord(out_, trailer);
+        if (!flush(error))
+        {
+            return false;
+        }
+        if (::fsync(fd_) != 0 || ::close(fd_) != 0)
+        {
+            error = "cannot sync " + temporaryPath() + ": " + std::strerror(errno);
+            fd_ = -1;
+            ::unlink(temporaryPath().c_str());
+            return false;
+        }
+        fd_ = -1;
+        if (::rename(temporaryPath().c_str(), path_.c_str()) != 0)
+        {
+            error = "cannot rename " + temporaryPath() + " to " + path_ + ": " + std::strerror(errno);
+            ::unlink(temporaryPath().c_str());
+            return false;
+        }
+        return true;
+    }
+
+private:
+    std::string temporaryPath() const { return path_ + ".tmp"; }
+
+    static void putString(std::string &out, const std::string &value)
+    {
+        putVarint(out, value.size());
+        out += value;
+    }
+
+    bool flush(std::string &error)
+    {
+        if (!writeFully(fd_, out_))
+        {
+            error = "cannot write " + temporaryPath() + ": " + std::strerror(errno);
+            return false;
+        }
+        written_ += out_.size();
+        out_.clear();
+        return true;
+    }
+
+    std::string path_;
+    int fd_ = -1;
+    std::string out_;
+    std::string block_;
+    unsigned long long previousSize_ = 0;
+    unsigned char previousDigest_[32];
+    bool haveDigest_ = false;
+    std::string previousPath_;
+    unsigned long long files_ = 0;
+    unsigned long long bytes_ = 0;
+    unsigned long long written_ = 0;
+};
+
+// Sequential reader of a host catalog; holds one decoded record at a time
+class HostCatalogReader
+{
+public:
+    bool open(const std::string &path, std::string &error)
+    {
+        path_ = path;
+        in_.open(path, std::ios::binary);
+        std::string magic(HOST_CATALOG_MAGIC.size(), '\0');
+        if (!in_ || !in_.read(magic.data(), magic.size()) || magic != HOST_CATALOG_MAGIC)
+        {
+            error = path + " is not a host catalog";
+            return false;
+        }
+        std::string header;
+        if (!readRecord(header) || header[0] != 'H')
+        {
+            error = path + ": damaged header";
+            return false;
+        }
+        unsigned long long version, time, rootCount;
+        const unsigned char *end;
+        const unsigned char *p = recordBody(header, end);
+        if (!getVarint(p, end, version))
+        {
+            error = path + ": damaged header";
+            return false;
+        }
+        if (version > HOST_CATALOG_VERSION)
+        {
+            error = path + ": catalog format " + std::to_string(version) + " is newer than this program (" +
+                    std::to_string(HOST_CATALOG_VERSION) + ")";
+            return false;
+        }
+        if (!getString(p, end, host_) || !getVarint(p, end, time) || !getVarint(p, end, rootCount))
+        {
+            error = path + ": damaged header";
+            return false;
+        }
+        exportTime_ = zigzagDecode(time);
+        return true;
+    }
+
+    const std::string &path() const { return path_; }
+    const std::string &host() const { return host_; }
+    long long exportTime() const { return exportTime_; }
+
+    // Function to read the next entry; false at the end, with error() set if the catalog is
+    // damaged or was cut short. Entries are delta coded, so pass the same entry every time.
+    bool next(HostCatalogEntry &entry)
+    {
+        while (p_ == end_)
+        {
+            if (finished_ || !readRecord(record_))
+            {
+                if (!finished_ && error_.empty())
+                {
+                    error_ = path_ + ": catalog is truncated";
+                }
+                return false;
+            }
+            if (record_[0] == 'T')
+            {
+                unsigned long long files, bytes;
+                const unsigned char *end;
+                const unsigned char *p = recordBody(record_, end);
+                finished_ = true;
+                if (!getVarint(p, end, files) || !getVarint(p, end, bytes) || files != files_ || bytes != bytes_)
+                {
+                    error_ = path_ + ": entry counts do not match the trailer";
+                }
+                return false;
+            }
+            if (record_[0] != 'E')
+            {
+                error_ = path_ + ": unknown record";
+                return false;
+            }
+            p_ = recordBody(record_, end_);
+            entry.size = 0;
+            entry.path.clear();
+        }
+
+        unsigned long long delta, shared;
+        std::string suffix;
+        if (!getVarint(p_, end_, delta) || p_ >= end_)
+        {
+            return damaged();
+        }
+        const bool newDigest = *p_++ != 0;
+        if (newDigest)
+        {
+            if (end_ - p_ < static_cast<ptrdiff_t>(sizeof(entry.digest)))
+            {
+                return damaged();
+            }
+            std::memcpy(entry.digest, p_, sizeof(entry.digest));
+            p_ += sizeof(entry.digest);
+        }
+        if (!getVarint(p_, end_, shared) || shared > entry.path.size() || !getString(p_, end_, suffix))
+        {
+            return damaged();
+        }
+        entry.size += delta;
+        entry.path.resize(shared);
+        entry.path += suffix;
+        ++files_;
+        bytes_ += entry.size;
+        return true;
+    }
+
+    const std::string &error() const { return error_; }
+
+private:
+    // Function to read one record and check its checksum
+    bool readRecord(std::string &payload)
+    {
+        unsigned long long length = 0;
+        for (unsigned shift = 0;; shift += 7)
+        {
+            const int byte = in_.get();
+            if (byte == EOF || shift >= 64)
+            {
+                return false;
+            }
+            length |= static_cast<unsigned long long>(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+            {
+                break;
+            }
+        }
+        if (length == 0 || length > (64ULL << 20))
+        {
+            return false;
+        }
+        payload.resize(length);
+        uint32_t stored;
+        if (!in_.read(payload.data(), length) || !in_.read(reinterpret_cast<char *>(&stored), 4))
+        {
+            return false;
+        }
+        if (stored != recordChecksum(reinterpret_cast<const unsigned char *>(payload.data()), length))
+        {
+            error_ = path_ + ": damaged record";
+            return false;
+        }
+        return true;
+    }
+
+    // Function to return the payload of a record after its type byte
+    static const unsigned char *recordBody(const std::string &record, const unsigned char *&end)
+    {
+        end = reinterpret_cast<const unsigned char *>(record.data()) + record.size();
+        return reinterpret_cast<const unsigned char *>(record.data()) + 1;
+    }
+
+    static bool getString(const unsigned char *&p, const unsigned char *end, std::string &value)
+    {
+        unsigned long long length;
+        if (!getVarint(p, end, length) || length > static_cast<unsigned long long>(end - p))
+        {
+            return false;
+        }
+        value.assign(reinterpret_cast<const char *>(p), length);
+        p += length;
+        return true;
+    }
+
+    bool damaged()
+    {
+        error_ = path_ + ": damaged entry";
+        p_ = end_ = nullptr;
+        finished_ = true;
+        return false;
+    }
+
+    std::string path_;
+    std::ifstream in_;
+    std::string host_;
+    long long exportTime_ = 0;
+    std::string record_;
+    const unsigned char *p_ = nullptr;
+    const unsigned char *end_ = nullptr;
+    bool finished_ = false;
+    unsigned long long files_ = 0;
+    unsigned long long bytes_ = 0;
+    std::string error_;
+};
+
+// Function to merge host catalogs and pass every group of identical content to
+// onGroup(entry, members), members being (catalog index, path) pairs. Each catalog is already
+// sorted by (size, hash), so a min-heap over one current entry per catalog yields the groups
+// in order and memory does not grow with the number of entries.
+template <typename OnGroup>
+void mergeHostCatalogs(std::vector<std::unique_ptr<HostCatalogReader>> &catalogs, OnGroup &&onGroup)
+{
+    std::vector<HostCatalogEntry> current(catalogs.size());
+    auto greater = [&](size_t a, size_t b)
+    {
+        if (current[a].size != current[b].size)
+        {
+            return current[a].size > current[b].size;
+        }
+        const int order = std::memcmp(current[a].digest, current[b].digest, sizeof(current[a].digest));
+        return order != 0 ? order > 0 : a > b;
+    };
+    std::vector<size_t> heap;
+    for (size_t i = 0; i < catalogs.size(); ++i)
+    {
+        if (catalogs[i]->next(current[i]))
+        {
+            heap.push_back(i);
+        }
+    }
+    std::make_heap(heap.begin(), heap.end(), greater);
+
+    HostCatalogEntry first;
+    std::vector<std::pair<size_t, std::string>> members;
+    while (!heap.empty())
+    {
+        std::pop_heap(heap.begin(), heap.end(), greater);
+        const size_t i = heap.back();
+        heap.pop_back();
+        if (!members.empty() && (current[i].size != first.size ||
+                                 std::memcmp(current[i].digest, first.digest, sizeof(first.digest)) != 0))
+        {
+            onGroup(first, members);
+            members.clear();
+        }
+        if (members.empty())
+        {
+            first.size = current[i].size;
+            std::memcpy(first.digest, current[i].digest, sizeof(first.digest));
+        }
+        members.emplace_back(i, current[i].path);
+        if (catalogs[i]->next(current[i]))
+        {
+            heap.push_back(i);
+            std::push_heap(heap.begin(), heap.end(), greater);
+        }
+    }
+    if (!members.empty())
+    {
+        onGroup(first, members);
+    }
+}
+
+// XXH64 (xxHash, 64-bit variant), used to fingerprint chunks at memory speed
+namespace xxh64
+{
+const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+const uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+const uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+
+inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+inline uint64_t read64(const uint8_t *p)
+{
+    uint64_t v;
+    std::memcpy(&v, p, 8);
+    return v;
+}
+inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+}
+inline uint64_t round(uint64_t acc, uint64_t input) { return rotl(acc + input * PRIME2, 31) * PRIME1; }
+inline uint64_t merge(uint64_t acc, uint64_t value) { return (acc ^ round(0, value)) * PRIME1 + PRIME4; }
+
+inline uint64_t hash(const uint8_t *p, size_t length, uint64_t seed = 0)
+{
+    const uint8_t *end = p + length;
+    uint64_t h;
+    if (length >= 32)
+    {
+        uint64_t v1 = seed + PRIME1 + PRIME2, v2 = seed + PRIME2, v3 = seed, v4 = seed - PRIME1;
+        for (; p + 32 <= end; p += 32)
+        {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+        }
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+    }
+    else
+    {
+        h = seed + PRIME5;
+    }
+    h += length;
+    for (; p + 8 <= end; p += 8)
+    {
+        h = rotl(h ^ round(0, read64(p)), 27) * PRIME1 + PRIME4;
+    }
+    if (p + 4 <= end)
+    {
+        h = rotl(h ^ (read32(p) * PRIME1), 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; ++p)
+    {
+        h = rotl(h ^ (*p * PRIME5), 11) * PRIME1;
+    }
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    return h ^ (h >> 32);
+}
+} // namespace xxh64
+
+// 128-bit digest of a file's content or of a whole directory subtree
+struct TreeDigest
+{
+    uint64_t low = 0;
+    uint64_t high = 0;
+
+    bool operator==(const TreeDigest &other) const { return low == other.low && high == other.high; }
+    bool operator<(const TreeDigest &other) const { return low != other.low ? low < other.low : high < other.high; }
+};
+
+// Directories and files of a scan, linked by index. A directory's parent always has a
+// smaller index, so walking the indexes downwards visits children before parents.
+struct DirectoryTree
+{
+    static const uint32_t NO_PARENT = ~0u;
+
+    struct File
+    {
+        uint32_t directory;
+        uint32_t nameLength;
+        size_t nameOffset;
+        unsigned long long size;
+        dev_t device;
+        unsigned long long inode;
+    };
+
+    std::vector<std::string> paths; // per directory
+    std::vector<uint32_t> parent;
+    std::vector<uint32_t> depth;
+    std::vector<File> files;
+    std::string names;
+    std::vector<uint32_t> fileStart; // CSR: files of directory d are fileOrder[fileStart[d], fileStart[d + 1])
+    std::vector<uint32_t> fileOrder;
+    std::vector<uint32_t> childStart; // CSR: subdirectories of d are childOrder[childStart[d], childStart[d + 1])
+    std::vector<uint32_t> childOrder;
+
+    std::string_view name(const File &file) const { return std::string_view(names).substr(file.nameOffset, file.nameLength); }
+
+    std::string filePath(const File &file) const
+    {
+        const std::string &directory = paths[file.directory];
+        std::string path;
+        path.reserve(directory.size() + 1 + file.nameLength);
+        path += directory;
+        if (path.back() != '/')
+        {
+            path += '/';
+        }
+        path += name(file);
+        return path;
+    }
+};
+
+// Function to build the directory tree of the roots. Only directories holding files somewhere
+// below them appear; empty directories have no content to compare.
+DirectoryTree buildDirectoryTree(const std::vector<fs::path> &rootPaths, ErrorTable &errors,
+                                 const ScanOptions &options)
+{
+    DirectoryTree tree;
+    std::unordered_map<std::string, uint32_t> directoryIds;
+    std::unordered_set<std::string> tops;
+    for (const auto &root : rootPaths)
+    {
+        std::string path = root.string();
+        while (path.size() > 1 && path.back() == '/')
+        {
+            path.pop_back();
+        }
+        std::error_code ec;
+        if (fs::is_regular_file(path, ec))
+        {
+            path = fs::path(path).parent_path().string();
+        }
+        tops.insert(path);
+    }
+
+    // Function to return the id of a directory, adding it and its missing ancestors up to a root
+    std::function<uint32_t(std::string_view)> intern = [&](std::string_view path) -> uint32_t
+    {
+        auto it = directoryIds.find(std::string(path));
+        if (it != directoryIds.end())
+        {
+            return it->second;
+        }
+        uint32_t parent = DirectoryTree::NO_PARENT;
+        const size_t slash = path.rfind('/');
+        if (!tops.count(std::string(path)) && slash != std::string_view::npos && path.size() > 1)
+        {
+            parent = intern(path.substr(0, std::max<size_t>(slash, 1)));
+        }
+        const uint32_t id = static_cast<uint32_t>(tree.paths.size());
+        tree.paths.emplace_back(path);
+        tree.parent.push_back(parent);
+        tree.depth.push_back(parent == DirectoryTree::NO_PARENT ? 0 : tree.depth[parent] + 1);
+        directoryIds.emplace(tree.paths.back(), id);
+        return id;
+    };
+
+    MetricsPhase phase("traversal");
+    ParentCache<uint32_t> parents;
+    for (const auto &root : rootPaths)
+    {
+        scanTree(root, [&](const ScanEntry &entry)
+                 {
+                     const uint32_t currentDirectory = parents.get(entry, intern);
+                     tree.files.push_back({currentDirectory, static_cast<uint32_t>(entry.name.size()), tree.names.size(),
+                                           entry.size, entry.device, entry.inode});
+                     tree.names.append(entry.name);
+                 },
+                 errors, options);
+    }
+
+    // Counting sort of files and subdirectories by parent
+    const size_t count = tree.paths.size();
+    tree.fileStart.assign(count + 1, 0);
+    tree.childStart.assign(count + 1, 0);
+    for (const auto &file : tree.files)
+    {
+        ++tree.fileStart[file.directory + 1];
+    }
+    for (uint32_t parent : tree.parent)
+    {
+        if (parent != DirectoryTree::NO_PARENT)
+        {
+            ++tree.childStart[parent + 1];
+        }
+    }
+    for (size_t d = 0; d < count; ++d)
+    {
+        tree.fileStart[d + 1] += tree.fileStart[d];
+        tree.childStart[d + 1] += tree.childStart[d];
+    }
+    tree.fileOrder.resize(tree.files.size());
+    tree.childOrder.resize(tree.childStart[count]);
+    std::vector<uint32_t> cursor(tree.fileStart.begin(), tree.fileStart.end() - 1);
+    for (size_t f = 0; f < tree.files.size(); ++f)
+    {
+        tree.fileOrder[cursor[tree.files[f].directory]++] = static_cast<uint32_t>(f);
+    }
+    cursor.assign(tree.childStart.begin(), tree.childStart.end() - 1);
+    for (size_t d = 0; d < count; ++d)
+    {
+        if (tree.parent[d] != DirectoryTree::NO_PARENT)
+        {
+            tree.childOrder[cursor[tree.parent[d]]++] = static_cast<uint32_t>(d);
+        }
+    }
+    return tree;
+}
+
+// Function to compute a content digest for every file. Like the duplicate engine, only files
+// whose size is shared are hashed, and hard links to one inode are hashed once; a file with
+// a unique size gets a digest nothing else can have.
+std::vector<TreeDigest> hashTreeFiles(const DirectoryTree &tree, ErrorTable &errors,
+                                      const DuplicateScanOptions &options)
+{
+    std::vector<TreeDigest> digests(tree.files.size());
+    for (size_t f = 0; f < tree.files.size(); ++f)
+    {
+        digests[f] = {xxh64::hash(reinterpret_cast<const uint8_t *>(&f), sizeof(f), 0x756e69717565ULL), ~0ULL};
+    }
+
+    std::vector<uint32_t> bySize(tree.files.size());
+    std::iota(bySize.begin(), bySize.end(), 0u);
+    std::sort(bySize.begin(), bySize.end(), [&](uint32_t a, uint32_t b)
+              {
+                  const auto &x = tree.files[a];
+                  const auto &y = tree.files[b];
+                  if (x.size != y.size)
+                  {
+                      return x.size < y.size;
+                  }
+                  return x.device != y.device ? x.device < y.device : x.inode != y.inode ? x.inode < y.inode : a < b;
+              });
+
+    // Candidates are the first link of each inode in a size shared by another inode; the
+    // other links copy its digest afterwards
+    std::vector<DuplicateCandidate> batch;
+    std::vector<std::string> hashes;
+    std::vector<std::pair<uint32_t, uint32_t>> links; // (file, first link of its inode)
+    ReadaheadTuner readahead(options);
+    const size_t BATCH_SIZE = 65536;
+    auto hashBatch = [&]
+    {
+        hashCandidateBatch(batch, hashes, options, readahead);
+        for (size_t i = 0; i < batch.size(); ++i)
+        {
+            if (hashes[i].size() < 32)
+            {
+                if (batch[i].error != 0)
+                {
+                    errors.record(batch[i].path, batch[i].error, ScanOp::Read);
+                }
+                continue;
+            }
+            TreeDigest &digest = digests[batch[i].id];
+            std::from_chars(hashes[i].data(), hashes[i].data() + 16, digest.low, 16);
+            std::from_chars(hashes[i].data() + 16, hashes[i].data() + 32, digest.high, 16);
+        }
+        batch.clear();
+    };
+    for (size_t begin = 0; begin < bySize.size();)
+    {
+        size_t end = begin;
+        size_t inodes = 0;
+        for (; end < bySize.size() && tree.files[bySize[end]].size == tree.files[bySize[begin]].size; ++end)
+        {
+            const auto &file = tree.files[bySize[end]];
+            const auto &previous = tree.files[bySize[end == begin ? end : end - 1]];
+            inodes += end == begin || file.device != previous.device || file.inode != previous.inode;
+        }
+        if (inodes > 1)
+        {
+            uint32_t first = bySize[begin];
+            for (size_t i = begin; i < end; ++i)
+            {
+                const auto &file = tree.files[bySize[i]];
+                if (i != begin && file.device == tree.files[first].device && file.inode == tree.files[first].inode)
+                {
+                    links.emplace_back(bySize[i], first);
+                    continue;
+                }
+                first = bySize[i];
+                batch.push_back({tree.filePath(file), file.size, first, file.device, file.inode, 0});
+            }
+        }
+        else if (end - begin > 1)
+        {
+            for (size_t i = begin + 1; i < end; ++i)
+            {
+                links.emplace_back(bySize[i], bySize[begin]);
+            }
+        }
+        if (batch.size() >= BATCH_SIZE)
+        {
+            hashBatch();
+        }
+        begin = end;
+    }
+    hashBatch();
+    for (const auto &[file, first] : links)
+    {
+        digests[file] = digests[first];
+    }
+    return digests;
+}
+
+// Parameters of duplicate directory detection
+struct TreeCompareOptions
+{
+    bool ignoreNames = false;    // match subtrees by content only, whatever their files are called
+    double minSimilarity = 0.8;  // near-identical threshold on estimated Jaccard similarity; 1 disables
+};
+
+// A directory reported in a duplicate tree group
+struct DirectoryMatch
+{
+    std::string path;
+    unsigned long long bytes;
+    unsigned long long files;
+    double similarity; // estimated similarity to the group's largest member, 1 for identical
+};
+
+// Identical or near-identical directory subtrees
+struct DirectoryGroup
+{
+    bool identical;
+    unsigned long long reclaimableBytes; // bytes freed by keeping one member (estimated for near matches)
+    std::vector<DirectoryMatch> members;
+};
+
+// Function to find duplicate directory trees under the roots. Every directory gets a Merkle
+// digest over its sorted children (files by content digest and size, subdirectories by their
+// own digest, both keyed by name unless names are ignored) in a post-order pass that handles
+// one depth level at a time in parallel. Directories with equal digests hold identical
+// subtrees. Each directory also gets a MinHash signature of the file contents below it, which
+// composes bottom-up by elementwise minimum; banding the signatures finds pairs whose content
+// sets are similar without comparing every pair. A group is only reported when it is not
+// implied by a group of the members' parents. Groups are ordered by reclaimable bytes.
+std::vector<DirectoryGroup> findDuplicateTrees(const std::vector<fs::path> &rootPaths, const TreeCompareOptions &compare,
+                                               ErrorTable &errors,
+                                               const DuplicateScanOptions &options)
+{
+    const DirectoryTree tree = buildDirectoryTree(rootPaths, errors, options.scanOptions);
+    const std::vector<TreeDigest> fileDigests = hashTreeFiles(tree, errors, options);
+    const size_t count = tree.paths.size();
+
+    const size_t SIGNATURE = 32;
+    const size_t BANDS = 8;
+    const size_t ROWS = SIGNATURE / BANDS;
+    std::vector<TreeDigest> digests(count);
+    std::vector<unsigned long long> bytes(count, 0);
+    std::vector<unsigned long long> fileCounts(count, 0);
+    std::vector<uint32_t> signatures(count * SIGNATURE, ~0u);
+    {
+        MetricsPhase phase("merkle");
+        std::vector<std::vector<uint32_t>> levels;
+        for (size_t d = 0; d < count; ++d)
+        {
+            if (tree.depth[d] >= levels.size())
+            {
+                levels.resize(tree.depth[d] + 1);
+            }
+            levels[tree.depth[d]].push_back(static_cast<uint32_t>(d));
+        }
+
+        struct ChildRecord
+        {
+            uint64_t name;
+            uint64_t size;
+            TreeDigest digest;
+
+            bool operator<(const ChildRecord &other) const
+            {
+                return name != other.name ? name < other.name : digest < other.digest;
+            }
+        };
+        auto computeDirectory = [&](uint32_t d, std::vector<ChildRecord> &records)
+        {
+            records.clear();
+            uint32_t *signature = &signatures[d * SIGNATURE];
+            for (uint32_t i = tree.fileStart[d]; i < tree.fileStart[d + 1]; ++i)
+            {
+                const uint32_t f = tree.fileOrder[i];
+                const auto &file = tree.files[f];
+                const std::string_view name = tree.name(file);
+                records.push_back({compare.ignoreNames ? 0 : xxh64::hash(reinterpret_cast<const uint8_t *>(name.data()), name.size()),
+                                   file.size, fileDigests[f]});
+                bytes[d] += file.size;
+                ++fileCounts[d];
+                for (size_t k = 0; k < SIGNATURE; ++k)
+                {
+                    signature[k] = std::min(signature[k], static_cast<uint32_t>(mix64(fileDigests[f].low + k * 0x9e3779b97f4a7c15ULL) >> 32));
+                }
+            }
+            for (uint32_t i = tree.childStart[d]; i < tree.childStart[d + 1]; ++i)
+            {
+                const uint32_t c = tree.childOrder[i];
+                const std::string &path = tree.paths[c];
+                const size_t slash = path.rfind('/');
+                const std::string_view name = std::string_view(path).substr(slash + 1);
+                // The top bit of the size field keeps a subdirectory from matching a file
+                records.push_back({compare.ignoreNames ? 0 : xxh64::hash(reinterpret_cast<const uint8_t *>(name.data()), name.size()),
+                                   bytes[c] | (1ULL << 63), digests[c]});
+                bytes[d] += bytes[c];
+                fileCounts[d] += fileCounts[c];
+                for (size_t k = 0; k < SIGNATURE; ++k)
+                {
+                    signature[k] = std::min(signature[k], signatures[c * SIGNATURE + k]);
+                }
+            }
+            std::sort(records.begin(), records.end());
+            const auto *data = reinterpret_cast<const uint8_t *>(records.data());
+            const size_t length = records.size() * sizeof(ChildRecord);
+            digests[d] = {xxh64::hash(data, length, 1), xxh64::hash(data, length, 2)};
+        };
+
+        const unsigned workers = options.workers ? options.workers : std::max(1u, std::thread::hardware_concurrency());
+        for (size_t level = levels.size(); level-- > 0;)
+        {
+            const auto &directories = levels[level];
+            std::atomic<size_t> next{0};
+            auto worker = [&]
+            {
+                std::vector<ChildRecord> records;
+                for (size_t i; (i = next.fetch_add(64)) < directories.size();)
+                {
+                    for (size_t j = i; j < std::min(i + 64, directories.size()); ++j)
+                    {
+                        computeDirectory(directories[j], records);
+                    }
+                }
+            };
+            std::vector<std::thread> pool;
+            for (unsigned w = 1; w < workers && w * 64 < directories.size(); ++w)
+            {
+                pool.emplace_back(worker);
+            }
+            worker();
+            for (auto &thread : pool)
+            {
+                thread.join();
+            }
+        }
+    }
+
+    MetricsPhase phase("grouping");
+    std::vector<DirectoryGroup> groups;
+    auto isAncestor = [&](uint32_t ancestor, uint32_t d)
+    {
+        for (uint32_t p = tree.parent[d]; p != DirectoryTree::NO_PARENT && tree.depth[p] >= tree.depth[ancestor]; p = tree.parent[p])
+        {
+            if (p == ancestor)
+            {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    // Identical subtrees are runs of equal digests; each run is represented by its first member
+    std::vector<uint32_t> byDigest(count);
+    std::iota(byDigest.begin(), byDigest.end(), 0u);
+    std::sort(byDigest.begin(), byDigest.end(), [&](uint32_t a, uint32_t b)
+              { return digests[a] == digests[b] ? a < b : digests[a] < digests[b]; });
+    std::vector<uint32_t> representative(count);
+    std::vector<std::pair<size_t, size_t>> runs;
+    for (size_t begin = 0; begin < count;)
+    {
+        size_t end = begin + 1;
+        while (end < count && digests[byDigest[end]] == digests[byDigest[begin]])
+        {
+            ++end;
+        }
+        for (size_t i = begin; i < end; ++i)
+        {
+            representative[byDigest[i]] = byDigest[begin];
+        }
+        runs.emplace_back(begin, end);
+        begin = end;
+    }
+
+    // Near-identical subtrees among the representatives: candidate pairs share one band of
+    // their signatures, and are kept when enough of the whole signature agrees. Directories
+    // without files of their own and a single subdirectory only wrap it and are skipped.
+    auto similarity = [&](uint32_t a, uint32_t b)
+    {
+        size_t same = 0;
+        for (size_t k = 0; k < SIGNATURE; ++k)
+        {
+            same += signatures[a * SIGNATURE + k] == signatures[b * SIGNATURE + k];
+        }
+        return static_cast<double>(same) / SIGNATURE;
+    };
+    auto pairKey = [](uint32_t a, uint32_t b)
+    { return a < b ? (uint64_t(a) << 32) | b : (uint64_t(b) << 32) | a; };
+    std::vector<uint64_t> pairs;
+    if (compare.minSimilarity < 1.0)
+    {
+        std::vector<std::pair<uint64_t, uint32_t>> bands;
+        for (const auto &run : runs)
+        {
+            const uint32_t d = byDigest[run.first];
+            const bool wrapper = tree.fileStart[d] == tree.fileStart[d + 1] && tree.childStart[d + 1] - tree.childStart[d] == 1;
+            if (fileCounts[d] < 2 || bytes[d] == 0 || wrapper)
+            {
+                continue;
+            }
+            for (size_t band = 0; band < BANDS; ++band)
+            {
+                bands.emplace_back(xxh64::hash(reinterpret_cast<const uint8_t *>(&signatures[d * SIGNATURE + band * ROWS]),
+                                               ROWS * sizeof(uint32_t), band),
+                                   d);
+            }
+        }
+        std::sort(bands.begin(), bands.end());
+        // Buckets of near-identical trees can be large; comparing each member with the next
+        // few in the bucket is enough to connect them
+        const size_t MAX_COMPARISONS = 32;
+        for (size_t begin = 0; begin < bands.size();)
+        {
+            size_t end = begin + 1;
+            while (end < bands.size() && bands[end].first == bands[begin].first)
+            {
+                ++end;
+            }
+            for (size_t i = begin; i < end; ++i)
+            {
+                for (size_t j = i + 1; j < end && j <= i + MAX_COMPARISONS; ++j)
+                {
+                    const uint32_t a = bands[i].second;
+                    const uint32_t b = bands[j].second;
+                    if (similarity(a, b) >= compare.minSimilarity && !isAncestor(a, b) && !isAncestor(b, a))
+                    {
+                        pairs.push_back(pairKey(a, b));
+                    }
+                }
+            }
+            begin = end;
+        }
+        std::sort(pairs.begin(), pairs.end());
+        pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+    }
+
+    // Union-find over representatives: linked connects everything identical or similar and
+    // decides which matches are implied by their parents; reported only joins kept pairs
+    struct UnionFind
+    {
+        std::vector<uint32_t> parent;
+        explicit UnionFind(size_t size) : parent(size) { std::iota(parent.begin(), parent.end(), 0u); }
+        uint32_t find(uint32_t x)
+        {
+            while (parent[x] != x)
+            {
+                x = parent[x] = parent[parent[x]];
+            }
+            return x;
+        }
+    };
+    UnionFind linked(count);
+    for (uint64_t key : pairs)
+    {
+        linked.parent[linked.find(static_cast<uint32_t>(key >> 32))] = linked.find(static_cast<uint32_t>(key));
+    }
+    // Function to tell whether the parents of members are distinct directories that are all
+    // identical or similar to each other, in which case the parents' group already covers them
+    std::unordered_set<uint32_t> parents;
+    auto impliedByParents = [&](auto begin, auto end)
+    {
+        parents.clear();
+        uint32_t component = DirectoryTree::NO_PARENT;
+        for (auto it = begin; it != end; ++it)
+        {
+            const uint32_t p = tree.parent[*it];
+            if (p == DirectoryTree::NO_PARENT || !parents.insert(p).second)
+            {
+                return false;
+            }
+            const uint32_t c = linked.find(representative[p]);
+            if (component != DirectoryTree::NO_PARENT && c != component)
+            {
+                return false;
+            }
+            component = c;
+        }
+        return true;
+    };
+
+    for (const auto &[begin, end] : runs)
+    {
+        const uint32_t first = byDigest[begin];
+        if (end - begin > 1 && bytes[first] > 0 && !impliedByParents(byDigest.begin() + begin, byDigest.begin() + end))
+        {
+            DirectoryGroup group{true, bytes[first] * (end - begin - 1), {}};
+            for (size_t i = begin; i < end; ++i)
+            {
+                group.members.push_back({tree.paths[byDigest[i]], bytes[first], fileCounts[first], 1.0});
+            }
+            groups.push_back(std::move(group));
+        }
+    }
+
+    UnionFind reported(count);
+    std::vector<uint32_t> grouped;
+    for (uint64_t key : pairs)
+    {
+        const uint32_t pair[2] = {static_cast<uint32_t>(key >> 32), static_cast<uint32_t>(key)};
+        if (!impliedByParents(std::begin(pair), std::end(pair)))
+        {
+            reported.parent[reported.find(pair[0])] = reported.find(pair[1]);
+            grouped.insert(grouped.end(), std::begin(pair), std::end(pair));
+        }
+    }
+    std::sort(grouped.begin(), grouped.end());
+    grouped.erase(std::unique(grouped.begin(), grouped.end()), grouped.end());
+    std::unordered_map<uint32_t, std::vector<uint32_t>> components;
+    for (uint32_t d : grouped)
+    {
+        components[reported.find(d)].push_back(d);
+    }
+    for (auto &[root, members] : components)
+    {
+        std::sort(members.begin(), members.end(), [&](uint32_t a, uint32_t b)
+                  { return bytes[a] != bytes[b] ? bytes[a] > bytes[b] : a < b; });
+        DirectoryGroup group{false, 0, {}};
+        for (uint32_t d : members)
+        {
+            const double score = d == members.front() ? 1.0 : similarity(members.front(), d);
+            if (d != members.front())
+            {
+                group.reclaimableBytes += static_cast<unsigned long long>(bytes[d] * score);
+            }
+            group.members.push_back({tree.paths[d], bytes[d], fileCounts[d], score});
+        }
+        groups.push_back(std::move(group));
+    }
+
+    std::sort(groups.begin(), groups.end(), [](const DirectoryGroup &a, const DirectoryGroup &b)
+              {
+                  if (a.reclaimableBytes != b.reclaimableBytes)
+                  {
+                      return a.reclaimableBytes > b.reclaimableBytes;
+                  }
+                  return a.members.front().path < b.members.front().path;
+              });
+    return groups;
+}
+
+// Grayscale image for perceptual hashing. Values are luma on an arbitrary scale; the hash
+// only depends on their relative order.
+struct LumaImage
+{
+    unsigned width = 0;
+    unsigned height = 0;
+    std::vector<float> pixels; // row-major
+};
+
+// Minimal DEFLATE decoder (RFC 1951) for PNG image data. Codes are decoded canonically one
+// bit at a time, which is plenty for images that are downscaled to 32x32 afterwards.
+class Inflater
+{
+public:
+    // Function to inflate a raw deflate stream; output beyond limit bytes is an error
+    bool inflate(const uint8_t *data, size_t size, size_t limit, std::vector<uint8_t> &out)
+    {
+        in_ = data;
+        size_ = size;
+        pos_ = 0;
+        bitBuffer_ = 0;
+        bitCount_ = 0;
+        error_ = false;
+        out_ = &out;
+        limit_ = limit;
+        bool last = false;
+        while (!last && !error_)
+        {
+            last = bits(1) != 0;
+            const unsigned type = bits(2);
+            if (type == 0)
+            {
+                stored();
+            }
+            else if (type == 1)
+            {
+                fixed();
+            }
+            else if (type == 2)
+            {
+                dynamic();
+            }
+            else
+            {
+                error_ = true;
+            }
+        }
+        return !error_;
+    }
+
+private:
+    struct Huffman
+    {
+        uint16_t counts[16];
+        uint16_t symbols[288];
+    };
+
+    unsigned bits(int need)
+    {
+        while (bitCount_ < need)
+        {
+            if (pos_ >= size_)
+            {
+                error_ = true;
+                return 0;
+            }
+            bitBuffer_ |= static_cast<uint32_t>(in_[pos_++]) << bitCount_;
+            bitCount_ += 8;
+        }
+        const unsigned value = bitBuffer_ & ((1u << need) - 1);
+        bitBuffer_ >>= need;
+        bitCount_ -= need;
+        return value;
+    }
+
+    static bool build(Huffman &h, const uint8_t *lengths, int n)
+    {
+        std::fill(std::begin(h.counts), std::end(h.counts), 0);
+        for (int i = 0; i < n; ++i)
+        {
+            ++h.counts[lengths[i]];
+        }
+        int left = 1;
+        for (int len = 1; len < 16; ++len)
+        {
+            left = (left << 1) - h.counts[len];
+            if (left < 0)
+            {
+                return false; // over-subscribed
+            }
+        }
+        uint16_t offsets[16];
+        offsets[1] = 0;
+        for (int len = 1; len < 15; ++len)
+        {
+            offsets[len + 1] = offsets[len] + h.counts[len];
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            if (lengths[i] != 0)
+            {
+                h.symbols[offsets[lengths[i]]++] = static_cast<uint16_t>(i);
+            }
+        }
+        return true;
+    }
+
+    int decode(const Huffman &h)
+    {
+        int code = 0, first = 0, index = 0;
+        for (int len = 1; len < 16; ++len)
+        {
+            code |= static_cast<int>(bits(1));
+            const int count = h.counts[len];
+            if (code - count < first)
+            {
+                return h.symbols[index + (code - first)];
+            }
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+        error_ = true;
+        return -1;
+    }
+
+    void put(uint8_t byte)
+    {
+        if (out_->size() >= limit_)
+        {
+            error_ = true;
+            return;
+        }
+        out_->push_back(byte);
+    }
+
+    void stored()
+    {
+        bitBuffer_ = 0;
+        bitCount_ = 0;
+        if (pos_ + 4 > size_)
+        {
+            error_ = true;
+            return;
+        }
+        const unsigned length = in_[pos_] | (in_[pos_ + 1] << 8);
+        pos_ += 4;
+        if (pos_ + length > size_)
+        {
+            error_ = true;
+            return;
+        }
+        for (unsigned i = 0; i < length && !error_; ++i)
+        {
+            put(in_[pos_++]);
+        }
+    }
+
+    void codes(const Huffman &literals, const Huffman &distances)
+    {
+        static const uint16_t lengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                                35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+        static const uint8_t lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                                3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+        static const uint16_t distanceBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129,
+                                                  193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+                                                  4097, 6145, 8193, 12289, 16385, 24577};
+        static const uint8_t distanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+                                                  6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+        while (!error_)
+        {
+            const int symbol = decode(literals);
+            if (symbol < 256)
+            {
+                if (symbol >= 0)
+                {
+                    put(static_cast<uint8_t>(symbol));
+                }
+                continue;
+            }
+            if (symbol == 256)
+            {
+                return;
+            }
+            const int lengthIndex = symbol - 257;
+            if (lengthIndex >= 29)
+            {
+                error_ = true;
+                return;
+            }
+            const size_t length = lengthBase[lengthIndex] + bits(lengthExtra[lengthIndex]);
+            const int distanceIndex = decode(distances);
+            if (distanceIndex < 0 || distanceIndex >= 30)
+            {
+                error_ = true;
+                return;
+            }
+            const size_t distance = distanceBase[distanceIndex] + bits(distanceExtra[distanceIndex]);
+            if (distance > out_->size())
+            {
+                error_ = true;
+                return;
+            }
+            for (size_t i = 0; i < length && !error_; ++i)
+            {
+                put((*out_)[out_->size() - distance]);
+            }
+        }
+    }
+
+    void fixed()
+    {
+        static Huffman literals, distances;
+        static bool built = [&]
+        {
+            uint8_t lengths[288];
+            std::fill(lengths, lengths + 144, 8);
+            std::fill(lengths + 144, lengths + 256, 9);
+            std::fill(lengths + 256, lengths + 280, 7);
+            std::fill(lengths + 280, lengths + 288, 8);
+            build(literals, lengths, 288);
+            std::fill(lengths, lengths + 30, 5);
+            build(distances, lengths, 30);
+            return true;
+        }();
+        (void)built;
+        codes(literals, distances);
+    }
+
+    void dynamic()
+    {
+        static const uint8_t order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+        const int literalCount = static_cast<int>(bits(5)) + 257;
+        const int distanceCount = static_cast<int>(bits(5)) + 1;
+        const int codeCount = static_cast<int>(bits(4)) + 4;
+        if (literalCount > 286 || distanceCount > 30)
+        {
+            error_ = true;
+            return;
+        }
+        uint8_t lengths[320] = {};
+        for (int i = 0; i < codeCount; ++i)
+        {
+            lengths[order[i]] = static_cast<uint8_t>(bits(3));
+        }
+        Huffman lengthCode, literals, distances;
+        if (!build(lengthCode, lengths, 19))
+        {
+            error_ = true;
+            return;
+        }
+        int index = 0;
+        while (index < literalCount + distanceCount && !error_)
+        {
+            int symbol = decode(lengthCode);
+            if (symbol < 16)
+            {
+                lengths[index++] = static_cast<uint8_t>(std::max(symbol, 0));
+                continue;
+            }
+            uint8_t value = 0;
+            int repeat;
+            if (symbol == 16)
+            {
+                if (index == 0)
+                {
+                    error_ = true;
+                    return;
+                }
+                value = lengths[index - 1];
+                repeat = 3 + static_cast<int>(bits(2));
+            }
+            else if (symbol == 17)
+            {
+                repeat = 3 + static_cast<int>(bits(3));
+            }
+            else
+            {
+                repeat = 11 + static_cast<int>(bits(7));
+            }
+            if (index + repeat > literalCount + distanceCount)
+            {
+                error_ = true;
+                return;
+            }
+            std::fill(lengths + index, lengths + index + repeat, value);
+            index += repeat;
+        }
+        if (error_ || !build(literals, lengths, literalCount) || !build(distances, lengths + literalCount, distanceCount))
+        {
+            error_ = true;
+            return;
+        }
+        codes(literals, distances);
+    }
+
+    const uint8_t *in_ = nullptr;
+    size_t size_ = 0;
+    size_t pos_ = 0;
+    uint32_t bitBuffer_ = 0;
+    int bitCount_ = 0;
+    bool error_ = false;
+    std::vector<uint8_t> *out_ = nullptr;
+    size_t limit_ = 0;
+};
+
+// Largest image decoded for hashing, in pixels
+const unsigned long long MAX_IMAGE_PIXELS = 100ULL * 1000 * 1000;
+// DEFLATE's best case: a 258-byte match coded in two bits, so at most 1032 bytes per input byte
+const size_t MAX_INFLATE_RATIO = 1032;
+
+inline uint32_t readBigEndian32(const uint8_t *p)
+{
+    return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// Function to decode a non-interlaced PNG of any colour type and bit depth into luma
+bool decodePng(const std::vector<uint8_t> &file, LumaImage &image)
+{
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    if (file.size() < 8 || !std::equal(signature, signature + 8, file.begin()))
+    {
+        return false;
+    }
+    unsigned width = 0, height = 0, depth = 0, colorType = 0;
+    bool interlaced = false;
+    float palette[256] = {};
+    std::vector<uint8_t> compressed;
+    for (size_t pos = 8; pos + 12 <= file.size();)
+    {
+        const uint32_t length = readBigEndian32(&file[pos]);
+        const uint8_t *type = &file[pos + 4];
+        const uint8_t *data = &file[pos + 8];
+        if (length > file.size() - pos - 12)
+        {
+            return false;
+        }
+        if (std::memcmp(type, "IHDR", 4) == 0 && length >= 13)
+        {
+            width = readBigEndian32(data);
+            height = readBigEndian32(data + 4);
+            depth = data[8];
+            colorType = data[9];
+            interlaced = data[12] != 0;
+        }
+        else if (std::memcmp(type, "PLTE", 4) == 0)
+        {
+            for (uint32_t i = 0; i < length / 3 && i < 256; ++i)
+            {
+                palette[i] = 0.299f * data[3 * i] + 0.587f * data[3 * i + 1] + 0.114f * data[3 * i + 2];
+            }
+        }
+        else if (std::memcmp(type, "IDAT", 4) == 0)
+        {
+            compressed.insert(compressed.end(), data, data + length);
+        }
+        else if (std::memcmp(type, "IEND", 4) == 0)
+        {
+            break;
+        }
+        pos += 12 + length;
+    }
+
+    unsigned channels;
+    switch (colorType)
+    {
+    case 0:
+    case 3:
+        channels = 1;
+        break;
+    case 2:
+        channels = 3;
+        break;
+    case 4:
+        channels = 2;
+        break;
+    case 6:
+        channels = 4;
+        break;
+    default:
+        return false;
+    }
+    const bool depthValid = depth == 8 || (depth == 16 && colorType != 3) || ((depth == 1 || depth == 2 || depth == 4) && channels == 1);
+    if (width == 0 || height == 0 || !depthValid || interlaced ||
+        static_cast<unsigned long long>(width) * height > MAX_IMAGE_PIXELS || compressed.size() < 2 ||
+        (compressed[0] & 0x0f) != 8)
+    {
+        return false; // Adam7 interlacing is not supported
+    }
+
+    const size_t rowBytes = (static_cast<size_t>(width) * channels * depth + 7) / 8;
+    const size_t bytesPerPixel = std::max<size_t>(1, channels * depth / 8);
+    const size_t expected = (rowBytes + 1) * height;
+    if (expected / MAX_INFLATE_RATIO > compressed.size())
+    {
+        return false; // IHDR claims more than the IDAT data can hold; don't reserve for it
+    }
+    std::vector<uint8_t> raw;
+    raw.reserve(expected);
+    Inflater inflater;
+    inflater.inflate(compressed.data() + 2, compressed.size() - 2, expected, raw);
+    if (raw.size() < expected)
+    {
+        return false;
+    }
+
+    image.width = width;
+    image.height = height;
+    image.pixels.resize(static_cast<size_t>(width) * height);
+    std::vector<uint8_t> previous(rowBytes, 0);
+    for (unsigned y = 0; y < height; ++y)
+    {
+        uint8_t *row = &raw[y * (rowBytes + 1) + 1];
+        const uint8_t filter = row[-1];
+        for (size_t i = 0; i < rowBytes; ++i)
+        {
+            const int left = i >= bytesPerPixel ? row[i - bytesPerPixel] : 0;
+            const int up = previous[i];
+            const int upLeft = i >= bytesPerPixel ? previous[i - bytesPerPixel] : 0;
+            int predictor = 0;
+            switch (filter)
+            {
+            case 1:
+                predictor = left;
+                break;
+            case 2:
+                predictor = up;
+                break;
+            case 3:
+                predictor = (left + up) / 2;
+                break;
+            case 4:
+            {
+                const int p = left + up - upLeft;
+                const int pa = std::abs(p - left), pb = std::abs(p - up), pc = std::abs(p - upLeft);
+                predictor = pa <= pb && pa <= pc ? left : pb <= pc ? up : upLeft;
+                break;
+            }
+            default:
+                break;
+            }
+            row[i] = static_cast<uint8_t>(row[i] + predictor);
+        }
+        std::copy(row, row + rowBytes, previous.begin());
+
+        float *out = &image.pixels[static_cast<size_t>(y) * width];
+        const size_t step = depth == 16 ? 2 : 1;
+        auto sample = [&](const uint8_t *at) -> float
+        { return depth == 16 ? ((at[0] << 8) | at[1]) / 257.0f : at[0]; };
+        for (unsigned x = 0; x < width; ++x)
+        {
+            if (depth < 8)
+            {
+                const unsigned bit = x * depth;
+                const unsigned value = (row[bit / 8] >> (8 - depth - bit % 8)) & ((1u << depth) - 1);
+                out[x] = colorType == 3 ? palette[value] : value * 255.0f / ((1u << depth) - 1);
+                continue;
+            }
+            const uint8_t *pixel = row + static_cast<size_t>(x) * channels * step;
+            if (colorType == 3)
+            {
+                out[x] = palette[pixel[0]];
+            }
+            else if (channels >= 3)
+            {
+                out[x] = 0.299f * sample(pixel) + 0.587f * sample(pixel + step) + 0.114f * sample(pixel + 2 * step);
+            }
+            else
+            {
+                out[x] = sample(pixel);
+            }
+        }
+    }
+    return true;
+}
+
+// Bit reader over JPEG entropy-coded data: removes 0xFF00 stuffing and feeds zeros once a
+// marker is reached
+struct JpegBitReader
+{
+    const uint8_t *p;
+    const uint8_t *end;
+    uint32_t buffer = 0;
+    int count = 0;
+    bool atMarker = false;
+
+    void fill()
+    {
+        while (count <= 24)
+        {
+            uint32_t byte = 0;
+            if (!atMarker && p < end)
+            {
+                byte = *p;
+                if (byte == 0xFF)
+                {
+                    if (p + 1 < end && p[1] == 0x00)
+                    {
+                        p += 2;
+                    }
+                    else
+                    {
+                        atMarker = true;
+                        byte = 0;
+                    }
+                }
+                else
+                {
+                    ++p;
+                }
+            }
+            buffer |= byte << (24 - count);
+            count += 8;
+        }
+    }
+
+    uint32_t peek16()
+    {
+        fill();
+        return buffer >> 16;
+    }
+
+    void skip(int bits)
+    {
+        buffer <<= bits;
+        count -= bits;
+    }
+
+    int receiveExtend(int bits)
+    {
+        if (bits == 0)
+        {
+            return 0;
+        }
+        fill();
+        const int value = static_cast<int>(buffer >> (32 - bits));
+        skip(bits);
+        return value < (1 << (bits - 1)) ? value - (1 << bits) + 1 : value;
+    }
+
+    // Function to drop buffered bits and step over the RSTn marker at a restart boundary
+    void restart()
+    {
+        buffer = 0;
+        count = 0;
+        while (p + 1 < end && !(p[0] == 0xFF && p[1] >= 0xD0 && p[1] <= 0xD7))
+        {
+            ++p;
+        }
+        if (p + 1 < end)
+        {
+            p += 2;
+        }
+        atMarker = false;
+    }
+};
+
+// Canonical Huffman table of a JPEG with a 9-bit lookup for the common short codes
+struct JpegHuffman
+{
+    bool present = false;
+    uint8_t fastLength[512] = {};
+    uint8_t fastValue[512] = {};
+    int minCode[17] = {};
+    int maxCode[18] = {};
+    int valueIndex[17] = {};
+    uint8_t values[256] = {};
+
+    bool build(const uint8_t *counts, const uint8_t *symbols, int total)
+    {
+        if (total > 256)
+        {
+            return false;
+        }
+        std::copy(symbols, symbols + total, values);
+        std::fill(std::begin(fastLength), std::end(fastLength), 0);
+        int code = 0, k = 0;
+        for (int len = 1; len <= 16; ++len)
+        {
+            valueIndex[len] = k;
+            minCode[len] = code;
+            for (int i = 0; i < counts[len - 1]; ++i, ++code, ++k)
+            {
+                if (len <= 9)
+                {
+                    const int shift = 9 - len;
+                    for (int fill = 0; fill < (1 << shift); ++fill)
+                    {
+                        fastLength[(code << shift) | fill] = static_cast<uint8_t>(len);
+                        fastValue[(code << shift) | fill] = values[k];
+                    }
+                }
+            }
+            if (code >= (1 << len))
+            {
+                return false; // over-subscribed, or uses the all-ones code
+            }
+            maxCode[len] = counts[len - 1] ? code - 1 : -1;
+            code <<= 1;
+        }
+        maxCode[17] = std::numeric_limits<int>::max();
+        present = true;
+        return true;
+    }
+
+    int decode(JpegBitReader &bits) const
+    {
+        const uint32_t look = bits.peek16();
+        const int fast = fastLength[look >> 7];
+        if (fast)
+        {
+            bits.skip(fast);
+            return fastValue[look >> 7];
+        }
+        for (int len = 10; len <= 16; ++len)
+        {
+            const int code = static_cast<int>(look >> (16 - len));
+            if (code <= maxCode[len])
+            {
+                bits.skip(len);
+                return values[valueIndex[len] + code - minCode[len]];
+            }
+        }
+        return -1;
+    }
+};
+
+// Function to decode the luma DC coefficients of a baseline (Huffman, sequential) JPEG. Each
+// DC term is the mean of an 8x8 block, so the result is the image downscaled by eight
+// without any inverse DCT; AC terms are entropy decoded only to be skipped. Progressive and
+// arithmetic-coded JPEGs are not supported.
+bool decodeJpegDc(const std::vector<uint8_t> &file, LumaImage &image)
+{
+    if (file.size() < 4 || file[0] != 0xFF || file[1] != 0xD8)
+    {
+        return false;
+    }
+    struct Component
+    {
+        int id, h, v;
+    };
+    std::vector<Component> components;
+    unsigned width = 0, height = 0;
+    int hMax = 1, vMax = 1;
+    unsigned restartInterval = 0;
+    JpegHuffman dcTables[4], acTables[4];
+
+    size_t pos = 2;
+    while (pos + 4 <= file.size())
+    {
+        if (file[pos] != 0xFF)
+        {
+            ++pos;
+            continue;
+        }
+        const uint8_t marker = file[pos + 1];
+        if (marker == 0xFF || marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8))
+        {
+            pos += marker == 0xFF ? 1 : 2;
+            continue;
+        }
+        if (marker == 0xD9)
+        {
+            break;
+        }
+        const size_t length = (file[pos + 2] << 8) | file[pos + 3];
+        const uint8_t *segment = &file[pos + 4];
+        const size_t segmentEnd = pos + 2 + length;
+        if (length < 2 || segmentEnd > file.size())
+        {
+            return false;
+        }
+        if (marker == 0xC0 || marker == 0xC1)
+        {
+            if (length < 8)
+            {
+                return false;
+            }
+            height = (segment[1] << 8) | segment[2];
+            width = (segment[3] << 8) | segment[4];
+            const int count = segment[5];
+            if (length < 8 + 3u * count || count == 0 || count > 4)
+            {
+                return false;
+            }
+            for (int i = 0; i < count; ++i)
+            {
+                const Component component{segment[6 + 3 * i], segment[7 + 3 * i] >> 4, segment[7 + 3 * i] & 15};
+                if (component.h < 1 || component.h > 4 || component.v < 1 || component.v > 4)
+                {
+                    return false;
+                }
+                components.push_back(component);
+                hMax = std::max(hMax, component.h);
+                vMax = std::max(vMax, component.v);
+            }
+        }
+        else if ((marker >= 0xC2 && marker <= 0xCF) && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+        {
+            return false; // progressive, lossless or arithmetic coded
+        }
+        else if (marker == 0xC4)
+        {
+            size_t offset = 0;
+            while (offset + 17 <= length - 2)
+            {
+                const uint8_t classAndId = segment[offset];
+                const uint8_t *counts = segment + offset + 1;
+                int total = 0;
+                for (int i = 0; i < 16; ++i)
+                {
+                    total += counts[i];
+                }
+                if (offset + 17 + total > length - 2 || (classAndId & 15) > 3)
+                {
+                    return false;
+                }
+                JpegHuffman &table = (classAndId >> 4) ? acTables[classAndId & 3] : dcTables[classAndId & 3];
+                if (!table.build(counts, segment + offset + 17, total))
+                {
+                    return false;
+                }
+                offset += 17 + total;
+            }
+        }
+        else if (marker == 0xDD && length >= 4)
+        {
+            restartInterval = (segment[0] << 8) | segment[1];
+        }
+        else if (marker == 0xDA)
+        {
+            if (components.empty() || width == 0 || height == 0 ||
+                static_cast<unsigned long long>(width) * height > MAX_IMAGE_PIXELS)
+            {
+                return false;
+            }
+            struct ScanComponent
+            {
+                int index, dc, ac;
+            };
+            std::vector<ScanComponent> scan;
+            const int count = segment[0];
+            for (int i = 0; i < count && 3u + 2u * i < length; ++i)
+            {
+                const int id = segment[1 + 2 * i];
+                const int tables = segment[2 + 2 * i];
+                for (size_t c = 0; c < components.size(); ++c)
+                {
+                    if (components[c].id == id)
+                    {
+                        scan.push_back({static_cast<int>(c), tables >> 4, tables & 3});
+                    }
+                }
+            }
+            for (const auto &component : scan)
+            {
+                if (!dcTables[component.dc & 3].present || !acTables[component.ac].present)
+                {
+                    return false;
+                }
+            }
+
+            const Component &luma = components[0];
+            const unsigned lumaWidth = (width * luma.h + hMax - 1) / hMax;
+            const unsigned lumaHeight = (height * luma.v + vMax - 1) / vMax;
+            const unsigned blocksWide = (lumaWidth + 7) / 8;
+            const unsigned blocksHigh = (lumaHeight + 7) / 8;
+            const bool interleaved = scan.size() > 1;
+            const unsigned mcusWide = interleaved ? (width + 8 * hMax - 1) / (8 * hMax) : blocksWide;
+            const unsigned mcusHigh = interleaved ? (height + 8 * vMax - 1) / (8 * vMax) : blocksHigh;
+            const bool hasLuma = std::any_of(scan.begin(), scan.end(), [](const ScanComponent &c)
+                                             { return c.index == 0; });
+
+            JpegBitReader bits{file.data() + segmentEnd, file.data() + file.size()};
+            if (hasLuma)
+            {
+                image.width = blocksWide;
+                image.height = blocksHigh;
+                image.pixels.assign(static_cast<size_t>(blocksWide) * blocksHigh, 0.0f);
+                int predictions[4] = {};
+                const unsigned long long mcus = static_cast<unsigned long long>(mcusWide) * mcusHigh;
+                for (unsigned long long mcu = 0; mcu < mcus; ++mcu)
+                {
+                    if (restartInterval && mcu && mcu % restartInterval == 0)
+                    {
+                        bits.restart();
+                        std::fill(std::begin(predictions), std::end(predictions), 0);
+                    }
+                    const unsigned mcuX = static_cast<unsigned>(mcu % mcusWide);
+                    const unsigned mcuY = static_cast<unsigned>(mcu / mcusWide);
+                    for (const auto &component : scan)
+                    {
+                        const int blocksH = interleaved ? components[component.index].h : 1;
+                        const int blocksV = interleaved ? components[component.index].v : 1;
+                        for (int by = 0; by < blocksV; ++by)
+                        {
+                            for (int bx = 0; bx < blocksH; ++bx)
+                            {
+                                const int size = dcTables[component.dc & 3].decode(bits);
+                                if (size < 0 || size > 16)
+                                {
+                                    return false;
+                                }
+                                predictions[component.index] += bits.receiveExtend(size);
+                                for (int k = 1; k < 64;)
+                                {
+                                    const int rs = acTables[component.ac].decode(bits);
+                                    if (rs < 0)
+                                    {
+                                        return false;
+                                    }
+                                    if ((rs & 15) == 0)
+                                    {
+                                        if (rs != 0xF0)
+                                        {
+                                            break;
+                                        }
+                                        k += 16;
+                                        continue;
+                                    }
+                                    bits.fill();
+                                    bits.skip(rs & 15);
+                                    k += (rs >> 4) + 1;
+                                }
+                                if (component.index == 0)
+                                {
+                                    const unsigned x = mcuX * blocksH + bx;
+                                    const unsigned y = mcuY * blocksV + by;
+                                    if (x < blocksWide && y < blocksHigh)
+                                    {
+                                        image.pixels[static_cast<size_t>(y) * blocksWide + x] = static_cast<float>(predictions[0]);
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
+                return true;
+            }
+            // A separate scan for another component: skip its entropy-coded data
+            pos = segmentEnd;
+            while (pos + 1 < file.size() && !(file[pos] == 0xFF && file[pos + 1] != 0x00 &&
+                                              !(file[pos + 1] >= 0xD0 && file[pos + 1] <= 0xD7)))
+            {
+                ++pos;
+            }
+            continue;
+        }
+        pos = segmentEnd;
+    }
+    return false;
+}
+
+// Function to compute a 64-bit DCT perceptual hash (pHash). The luma image is box-filtered
+// to 32x32, the 8x8 lowest frequencies of its 2-D DCT-II are computed as two small matrix
+// products, and each bit records whether a coefficient lies above their median (the DC term
+// is left out, so bit 0 is always clear). The inner loops run over contiguous float rows so
+// the compiler can vectorize them.
+uint64_t perceptualHash(const LumaImage &image)
+{
+    constexpr int N = 32;
+    constexpr int K = 8;
+    static const auto cosines = []
+    {
+        std::array<float, K * N> table{};
+        for (int u = 0; u < K; ++u)
+        {
+            for (int x = 0; x < N; ++x)
+            {
+                table[u * N + x] = static_cast<float>(std::cos((2 * x + 1) * u * M_PI / (2 * N)));
+            }
+        }
+        return table;
+    }();
+
+    // Box filter: every source pixel lands in exactly one cell, small images are stretched
+    std::array<float, N * N> small{};
+    std::array<float, N * N> weight{};
+    for (unsigned y = 0; y < image.height; ++y)
+    {
+        const int cellY = static_cast<int>(static_cast<unsigned long long>(y) * N / image.height);
+        const float *row = &image.pixels[static_cast<size_t>(y) * image.width];
+        for (unsigned x = 0; x < image.width; ++x)
+        {
+            const int cell = cellY * N + static_cast<int>(static_cast<unsigned long long>(x) * N / image.width);
+            small[cell] += row[x];
+            weight[cell] += 1.0f;
+        }
+    }
+    for (int y = 0; y < N; ++y)
+    {
+        for (int x = 0; x < N; ++x)
+        {
+            const unsigned sourceY = static_cast<unsigned>(static_cast<unsigned long long>(y) * image.height / N);
+            const unsigned sourceX = static_cast<unsigned>(static_cast<unsigned long long>(x) * image.width / N);
+            const int cell = y * N + x;
+            small[cell] = weight[cell] > 0 ? small[cell] / weight[cell]
+                                           : image.pixels[static_cast<size_t>(sourceY) * image.width + sourceX];
+        }
+    }
+
+    // rows[y][u] = sum_x small[y][x] * cos_u(x), then coefficients[v][u] = sum_y cos_v(y) * rows[y][u]
+    std::array<float, N * K> rows{};
+    for (int y = 0; y < N; ++y)
+    {
+        for (int u = 0; u < K; ++u)
+        {
+            float sum = 0.0f;
+            for (int x = 0; x < N; ++x)
+            {
+                sum += small[y * N + x] * cosines[u * N + x];
+            }
+            rows[y * K + u] = sum;
+        }
+    }
+    std::array<float, K * K> coefficients{};
+    for (int v = 0; v < K; ++v)
+    {
+        for (int y = 0; y < N; ++y)
+        {
+            const float c = cosines[v * N + y];
+            for (int u = 0; u < K; ++u)
+            {
+                coefficients[v * K + u] += c * rows[y * K + u];
+            }
+        }
+    }
+
+    std::array<float, K * K - 1> ac;
+    std::copy(coefficients.begin() + 1, coefficients.end(), ac.begin());
+    std::nth_element(ac.begin(), ac.begin() + ac.size() / 2, ac.end());
+    const float median = ac[ac.size() / 2];
+    uint64_t hash = 0;
+    for (int i = 1; i < K * K; ++i)
+    {
+        hash |= static_cast<uint64_t>(coefficients[i] > median) << i;
+    }
+    return hash;
+}
+
+// Multi-index hash over 64-bit perceptual hashes. Each hash is cut into m chunks of about
+// log2(n) bits, so buckets hold about one hash, and every chunk position has its own table:
+// bucket offsets plus the ids and hashes sorted by chunk value. Two hashes within distance d
+// differ in at most floor(d / m) bits of at least one chunk, so probing each chunk's
+// neighbours within that radius finds every match without comparing all pairs.
+class HammingIndex
+{
+public:
+    explicit HammingIndex(const std::vector<uint64_t> &hashes) : size_(hashes.size())
+    {
+        const unsigned logSize = hashes.size() < 2 ? 1 : 64 - __builtin_clzll(hashes.size() - 1);
+        const unsigned chunks = std::clamp(64u / std::max(logSize, 1u), 3u, 8u);
+        unsigned shift = 0;
+        for (unsigned c = 0; c < chunks; ++c)
+        {
+            Table table;
+            table.shift = shift;
+            table.bits = 64 / chunks + (c < 64 % chunks ? 1 : 0);
+            shift += table.bits;
+            table.offsets.assign((size_t(1) << table.bits) + 1, 0);
+            for (uint64_t hash : hashes)
+            {
+                ++table.offsets[table.key(hash) + 1];
+            }
+            for (size_t i = 1; i < table.offsets.size(); ++i)
+            {
+                table.offsets[i] += table.offsets[i - 1];
+            }
+            table.ids.resize(hashes.size());
+            table.hashes.resize(hashes.size());
+            std::vector<uint32_t> next(table.offsets.begin(), table.offsets.end() - 1);
+            for (size_t id = 0; id < hashes.size(); ++id)
+            {
+                const uint32_t slot = next[table.key(hashes[id])]++;
+                table.ids[slot] = static_cast<uint32_t>(id);
+                table.hashes[slot] = hashes[id];
+            }
+            tables_.push_back(std::move(table));
+        }
+    }
+
+    // Function to call onMatch(i, j), i < j, once for every pair within maxDistance bits; a
+    // pair is reported by the first table that brings it within the radius. Queries run in
+    // blocks of consecutive keys with the probe masks in the outer loop, so every mask
+    // sweeps a narrow window of the table instead of jumping around it. Blocks are spread
+    // over workers; onMatch must be safe to call concurrently.
+    template <typename OnMatch>
+    void forEachPairWithin(unsigned maxDistance, unsigned workers, OnMatch &&onMatch) const
+    {
+        const unsigned radius = maxDistance / static_cast<unsigned>(tables_.size());
+        constexpr size_t BLOCK = 4096;
+        for (size_t t = 0; t < tables_.size(); ++t)
+        {
+            const Table &table = tables_[t];
+            std::vector<uint32_t> masks;
+            neighbours(0, table.bits, radius, 0, masks);
+            std::atomic<size_t> next{0};
+            auto worker = [&]
+            {
+                for (size_t first = next.fetch_add(BLOCK); first < size_; first = next.fetch_add(BLOCK))
+                {
+                    const size_t last = std::min(first + BLOCK, size_);
+                    for (uint32_t mask : masks)
+                    {
+                        for (size_t k = first; k < last; ++k)
+                        {
+                            const uint64_t hash = table.hashes[k];
+                            const uint32_t probe = table.key(hash) ^ mask;
+                            for (uint32_t slot = table.offsets[probe]; slot < table.offsets[probe + 1]; ++slot)
+                            {
+                                if (table.ids[slot] <= table.ids[k] ||
+                                    static_cast<unsigned>(__builtin_popcountll(hash ^ table.hashes[slot])) > maxDistance)
+                                {
+                                    continue;
+                                }
+                                bool foundEarlier = false;
+                                for (size_t e = 0; e < t && !foundEarlier; ++e)
+                                {
+                                    const Table &earlier = tables_[e];
+                                    foundEarlier = static_cast<unsigned>(__builtin_popcount(earlier.key(hash) ^ earlier.key(table.hashes[slot]))) <= radius;
+                                }
+                                if (!foundEarlier)
+                                {
+                                    onMatch(table.ids[k], table.ids[slot]);
+                                }
+                            }
+                        }
+                    }
+                }
+            };
+            std::vector<std::thread> pool;
+            for (unsigned w = 1; w < workers; ++w)
+            {
+                pool.emplace_back(worker);
+            }
+            worker();
+            for (auto &thread : pool)
+            {
+                thread.join();
+            }
+        }
+    }
+
+private:
+    struct Table
+    {
+        unsigned shift;
+        unsigned bits;
+        std::vector<uint32_t> offsets;
+        std::vector<uint32_t> ids;
+        std::vector<uint64_t> hashes; // copy in table order, so candidate checks stay local
+
+        uint32_t key(uint64_t hash) const { return static_cast<uint32_t>((hash >> shift) & ((1ULL << bits) - 1)); }
+    };
+
+    // Function to list every bits-wide value within radius bits of value, flipping bits from
+    // position `from` upwards so each value is produced once
+    static void neighbours(uint32_t value, unsigned bits, unsigned radius, unsigned from, std::vector<uint32_t> &out)
+    {
+        out.push_back(value);
+        if (radius == 0)
+        {
+            return;
+        }
+        for (unsigned bit = from; bit < bits; ++bit)
+        {
+            neighbours(value ^ (1u << bit), bits, radius - 1, bit + 1, out);
+        }
+    }
+
+    size_t size_;
+    std::vector<Table> tables_;
+};
+
+// Function to read a whole file for decoding, paying the throttle for the bytes read
+bool readFileBytes(const std::string &path, std::vector<uint8_t> &data, Throttle *throttle, size_t limit)
+{
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || static_cast<unsigned long long>(st.st_size) > limit)
+    {
+        ::close(fd);
+        return false;
+    }
+    data.resize(static_cast<size_t>(st.st_size));
+    size_t done = 0;
+    while (done < data.size())
+    {
+        const ssize_t got = ::read(fd, data.data() + done, data.size() - done);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            break;
+        }
+        done += got;
+        countMetric(Metric::BytesRead, got);
+        if (throttle)
+        {
+            throttle->acquireBytes(got);
+        }
+    }
+    ::close(fd);
+    data.resize(done);
+    return true;
+}
+
+// One decoded image of a similarity scan
+struct ImageHash
+{
+    std::string path;
+    unsigned long long size;
+    unsigned width;
+    unsigned height;
+    uint64_t hash;
+};
+
+// Function to find groups of visually similar JPEG and PNG images under the roots. Images
+// are hashed with perceptualHash on a worker pool, pairs within maxDistance bits are found
+// with a HammingIndex, and groups are the connected components of those pairs.
+// Files that cannot be decoded (progressive JPEGs, interlaced PNGs, damaged files) are
+// reported in undecodable and otherwise ignored.
+std::vector<std::vector<ImageHash>> findSimilarImages(const std::vector<fs::path> &rootPaths, unsigned maxDistance,
+                                                      ErrorTable &errors,
+                                                      std::vector<std::string> &undecodable,
+                                                      const DuplicateScanOptions &options)
+{
+    std::vector<ImageHash> images;
+    {
+        MetricsPhase phase("traversal");
+        std::string extension;
+        for (const auto &root : rootPaths)
+        {
+            scanTree(root, [&](const ScanEntry &entry)
+                     {
+                         lowercaseInto(extensionOf(entry.name), extension);
+                         if (categorizeExtension(extension) == FileType::Image)
+                         {
+                             images.push_back({std::string(entry.path), entry.size, 0, 0, 0});
+                         }
+                     },
+                     errors, options.scanOptions);
+        }
+    }
+
+    std::vector<uint8_t> decoded(images.size(), 0); // 1 hashed, 2 left unread by a stop
+    const unsigned workers = options.workers ? options.workers : std::max(1u, std::thread::hardware_concurrency());
+    {
+        MetricsPhase phase("hashing");
+        Throttle *throttle = options.scanOptions.throttle;
+        const unsigned poolSize = throttle ? throttle->poolSize(workers) : workers;
+        ScanControl *control = options.scanOptions.control;
+        countMetric(Metric::HashQueue, images.size());
+        std::atomic<size_t> next{0};
+        auto worker = [&](unsigned index)
+        {
+            std::vector<uint8_t> data;
+            LumaImage luma;
+            auto finished = [&] { return next.load() >= images.size() || (control && control->stopped()); };
+            while (!throttle || throttle->admitWorker(index, workers, finished))
+            {
+                const size_t i = next.fetch_add(1);
+                if (i >= images.size())
+                {
+                    break;
+                }
+                countMetric(Metric::HashQueue, -1ULL);
+                if (control && !control->proceed())
+                {
+                    decoded[i] = 2;
+                    continue;
+                }
+                if (!readFileBytes(images[i].path, data, throttle, 1ULL << 30) ||
+                    !(decodeJpegDc(data, luma) || decodePng(data, luma)))
+                {
+                    continue;
+                }
+                SampledTimer timer(Metric::HashNs, 0);
+                images[i].width = luma.width;
+                images[i].height = luma.height;
+                images[i].hash = perceptualHash(luma);
+                countMetric(Metric::BytesHashed, data.size());
+                decoded[i] = 1;
+            }
+        };
+        std::vector<std::thread> pool;
+        for (unsigned w = 1; w < poolSize && w < images.size(); ++w)
+        {
+            pool.emplace_back(worker, w);
+        }
+        worker(0);
+        for (auto &thread : pool)
+        {
+            thread.join();
+        }
+    }
+
+    std::vector<ImageHash> hashed;
+    for (size_t i = 0; i < images.size(); ++i)
+    {
+        if (decoded[i] == 1)
+        {
+            hashed.push_back(std::move(images[i]));
+        }
+        else if (decoded[i] == 0)
+        {
+            undecodable.push_back(std::move(images[i].path));
+        }
+    }
+
+    MetricsPhase phase("matching");
+    std::vector<uint64_t> hashes;
+    hashes.reserve(hashed.size());
+    for (const auto &image : hashed)
+    {
+        hashes.push_back(image.hash);
+    }
+    std::vector<uint32_t> parent(hashed.size());
+    std::iota(parent.begin(), parent.end(), 0);
+    auto find = [&](uint32_t x)
+    {
+        while (parent[x] != x)
+        {
+            parent[x] = parent[parent[x]];
+            x = parent[x];
+        }
+        return x;
+    };
+    std::mutex unionMutex;
+    HammingIndex index(hashes);
+    index.forEachPairWithin(maxDistance, workers, [&](size_t i, size_t j)
+                            {
+                                std::lock_guard<std::mutex> lock(unionMutex);
+                                const uint32_t a = find(static_cast<uint32_t>(i));
+                                const uint32_t b = find(static_cast<uint32_t>(j));
+                                if (a != b)
+                                {
+                                    parent[std::max(a, b)] = std::min(a, b);
+                                }
+                            });
+
+    std::unordered_map<uint32_t, size_t> groupOf;
+    std::vector<std::vector<ImageHash>> groups;
+    std::vector<size_t> members(hashed.size(), 0);
+    for (uint32_t i = 0; i < hashed.size(); ++i)
+    {
+        ++members[find(i)];
+    }
+    for (uint32_t i = 0; i < hashed.size(); ++i)
+    {
+        const uint32_t root = find(i);
+        if (members[root] < 2)
+        {
+            continue;
+        }
+        auto [it, inserted] = groupOf.try_emplace(root, groups.size());
+        if (inserted)
+        {
+            groups.emplace_back();
+        }
+        groups[it->second].push_back(std::move(hashed[i]));
+    }
+    return groups;
+}
+
+// Column store of scanned files: one array per attribute, so a filter only touches the
+// columns it reads. Extensions and parent directories are dictionary encoded; row ids are
+// 32-bit, which caps a catalog at four billion files.
+struct Catalog
+{
+    std::vector<unsigned long long> size;
+    std::vector<unsigned long long> allocated;
+    std::vector<long long> mtime;
+    std::vector<long long> atime;
+    std::vector<uint8_t> type;                  // FileType
+    std::vector<uint32_t> extension;            // index into extensions
+    std::vector<uint32_t> directory;            // index into directories
+    std::vector<unsigned long long> nameOffset; // start of the file name in names
+    std::string names;
+    std::vector<std::string> extensions;
+    std::vector<std::string> directories;
+
+    size_t rows() const { return size.size(); }
+
+    std::string_view name(size_t row) const
+    {
+        const unsigned long long end = row + 1 < nameOffset.size() ? nameOffset[row + 1] : names.size();
+        return std::string_view(names).substr(nameOffset[row], end - nameOffset[row]);
+    }
+
+    std::string path(size_t row) const
+    {
+        std::string result = directories[directory[row]];
+        if (result.empty() || result.back() != '/')
+        {
+            result += '/';
+        }
+        result += name(row);
+        return result;
+    }
+};
+
+// Function to scan the roots into a Catalog, passing every file on to onFile as well
+template <typename OnFile>
+Catalog buildCatalog(const std::vector<fs::path> &roots, ErrorTable &errors, const ScanOptions &options, OnFile &&onFile)
+{
+    MetricsPhase phase("traversal");
+    Catalog catalog;
+    std::unordered_map<std::string, uint32_t> extensionIds;
+    std::unordered_map<std::string, uint32_t> directoryIds;
+    std::string extension;
+    ParentCache<uint32_t> parents;
+    auto internDirectory = [&](std::string_view parent)
+    {
+        auto [it, inserted] = directoryIds.try_emplace(std::string(parent), static_cast<uint32_t>(catalog.directories.size()));
+        if (inserted)
+        {
+            catalog.directories.push_back(it->first);
+        }
+        return it->second;
+    };
+    for (const auto &root : roots)
+    {
+        scanTree(root, [&](const ScanEntry &entry)
+                 {
+                     const uint32_t currentDirectory = parents.get(entry, internDirectory);
+
+                     lowercaseInto(extensionOf(entry.name), extension);
+                     auto [it, inserted] = extensionIds.try_emplace(extension, static_cast<uint32_t>(catalog.extensions.size()));
+                     if (inserted)
+                     {
+                         catalog.extensions.push_back(extension);
+                     }
+
+                     catalog.size.push_back(entry.size);
+                     catalog.allocated.push_back(entry.allocated);
+                     catalog.mtime.push_back(entry.mtime);
+                     catalog.atime.push_back(entry.atime);
+                     catalog.type.push_back(static_cast<uint8_t>(categorizeExtension(extension)));
+                     catalog.extension.push_back(it->second);
+                     catalog.directory.push_back(currentDirectory);
+                     catalog.nameOffset.push_back(catalog.names.size());
+                     catalog.names.append(entry.name);
+                     onFile(entry);
+                 },
+                 errors, options);
+    }
+    return catalog;
+}
+
+// Function to scan the roots into a Catalog
+Catalog buildCatalog(const std::vector<fs::path> &roots, ErrorTable &errors, const ScanOptions &options)
+{
+    return buildCatalog(roots, errors, options, [](const ScanEntry &) {});
+}
+
+enum class QueryField
+{
+    Size,
+    Mtime,
+    Atime,
+    Type,
+    Extension,
+    Path,
+};
+
+// One term of a query. Numeric terms are normalised to an inclusive range; type and
+// extension terms list accepted values; path terms hold a glob.
+struct QueryPredicate
+{
+    QueryField field;
+    bool negate = false;
+    long long low = std::numeric_limits<long long>::min();
+    long long high = std::numeric_limits<long long>::max();
+    std::vector<std::string> values;
+};
+
+enum class QueryGroup
+{
+    None,      // list matching files
+    All,       // one total row
+    Type,
+    Extension,
+    Directory, // parent directory
+};
+
+// A conjunction of predicates with an optional aggregation
+struct Query
+{
+    std::vector<QueryPredicate> predicates;
+    QueryGroup groupBy = QueryGroup::None;
+};
+
+// Function to parse a time value: a date (YYYY-MM-DD, UTC) or an age before now such as
+// 90m, 12h, 30d, 2w or 1y
+bool parseQueryTime(const std::string &text, long long &value)
+{
+    int year, month, day;
+    char tail;
+    if (std::sscanf(text.c_str(), "%4d-%2d-%2d%c", &year, &month, &day, &tail) == 3)
+    {
+        std::tm date = {};
+        date.tm_year = year - 1900;
+        date.tm_mon = month - 1;
+        date.tm_mday = day;
+        value = static_cast<long long>(::timegm(&date));
+        return true;
+    }
+    char *end = nullptr;
+    const double amount = std::strtod(text.c_str(), &end);
+    if (end == text.c_str() || end[0] == '\0' || end[1] != '\0')
+    {
+        return false;
+    }
+    static const std::pair<char, double> units[] = {{'m', 60}, {'h', 3600}, {'d', 86400}, {'w', 604800}, {'y', 31557600}};
+    for (const auto &[unit, seconds] : units)
+    {
+        if (*end == unit)
+        {
+            value = static_cast<long long>(std::time(nullptr)) - static_cast<long long>(amount * seconds);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Function to parse a query such as "size>100M and mtime<90d and type=Video,Image".
+// Terms are field, operator (< <= > >= = !=) and value, joined by "and" or whitespace.
+// Sizes take K/M/G suffixes, ext takes a comma list, path takes a glob over the full path.
+bool parseQuery(const std::string &text, Query &query, std::string &error)
+{
+    std::istringstream terms(text);
+    std::string term;
+    while (terms >> term)
+    {
+        if (term == "and" || term == "AND")
+        {
+            continue;
+        }
+        const size_t opStart = term.find_first_of("<>=!");
+        if (opStart == std::string::npos || opStart == 0)
+        {
+            error = "expected <field><op><value>: " + term;
+            return false;
+        }
+        const size_t opEnd = term.find_first_not_of("<>=!", opStart);
+        const std::string field = term.substr(0, opStart);
+        const std::string op = term.substr(opStart, opEnd == std::string::npos ? std::string::npos : opEnd - opStart);
+        const std::string value = opEnd == std::string::npos ? std::string() : term.substr(opEnd);
+        static const char *operators[] = {"<", "<=", ">", ">=", "=", "!="};
+        if (std::find(std::begin(operators), std::end(operators), op) == std::end(operators) || value.empty())
+        {
+            error = "bad operator or missing value: " + term;
+            return false;
+        }
+
+        QueryPredicate predicate;
+        predicate.negate = op == "!=";
+        if (field == "size" || field == "mtime" || field == "atime")
+        {
+            long long number;
+            if (field == "size")
+            {
+                predicate.field = QueryField::Size;
+                char *end = nullptr;
+                std::strtod(value.c_str(), &end);
+                if (end == value.c_str())
+                {
+                    error = "bad size: " + value;
+                    return false;
+                }
+                number = static_cast<long long>(parseScaledNumber(value));
+            }
+            else
+            {
+                predicate.field = field == "mtime" ? QueryField::Mtime : QueryField::Atime;
+                if (!parseQueryTime(value, number))
+                {
+                    error = "bad time (YYYY-MM-DD or an age like 30d): " + value;
+                    return false;
+                }
+            }
+            if (op == "<")
+            {
+                predicate.high = number - 1;
+            }
+            else if (op == "<=")
+            {
+                predicate.high = number;
+            }
+            else if (op == ">")
+            {
+                predicate.low = number + 1;
+            }
+            else if (op == ">=")
+            {
+                predicate.low = number;
+            }
+            else
+            {
+                predicate.low = predicate.high = number;
+            }
+        }
+        else if (field == "type" || field == "ext" || field == "path")
+        {
+            if (op != "=" && op != "!=")
+            {
+                error = field + " only supports = and !=";
+                return false;
+            }
+            predicate.field = field == "type" ? QueryField::Type : field == "ext" ? QueryField::Extension : QueryField::Path;
+            if (predicate.field == QueryField::Path)
+            {
+                predicate.values.push_back(value);
+            }
+            else
+            {
+                std::istringstream items(value);
+                std::string item;
+                while (std::getline(items, item, ','))
+                {
+                    std::transform(item.begin(), item.end(), item.begin(), ::tolower);
+                    if (predicate.field == QueryField::Extension && !item.empty() && item[0] != '.')
+                    {
+                        item.insert(item.begin(), '.');
+                    }
+                    predicate.values.push_back(item);
+                }
+            }
+        }
+        else
+        {
+            error = "unknown field (size, mtime, atime, type, ext, path): " + field;
+            return false;
+        }
+        query.predicates.push_back(std::move(predicate));
+    }
+    return true;
+}
+
+// Filter kernels. Each one narrows a byte mask over a batch of rows without branching on
+// the data, so the compiler can vectorize them.
+template <typename T>
+void rangeMask(const T *column, size_t count, T low, T high, bool negate, uint8_t *mask)
+{
+    const uint8_t flip = negate ? 1 : 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        mask[i] &= static_cast<uint8_t>((column[i] >= low) & (column[i] <= high)) ^ flip;
+    }
+}
+
+template <typename T>
+void lookupMask(const T *column, size_t count, const uint8_t *accepted, uint8_t *mask)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        mask[i] &= accepted[column[i]];
+    }
+}
+
+// Executes a Query over a Catalog. Rows are processed in batches: the column predicates
+// narrow a byte mask, the mask is compacted into a selection vector of row ids, and path
+// globs, which need the string, only run on the rows that survived. Batches are spread
+// across threads.
+class QueryEngine
+{
+public:
+    static constexpr size_t BATCH = 4096;
+
+    QueryEngine(const Catalog &catalog, const Query &query) : catalog_(catalog), query_(query)
+    {
+        // Type and extension terms become lookup tables over the dictionary ids
+        for (const auto &predicate : query.predicates)
+        {
+            if (predicate.field == QueryField::Type || predicate.field == QueryField::Extension)
+            {
+                const bool isType = predicate.field == QueryField::Type;
+                const size_t domain = isType ? static_cast<size_t>(FileType::Document) + 1 : catalog.extensions.size();
+                std::vector<uint8_t> accepted(std::max<size_t>(domain, 1), predicate.negate ? 1 : 0);
+                for (size_t id = 0; id < domain; ++id)
+                {
+                    std::string key = isType ? getFileTypeName(static_cast<FileType>(id)) : catalog.extensions[id];
+                    std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+                    if (std::find(predicate.values.begin(), predicate.values.end(), key) != predicate.values.end())
+                    {
+                        accepted[id] = predicate.negate ? 0 : 1;
+                    }
+                }
+                lookups_.push_back(std::move(accepted));
+            }
+        }
+    }
+
+    // Function to call onBatch(worker, batch, rows, count) with the selected row ids of every
+    // batch. Calls for different batches may run concurrently on different workers.
+    template <typename OnBatch>
+    void run(unsigned workers, OnBatch &&onBatch) const
+    {
+        const size_t batches = (catalog_.rows() + BATCH - 1) / BATCH;
+        workers = std::max(1u, std::min<unsigned>(workers, static_cast<unsigned>(std::max<size_t>(batches, 1))));
+        std::atomic<size_t> next{0};
+        auto worker = [&](unsigned index)
+        {
+            std::vector<uint8_t> mask(BATCH);
+            std::vector<uint32_t> selection(BATCH);
+            std::string path;
+            for (size_t batch = next.fetch_add(1); batch < batches; batch = next.fetch_add(1))
+            {
+                const size_t count = filterBatch(batch * BATCH, mask.data(), selection.data(), path);
+                onBatch(index, batch, selection.data(), count);
+            }
+        };
+        std::vector<std::thread> pool;
+        for (unsigned w = 1; w < workers; ++w)
+        {
+            pool.emplace_back(worker, w);
+        }
+        worker(0);
+        for (auto &thread : pool)
+        {
+            thread.join();
+        }
+    }
+
+private:
+    size_t filterBatch(size_t first, uint8_t *mask, uint32_t *selection, std::string &path) const
+    {
+        const size_t count = std::min(BATCH, catalog_.rows() - first);
+        std::fill(mask, mask + count, 1);
+        size_t lookup = 0;
+        for (const auto &predicate : query_.predicates)
+        {
+            switch (predicate.field)
+            {
+            case QueryField::Size:
+                // A range entirely below zero (size<0) matches nothing: encode it as low > high
+                rangeMask<unsigned long long>(catalog_.size.data() + first, count,
+                                              predicate.high < 0 ? 1 : static_cast<unsigned long long>(std::max(predicate.low, 0LL)),
+                                              predicate.high < 0 ? 0 : static_cast<unsigned long long>(predicate.high),
+                                              predicate.negate, mask);
+                break;
+            case QueryField::Mtime:
+                rangeMask(catalog_.mtime.data() + first, count, predicate.low, predicate.high, predicate.negate, mask);
+                break;
+            case QueryField::Atime:
+                rangeMask(catalog_.atime.data() + first, count, predicate.low, predicate.high, predicate.negate, mask);
+                break;
+            case QueryField::Type:
+                lookupMask(catalog_.type.data() + first, count, lookups_[lookup++].data(), mask);
+                break;
+            case QueryField::Extension:
+                lookupMask(catalog_.extension.data() + first, count, lookups_[lookup++].data(), mask);
+                break;
+            case QueryField::Path:
+                break;
+            }
+        }
+
+        // Branch-free compaction: always write the row id, only advance on a match
+        size_t selected = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            selection[selected] = static_cast<uint32_t>(first + i);
+            selected += mask[i];
+        }
+
+        for (const auto &predicate : query_.predicates)
+        {
+            if (predicate.field != QueryField::Path)
+            {
+                continue;
+            }
+            size_t kept = 0;
+            for (size_t i = 0; i < selected; ++i)
+            {
+                path = catalog_.path(selection[i]);
+                const bool matches = ::fnmatch(predicate.values[0].c_str(), path.c_str(), 0) == 0;
+                selection[kept] = selection[i];
+                kept += matches != predicate.negate;
+            }
+            selected = kept;
+        }
+        return selected;
+    }
+
+    const Catalog &catalog_;
+    const Query &query_;
+    std::vector<std::vector<uint8_t>> lookups_;
+};
+
+// Count and total size of one group of a query result
+struct QueryAggregate
+{
+    std::string group;
+    unsigned long long files = 0;
+    unsigned long long bytes = 0;
+    unsigned long long allocated = 0;
+};
+
+// Function to run an aggregating query. Each worker sums into its own dense arrays indexed by
+// the group's dictionary id; the arrays are added up at the end. Groups come back largest first
+// by the chosen size.
+std::vector<QueryAggregate> aggregateQuery(const Catalog &catalog, const Query &query, unsigned workers, SizeBasis basis = SizeBasis::Apparent)
+{
+    size_t groups = 1;
+    if (query.groupBy == QueryGroup::Type)
+    {
+        groups = static_cast<size_t>(FileType::Document) + 1;
+    }
+    else if (query.groupBy == QueryGroup::Extension)
+    {
+        groups = catalog.extensions.size();
+    }
+    else if (query.groupBy == QueryGroup::Directory)
+    {
+        groups = catalog.directories.size();
+    }
+    workers = std::max(1u, workers);
+    std::vector<std::vector<unsigned long long>> files(workers, std::vector<unsigned long long>(groups));
+    std::vector<std::vector<unsigned long long>> bytes(workers, std::vector<unsigned long long>(groups));
+    std::vector<std::vector<unsigned long long>> allocated(workers, std::vector<unsigned long long>(groups));
+
+    QueryEngine engine(catalog, query);
+    engine.run(workers, [&](unsigned worker, size_t, const uint32_t *rows, size_t count)
+               {
+                   unsigned long long *fileCounts = files[worker].data();
+                   unsigned long long *byteCounts = bytes[worker].data();
+                   unsigned long long *allocatedCounts = allocated[worker].data();
+                   for (size_t i = 0; i < count; ++i)
+                   {
+                       const uint32_t row = rows[i];
+                       size_t group = 0;
+                       switch (query.groupBy)
+                       {
+                       case QueryGroup::Type:
+                           group = catalog.type[row];
+                           break;
+                       case QueryGroup::Extension:
+                           group = catalog.extension[row];
+                           break;
+                       case QueryGroup::Directory:
+                           group = catalog.directory[row];
+                           break;
+                       default:
+                           break;
+                       }
+                       ++fileCounts[group];
+                       byteCounts[group] += catalog.size[row];
+                       allocatedCounts[group] += catalog.allocated[row];
+                   }
+               });
+
+    std::vector<QueryAggregate> result;
+    for (size_t group = 0; group < groups; ++group)
+    {
+        QueryAggregate aggregate;
+        for (unsigned w = 0; w < workers; ++w)
+        {
+            aggregate.files += files[w][group];
+            aggregate.bytes += bytes[w][group];
+            aggregate.allocated += allocated[w][group];
+        }
+        if (aggregate.files == 0 && query.groupBy != QueryGroup::All)
+        {
+            continue;
+        }
+        switch (query.groupBy)
+        {
+        case QueryGroup::Type:
+            aggregate.group = getFileTypeName(static_cast<FileType>(group));
+            break;
+        case QueryGroup::Extension:
+            aggregate.group = catalog.extensions[group];
+            break;
+        case QueryGroup::Directory:
+            aggregate.group = catalog.directories[group];
+            break;
+        default:
+            aggregate.group = "all";
+            break;
+        }
+        result.push_back(std::move(aggregate));
+    }
+    const bool byAllocated = basis == SizeBasis::Allocated;
+    std::sort(result.begin(), result.end(), [byAllocated](const QueryAggregate &a, const QueryAggregate &b)
+              { return byAllocated ? a.allocated > b.allocated : a.bytes > b.bytes; });
+    return result;
+}
+
+// Function to run a listing query and return the matching row ids in catalog order
+std::vector<uint32_t> selectQuery(const Catalog &catalog, const Query &query, unsigned workers)
+{
+    const size_t batches = (catalog.rows() + QueryEngine::BATCH - 1) / QueryEngine::BATCH;
+    std::vector<std::vector<uint32_t>> perBatch(batches);
+    QueryEngine engine(catalog, query);
+    engine.run(workers, [&](unsigned, size_t batch, const uint32_t *rows, size_t count)
+               { perBatch[batch].assign(rows, rows + count); });
+    std::vector<uint32_t> rows;
+    for (auto &selected : perBatch)
+    {
+        rows.insert(rows.end(), selected.begin(), selected.end());
+    }
+    return rows;
+}
+
+// One file of a snapshot; path ids index the history's path dictionary
+struct SnapshotEntry
+{
+    uint32_t id;
+    unsigned long long size;
+    long long mtime;
+};
+
+// Summary of one stored snapshot, read from its record header
+struct SnapshotInfo
+{
+    long long time = 0;
+    bool keyframe = false;
+    unsigned long long pathCount = 0; // dictionary size after this snapshot
+    unsigned long long pathBytes = 0; // length of paths.dat after this snapshot
+    unsigned long long files = 0;
+    unsigned long long bytes = 0;
+    unsigned long long offset = 0;    // payload position in snapshots.dat
+    unsigned long long length = 0;    // payload length
+};
+
+// Scan history kept in a directory. paths.dat is an append-only, front-coded dictionary that
+// gives every path ever seen a stable id. snapshots.dat is a log of checksummed records, each
+// holding the files removed, added or changed since the previous snapshot: ids ascending and
+// gap coded, sizes as varints, mtimes zigzag coded against the previous entry. Every
+// KEYFRAME_INTERVAL-th record is a full snapshot, so loading one never replays more records
+// than that. Unchanged files cost nothing, which keeps daily scans cheap to keep for months.
+class SnapshotHistory
+{
+public:
+    static constexpr size_t KEYFRAME_INTERVAL = 32;
+
+    explicit SnapshotHistory(std::string directory) : directory_(std::move(directory)) {}
+
+    // Function to read the snapshot index and path dictionary, creating the history if needed.
+    // A torn record or dictionary tail left by an interrupted append is cut off.
+    bool open(std::string &error)
+    {
+        std::error_code ec;
+        fs::create_directories(directory_, ec);
+        std::string log;
+        if (!readWholeFile(logPath(), log, error))
+        {
+            return false;
+        }
+        if (log.empty())
+        {
+            log = LOG_MAGIC;
+            if (!appendToFile(logPath(), log, error))
+            {
+                return false;
+            }
+        }
+        if (log.compare(0, LOG_MAGIC.size(), LOG_MAGIC) != 0)
+        {
+            error = logPath() + " is not a snapshot history";
+            return false;
+        }
+
+        const auto *base = reinterpret_cast<const unsigned char *>(log.data());
+        const unsigned char *p = base + LOG_MAGIC.size();
+        const unsigned char *end = base + log.size();
+        unsigned long long validEnd = p - base;
+        while (p < end)
+        {
+            unsigned long long length;
+            if (!getVarint(p, end, length) || length > static_cast<unsigned long long>(end - p) ||
+                static_cast<unsigned long long>(end - p) - length < 4)
+            {
+                break;
+            }
+            uint32_t stored;
+            std::memcpy(&stored, p + length, 4);
+            if (stored != recordChecksum(p, length))
+            {
+                break;
+            }
+            SnapshotInfo info;
+            info.offset = p - base;
+            info.length = length;
+            const unsigned char *field = p;
+            unsigned long long keyframe, time;
+            if (!getVarint(field, p + length, keyframe) || !getVarint(field, p + length, time) ||
+                !getVarint(field, p + length, info.pathCount) || !getVarint(field, p + length, info.pathBytes) ||
+                !getVarint(field, p + length, info.files) || !getVarint(field, p + length, info.bytes))
+            {
+                break;
+            }
+            info.keyframe = keyframe != 0;
+            info.time = zigzagDecode(time);
+            snapshots_.push_back(info);
+            p += length + 4;
+            validEnd = p - base;
+        }
+        if (validEnd < log.size())
+        {
+            fs::resize_file(logPath(), validEnd, ec);
+        }
+        log_ = std::move(log);
+        log_.resize(validEnd);
+
+        std::string dictionary;
+        if (!readWholeFile(dictionaryPath(), dictionary, error))
+        {
+            return false;
+        }
+        const unsigned long long pathBytes = snapshots_.empty() ? 0 : snapshots_.back().pathBytes;
+        const unsigned long long pathCount = snapshots_.empty() ? 0 : snapshots_.back().pathCount;
+        if (dictionary.size() < pathBytes)
+        {
+            error = dictionaryPath() + " is shorter than the snapshot log expects";
+            return false;
+        }
+        if (dictionary.size() > pathBytes)
+        {
+            fs::resize_file(dictionaryPath(), pathBytes, ec);
+            dictionary.resize(pathBytes);
+        }
+        p = reinterpret_cast<const unsigned char *>(dictionary.data());
+        end = p + dictionary.size();
+        std::string previous;
+        while (p < end)
+        {
+            unsigned long long shared, suffix;
+            if (!getVarint(p, end, shared) || !getVarint(p, end, suffix) || shared > previous.size() ||
+                suffix > static_cast<unsigned long long>(end - p))
+            {
+                error = dictionaryPath() + " is corrupt";
+                return false;
+            }
+            previous.resize(shared);
+            previous.append(reinterpret_cast<const char *>(p), suffix);
+            p += suffix;
+            ids_.emplace(previous, static_cast<uint32_t>(paths_.size()));
+            paths_.push_back(previous);
+        }
+        if (paths_.size() != pathCount)
+        {
+            error = dictionaryPath() + " does not match the snapshot log";
+            return false;
+        }
+        return true;
+    }
+
+    const std::vector<SnapshotInfo> &snapshots() const { return snapshots_; }
+    const std::string &path(uint32_t id) const { return paths_[id]; }
+
+    // Function to rebuild snapshot index from the nearest keyframe at or before it
+    std::vector<SnapshotEntry> load(size_t index) const
+    {
+        size_t first = index;
+        while (!snapshots_[first].keyframe)
+        {
+            --first;
+        }
+        std::vector<SnapshotEntry> entries;
+        for (size_t i = first; i <= index; ++i)
+        {
+            entries = applyDelta(entries, snapshots_[i]);
+        }
+        return entries;
+    }
+
+    // Function to store a catalog as the next snapshot, returns its summary
+    bool append(const Catalog &catalog, long long time, SnapshotInfo &info, unsigned long long &changed,
+                unsigned long long &removed, std::string &error)
+    {
+        // Assign ids to new paths; they are appended to the dictionary in sorted order so the
+        // front coding shares long prefixes
+        std::vector<std::pair<std::string, size_t>> newPaths;
+        std::vector<SnapshotEntry> current;
+        current.reserve(catalog.rows());
+        std::vector<size_t> pending;
+        for (size_t row = 0; row < catalog.rows(); ++row)
+        {
+            std::string path = catalog.path(row);
+            auto it = ids_.find(path);
+            if (it != ids_.end())
+            {
+                current.push_back({it->second, catalog.size[row], catalog.mtime[row]});
+            }
+            else
+            {
+                pending.push_back(current.size());
+                current.push_back({0, catalog.size[row], catalog.mtime[row]});
+                newPaths.emplace_back(std::move(path), pending.size() - 1);
+            }
+        }
+        std::sort(newPaths.begin(), newPaths.end());
+        std::string dictionaryTail;
+        std::string previous = paths_.empty() ? std::string() : paths_.back();
+        for (auto &[path, slot] : newPaths)
+        {
+            auto [it, inserted] = ids_.emplace(path, static_cast<uint32_t>(paths_.size()));
+            current[pending[slot]].id = it->second;
+            if (!inserted)
+            {
+                continue; // the same path under two overlapping roots
+            }
+            size_t shared = 0;
+            while (shared < previous.size() && shared < path.size() && previous[shared] == path[shared])
+            {
+                ++shared;
+            }
+            putVarint(dictionaryTail, shared);
+            putVarint(dictionaryTail, path.size() - shared);
+            dictionaryTail.append(path, shared, std::string::npos);
+            paths_.push_back(path);
+            previous = path;
+        }
+        std::sort(current.begin(), current.end(), [](const SnapshotEntry &a, const SnapshotEntry &b)
+                  { return a.id < b.id; });
+        current.erase(std::unique(current.begin(), current.end(), [](const SnapshotEntry &a, const SnapshotEntry &b)
+                                  { return a.id == b.id; }),
+                      current.end());
+
+        info = SnapshotInfo();
+        info.time = time;
+        info.keyframe = snapshots_.size() % KEYFRAME_INTERVAL == 0;
+        info.pathCount = paths_.size();
+        info.pathBytes = (snapshots_.empty() ? 0 : snapshots_.back().pathBytes) + dictionaryTail.size();
+        for (const auto &entry : current)
+        {
+            ++info.files;
+            info.bytes += entry.size;
+        }
+
+        std::vector<uint32_t> removedIds;
+        std::vector<SnapshotEntry> changedEntries;
+        if (info.keyframe)
+        {
+            changedEntries = current;
+        }
+        else
+        {
+            const std::vector<SnapshotEntry> before = load(snapshots_.size() - 1);
+            size_t b = 0;
+            for (const auto &entry : current)
+            {
+                while (b < before.size() && before[b].id < entry.id)
+                {
+                    removedIds.push_back(before[b++].id);
+                }
+                if (b < before.size() && before[b].id == entry.id)
+                {
+                    if (before[b].size != entry.size || before[b].mtime != entry.mtime)
+                    {
+                        changedEntries.push_back(entry);
+                    }
+                    ++b;
+                }
+                else
+                {
+                    changedEntries.push_back(entry);
+                }
+            }
+            for (; b < before.size(); ++b)
+            {
+                removedIds.push_back(before[b].id);
+            }
+        }
+        changed = changedEntries.size();
+        removed = removedIds.size();
+
+        std::string payload;
+        putVarint(payload, info.keyframe ? 1 : 0);
+        putVarint(payload, zigzagEncode(info.time));
+        putVarint(payload, info.pathCount);
+        putVarint(payload, info.pathBytes);
+        putVarint(payload, info.files);
+        putVarint(payload, info.bytes);
+        putVarint(payload, removedIds.size());
+        uint32_t lastId = 0;
+        for (uint32_t id : removedIds)
+        {
+            putVarint(payload, id - lastId);
+            lastId = id;
+        }
+        putVarint(payload, changedEntries.size());
+        lastId = 0;
+        long long lastMtime = 0;
+        for (const auto &entry : changedEntries)
+        {
+            putVarint(payload, entry.id - lastId);
+            putVarint(payload, entry.size);
+            putVarint(payload, zigzagEncode(entry.mtime - lastMtime));
+            lastId = entry.id;
+            lastMtime = entry.mtime;
+        }
+
+        std::string record;
+        putVarint(record, payload.size());
+        info.offset = log_.size() + record.size();
+        info.length = payload.size();
+        record += payload;
+        const uint32_t sum = recordChecksum(reinterpret_cast<const unsigned char *>(payload.data()), payload.size());
+        record.append(reinterpret_cast<const char *>(&sum), 4);
+
+        // The dictionary is made durable before the record that refers to it
+        if (!appendToFile(dictionaryPath(), dictionaryTail, error) || !appendToFile(logPath(), record, error))
+        {
+            return false;
+        }
+        log_ += record;
+        snapshots_.push_back(info);
+        return true;
+    }
+
+private:
+    inline static const std::string LOG_MAGIC = "DMSNAP1\n";
+
+    std::string logPath() const { return directory_ + "/snapshots.dat"; }
+    std::string dictionaryPath() const { return directory_ + "/paths.dat"; }
+
+    // Function to read a history file; only a missing file counts as a new, empty one
+    static bool readWholeFile(const std::string &path, std::string &contents, std::string &error)
+    {
+        contents.clear();
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == ENOENT)
+            {
+                return true; // not created yet
+            }
+            error = "cannot open " + path + ": " + std::strerror(errno);
+            return false;
+        }
+        char buffer[1 << 16];
+        ssize_t got;
+        while ((got = ::read(fd, buffer, sizeof(buffer))) != 0)
+        {
+            if (got < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (got < 0)
+            {
+                error = "cannot read " + path + ": " + std::strerror(errno);
+                ::close(fd);
+                return false;
+            }
+            contents.append(buffer, static_cast<size_t>(got));
+        }
+        ::close(fd);
+        return true;
+    }
+
+    static bool appendToFile(const std::string &path, const std::string &data, std::string &error)
+    {
+        const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            error = "cannot open " + path + ": " + std::strerror(errno);
+            return false;
+        }
+        size_t done = 0;
+        while (done < data.size())
+        {
+            const ssize_t written = ::write(fd, data.data() + done, data.size() - done);
+            if (written < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (written < 0)
+            {
+                error = "cannot write " + path + ": " + std::strerror(errno);
+                ::close(fd);
+                return false;
+            }
+            done += written;
+        }
+        const bool synced = ::fsync(fd) == 0;
+        ::close(fd);
+        if (!synced)
+        {
+            error = "cannot sync " + path + ": " + std::strerror(errno);
+        }
+        return synced;
+    }
+
+    // Function to apply one record to the state of the previous snapshot
+    std::vector<SnapshotEntry> applyDelta(const std::vector<SnapshotEntry> &before, const SnapshotInfo &info) const
+    {
+        const auto *p = reinterpret_cast<const unsigned char *>(log_.data()) + info.offset;
+        const unsigned char *end = p + info.length;
+        unsigned long long value;
+        for (int header = 0; header < 6; ++header)
+        {
+            getVarint(p, end, value);
+        }
+        unsigned long long removedCount = 0;
+        getVarint(p, end, removedCount);
+        std::vector<uint32_t> removedIds;
+        removedIds.reserve(removedCount);
+        unsigned long long id = 0;
+        for (unsigned long long i = 0; i < removedCount && getVarint(p, end, value); ++i)
+        {
+            id += value;
+            removedIds.push_back(static_cast<uint32_t>(id));
+        }
+        unsigned long long changedCount = 0;
+        getVarint(p, end, changedCount);
+        std::vector<SnapshotEntry> changedEntries;
+        changedEntries.reserve(changedCount);
+        id = 0;
+        long long mtime = 0;
+        for (unsigned long long i = 0; i < changedCount; ++i)
+        {
+            unsigned long long gap, size, mtimeDelta;
+            if (!getVarint(p, end, gap) || !getVarint(p, end, size) || !getVarint(p, end, mtimeDelta))
+            {
+                break;
+            }
+            id += gap;
+            mtime += zigzagDecode(mtimeDelta);
+            changedEntries.push_back({static_cast<uint32_t>(id), size, mtime});
+        }
+        if (info.keyframe)
+        {
+            return changedEntries;
+        }
+
+        // Three-way merge of the previous state, removals and changes, all sorted by id
+        std::vector<SnapshotEntry> after;
+        after.reserve(before.size() + changedEntries.size());
+        size_t r = 0, c = 0;
+        for (const auto &entry : before)
+        {
+            while (c < changedEntries.size() && changedEntries[c].id < entry.id)
+            {
+                after.push_back(changedEntries[c++]);
+            }
+            while (r < removedIds.size() && removedIds[r] < entry.id)
+            {
+                ++r;
+            }
+            if (c < changedEntries.size() && changedEntries[c].id == entry.id)
+            {
+                after.push_back(changedEntries[c++]);
+            }
+            else if (r == removedIds.size() || removedIds[r] != entry.id)
+            {
+                after.push_back(entry);
+            }
+        }
+        after.insert(after.end(), changedEntries.begin() + c, changedEntries.end());
+        return after;
+    }
+
+    std::string directory_;
+    std::string log_;
+    std::vector<SnapshotInfo> snapshots_;
+    std::vector<std::string> paths_;
+    std::unordered_map<std::string, uint32_t> ids_;
+};
+
+// Function to put the group a path falls in (parent directory, type, extension or "all")
+// into key; QueryGroup::None groups by directory
+void groupKeyOf(std::string_view path, QueryGroup groupBy, std::string &key)
+{
+    const size_t slash = path.rfind('/');
+    if (groupBy == QueryGroup::All)
+    {
+        key = "all";
+    }
+    else if (groupBy == QueryGroup::Type || groupBy == QueryGroup::Extension)
+    {
+        lowercaseInto(extensionOf(path.substr(slash == std::string_view::npos ? 0 : slash + 1)), key);
+        if (groupBy == QueryGroup::Type)
+        {
+            key = getFileTypeName(categorizeExtension(key));
+        }
+    }
+    else
+    {
+        key.assign(path.data(), slash == std::string_view::npos ? 0 : std::max<size_t>(slash, 1));
+    }
+}
+
+// Size change of one directory, type or extension between two snapshots
+struct GrowthRow
+{
+    std::string group;
+    unsigned long long bytesBefore = 0;
+    unsigned long long bytesAfter = 0;
+    unsigned long long filesBefore = 0;
+    unsigned long long filesAfter = 0;
+
+    long long growth() const { return static_cast<long long>(bytesAfter) - static_cast<long long>(bytesBefore); }
+};
+
+// Function to compare two snapshots of a history grouped by parent directory, type or
+// extension; rows come back fastest growing first
+std::vector<GrowthRow> computeGrowth(const SnapshotHistory &history, const std::vector<SnapshotEntry> &before,
+                                     const std::vector<SnapshotEntry> &after, QueryGroup groupBy)
+{
+    std::vector<GrowthRow> rows;
+    std::unordered_map<std::string, size_t> rowOf;
+    std::string key;
+    auto rowFor = [&](uint32_t id) -> GrowthRow &
+    {
+        groupKeyOf(history.path(id), groupBy, key);
+        auto [it, inserted] = rowOf.try_emplace(key, rows.size());
+        if (inserted)
+        {
+            rows.emplace_back();
+            rows.back().group = key;
+        }
+        return rows[it->second];
+    };
+    for (const auto &entry : before)
+    {
+        GrowthRow &row = rowFor(entry.id);
+        row.bytesBefore += entry.size;
+        ++row.filesBefore;
+    }
+    for (const auto &entry : after)
+    {
+        GrowthRow &row = rowFor(entry.id);
+        row.bytesAfter += entry.size;
+        ++row.filesAfter;
+    }
+    std::sort(rows.begin(), rows.end(), [](const GrowthRow &a, const GrowthRow &b)
+              { return a.growth() > b.growth(); });
+    return rows;
+}
+
+// Content-defined chunker in the style of FastCDC. A Gear rolling hash (h = 2h + gear[byte])
+// only remembers the last 64 bytes, so hashing starts 64 bytes before the minimum chunk size
+// instead of at the chunk start. Cut points are tested on the high bits of h, with a
+// stricter mask before the average size and a looser one after it, which narrows the chunk
+// size distribution (normalized chunking).
+class GearChunker
+{
+public:
+    explicit GearChunker(size_t averageSize)
+    {
+        int bits = 0;
+        while ((size_t(2) << bits) <= averageSize)
+        {
+            ++bits;
+        }
+        averageSize_ = size_t(1) << bits;
+        minSize_ = averageSize_ / 4;
+        maxSize_ = averageSize_ * 8;
+        strictMask_ = ~0ULL << (64 - (bits + 1));
+        looseMask_ = ~0ULL << (64 - (bits - 1));
+    }
+
+    size_t maxSize() const { return maxSize_; }
+
+    // Function to return the length of the chunk starting at data; available bytes are
+    // length, and last says no more data follows them. Returns 0 when more data is needed.
+    size_t cut(const uint8_t *data, size_t length, bool last) const
+    {
+        if (length <= minSize_)
+        {
+            return last ? length : 0;
+        }
+        // Without the final bytes only whole 4-byte steps are scanned, so cut points never
+        // depend on where a read happened to end
+        const size_t limit = std::min(last ? length : length & ~size_t(3), maxSize_);
+        const size_t normal = std::min(limit, averageSize_);
+        size_t i = minSize_ - 64;
+        uint64_t h = 0;
+        for (; i < minSize_; i += 4)
+        {
+            h = (h << 4) + (gear_[3][data[i]] + gear_[2][data[i + 1]]) + (gear_[1][data[i + 2]] + gear_[0][data[i + 3]]);
+        }
+        if (scan(data, i, normal, strictMask_, h) || scan(data, i, limit, looseMask_, h))
+        {
+            return i;
+        }
+        return last || limit == maxSize_ ? limit : 0;
+    }
+
+private:
+    // Function to advance the hash from i towards end; on a cut point leaves i just past it.
+    // Four bytes per step: with gear_[k] = gear << k the next hash is h << 4 plus two
+    // independent sums, which keeps the serial dependency chain to three operations. The
+    // intermediate values are the byte-wise hashes scaled by 8, 4 and 2; their high bits are
+    // tested like the final one's.
+    bool scan(const uint8_t *data, size_t &i, size_t end, uint64_t mask, uint64_t &h) const
+    {
+        for (; i + 4 <= end; i += 4)
+        {
+            const uint64_t base = h << 4;
+            const uint64_t a = gear_[3][data[i]];
+            const uint64_t b = gear_[2][data[i + 1]];
+            const uint64_t c = gear_[1][data[i + 2]];
+            const uint64_t next = base + (a + b) + (c + gear_[0][data[i + 3]]);
+            const uint64_t x1 = base + a;
+            const uint64_t x2 = x1 + b;
+            const uint64_t x3 = x2 + c;
+            if (!(x1 & mask) | !(x2 & mask) | !(x3 & mask) | !(next & mask))
+            {
+                i += !(x1 & mask) ? 1 : !(x2 & mask) ? 2 : !(x3 & mask) ? 3 : 4;
+                return true;
+            }
+            h = next;
+        }
+        while (i < end)
+        {
+            h = (h << 1) + gear_[0][data[i++]];
+            if (!(h & mask))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static std::array<std::array<uint64_t, 256>, 4> makeGear()
+    {
+        std::array<std::array<uint64_t, 256>, 4> tables{};
+        uint64_t state = 0x6765617243444331ULL;
+        for (size_t byte = 0; byte < 256; ++byte)
+        {
+            uint64_t z = (state += 0x9e3779b97f4a7c15ULL); // splitmix64
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            z ^= z >> 31;
+            for (unsigned shift = 0; shift < 4; ++shift)
+            {
+                tables[shift][byte] = z << shift;
+            }
+        }
+        return tables;
+    }
+
+    const std::array<std::array<uint64_t, 256>, 4> gear_ = makeGear();
+    size_t averageSize_;
+    size_t minSize_;
+    size_t maxSize_;
+    uint64_t strictMask_;
+    uint64_t looseMask_;
+};
+
+// Fingerprint and length of one chunk
+struct ChunkRef
+{
+    uint64_t fingerprint;
+    uint32_t length;
+};
+
+// Function to split a file into content-defined chunks. The file streams through a buffer;
+// the unfinished tail is moved to the front before the next read so every chunk is
+// contiguous when it is fingerprinted. Returns 0, or the errno of the failed open or read.
+int chunkFile(const std::string &path, const GearChunker &chunker, CachePolicy policy, Throttle *throttle,
+               std::vector<uint8_t> &buffer, std::vector<ChunkRef> &chunks)
+{
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return errno;
+    }
+    const bool dropPages = policy != CachePolicy::Buffered;
+    if (dropPages)
+    {
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    buffer.resize(std::max<size_t>(HASH_READ_SIZE * 4, chunker.maxSize() * 2));
+    size_t filled = 0;
+    bool eof = false;
+    int error = 0;
+    off_t offset = 0;
+    off_t droppedUpTo = 0;
+    chunks.clear();
+    while (!eof || filled > 0)
+    {
+        while (!eof && filled < buffer.size())
+        {
+            ssize_t got;
+            {
+                SampledTimer timer(Metric::ReadNs, 0);
+                got = ::read(fd, buffer.data() + filled, buffer.size() - filled);
+            }
+            if (got < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (got <= 0)
+            {
+                error = got < 0 ? errno : 0;
+                eof = true;
+                break;
+            }
+            filled += got;
+            offset += got;
+            countMetric(Metric::BytesRead, got);
+            if (throttle)
+            {
+                throttle->acquireBytes(got);
+            }
+        }
+        if (error != 0)
+        {
+            break;
+        }
+        size_t start = 0;
+        SampledTimer timer(Metric::HashNs, 0);
+        while (start < filled)
+        {
+            const size_t length = chunker.cut(buffer.data() + start, filled - start, eof);
+            if (length == 0)
+            {
+                break;
+            }
+            chunks.push_back({xxh64::hash(buffer.data() + start, length), static_cast<uint32_t>(length)});
+            start += length;
+        }
+        countMetric(Metric::BytesHashed, start);
+        std::memmove(buffer.data(), buffer.data() + start, filled - start);
+        filled -= start;
+        if (dropPages && offset - droppedUpTo >= DONTNEED_WINDOW)
+        {
+            ::posix_fadvise(fd, droppedUpTo, offset - droppedUpTo, POSIX_FADV_DONTNEED);
+            droppedUpTo = offset;
+        }
+    }
+    if (dropPages)
+    {
+        ::posix_fadvise(fd, droppedUpTo, 0, POSIX_FADV_DONTNEED);
+    }
+    ::close(fd);
+    return error;
+}
+
+// Open-addressing set of chunk fingerprints, 16 bytes per chunk. Each slot remembers the
+// first file the chunk was seen in, which tells repeats within a file from repeats across files.
+class ChunkIndex
+{
+public:
+    ChunkIndex() : slots_(1 << 16) {}
+
+    size_t size() const { return used_; }
+    unsigned long long uniqueBytes() const { return uniqueBytes_; }
+
+    // Function to add a chunk seen in file; returns the file that first held it, or -1 if new
+    long long insert(const ChunkRef &chunk, uint32_t file)
+    {
+        if ((used_ + 1) * 10 > slots_.size() * 7)
+        {
+            grow();
+        }
+        Slot &slot = find(chunk);
+        if (slot.owner != 0)
+        {
+            return static_cast<long long>(slot.owner) - 1;
+        }
+        slot = {chunk.fingerprint, chunk.length, file + 1};
+        ++used_;
+        uniqueBytes_ += chunk.length;
+        return -1;
+    }
+
+private:
+    struct Slot
+    {
+        uint64_t fingerprint = 0;
+        uint32_t length = 0;
+        uint32_t owner = 0; // first file + 1, 0 marks an empty slot
+    };
+
+    Slot &find(const ChunkRef &chunk)
+    {
+        const size_t mask = slots_.size() - 1;
+        for (size_t i = chunk.fingerprint & mask;; i = (i + 1) & mask)
+        {
+            Slot &slot = slots_[i];
+            if (slot.owner == 0 || (slot.fingerprint == chunk.fingerprint && slot.length == chunk.length))
+            {
+                return slot;
+            }
+        }
+    }
+
+    void grow()
+    {
+        std::vector<Slot> old(slots_.size() * 2);
+        old.swap(slots_);
+        for (const Slot &slot : old)
+        {
+            if (slot.owner != 0)
+            {
+                find({slot.fingerprint, slot.length}) = slot;
+            }
+        }
+    }
+
+    std::vector<Slot> slots_;
+    size_t used_ = 0;
+    unsigned long long uniqueBytes_ = 0;
+};
+
+// Block-level dedupe estimate for one group of files
+struct ChunkGroupStats
+{
+    std::string group;
+    unsigned long long files = 0;
+    unsigned long long bytes = 0;
+    unsigned long long redundantBytes = 0; // bytes whose chunk was already stored
+    unsigned long long crossFileBytes = 0; // ... first stored by another file
+};
+
+// Function to estimate how many bytes block-level dedupe would reclaim under the roots.
+// Files are chunked and fingerprinted in parallel in batches; each batch is then added to the
+// chunk index in scan order, so which copy counts as redundant does not depend on timing.
+// Returns the per-group rows (largest redundancy first) and fills total.
+std::vector<ChunkGroupStats> estimateChunkDedupe(const std::vector<fs::path> &rootPaths, size_t averageChunk,
+                                                 QueryGroup groupBy, ErrorTable &errors,
+                                                 const DuplicateScanOptions &options, ChunkGroupStats &total,
+                                                 unsigned long long &uniqueChunks)
+{
+    std::vector<std::pair<std::string, unsigned long long>> files;
+    {
+        MetricsPhase phase("traversal");
+        for (const auto &root : rootPaths)
+        {
+            scanTree(root, [&](const ScanEntry &entry)
+                     { files.emplace_back(std::string(entry.path), entry.size); },
+                     errors, options.scanOptions);
+        }
+    }
+
+    const GearChunker chunker(averageChunk);
+    ChunkIndex index;
+    std::vector<ChunkGroupStats> groups;
+    std::unordered_map<std::string, size_t> groupOf;
+    std::string key;
+    total = ChunkGroupStats();
+    total.group = "total";
+
+    MetricsPhase phase("chunking");
+    Throttle *throttle = options.scanOptions.throttle;
+    ScanControl *control = options.scanOptions.control;
+    const unsigned workers = options.workers ? options.workers : std::max(1u, std::thread::hardware_concurrency());
+    const unsigned poolSize = throttle ? throttle->poolSize(workers) : workers;
+    const unsigned long long BATCH_BYTES = 4ULL << 30;
+    const size_t BATCH_FILES = 1024;
+    std::vector<std::vector<ChunkRef>> results;
+    std::vector<int> failed; // errno per file of the batch, 0 when chunked, -1 when a stop left it unread
+    countMetric(Metric::HashQueue, files.size());
+    for (size_t first = 0; first < files.size();)
+    {
+        size_t last = first;
+        unsigned long long batchBytes = 0;
+        while (last < files.size() && last - first < BATCH_FILES && (last == first || batchBytes < BATCH_BYTES))
+        {
+            batchBytes += files[last++].second;
+        }
+        results.resize(last - first);
+        failed.assign(last - first, -1);
+        std::atomic<size_t> next{first};
+        auto worker = [&](unsigned workerIndex)
+        {
+            std::vector<uint8_t> buffer;
+            auto finished = [&] { return next.load() >= last || (control && control->stopped()); };
+            while (!throttle || throttle->admitWorker(workerIndex, workers, finished))
+            {
+                if (control && !control->proceed())
+                {
+                    break;
+                }
+                const size_t i = next.fetch_add(1);
+                if (i >= last)
+                {
+                    break;
+                }
+                failed[i - first] = chunkFile(files[i].first, chunker, options.cachePolicy, throttle, buffer, results[i - first]);
+                countMetric(Metric::HashQueue, -1ULL);
+            }
+        };
+        std::vector<std::thread> pool;
+        for (unsigned w = 1; w < poolSize && w < last - first; ++w)
+        {
+            pool.emplace_back(worker, w);
+        }
+        worker(0);
+        for (auto &thread : pool)
+        {
+            thread.join();
+        }
+
+        for (size_t i = first; i < last; ++i)
+        {
+            if (failed[i - first] != 0)
+            {
+                if (failed[i - first] > 0)
+                {
+                    errors.record(files[i].first, failed[i - first], ScanOp::Read);
+                }
+                continue;
+            }
+            groupKeyOf(files[i].first, groupBy, key);
+            auto [it, inserted] = groupOf.try_emplace(key, groups.size());
+            if (inserted)
+            {
+                groups.emplace_back();
+                groups.back().group = key;
+            }
+            ChunkGroupStats &group = groups[it->second];
+            ++group.files;
+            for (const ChunkRef &chunk : results[i - first])
+            {
+                group.bytes += chunk.length;
+                const long long owner = index.insert(chunk, static_cast<uint32_t>(i));
+                if (owner >= 0)
+                {
+                    group.redundantBytes += chunk.length;
+                    if (owner != static_cast<long long>(i))
+                    {
+                        group.crossFileBytes += chunk.length;
+                    }
+                }
+            }
+            results[i - first] = std::vector<ChunkRef>();
+        }
+        first = last;
+    }
+
+    for (const auto &group : groups)
+    {
+        total.files += group.files;
+        total.bytes += group.bytes;
+        total.redundantBytes += group.redundantBytes;
+        total.crossFileBytes += group.crossFileBytes;
+    }
+    uniqueChunks = index.size();
+    std::sort(groups.begin(), groups.end(), [](const ChunkGroupStats &a, const ChunkGroupStats &b)
+              { return a.redundantBytes > b.redundantBytes; });
+    return groups;
+}
+
+const size_t COMPRESS_BLOCK = 64 << 10;   // bytes read and compressed per sampled block
+const unsigned COMPRESS_MIN_SAMPLES = 8;  // per extension, so rare extensions get bounds too
+const unsigned long long COMPRESS_MIN_BUDGET = 64; // blocks read in all, however low the sample rate
+
+// Function to count the bytes an LZ4-style compressor would turn a block into, without
+// writing them: greedy matches of at least 4 bytes within 64 KiB, found through a 4096-entry
+// hash of the last position of each 4-byte sequence, skipping ahead faster the longer no
+// match turns up, and LZ4's costs per sequence (token, length bytes, literals, 2-byte
+// offset). zstd adds an entropy stage and saves more, so this is a floor for zstd archives.
+size_t lzCompressedSize(const uint8_t *data, size_t length, std::vector<uint32_t> &table)
+{
+    const size_t MIN_MATCH = 4;
+    const size_t LAST_LITERALS = 5; // a block ends with at least 5 literals
+    const size_t MATCH_LIMIT = 12;  // ... and no match starts in its last 12 bytes
+    auto lengthBytes = [](size_t n) -> size_t { return n >= 15 ? (n - 15) / 255 + 1 : 0; };
+    auto read32 = [data](size_t i)
+    {
+        uint32_t value;
+        std::memcpy(&value, data + i, sizeof(value));
+        return value;
+    };
+
+    table.assign(4096, 0);
+    size_t out = 0;
+    size_t anchor = 0;
+    if (length > MATCH_LIMIT)
+    {
+        size_t position = 0;
+        unsigned misses = 0;
+        while (position < length - MATCH_LIMIT)
+        {
+            const uint32_t sequence = read32(position);
+            uint32_t &slot = table[(sequence * 2654435761u) >> 20];
+            const size_t candidate = slot; // position + 1, 0 for none
+            slot = static_cast<uint32_t>(position + 1);
+            if (candidate == 0 || position - (candidate - 1) > 65535 || read32(candidate - 1) != sequence)
+            {
+                position += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+            size_t matchLength = MIN_MATCH;
+            while (position + matchLength < length - LAST_LITERALS && data[candidate - 1 + matchLength] == data[position + matchLength])
+            {
+                ++matchLength;
+            }
+            const size_t literals = position - anchor;
+            out += 1 + lengthBytes(literals) + literals + 2 + lengthBytes(matchLength - MIN_MATCH);
+            position += matchLength;
+            anchor = position;
+        }
+    }
+    const size_t literals = length - anchor;
+    return out + 1 + lengthBytes(literals) + literals;
+}
+
+// Sampled estimate of what compression would save in one group of files
+struct CompressionGroupStats
+{
+    enum class Kind
+    {
+        Total,
+        Type,
+        Directory,
+    };
+
+    Kind kind = Kind::Total;
+    std::string group;
+    unsigned long long files = 0;
+    unsigned long long bytes = 0;
+    unsigned long long sampledBytes = 0;
+    double savedBytes = 0;    // estimate
+    double variance = 0;      // of savedBytes
+    double unsampledBytes = 0; // bytes no sample says anything about; widen the upper bound
+};
+
+// Function to estimate what compressing the files under the roots would save, per file type
+// and top-level directory, from a small sample of blocks. At most sampleRate of the 64 KiB
+// blocks are read (or COMPRESS_MIN_BUDGET blocks if that is more). Every extension is a stratum
+// that first gets up to COMPRESS_MIN_SAMPLES of them, fewer when that would exceed the budget,
+// and the rest of the budget is shared out in proportion to size; a stratum given all its
+// blocks is read in full, and one given none is left unsampled. The blocks of a stratum are picked systematically along its files in scan
+// order from a random start, so the sample is also spread over the directories, and a block
+// is picked with probability proportional to its length. The saved share of each sampled
+// block, scaled by the stratum's bytes, is then an unbiased estimate of the stratum's savings,
+// and its sample variance gives the error bounds; a type or directory is a domain summed over
+// the strata. Blocks are read and compressed by a worker pool, one file at a time per worker.
+// Returns the total, then the types and directories, each largest savings first.
+std::vector<CompressionGroupStats> estimateCompression(const std::vector<fs::path> &rootPaths, double sampleRate, uint64_t seed,
+                                                       ErrorTable &errors, const DuplicateScanOptions &options,
+                                                       unsigned long long &blocksRead)
+{
+    struct CandidateFile
+    {
+        std::string path;
+        unsigned long long size;
+        uint32_t stratum;   // extension
+        uint32_t directory; // top-level directory
+    };
+    struct Stratum
+    {
+        std::string extension;
+        FileType type;
+        unsigned long long bytes = 0;
+        unsigned long long blocks = 0;
+        std::vector<uint32_t> files;
+        bool exhaustive = false; // every block is read
+    };
+    struct Sample
+    {
+        uint32_t file;
+        uint32_t length; // bytes read, 0 when the block could not be read
+        unsigned long long offset;
+        size_t compressed;
+    };
+
+    // Groups: the total, one per FileType, then one per top-level directory
+    const size_t TYPE_GROUPS = static_cast<size_t>(FileType::Document) + 1;
+    std::vector<CompressionGroupStats> groups(1 + TYPE_GROUPS);
+    groups[0].group = "total";
+    for (size_t type = 0; type < TYPE_GROUPS; ++type)
+    {
+        groups[1 + type].kind = CompressionGroupStats::Kind::Type;
+        groups[1 + type].group = getFileTypeName(static_cast<FileType>(type));
+    }
+
+    std::vector<CandidateFile> files;
+    std::vector<Stratum> strata;
+    std::unordered_map<std::string, uint32_t> stratumOf;
+    std::unordered_map<std::string, uint32_t> directoryOf;
+    std::unordered_map<uint64_t, unsigned long long> cellBytes; // (stratum, directory) -> bytes
+    {
+        MetricsPhase phase("traversal");
+        std::string extension;
+        for (const auto &rootPath : rootPaths)
+        {
+            std::string root = rootPath.string();
+            while (root.size() > 1 && root.back() == '/')
+            {
+                root.pop_back();
+            }
+            scanTree(root, [&](const ScanEntry &entry)
+                     {
+                         if (entry.size == 0)
+                         {
+                             return;
+                         }
+                         lowercaseInto(extensionOf(entry.name), extension);
+                         auto [stratum, newStratum] = stratumOf.try_emplace(extension, static_cast<uint32_t>(strata.size()));
+                         if (newStratum)
+                         {
+                             strata.emplace_back();
+                             strata.back().extension = extension;
+                             strata.back().type = categorizeExtension(extension);
+                         }
+
+                         auto [directory, newDirectory] = directoryOf.try_emplace(std::string(topLevelGroup(root, entry.path)), static_cast<uint32_t>(groups.size()));
+                         if (newDirectory)
+                         {
+                             groups.emplace_back();
+                             groups.back().kind = CompressionGroupStats::Kind::Directory;
+                             groups.back().group = directory->first;
+                         }
+
+                         Stratum &target = strata[stratum->second];
+                         target.bytes += entry.size;
+                         target.blocks += (entry.size + COMPRESS_BLOCK - 1) / COMPRESS_BLOCK;
+                         target.files.push_back(static_cast<uint32_t>(files.size()));
+                         cellBytes[(static_cast<uint64_t>(stratum->second) << 32) | directory->second] += entry.size;
+                         for (size_t group : {size_t(0), 1 + static_cast<size_t>(target.type), static_cast<size_t>(directory->second)})
+                         {
+                             ++groups[group].files;
+                             groups[group].bytes += entry.size;
+                         }
+                         files.push_back({std::string(entry.path), entry.size, stratum->second, directory->second});
+                     },
+                     errors, options.scanOptions);
+        }
+    }
+
+    // Share the block budget: floors first, lowered until they fit, then the rest by bytes. The
+    // budget is counted in whole blocks so that the bytes read stay within sampleRate.
+    unsigned long long totalBlocks = 0, totalBytes = 0;
+    for (const auto &stratum : strata)
+    {
+        totalBlocks += stratum.blocks;
+        totalBytes += stratum.bytes;
+    }
+    const unsigned long long budget = std::min(
+        totalBlocks, std::max(static_cast<unsigned long long>(sampleRate * totalBytes / COMPRESS_BLOCK), COMPRESS_MIN_BUDGET));
+    unsigned long long minimum = COMPRESS_MIN_SAMPLES;
+    auto floorsFor = [&](unsigned long long perStratum)
+    {
+        unsigned long long total = 0;
+        for (const auto &stratum : strata)
+        {
+            total += std::min(perStratum, stratum.blocks);
+        }
+        return total;
+    };
+    while (minimum > 0 && floorsFor(minimum) > budget)
+    {
+        --minimum;
+    }
+    const double spare = static_cast<double>(budget - floorsFor(minimum));
+    std::vector<unsigned long long> wantedOf(strata.size());
+    for (size_t h = 0; h < strata.size(); ++h)
+    {
+        const unsigned long long share = static_cast<unsigned long long>(spare * strata[h].bytes / totalBytes);
+        wantedOf[h] = std::min(strata[h].blocks, std::min(minimum, strata[h].blocks) + share);
+    }
+
+    // Pick the blocks of every stratum
+    std::vector<Sample> samples;
+    uint64_t random = mix64(seed);
+    for (size_t h = 0; h < strata.size(); ++h)
+    {
+        Stratum &stratum = strata[h];
+        const unsigned long long wanted = wantedOf[h];
+        if (wanted == 0)
+        {
+            continue; // the budget ran out before this extension
+        }
+        if (wanted >= stratum.blocks)
+        {
+            stratum.exhaustive = true;
+            for (uint32_t file : stratum.files)
+            {
+                for (unsigned long long offset = 0; offset < files[file].size; offset += COMPRESS_BLOCK)
+                {
+                    samples.push_back({file, 0, offset, 0});
+                }
+            }
+            continue;
+        }
+        const double step = static_cast<double>(stratum.bytes) / wanted;
+        random = mix64(random + 0x9e3779b97f4a7c15ULL);
+        double point = step * (static_cast<double>(random >> 11) * 0x1.0p-53);
+        size_t member = 0;
+        unsigned long long fileStart = 0;
+        for (unsigned long long k = 0; k < wanted; ++k, point += step)
+        {
+            const unsigned long long target = std::min(static_cast<unsigned long long>(point), stratum.bytes - 1);
+            while (fileStart + files[stratum.files[member]].size <= target)
+            {
+                fileStart += files[stratum.files[member++]].size;
+            }
+            samples.push_back({stratum.files[member], 0, (target - fileStart) / COMPRESS_BLOCK * COMPRESS_BLOCK, 0});
+        }
+    }
+    std::sort(samples.begin(), samples.end(), [](const Sample &a, const Sample &b)
+              { return a.file != b.file ? a.file < b.file : a.offset < b.offset; });
+
+    // One task per file: its samples are read in offset order through one descriptor
+    std::vector<size_t> taskStart;
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+        if (i == 0 || samples[i].file != samples[i - 1].file)
+        {
+            taskStart.push_back(i);
+        }
+    }
+    taskStart.push_back(samples.size());
+    std::vector<int> failed(taskStart.size() - 1, 0);
+    {
+        MetricsPhase phase("compression");
+        Throttle *throttle = options.scanOptions.throttle;
+        ScanControl *control = options.scanOptions.control;
+        const unsigned workers = options.workers ? options.workers : std::max(1u, std::thread::hardware_concurrency());
+        const unsigned poolSize = throttle ? throttle->poolSize(workers) : workers;
+        std::atomic<size_t> next{0};
+        const size_t tasks = failed.size();
+        auto worker = [&](unsigned workerIndex)
+        {
+            std::vector<uint8_t> buffer(COMPRESS_BLOCK);
+            std::vector<uint32_t> table;
+            auto finished = [&] { return next.load() >= tasks || (control && control->stopped()); };
+            while (!throttle || throttle->admitWorker(workerIndex, workers, finished))
+            {
+                if (control && !control->proceed())
+                {
+                    break;
+                }
+                const size_t task = next.fetch_add(1);
+                if (task >= tasks)
+                {
+                    break;
+                }
+                const CandidateFile &file = files[samples[taskStart[task]].file];
+                const int fd = ::open(file.path.c_str(), O_RDONLY | O_CLOEXEC);
+                if (fd < 0)
+                {
+                    failed[task] = errno;
+                    continue;
+                }
+                for (size_t i = taskStart[task]; i < taskStart[task + 1]; ++i)
+                {
+                    Sample &sample = samples[i];
+                    const off_t offset = static_cast<off_t>(sample.offset);
+                    const bool dropPages = options.cachePolicy != CachePolicy::Buffered && !isMostlyCached(fd, file.size, offset);
+                    const size_t wanted = static_cast<size_t>(std::min<unsigned long long>(COMPRESS_BLOCK, file.size - sample.offset));
+                    size_t filled = 0;
+                    while (filled < wanted)
+                    {
+                        ssize_t got;
+                        {
+                            SampledTimer timer(Metric::ReadNs, 0);
+                            got = ::pread(fd, buffer.data() + filled, wanted - filled, offset + static_cast<off_t>(filled));
+                        }
+                        if (got < 0 && errno == EINTR)
+                        {
+                            continue;
+                        }
+                        if (got <= 0)
+                        {
+                            failed[task] = got < 0 ? errno : 0;
+                            break;
+                        }
+                        filled += static_cast<size_t>(got);
+                        countMetric(Metric::BytesRead, got);
+                        if (throttle)
+                        {
+                            throttle->acquireBytes(got);
+                        }
+                    }
+                    if (dropPages)
+                    {
+                        ::posix_fadvise(fd, offset, static_cast<off_t>(filled), POSIX_FADV_DONTNEED);
+                    }
+                    // A file that shrank since the scan is sampled as far as it still goes
+                    sample.length = static_cast<uint32_t>(filled);
+                    sample.compressed = filled ? lzCompressedSize(buffer.data(), filled, table) : 0;
+                }
+                ::close(fd);
+            }
+        };
+        std::vector<std::thread> pool;
+        for (unsigned w = 1; w < poolSize && w < tasks; ++w)
+        {
+            pool.emplace_back(worker, w);
+        }
+        worker(0);
+        for (auto &thread : pool)
+        {
+            thread.join();
+        }
+    }
+    for (size_t task = 0; task + 1 < taskStart.size(); ++task)
+    {
+        if (failed[task] > 0)
+        {
+            errors.record(files[samples[taskStart[task]].file].path, failed[task], ScanOp::Read);
+        }
+    }
+
+    // Estimate every group stratum by stratum from the blocks that were read
+    std::vector<std::vector<const Sample *>> byStratum(strata.size());
+    blocksRead = 0;
+    for (const Sample &sample : samples)
+    {
+        if (sample.length > 0)
+        {
+            byStratum[files[sample.file].stratum].push_back(&sample);
+            ++blocksRead;
+        }
+    }
+    struct DomainSums
+    {
+        double saved = 0;   // exhaustive strata: saved bytes; sampled: sum of saved shares
+        double squares = 0; // sampled strata: sum of squared saved shares
+        unsigned long long sampledBytes = 0;
+    };
+    std::vector<std::vector<std::pair<uint32_t, unsigned long long>>> cells(strata.size());
+    for (const auto &[cell, bytes] : cellBytes)
+    {
+        cells[cell >> 32].emplace_back(static_cast<uint32_t>(cell), bytes);
+    }
+    std::unordered_map<uint32_t, DomainSums> domains;
+    for (uint32_t h = 0; h < strata.size(); ++h)
+    {
+        const Stratum &stratum = strata[h];
+        const auto &read = byStratum[h];
+        domains.clear();
+        unsigned long long readBytes = 0;
+        for (const Sample *sample : read)
+        {
+            const double saved = static_cast<double>(sample->length) - std::min<double>(sample->compressed, sample->length);
+            const double value = stratum.exhaustive ? saved : saved / sample->length;
+            const uint32_t directory = files[sample->file].directory;
+            for (uint32_t group : {0u, 1u + static_cast<uint32_t>(stratum.type), directory})
+            {
+                DomainSums &sums = domains[group];
+                sums.saved += value;
+                sums.squares += value * value;
+                sums.sampledBytes += sample->length;
+            }
+            readBytes += sample->length;
+        }
+
+        const double n = static_cast<double>(read.size());
+        const double populationBytes = static_cast<double>(stratum.bytes);
+        const double finite = stratum.exhaustive ? 0.0 : std::max(0.0, 1.0 - n / stratum.blocks);
+        auto addDomain = [&](uint32_t group, double domainBytes)
+        {
+            CompressionGroupStats &row = groups[group];
+            const auto it = domains.find(group);
+            if (it == domains.end())
+            {
+                // Nothing was read here, so the stratum's share of this group is unknown
+                row.unsampledBytes += domainBytes;
+                return;
+            }
+            const DomainSums &sums = it->second;
+            row.sampledBytes += sums.sampledBytes;
+            if (stratum.exhaustive)
+            {
+                // Blocks that failed to read are assumed to compress like the rest
+                row.savedBytes += sums.saved * populationBytes / static_cast<double>(readBytes);
+                return;
+            }
+            const double mean = sums.saved / n;
+            // With one block the spread is unknown; a share lies in [0, 1], so 0.25 bounds it
+            const double spread = n > 1 ? std::max(0.0, (sums.squares - n * mean * mean) / (n - 1)) : 0.25;
+            row.savedBytes += populationBytes * mean;
+            row.variance += populationBytes * populationBytes * spread / n * finite;
+        };
+        addDomain(0, populationBytes);
+        addDomain(1 + static_cast<uint32_t>(stratum.type), populationBytes);
+        for (const auto &[directory, bytes] : cells[h])
+        {
+            addDomain(directory, static_cast<double>(bytes));
+        }
+    }
+
+    std::vector<CompressionGroupStats> result;
+    result.push_back(std::move(groups[0]));
+    auto bySavings = [](const CompressionGroupStats &a, const CompressionGroupStats &b)
+    { return a.savedBytes > b.savedBytes; };
+    const auto firstDirectory = groups.begin() + static_cast<std::ptrdiff_t>(1 + TYPE_GROUPS);
+    std::sort(groups.begin() + 1, firstDirectory, bySavings);
+    std::sort(firstDirectory, groups.end(), bySavings);
+    for (auto it = groups.begin() + 1; it != groups.end(); ++it)
+    {
+        if (it->files > 0)
+        {
+            result.push_back(std::move(*it));
+        }
+    }
+    return result;
+}
+
+// Randomized estimate of where the space under a set of roots goes, for volumes too large to
+// crawl. Each top-level directory is a stratum sampled with Knuth's tree-size estimator: a
+// walk descends from the stratum root picking one subdirectory per level with probability p,
+// and every directory on the path contributes its own files weighted by the product of 1/p
+// along the way, which is an unbiased estimate of the whole subtree. Descents are importance
+// weighted: half of p is uniform over the children and half follows what earlier walks
+// learned about each child's size, so large subtrees are visited more often while no child's
+// probability gets close to zero. Listings are cached, and a subtree whose directories have
+// all been listed is complete: walks substitute its exact total, so the estimates converge on
+// the exact answer as walks, or a full scan running alongside them, cover the tree.
+class TreeEstimator
+{
+public:
+    // Components of every total: bytes per FileType, files per FileType, then all files and bytes
+    static const size_t TYPES = 4;
+    static const size_t FILES = 2 * TYPES;
+    static const size_t BYTES = 2 * TYPES + 1;
+    static const size_t COMPONENTS = 2 * TYPES + 2;
+    using Totals = std::array<double, COMPONENTS>;
+
+    // Estimate with a 95% confidence half-width for every component
+    struct Estimate
+    {
+        std::string group;
+        Totals value{};
+        Totals halfWidth{};
+        unsigned long long walks = 0;
+        bool exact = false;
+    };
+
+    TreeEstimator(const std::vector<fs::path> &roots, const ScanOptions &options) : options_(options)
+    {
+        for (const auto &root : roots)
+        {
+            std::string path = root.string();
+            while (path.size() > 1 && path.back() == '/')
+            {
+                path.pop_back();
+            }
+            struct stat st;
+            const int statResult = ::stat(path.c_str(), &st);
+            if (statResult != 0 || !S_ISDIR(st.st_mode))
+            {
+                errors_.record(path, statResult != 0 ? errno : ENOTDIR, ScanOp::Stat);
+                continue;
+            }
+            const uint32_t id = addNode(path, NONE, options.rules ? options.rules->start(path) : ScanRules::Cursor(), st.st_dev);
+            tops_.push_back(id);
+            list(id);
+            for (uint32_t child : nodes_[id].children)
+            {
+                strata_.push_back({child, {}, {}, 0});
+            }
+        }
+    }
+
+    ErrorTable takeErrors()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return std::move(errors_);
+    }
+
+    bool complete() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (uint32_t top : tops_)
+        {
+            if (!nodes_[top].complete)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Function to run one walk in the stratum that most needs it; false once all are exact
+    bool sample(uint64_t &random)
+    {
+        size_t stratum;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stratum = pickStratum();
+        }
+        if (stratum == NONE)
+        {
+            return false;
+        }
+
+        struct Step
+        {
+            uint32_t node;
+            uint32_t choice; // index of the child descended into, NONE at the last step
+            double multiplier;
+            double contribution; // bytes
+        };
+        std::vector<Step> steps;
+        Totals estimate{};
+        uint32_t node = strata_[stratum].root;
+        double multiplier = 1.0;
+        while (true)
+        {
+            ensureListed(node);
+            std::lock_guard<std::mutex> lock(mutex_);
+            const Node &current = nodes_[node];
+            const Totals &values = current.complete ? current.total : current.own;
+            for (size_t c = 0; c < COMPONENTS; ++c)
+            {
+                estimate[c] += multiplier * values[c];
+            }
+            steps.push_back({node, NONE, multiplier, multiplier * values[BYTES]});
+            if (current.complete || current.children.empty())
+            {
+                break;
+            }
+
+            const size_t count = current.children.size();
+            double learned = 0.0;
+            for (size_t i = 0; i < count; ++i)
+            {
+                learned += childWeight(current, i);
+            }
+            random += 0x9e3779b97f4a7c15ULL;
+            const double u = (mix64(random) >> 11) * (1.0 / 9007199254740992.0);
+            double cumulative = 0.0;
+            size_t choice = count - 1;
+            double probability = 0.0;
+            for (size_t i = 0; i < count; ++i)
+            {
+                probability = 0.5 / count + (learned > 0 ? 0.5 * childWeight(current, i) / learned : 0.5 / count);
+                cumulative += probability;
+                if (u < cumulative)
+                {
+                    choice = i;
+                    break;
+                }
+            }
+            steps.back().choice = static_cast<uint32_t>(choice);
+            multiplier /= probability;
+            node = current.children[choice];
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        // Every step's suffix sum, rescaled, estimates the subtree below it; it teaches the
+        // parent how large that child is
+        double below = 0.0;
+        for (size_t i = steps.size(); i-- > 0;)
+        {
+            below += steps[i].contribution;
+            if (i > 0)
+            {
+                Node &parent = nodes_[steps[i - 1].node];
+                const uint32_t choice = steps[i - 1].choice;
+                const double subtree = below / steps[i].multiplier;
+                parent.childSamples[choice] += 1;
+                parent.childEstimate[choice] += (subtree - parent.childEstimate[choice]) / parent.childSamples[choice];
+            }
+        }
+        Stratum &target = strata_[stratum];
+        ++target.walks;
+        for (size_t c = 0; c < COMPONENTS; ++c)
+        {
+            const double delta = estimate[c] - target.mean[c];
+            target.mean[c] += delta / target.walks;
+            target.m2[c] += delta * (estimate[c] - target.mean[c]);
+        }
+        return true;
+    }
+
+    // Function to list one directory that no walk has reached yet, depth first so subtrees
+    // complete early; false when every directory is listed
+    bool scanNext()
+    {
+        uint32_t node = NONE;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            while (!unlisted_.empty() && node == NONE)
+            {
+                const uint32_t candidate = unlisted_.back();
+                unlisted_.pop_back();
+                if (nodes_[candidate].state == State::Unlisted)
+                {
+                    node = candidate;
+                }
+            }
+        }
+        if (node == NONE)
+        {
+            return false;
+        }
+        ensureListed(node);
+        return true;
+    }
+
+    // Function to combine the strata into totals, per-type and per-directory estimates
+    std::vector<Estimate> report() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Estimate total;
+        total.group = "total";
+        total.exact = true;
+        Totals variance{};
+        for (uint32_t top : tops_)
+        {
+            for (size_t c = 0; c < COMPONENTS; ++c)
+            {
+                total.value[c] += nodes_[top].own[c];
+            }
+        }
+        std::vector<Estimate> directories;
+        for (const Stratum &stratum : strata_)
+        {
+            Estimate row;
+            row.group = nodes_[stratum.root].path;
+            row.walks = stratum.walks;
+            const Node &root = nodes_[stratum.root];
+            row.exact = root.complete;
+            for (size_t c = 0; c < COMPONENTS; ++c)
+            {
+                double rowVariance = 0.0;
+                if (root.complete)
+                {
+                    row.value[c] = root.total[c];
+                }
+                else if (stratum.walks == 0)
+                {
+                    row.value[c] = 0.0;
+                    rowVariance = std::numeric_limits<double>::infinity();
+                }
+                else
+                {
+                    row.value[c] = stratum.mean[c];
+                    rowVariance = walkVariance(stratum, c) / stratum.walks;
+                }
+                row.halfWidth[c] = 1.96 * std::sqrt(rowVariance);
+                total.value[c] += row.value[c];
+                variance[c] += rowVariance;
+            }
+            total.walks += stratum.walks;
+            total.exact = total.exact && row.exact;
+            directories.push_back(row);
+        }
+        for (size_t c = 0; c < COMPONENTS; ++c)
+        {
+            total.halfWidth[c] = 1.96 * std::sqrt(variance[c]);
+        }
+
+        std::vector<Estimate> rows{total};
+        for (size_t type = 0; type < TYPES; ++type)
+        {
+            Estimate row;
+            row.group = std::string("type:") + getFileTypeName(static_cast<FileType>(type));
+            row.walks = total.walks;
+            row.exact = total.exact;
+            row.value[BYTES] = total.value[type];
+            row.halfWidth[BYTES] = total.halfWidth[type];
+            row.value[FILES] = total.value[TYPES + type];
+            row.halfWidth[FILES] = total.halfWidth[TYPES + type];
+            if (row.value[BYTES] > 0 || !row.exact)
+            {
+                rows.push_back(row);
+            }
+        }
+        std::sort(directories.begin(), directories.end(), [](const Estimate &a, const Estimate &b)
+                  { return a.value[BYTES] > b.value[BYTES]; });
+        rows.insert(rows.end(), directories.begin(), directories.end());
+        return rows;
+    }
+
+private:
+    static const uint32_t NONE = ~0u;
+
+    enum class State : uint8_t
+    {
+        Unlisted,
+        Listing,
+        Listed
+    };
+
+    struct Node
+    {
+        std::string path;
+        uint32_t parent;
+        dev_t rootDevice;
+        ScanRules::Cursor cursor;
+        State state = State::Unlisted;
+        bool complete = false;
+        Totals own{};
+        Totals total{}; // exact subtree totals once complete
+        std::vector<uint32_t> children;
+        std::vector<double> childEstimate; // bytes below each child, learned from walks
+        std::vector<uint32_t> childSamples;
+        size_t pendingChildren = 0;
+    };
+
+    struct Stratum
+    {
+        uint32_t root;
+        Totals mean;
+        Totals m2;
+        unsigned long long walks;
+    };
+
+    uint32_t addNode(const std::string &path, uint32_t parent, ScanRules::Cursor cursor, dev_t rootDevice)
+    {
+        nodes_.emplace_back();
+        Node &node = nodes_.back();
+        node.path = path;
+        node.parent = parent;
+        node.rootDevice = rootDevice;
+        node.cursor = std::move(cursor);
+        const uint32_t id = static_cast<uint32_t>(nodes_.size() - 1);
+        unlisted_.push_back(id);
+        return id;
+    }
+
+    // Function to return the variance of one walk's estimate. A few walks that all missed
+    // the big subtree look deceptively consistent, so the sample variance is shrunk towards a
+    // prior of PRIOR_WALKS walks spread as widely as the mean itself.
+    static double walkVariance(const Stratum &stratum, size_t c)
+    {
+        const double PRIOR_WALKS = 2.0;
+        return (stratum.m2[c] + PRIOR_WALKS * stratum.mean[c] * stratum.mean[c]) / (stratum.walks - 1 + PRIOR_WALKS);
+    }
+
+    double childWeight(const Node &node, size_t i) const
+    {
+        const Node &child = nodes_[node.children[i]];
+        return child.complete ? child.total[BYTES] : node.childEstimate[i];
+    }
+
+    // Function to pick the stratum whose next walk shrinks the total variance most; strata
+    // with fewer than two walks come first. A stratum whose walks all missed its large
+    // subtree looks small and certain, so every fourth walk goes to the least sampled stratum
+    // instead. Returns NONE when all strata are complete.
+    size_t pickStratum()
+    {
+        const bool explore = ++picks_ % 4 == 0;
+        size_t best = NONE;
+        double bestScore = -std::numeric_limits<double>::infinity();
+        for (size_t s = 0; s < strata_.size(); ++s)
+        {
+            const Stratum &stratum = strata_[s];
+            if (nodes_[stratum.root].complete)
+            {
+                continue;
+            }
+            double score;
+            if (explore)
+            {
+                score = -static_cast<double>(stratum.walks);
+            }
+            else if (stratum.walks < 2)
+            {
+                score = std::numeric_limits<double>::max() - stratum.walks;
+            }
+            else
+            {
+                score = walkVariance(stratum, BYTES) / (stratum.walks * (stratum.walks + 1.0));
+            }
+            if (score > bestScore)
+            {
+                bestScore = score;
+                best = s;
+            }
+        }
+        return best;
+    }
+
+    // Function to make sure a directory is listed, waiting if another thread is listing it
+    void ensureListed(uint32_t id)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (nodes_[id].state == State::Listed)
+        {
+            return;
+        }
+        if (nodes_[id].state == State::Listing)
+        {
+            listed_.wait(lock, [&] { return nodes_[id].state == State::Listed; });
+            return;
+        }
+        nodes_[id].state = State::Listing;
+        lock.unlock();
+        list(id);
+    }
+
+    // Function to read one directory: its files' sizes by type and its subdirectories
+    void list(uint32_t id)
+    {
+        std::string path;
+        dev_t rootDevice;
+        ScanRules::Cursor cursor;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            nodes_[id].state = State::Listing;
+            path = nodes_[id].path;
+            rootDevice = nodes_[id].rootDevice;
+            cursor = nodes_[id].cursor;
+        }
+        const ScanRules *rules = options_.rules;
+        Totals own{};
+        std::vector<std::pair<std::string, ScanRules::Cursor>> subdirs;
+        ErrorTable failures;
+        if (options_.throttle)
+        {
+            options_.throttle->acquireMetadata();
+        }
+        const int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        DIR *dir = fd >= 0 ? ::fdopendir(fd) : nullptr;
+        struct stat st;
+        if (dir != nullptr && options_.oneFileSystem && ::fstat(fd, &st) == 0 && st.st_dev != rootDevice)
+        {
+            ::closedir(dir);
+            dir = nullptr;
+        }
+        else if (dir == nullptr)
+        {
+            const int error = errno;
+            if (fd >= 0)
+            {
+                ::close(fd);
+            }
+            failures.record(path, error, ScanOp::OpenDir);
+        }
+        if (dir != nullptr)
+        {
+            countMetric(Metric::Directories);
+            std::string extension;
+            ScanRules::Cursor child;
+            while (dirent *de = ::readdir(dir))
+            {
+                const char *name = de->d_name;
+                if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                {
+                    continue;
+                }
+                const size_t length = std::strlen(name);
+                bool isDirectory = de->d_type == DT_DIR;
+                if (!isDirectory && de->d_type != DT_REG && de->d_type != DT_UNKNOWN)
+                {
+                    continue;
+                }
+                if (!isDirectory)
+                {
+                    if (rules && de->d_type == DT_REG && !rules->acceptsName(cursor, name, length))
+                    {
+                        continue;
+                    }
+                    if (options_.throttle)
+                    {
+                        options_.throttle->acquireMetadata();
+                    }
+                    struct statx stx;
+                    if (const int error = statEntry(fd, name, stx); error != 0)
+                    {
+                        failures.record(path + '/' + name, error, ScanOp::Stat);
+                        continue;
+                    }
+                    isDirectory = S_ISDIR(stx.stx_mode);
+                    if (!isDirectory)
+                    {
+                        if (!S_ISREG(stx.stx_mode) ||
+                            (rules && ((de->d_type == DT_UNKNOWN && !rules->acceptsName(cursor, name, length)) ||
+                                       !rules->acceptsStat(stx.stx_size, static_cast<long long>(stx.stx_mtime.tv_sec)))))
+                        {
+                            continue;
+                        }
+                        countMetric(Metric::Files);
+                        lowercaseInto(extensionOf(std::string_view(name, length)), extension);
+                        const size_t type = static_cast<size_t>(categorizeExtension(extension));
+                        own[type] += static_cast<double>(stx.stx_size);
+                        own[TYPES + type] += 1;
+                        own[FILES] += 1;
+                        own[BYTES] += static_cast<double>(stx.stx_size);
+                        continue;
+                    }
+                }
+                if (rules && !rules->enterDirectory(cursor, name, length, child, options_.oneFileSystem, rootDevice))
+                {
+                    countMetric(Metric::Pruned);
+                    continue;
+                }
+                subdirs.emplace_back(name, rules ? child : ScanRules::Cursor());
+            }
+            ::closedir(dir);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!failures.empty())
+        {
+            errors_.merge(failures);
+        }
+        std::vector<uint32_t> children;
+        children.reserve(subdirs.size());
+        for (auto &[name, childCursor] : subdirs)
+        {
+            children.push_back(addNode(path == "/" ? "/" + name : path + '/' + name, id, std::move(childCursor), rootDevice));
+        }
+        Node &node = nodes_[id];
+        node.own = own;
+        node.children = std::move(children);
+        node.childEstimate.assign(node.children.size(), 0.0);
+        node.childSamples.assign(node.children.size(), 0);
+        node.pendingChildren = node.children.size();
+        node.state = State::Listed;
+        if (node.pendingChildren == 0)
+        {
+            markComplete(id);
+        }
+        listed_.notify_all();
+    }
+
+    // Function to record that every directory below id is listed, and pass it up the tree
+    void markComplete(uint32_t id)
+    {
+        while (id != NONE)
+        {
+            Node &node = nodes_[id];
+            node.complete = true;
+            node.total = node.own;
+            for (uint32_t child : node.children)
+            {
+                for (size_t c = 0; c < COMPONENTS; ++c)
+                {
+                    node.total[c] += nodes_[child].total[c];
+                }
+            }
+            node.cursor = ScanRules::Cursor();
+            id = node.parent;
+            if (id == NONE || --nodes_[id].pendingChildren != 0 || nodes_[id].state != State::Listed)
+            {
+                break;
+            }
+        }
+    }
+
+    ScanOptions options_;
+    mutable std::mutex mutex_;
+    std::condition_variable listed_;
+    std::deque<Node> nodes_;
+    std::vector<uint32_t> tops_;
+    std::vector<Stratum> strata_;
+    std::vector<uint32_t> unlisted_; // stack for the full scan
+    unsigned long long picks_ = 0;
+    ErrorTable errors_;
+};
+
+// Axes of the cold-data heat map. File sizes are bucketed by powers of 16; ages, in days since a
+// file was last touched, at the thresholds people ask about. The age edges from 7 days up are
+// also the "not touched in N days" rollup columns of the cold report.
+constexpr unsigned long long COLD_SIZE_EDGES[] = {4ULL << 10, 64ULL << 10, 1ULL << 20, 16ULL << 20, 256ULL << 20, 4ULL << 30};
+constexpr long long COLD_AGE_DAYS[] = {1, 7, 30, 90, 180, 365, 730};
+constexpr size_t COLD_SIZE_BUCKETS = std::size(COLD_SIZE_EDGES) + 1;
+constexpr size_t COLD_AGE_BUCKETS = std::size(COLD_AGE_DAYS) + 1;
+constexpr const char *COLD_SIZE_LABELS[COLD_SIZE_BUCKETS] = {"<4K", "4K-64K", "64K-1M", "1M-16M", "16M-256M", "256M-4G", ">=4G"};
+constexpr const char *COLD_AGE_LABELS[COLD_AGE_BUCKETS] = {"<1d", "1d-7d", "7d-30d", "30d-90d", "90d-180d", "180d-1y", "1y-2y", ">=2y"};
+
+// Which timestamp counts as the last touch of a file. Touch is the later of atime and mtime:
+// noatime and relatime mounts can leave atime behind the last write.
+enum class AgeBy
+{
+    Touch,
+    Access,
+    Modify,
+    Change,
+};
+
+struct ColdCell
+{
+    unsigned long long files = 0;
+    unsigned long long bytes = 0;
+    unsigned long long allocated = 0;
+};
+
+// A directory of the cold report: its own files while scanning, its whole subtree after rollUp()
+struct ColdDirectory
+{
+    unsigned long long files = 0;
+    unsigned long long bytes = 0;
+    unsigned long long allocated = 0;
+    unsigned long long coldFiles = 0;
+    unsigned long long coldBytes = 0; // not touched within the cold threshold
+    unsigned long long coldAllocated = 0;
+    long long lastTouch = 0;          // newest touch of any file below
+    unsigned long long ageBytes[COLD_AGE_BUCKETS] = {};
+};
+
+// Accumulates the cold-data report from the scan's own stat results, so it costs no extra
+// system call: per directory bytes by age bucket and cold bytes, and a size x age heat map of
+// bytes per --group-by group. Directories only hold their own files until rollUp() adds each
+// of them into its ancestors.
+class ColdDataReport
+{
+public:
+    ColdDataReport(long long now, long long coldDays, AgeBy ageBy, QueryGroup heatmapGroup)
+        : now_(now), coldSeconds_(coldDays * 86400), ageBy_(ageBy), heatmapGroup_(heatmapGroup)
+    {
+    }
+
+    // Function to start the files of another root; heat map directories are its top-level directories
+    void beginRoot(const std::string &root)
+    {
+        root_ = root;
+        while (root_.size() > 1 && root_.back() == '/')
+        {
+            root_.pop_back();
+        }
+        roots_.push_back(root_);
+        parents_.reset();
+    }
+
+    void add(const ScanEntry &entry)
+    {
+        long long touched = entry.atime;
+        switch (ageBy_)
+        {
+        case AgeBy::Touch:
+            touched = std::max(entry.atime, entry.mtime);
+            break;
+        case AgeBy::Modify:
+            touched = entry.mtime;
+            break;
+        case AgeBy::Change:
+            touched = entry.ctime;
+            break;
+        default:
+            break;
+        }
+        const long long idleDays = std::max(now_ - touched, 0LL) / 86400;
+        const size_t ageBucket = std::upper_bound(std::begin(COLD_AGE_DAYS), std::end(COLD_AGE_DAYS), idleDays) - std::begin(COLD_AGE_DAYS);
+        const bool cold = now_ - touched >= coldSeconds_;
+
+        ColdDirectory &directory = *parents_.get(entry, [this](std::string_view parent) { return &directories_[std::string(parent)]; });
+        ++directory.files;
+        directory.bytes += entry.size;
+        directory.allocated += entry.allocated;
+        directory.coldFiles += cold;
+        directory.coldBytes += cold ? entry.size : 0;
+        directory.coldAllocated += cold ? entry.allocated : 0;
+        directory.lastTouch = std::max(directory.lastTouch, touched);
+        directory.ageBytes[ageBucket] += entry.size;
+
+        if (heatmapGroup_ != QueryGroup::None)
+        {
+            const size_t sizeBucket = std::upper_bound(std::begin(COLD_SIZE_EDGES), std::end(COLD_SIZE_EDGES), entry.size) - std::begin(COLD_SIZE_EDGES);
+            ColdCell &cell = heatmapRow(entry)[sizeBucket * COLD_AGE_BUCKETS + ageBucket];
+            ++cell.files;
+            cell.bytes += entry.size;
+            cell.allocated += entry.allocated;
+        }
+    }
+
+    // Function to add every directory into its ancestors up to its root, once the scan is done
+    void rollUp()
+    {
+        std::vector<std::pair<std::string, ColdDirectory>> own(directories_.begin(), directories_.end());
+        for (const auto &[path, totals] : own)
+        {
+            std::string ancestor = path;
+            while (!isRoot(ancestor))
+            {
+                const size_t slash = ancestor.rfind('/');
+                if (slash == std::string::npos)
+                {
+                    break;
+                }
+                ancestor.resize(slash == 0 ? 1 : slash);
+                ColdDirectory &target = directories_[ancestor];
+                target.files += totals.files;
+                target.bytes += totals.bytes;
+                target.allocated += totals.allocated;
+                target.coldFiles += totals.coldFiles;
+                target.coldBytes += totals.coldBytes;
+                target.coldAllocated += totals.coldAllocated;
+                target.lastTouch = std::max(target.lastTouch, totals.lastTouch);
+                for (size_t bucket = 0; bucket < COLD_AGE_BUCKETS; ++bucket)
+                {
+                    target.ageBytes[bucket] += totals.ageBytes[bucket];
+                }
+            }
+        }
+        parents_.reset();
+    }
+
+    const std::vector<std::string> &roots() const { return roots_; }
+
+    const ColdDirectory *directory(const std::string &path) const
+    {
+        auto it = directories_.find(path);
+        return it == directories_.end() ? nullptr : &it->second;
+    }
+
+    // Function to rank the largest cold subtrees: directories below the roots whose cold share
+    // reaches minShare and that are not inside another such directory, most cold bytes first
+    std::vector<std::pair<std::string, const ColdDirectory *>> coldSubtrees(double minShare) const
+    {
+        std::vector<std::pair<std::string, const ColdDirectory *>> candidates;
+        for (const auto &[path, totals] : directories_)
+        {
+            if (totals.coldBytes > 0 && static_cast<double>(totals.coldBytes) >= minShare * static_cast<double>(totals.bytes) &&
+                !isRoot(path))
+            {
+                candidates.emplace_back(path, &totals);
+            }
+        }
+        // Shorter paths first, so an ancestor is always chosen before its descendants are looked at
+        std::sort(candidates.begin(), candidates.end(), [](const auto &a, const auto &b)
+                  { return a.first.size() < b.first.size(); });
+        std::unordered_set<std::string> chosen;
+        std::vector<std::pair<std::string, const ColdDirectory *>> subtrees;
+        for (auto &candidate : candidates)
+        {
+            bool nested = false;
+            std::string ancestor = candidate.first;
+            while (!nested && !isRoot(ancestor) && ancestor.size() > 1)
+            {
+                const size_t slash = ancestor.rfind('/');
+                ancestor.resize(slash == 0 ? 1 : slash);
+                nested = chosen.count(ancestor) != 0;
+            }
+            if (!nested)
+            {
+                chosen.insert(candidate.first);
+                subtrees.push_back(std::move(candidate));
+            }
+        }
+        std::sort(subtrees.begin(), subtrees.end(), [](const auto &a, const auto &b)
+                  { return a.second->coldBytes > b.second->coldBytes; });
+        return subtrees;
+    }
+
+    // Heat map rows per group, the group with the most bytes first
+    std::vector<std::pair<std::string, const std::vector<ColdCell> *>> heatmap() const
+    {
+        std::vector<std::pair<std::string, const std::vector<ColdCell> *>> rows;
+        for (const auto &[group, cells] : heatmap_)
+        {
+            rows.emplace_back(group, &cells);
+        }
+        auto total = [](const std::vector<ColdCell> &cells)
+        {
+            unsigned long long sum = 0;
+            for (const auto &cell : cells)
+            {
+                sum += cell.bytes;
+            }
+            return sum;
+        };
+        std::sort(rows.begin(), rows.end(), [&](const auto &a, const auto &b)
+                  { return total(*a.second) > total(*b.second); });
+        return rows;
+    }
+
+private:
+    bool isRoot(const std::string &path) const
+    {
+        return std::find(roots_.begin(), roots_.end(), path) != roots_.end();
+    }
+
+    std::vector<ColdCell> &heatmapRow(const ScanEntry &entry)
+    {
+        switch (heatmapGroup_)
+        {
+        case QueryGroup::Type:
+            lowercaseInto(extensionOf(entry.name), group_);
+            group_ = getFileTypeName(categorizeExtension(group_));
+            break;
+        case QueryGroup::Extension:
+            lowercaseInto(extensionOf(entry.name), group_);
+            break;
+        case QueryGroup::Directory:
+        {
+            const std::string_view group = topLevelGroup(root_, entry.path);
+            group_.assign(group.data(), group.size());
+            break;
+        }
+        default:
+            group_ = "all";
+            break;
+        }
+        auto [it, inserted] = heatmap_.try_emplace(group_);
+        if (inserted)
+        {
+            it->second.resize(COLD_SIZE_BUCKETS * COLD_AGE_BUCKETS);
+        }
+        return it->second;
+    }
+
+    long long now_;
+    long long coldSeconds_;
+    AgeBy ageBy_;
+    QueryGroup heatmapGroup_;
+    std::string root_;
+    std::vector<std::string> roots_;
+    std::unordered_map<std::string, ColdDirectory> directories_;
+    ParentCache<ColdDirectory *> parents_; // pointers stay valid: unordered_map never moves its elements
+    std::unordered_map<std::string, std::vector<ColdCell>> heatmap_;
+    std::string group_;
+};
+
+// Parameters for the synthetic tree generator used by gen-tree and bench
+struct TreeSpec
+{
+    unsigned long long seed = 1;
+    unsigned depth = 3;         // directory levels below the root
+    unsigned fanout = 4;        // subdirectories per directory
+    unsigned filesPerDir = 16;
+    unsigned long long minSize = 1024;
+    unsigned long long maxSize = 1024 * 1024; // sizes are log-uniform in [minSize, maxSize]
+    std::vector<std::pair<std::string, unsigned>> extensions = {
+        {".txt", 4}, {".log", 2}, {".jpg", 2}, {".mp4", 1}, {".docx", 1}};
+    double duplicateRatio = 0.1; // fraction of files that copy an earlier file's content
+    double hardLinkRatio = 0.02; // fraction of files that are hard links to an earlier file
+};
+
+// splitmix64: small, fast and identical on every platform, unlike the std distributions
+struct SplitMix64
+{
+    unsigned long long state;
+
+    explicit SplitMix64(unsigned long long seed) : state(seed) {}
+
+    unsigned long long next()
+    {
+        unsigned long long z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    double nextDouble() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+};
+
+// Function to parse "ext:weight,ext:weight" into an extension mix
+bool parseExtensionMix(const std::string &text, std::vector<std::pair<std::string, unsigned>> &mix)
+{
+    mix.clear();
+    size_t start = 0;
+    while (start < text.size())
+    {
+        size_t end = text.find(',', start);
+        if (end == std::string::npos)
+        {
+            end = text.size();
+        }
+        const std::string item = text.substr(start, end - start);
+        const size_t colon = item.find(':');
+        std::string extension = item.substr(0, colon);
+        unsigned weight = 1;
+        if (colon != std::string::npos)
+        {
+            const char *first = item.data() + colon + 1;
+            if (std::from_chars(first, item.data() + item.size(), weight).ec != std::errc())
+            {
+                return false;
+            }
+        }
+        if (!extension.empty() && extension[0] != '.')
+        {
+            extension.insert(extension.begin(), '.');
+        }
+        mix.emplace_back(extension, weight);
+        start = end + 1;
+    }
+    return !mix.empty();
+}
+
+// Options shared by all batch subcommands
+struct BatchOptions
+{
+    std::string command;
+    ReportWriter::Format format = ReportWriter::Format::Ndjson;
+    std::string outputPath;
+    std::string extension; // bench
+    NameMatcher selection; // delete-type: extensions and name globs
+    bool dryRun = false;
+    TreeSpec treeSpec;            // gen-tree and bench
+    std::string baselinePath;     // bench: compare against this baseline
+    std::string saveBaselinePath; // bench: store results as the new baseline
+    double tolerance = 0.10;      // bench: allowed slowdown before reporting a regression
+    bool allMounts = false;       // scan every discovered mount instead of explicit roots
+    Query query;                  // query: --where filter and --group-by aggregation
+    std::string historyPath;      // snapshot, history and growth: snapshot store directory
+    long long fromSnapshot = 0;   // growth: snapshot indexes, negative counts from the latest
+    long long toSnapshot = -1;
+    unsigned long long limit = 20; // growth: rows reported
+    unsigned maxDistance = 8;     // similar: Hamming distance between perceptual hashes
+    size_t chunkSize = 8192;      // chunks: average content-defined chunk size
+    double sampleRate = 0.002;    // compress: share of the blocks read and compressed
+    bool seeded = false;          // compress: --seed given, so the sample is reproducible
+    TreeCompareOptions treeCompare; // dupe-dirs
+    double timeLimit = 5.0;       // estimate: seconds of sampling before the first report
+    bool refine = false;          // estimate: keep scanning until the estimate is exact
+    double refreshInterval = 0;   // estimate: seconds between refined reports (default 5), serve: between rescans (300)
+    double timeBudget = 0;        // stop after this many seconds of wall time; 0 = no budget
+    unsigned long long ioBudget = 0; // stop after reading this many bytes of file contents; 0 = no budget
+    std::string checkpointPath;   // scan, breakdown and dupes: partial result of a stopped run
+    std::string socketPath;       // serve and ask: the daemon's Unix socket, empty for the default
+    std::string catalogPath;      // export: host catalog written
+    std::string hostId;           // export: host id stored in the catalog, empty for the host name
+    long long coldDays = 180;     // cold: files not touched for this many days are cold
+    double minColdShare = 0.9;    // cold: share of cold bytes that makes a directory a cold subtree
+    AgeBy ageBy = AgeBy::Touch;   // cold: which timestamp counts as the last touch
+    SizeBasis sizeBy = SizeBasis::Apparent; // large, breakdown and ask top: which size ranks files
+    std::string askRequest;       // ask: status, breakdown, top, dupes, query or refresh
+    std::string planAction;       // plan: status, replay or rollback
+    size_t journalBatch = 256;    // delete-type, plan and bench: moves committed per journal sync
+    DuplicateScanOptions duplicateOptions;
+    ScanOptions scanOptions;
+    ScanRules scanRules;          // --exclude/--include patterns and cutoffs, compiled with the mount table
+    bool defaultExcludes = true;  // prune pseudo filesystem and overlay mounts
+    ThrottleLimits throttleLimits;
+    std::string controlPath;      // throttle limits that can be edited while running
+    std::string ioprio;           // "idle" or "be:<level>"
+    int niceLevel = 0;
+    int progress = -1;            // live progress line: -1 = only when stderr is a terminal
+    std::string metricsPath;      // final metrics summary, "-" for stderr
+    std::vector<fs::path> roots;
+};
+
+void printBatchUsage()
+{
+    std::cerr << "Usage: diskmanager <command> [options] <root>...\n"
+              << "Commands:\n"
+              << "  scan                  list every regular file (path, size, mtime, type, extension)\n"
+              << "  breakdown             space utilization by extension per root\n"
+              << "  dupes                 duplicate file groups\n"
+              << "  dupe-dirs             identical and near-identical directory trees, by reclaimable bytes\n"
+              << "  similar               groups of visually similar JPEG/PNG images (resized or re-encoded copies)\n"
+              << "  large                 files larger than mean + one standard deviation\n"
+              << "  cold                  bytes not touched in 7 to 730 days and the largest cold subtrees, or with\n"
+              << "                        --group-by all|type|ext|dir a size x age heat map of bytes\n"
+              << "  estimate              sampled usage per type and top-level directory, with 95% confidence intervals\n"
+              << "  delete-type <patterns> move files matching any of the comma-separated extensions and name globs\n"
+              << "                        (e.g. .log,.tmp,core.*) to the Trash directory, through a journaled plan\n"
+              << "  plan <action>         interrupted deletion plan: status, replay (finish it) or rollback (undo it)\n"
+              << "  mounts                capacity, used and free space of every discovered mount\n"
+              << "  query                 files matching --where, or their totals with --group-by\n"
+              << "  snapshot              scan and append a snapshot to --history\n"
+              << "  history               list the snapshots in --history\n"
+              << "  growth                fastest growing directories (or --group-by type|ext|all) between two snapshots\n"
+              << "  chunks                bytes block-level dedupe would reclaim, per directory (or --group-by type|ext|all)\n"
+              << "  compress              bytes LZ compression would save per type and top-level directory, with 95%\n"
+              << "                        bounds, from a sample of --sample-rate of the 64 KiB blocks\n"
+              << "  serve                 keep the catalog of the roots and their duplicates in memory, rescan them\n"
+              << "                        periodically and answer ask requests over a Unix socket\n"
+              << "  ask <request>         query a running serve: status, breakdown, top, dupes, query or refresh\n"
+              << "  export                hash every file and write a host catalog (size, hash, path) to --catalog\n"
+              << "  merge <catalog>...    duplicate groups spanning several hosts, or with --group-by all|type|ext\n"
+              << "                        fleet-wide usage and redundant bytes, from exported catalogs\n"
+              << "  gen-tree              generate a deterministic synthetic tree in each root\n"
+              << "  bench                 generate a tree under <root>/tree and time every phase on it\n"
+              << "Options:\n"
+              << "  --format ndjson|csv   report format (default ndjson)\n"
+              << "  --output <file>       write the report to a file instead of stdout\n"
+              << "  --dry-run             delete-type: report matches without moving them\n"
+              << "  --journal-batch <n>   delete-type and plan: files moved per journal commit (default 256)\n"
+              << "  --where <expr>        query: e.g. \"size>100M and mtime<90d and type=video ext!=.tmp path=*/cache/*\"\n"
+              << "                        fields size, mtime, atime (YYYY-MM-DD or age 30d), type, ext, path (glob)\n"
+              << "  --group-by all|type|ext|dir  query: count and total size per group instead of listing files;\n"
+              << "                        growth and chunks: rows per group (default dir)\n"
+              << "  --history <dir>       snapshot store used by snapshot, history and growth\n"
+              << "  --from <n> --to <n>   growth: snapshots to compare (default 0 and -1, negative counts from the latest)\n"
+              << "  --limit <n>           growth, chunks and ask top: rows reported, compress: directories,\n"
+              << "                        dupe-dirs and ask dupes: groups (default 20, 0 for all)\n"
+              << "  --chunk-size <n>      chunks: average chunk size, a power of two from 1K to 1M (default 8K)\n"
+              << "  --sample-rate <f>     compress: share of the blocks read, at least 64 (default 0.002)\n"
+              << "  --all-mounts          breakdown: scan every mount, independent devices in parallel\n"
+              << "  --exclude <pattern>   skip files and directories matching a glob: name, a/b, /anchored/path,\n"
+              << "                        ** for any depth, trailing / for directories only (repeatable)\n"
+              << "  --include <pattern>   only report files matching one of the include patterns (repeatable)\n"
+              << "  --exclude-from <file> read exclude patterns from a file, one per line, # for comments\n"
+              << "  --min-size <n> --max-size <n>  only files within the size range (suffixes K, M, G)\n"
+              << "  --older-than <t> --newer-than <t>  only files modified before/after t (YYYY-MM-DD or age 30d)\n"
+              << "  --one-file-system     do not descend into other mounts\n"
+              << "  --no-default-excludes also walk /proc, /sys and other pseudo filesystem and overlay mounts\n"
+              << "  --read-order auto|physical|directory\n"
+              << "                        dupes: hash in on-disk order (auto: only on rotational disks)\n"
+              << "  --cache-policy buffered|dontneed|direct\n"
+              << "                        dupes: page cache use of hash reads (default dontneed)\n"
+              << "  --readahead-kb <n>|<disk>=<n>,...\n"
+              << "                        dupes: read_ahead_kb for the disks read from, restored afterwards\n"
+              << "  --max-read-rate <n>   throttle reads to n bytes/s (suffixes K, M, G)\n"
+              << "  --max-metadata-rate <n>  throttle opendir/stat calls to n per second\n"
+              << "  --time-limit <s>      estimate: sampling time before reporting (default 5)\n"
+              << "  --refine [--refresh <s>]  estimate: then scan fully, reporting every s seconds (default 5) until exact\n"
+              << "  --refresh <s>         serve: seconds between rescans (default 300)\n"
+              << "  --socket <path>       serve and ask: Unix socket (default $XDG_RUNTIME_DIR/diskmanager.sock,\n"
+              << "                        else /tmp/diskmanager-<uid>.sock)\n"
+              << "  --time-budget <t>     stop cleanly after t of wall time (seconds, or suffixes m and h)\n"
+              << "  --io-budget <n>       stop cleanly after reading n bytes of file contents (suffixes K, M, G)\n"
+              << "  --checkpoint <file>   scan, breakdown, dupes: save the partial result when stopped (budget or\n"
+              << "                        Ctrl-C) and continue from it on the next run; removed once a run completes\n"
+              << "  --catalog <file>      export: host catalog to write (replaced atomically when complete)\n"
+              << "  --host <id>           export: host id stored in the catalog (default: the host name)\n"
+              << "  --cold-days <n>       cold: days without a touch that make a file cold (default 180)\n"
+              << "  --min-cold-share <f>  cold: share of cold bytes that makes a directory a cold subtree (default 0.9)\n"
+              << "  --age-by touch|atime|mtime|ctime  cold: last touch of a file (default touch, the later of atime and mtime)\n"
+              << "  --size-by apparent|allocated  large, breakdown, ask top: rank by file length (default) or by the\n"
+              << "                        disk space its blocks take, which is smaller for sparse files\n"
+              << "  --ignore-names        dupe-dirs: compare directories by content only\n"
+              << "  --min-similarity <f>  dupe-dirs: share of contents near-identical trees have in common (default 0.8, 1 = identical only)\n"
+              << "  --max-distance <bits> similar: perceptual hash bits (of 64) that may differ (default 8)\n"
+              << "  --memory-budget <n>   dupes and export: memory for the file catalogs before spilling sorted runs (suffixes K, M, G)\n"
+              << "  --temp-dir <dir>      dupes: where spilled runs go (default $TMPDIR or /tmp)\n"
+              << "  --prefilter           dupes: walk twice and only catalog files whose size a Bloom filter saw twice\n"
+              << "  --workers <n>         hashing threads (default: 1 on rotational disks, else one per core)\n"
+              << "  --control-file <file> reload read_rate=, metadata_rate=, workers= from file when it changes or on SIGHUP\n"
+              << "  --ioprio idle|be:<0-7> --nice <n>  lower I/O and CPU priority\n"
+              << "  --progress, --no-progress  live progress line on stderr (default: when stderr is a terminal)\n"
+              << "  --metrics <file>      write a metrics summary (totals and per-phase times), - for stderr\n"
+              << "  --seed <n>            gen-tree: tree generated (default 1), compress: blocks sampled (default random)\n"
+              << "  --depth <n> --fanout <n> --files-per-dir <n>\n"
+              << "  --sizes <min>:<max>   log-uniform file sizes in bytes (default 1024:1048576)\n"
+              << "  --extensions <mix>    extension mix, e.g. .txt:4,.jpg:2,.mp4:1\n"
+              << "  --dup-ratio <f> --hardlink-ratio <f>\n"
+              << "  --delete-ext <ext>    bench: extension moved in the deletion phase (default .log)\n"
+              << "  --baseline <file>     bench: compare against a saved baseline, exit 1 on regression\n"
+              << "  --save-baseline <file> --tolerance <f>\n"
+              << "Run without arguments for the interactive menu.\n";
+}
+
+// Function to parse argv into BatchOptions, returns false on a usage error
+bool parseBatchOptions(int argc, char *argv[], BatchOptions &options)
+{
+    options.command = argv[1];
+    static const char *commands[] = {"scan", "breakdown", "dupes", "dupe-dirs", "similar", "large", "estimate", "delete-type", "mounts", "query", "snapshot", "history", "growth", "chunks", "compress", "cold", "serve", "ask", "plan", "export", "merge", "gen-tree", "bench"};
+    if (std::find(std::begin(commands), std::end(commands), options.command) == std::end(commands))
+    {
+        std::cerr << "Unknown command: " << options.command << '\n';
+        return false;
+    }
+    int i = 2;
+    if (options.command == "delete-type")
+    {
+        std::string error;
+        if (i >= argc)
+        {
+            std::cerr << "delete-type needs an extension or a list of patterns\n";
+            return false;
+        }
+        if (!options.selection.add(argv[i++], error))
+        {
+            std::cerr << "Invalid patterns: " << error << '\n';
+            return false;
+        }
+        options.selection.compile();
+    }
+    else if (options.command == "bench")
+    {
+        options.extension = ".log";
+    }
+    else if (options.command == "ask")
+    {
+        static const char *requests[] = {"status", "breakdown", "top", "dupes", "query", "refresh"};
+        if (i >= argc || std::find(std::begin(requests), std::end(requests), std::string(argv[i])) == std::end(requests))
+        {
+            std::cerr << "ask needs a request: status, breakdown, top, dupes, query or refresh\n";
+            return false;
+        }
+        options.askRequest = argv[i++];
+    }
+    else if (options.command == "plan")
+    {
+        static const char *actions[] = {"status", "replay", "rollback"};
+        if (i >= argc || std::find(std::begin(actions), std::end(actions), std::string(argv[i])) == std::end(actions))
+        {
+            std::cerr << "plan needs an action: status, replay or rollback\n";
+            return false;
+        }
+        options.planAction = argv[i++];
+    }
+
+    for (; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--format" && i + 1 < argc)
+        {
+            const std::string format = argv[++i];
+            if (format == "ndjson")
+            {
+                options.format = ReportWriter::Format::Ndjson;
+            }
+            else if (format == "csv")
+            {
+                options.format = ReportWriter::Format::Csv;
+            }
+            else
+            {
+                std::cerr << "Unknown format: " << format << '\n';
+                return false;
+            }
+        }
+        else if (arg == "--output" && i + 1 < argc)
+        {
+            options.outputPath = argv[++i];
+        }
+        else if (arg == "--dry-run")
+        {
+            options.dryRun = true;
+        }
+        else if (arg == "--journal-batch" && i + 1 < argc)
+        {
+            const std::string value = argv[++i];
+            size_t number = 0;
+            if (std::from_chars(value.data(), value.data() + value.size(), number).ec != std::errc() || number == 0)
+            {
+                std::cerr << "Invalid value for " << arg << ": " << value << '\n';
+                return false;
+            }
+            options.journalBatch = number;
+        }
+        else if (arg == "--read-order" && i + 1 < argc)
+        {
+            const std::string order = argv[++i];
+            if (order == "auto")
+            {
+                options.duplicateOptions.readOrder = ReadOrder::Auto;
+            }
+            else if (order == "physical")
+            {
+                options.duplicateOptions.readOrder = ReadOrder::Physical;
+            }
+            else if (order == "directory")
+            {
+                options.duplicateOptions.readOrder = ReadOrder::Directory;
+            }
+            else
+            {
+                std::cerr << "Unknown read order: " << order << '\n';
+                return false;
+            }
+        }
+        else if (arg == "--cache-policy" && i + 1 < argc)
+        {
+            const std::string policy = argv[++i];
+            if (policy == "buffered")
+            {
+                options.duplicateOptions.cachePolicy = CachePolicy::Buffered;
+            }
+            else if (policy == "dontneed")
+            {
+                options.duplicateOptions.cachePolicy = CachePolicy::DontNeed;
+            }
+            else if (policy == "direct")
+            {
+                options.duplicateOptions.cachePolicy = CachePolicy::Direct;
+            }
+            else
+            {
+                std::cerr << "Unknown cache policy: " << policy << '\n';
+                return false;
+            }
+        }
+        else if (arg == "--readahead-kb" && i + 1 < argc)
+        {
+            std::istringstream items(argv[++i]);
+            std::string item;
+            while (std::getline(items, item, ','))
+            {
+                const size_t equals = item.find('=');
+                const long kb = std::strtol(item.c_str() + (equals == std::string::npos ? 0 : equals + 1), nullptr, 10);
+                if (equals == std::string::npos)
+                {
+                    options.duplicateOptions.readaheadKb = kb;
+                }
+                else
+                {
+                    options.duplicateOptions.readaheadByDisk[item.substr(0, equals)] = kb;
+                }
+            }
+        }
+        else if (arg == "--max-read-rate" && i + 1 < argc)
+        {
+            options.throttleLimits.readBytesPerSecond = parseScaledNumber(argv[++i]);
+        }
+        else if (arg == "--max-metadata-rate" && i + 1 < argc)
+        {
+            options.throttleLimits.metadataOpsPerSecond = parseScaledNumber(argv[++i]);
+        }
+        else if (arg == "--where" && i + 1 < argc)
+        {
+            std::string error;
+            if (!parseQuery(argv[++i], options.query, error))
+            {
+                std::cerr << "Invalid query: " << error << '\n';
+                return false;
+            }
+        }
+        else if (arg == "--group-by" && i + 1 < argc)
+        {
+            const std::string group = argv[++i];
+            if (group == "all")
+            {
+                options.query.groupBy = QueryGroup::All;
+            }
+            else if (group == "type")
+            {
+                options.query.groupBy = QueryGroup::Type;
+            }
+            else if (group == "ext")
+            {
+                options.query.groupBy = QueryGroup::Extension;
+            }
+            else if (group == "dir")
+            {
+                options.query.groupBy = QueryGroup::Directory;
+            }
+            else
+            {
+                std::cerr << "Unknown group: " << group << '\n';
+                return false;
+            }
+        }
+        else if (arg == "--history" && i + 1 < argc)
+        {
+            options.historyPath = argv[++i];
+        }
+        else if ((arg == "--from" || arg == "--to" || arg == "--limit") && i + 1 < argc)
+        {
+            const std::string value = argv[++i];
+            long long number = 0;
+            const auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), number);
+            if (ec != std::errc() || end != value.data() + value.size() || (arg == "--limit" && number < 0))
+            {
+                std::cerr << "Invalid value for " << arg << ": " << value << '\n';
+                return false;
+            }
+            if (arg == "--from")
+            {
+                options.fromSnapshot = number;
+            }
+            else if (arg == "--to")
+            {
+                options.toSnapshot = number;
+            }
+            else
+            {
+                options.limit = static_cast<unsigned long long>(number);
+            }
+        }
+        else if (arg == "--max-distance" && i + 1 < argc)
+        {
+            const std::string value = argv[++i];
+            unsigned number = 0;
+            if (std::from_chars(value.data(), value.data() + value.size(), number).ec != std::errc() || number > 16)
+            {
+                std::cerr << "Invalid value for " << arg << " (0-16): " << value << '\n';
+                return false;
+            }
+            options.maxDistance = number;
+        }
+        else if ((arg == "--time-limit" || arg == "--refresh") && i + 1 < argc)
+        {
+            const char *value = argv[++i];
+            char *end = nullptr;
+            const double seconds = std::strtod(value, &end);
+            if (end == value || *end != '\0' || !(seconds > 0.0))
+            {
+                std::cerr << "Invalid value for " << arg << " (seconds): " << value << '\n';
+                return false;
+            }
+            (arg == "--time-limit" ? options.timeLimit : options.refreshInterval) = seconds;
+        }
+        else if (arg == "--refine")
+        {
+            options.refine = true;
+        }
+        else if (arg == "--time-budget" && i + 1 < argc)
+        {
+            const char *value = argv[++i];
+            char *end = nullptr;
+            double seconds = std::strtod(value, &end);
+            if (end != value && (*end == 'm' || *end == 'h') && end[1] == '\0')
+            {
+                seconds *= *end == 'm' ? 60 : 3600;
+                ++end;
+            }
+            if (end == value || *end != '\0' || !(seconds > 0.0))
+            {
+                std::cerr << "Invalid value for " << arg << " (e.g. 600, 90m, 2h): " << value << '\n';
+                return false;
+            }
+            options.timeBudget = seconds;
+        }
+        else if (arg == "--io-budget" && i + 1 < argc)
+        {
+            options.ioBudget = static_cast<unsigned long long>(parseScaledNumber(argv[++i]));
+        }
+        else if (arg == "--checkpoint" && i + 1 < argc)
+        {
+            options.checkpointPath = argv[++i];
+        }
+        else if (arg == "--socket" && i + 1 < argc)
+        {
+            options.socketPath = argv[++i];
+        }
+        else if (arg == "--catalog" && i + 1 < argc)
+        {
+            options.catalogPath = argv[++i];
+        }
+        else if (arg == "--host" && i + 1 < argc)
+        {
+            options.hostId = argv[++i];
+        }
+        else if (arg == "--cold-days" && i + 1 < argc)
+        {
+            const std::string value = argv[++i];
+            const auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), options.coldDays);
+            if (ec != std::errc() || end != value.data() + value.size() || options.coldDays < 0)
+            {
+                std::cerr << "Invalid value for " << arg << " (days): " << value << '\n';
+                return false;
+            }
+        }
+        else if (arg == "--sample-rate" && i + 1 < argc)
+        {
+            const char *value = argv[++i];
+            char *end = nullptr;
+            const double rate = std::strtod(value, &end);
+            if (end == value || *end != '\0' || !(rate > 0.0 && rate <= 1.0))
+            {
+                std::cerr << "Invalid value for " << arg << " (0-1): " << value << '\n';
+                return false;
+            }
+            options.sampleRate = rate;
+        }
+        else if (arg == "--min-cold-share" && i + 1 < argc)
+        {
+            const char *value = argv[++i];
+            char *end = nullptr;
+            const double share = std::strtod(value, &end);
+            if (end == value || *end != '\0' || !(share > 0.0 && share <= 1.0))
+            {
+                std::cerr << "Invalid value for " << arg << " (0-1): " << value << '\n';
+                return false;
+            }
+            options.minColdShare = share;
+        }
+        else if (arg == "--age-by" && i + 1 < argc)
+        {
+            const std::string age = argv[++i];
+            if (age == "touch")
+            {
+                options.ageBy = AgeBy::Touch;
+            }
+            else if (age == "atime")
+            {
+                options.ageBy = AgeBy::Access;
+            }
+            else if (age == "mtime")
+            {
+                options.ageBy = AgeBy::Modify;
+            }
+            else if (age == "ctime")
+            {
+                options.ageBy = AgeBy::Change;
+            }
+            else
+            {
+                std::cerr << "Unknown value for " << arg << ": " << age << '\n';
+                return false;
+            }
+        }
+        else if (arg == "--size-by" && i + 1 < argc)
+        {
+            const std::string basis = argv[++i];
+            if (basis == "apparent")
+            {
+                options.sizeBy = SizeBasis::Apparent;
+            }
+            else if (basis == "allocated")
+            {
+                options.sizeBy = SizeBasis::Allocated;
+            }
+            else
+            {
+                std::cerr << "Unknown value for " << arg << ": " << basis << '\n';
+                return false;
+            }
+        }
+        else if (arg == "--ignore-names")
+        {
+            options.treeCompare.ignoreNames = true;
+        }
+        else if (arg == "--min-similarity" && i + 1 < argc)
+        {
+            const char *value = argv[++i];
+            char *end = nullptr;
+            const double similarity = std::strtod(value, &end);
+            if (end == value || *end != '\0' || !(similarity > 0.0 && similarity <= 1.0))
+            {
+                std::cerr << "Invalid value for " << arg << " (0-1): " << value << '\n';
+                return false;
+            }
+            options.treeCompare.minSimilarity = similarity;
+        }
+        else if (arg == "--chunk-size" && i + 1 < argc)
+        {
+            const char *value = argv[++i];
+            const double size = parseScaledNumber(value);
+            if (size < 1024 || size > (1 << 20) || __builtin_popcountll(static_cast<unsigned long long>(size)) != 1)
+            {
+                std::cerr << "Invalid value for " << arg << " (a power of two from 1K to 1M): " << value << '\n';
+                return false;
+            }
+            options.chunkSize = static_cast<size_t>(size);
+        }
+        else if (arg == "--prefilter")
+        {
+            options.duplicateOptions.prefilter = true;
+        }
+        else if (arg == "--memory-budget" && i + 1 < argc)
+        {
+            options.duplicateOptions.memoryBudget = static_cast<unsigned long long>(parseScaledNumber(argv[++i]));
+        }
+        else if (arg == "--temp-dir" && i + 1 < argc)
+        {
+            options.duplicateOptions.tempDir = argv[++i];
+        }
+        else if (arg == "--workers" && i + 1 < argc)
+        {
+            options.throttleLimits.workers = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+            options.duplicateOptions.workers = options.throttleLimits.workers;
+        }
+        else if (arg == "--control-file" && i + 1 < argc)
+        {
+            options.controlPath = argv[++i];
+        }
+        else if (arg == "--ioprio" && i + 1 < argc)
+        {
+            options.ioprio = argv[++i];
+        }
+        else if (arg == "--nice" && i + 1 < argc)
+        {
+            options.niceLevel = std::atoi(argv[++i]);
+        }
+        else if (arg == "--all-mounts")
+        {
+            options.allMounts = true;
+        }
+        else if ((arg == "--exclude" || arg == "--include") && i + 1 < argc)
+        {
+            const char *pattern = argv[++i];
+            if (!options.scanRules.addPattern(pattern, arg == "--include"))
+            {
+                std::cerr << "Invalid pattern for " << arg << ": " << pattern << '\n';
+                return false;
+            }
+        }
+        else if (arg == "--exclude-from" && i + 1 < argc)
+        {
+            std::ifstream patterns(argv[++i]);
+            if (!patterns)
+            {
+                std::cerr << "Cannot read " << argv[i] << '\n';
+                return false;
+            }
+            std::string line;
+            while (std::getline(patterns, line))
+            {
+                if (!line.empty() && line.back() == '\r')
+                {
+                    line.pop_back();
+                }
+                if (!line.empty() && line[0] != '#')
+                {
+                    options.scanRules.addPattern(line, false);
+                }
+            }
+        }
+        else if ((arg == "--min-size" || arg == "--max-size") && i + 1 < argc)
+        {
+            const auto size = static_cast<unsigned long long>(parseScaledNumber(argv[++i]));
+            (arg == "--min-size" ? options.scanRules.minSize : options.scanRules.maxSize) = size;
+        }
+        else if ((arg == "--older-than" || arg == "--newer-than") && i + 1 < argc)
+        {
+            long long time = 0;
+            if (!parseQueryTime(argv[++i], time))
+            {
+                std::cerr << "Invalid value for " << arg << " (YYYY-MM-DD or an age such as 30d): " << argv[i] << '\n';
+                return false;
+            }
+            (arg == "--older-than" ? options.scanRules.modifiedBefore : options.scanRules.modifiedAfter) = time;
+        }
+        else if (arg == "--one-file-system")
+        {
+            options.scanOptions.oneFileSystem = true;
+        }
+        else if (arg == "--no-default-excludes")
+        {
+            options.defaultExcludes = false;
+        }
+        else if (arg == "--progress" || arg == "--no-progress")
+        {
+            options.progress = arg == "--progress";
+        }
+        else if (arg == "--metrics" && i + 1 < argc)
+        {
+            options.metricsPath = argv[++i];
+        }
+        else if (i + 1 < argc && (arg == "--seed" || arg == "--depth" || arg == "--fanout" || arg == "--files-per-dir"))
+        {
+            const std::string value = argv[++i];
+            unsigned long long number = 0;
+            if (std::from_chars(value.data(), value.data() + value.size(), number).ec != std::errc())
+            {
+                std::cerr << "Invalid value for " << arg << ": " << value << '\n';
+                return false;
+            }
+            TreeSpec &spec = options.treeSpec;
+            if (arg == "--seed")
+            {
+                spec.seed = number;
+                options.seeded = true;
+            }
+            else if (arg == "--depth")
+            {
+                spec.depth = static_cast<unsigned>(number);
+            }
+            else if (arg == "--fanout")
+            {
+                spec.fanout = static_cast<unsigned>(number);
+            }
+            else if (arg == "--files-per-dir")
+            {
+                spec.filesPerDir = static_cast<unsigned>(number);
+            }
+        }
+        else if (arg == "--sizes" && i + 1 < argc)
+        {
+            const std::string value = argv[++i];
+            const size_t colon = value.find(':');
+            TreeSpec &spec = options.treeSpec;
+            if (colon == std::string::npos ||
+                std::from_chars(value.data(), value.data() + colon, spec.minSize).ec != std::errc() ||
+                std::from_chars(value.data() + colon + 1, value.data() + value.size(), spec.maxSize).ec != std::errc())
+            {
+                std::cerr << "Invalid --sizes, expected <min>:<max>\n";
+                return false;
+            }
+        }
+        else if (arg == "--extensions" && i + 1 < argc)
+        {
+            if (!parseExtensionMix(argv[++i], options.treeSpec.extensions))
+            {
+                std::cerr << "Invalid --extensions, expected .ext:weight,...\n";
+                return false;
+            }
+        }
+        else if (i + 1 < argc && (arg == "--dup-ratio" || arg == "--hardlink-ratio" || arg == "--tolerance"))
+        {
+            const char *text = argv[++i];
+            char *end = nullptr;
+            const double value = std::strtod(text, &end);
+            // Ratios are shares of the generated files; the tolerance is a relative slowdown
+            const double limit = arg == "--tolerance" ? 100.0 : 1.0;
+            if (end == text || *end != '\0' || !(value >= 0.0 && value <= limit))
+            {
+                std::cerr << "Invalid value for " << arg << " (0-" << limit << "): " << text << '\n';
+                return false;
+            }
+            if (arg == "--dup-ratio")
+            {
+                options.treeSpec.duplicateRatio = value;
+            }
+            else if (arg == "--hardlink-ratio")
+            {
+                options.treeSpec.hardLinkRatio = value;
+            }
+            else
+            {
+                options.tolerance = value;
+            }
+        }
+        else if (arg == "--delete-ext" && i + 1 < argc)
+        {
+            options.extension = argv[++i];
+            std::transform(options.extension.begin(), options.extension.end(), options.extension.begin(), ::tolower);
+        }
+        else if (arg == "--baseline" && i + 1 < argc)
+        {
+            options.baselinePath = argv[++i];
+        }
+        else if (arg == "--save-baseline" && i + 1 < argc)
+        {
+            options.saveBaselinePath = argv[++i];
+        }
+        else if (arg.size() > 1 && arg[0] == '-' && arg[1] == '-')
+        {
+            std::cerr << "Unknown option: " << arg << '\n';
+            return false;
+        }
+        else
+        {
+            options.roots.emplace_back(arg);
+        }
+    }
+
+    const bool needsHistory = options.command == "snapshot" || options.command == "history" || options.command == "growth";
+    if (needsHistory && options.historyPath.empty())
+    {
+        std::cerr << options.command << " needs --history <dir>\n";
+        return false;
+    }
+    if (options.command == "export" && options.catalogPath.empty())
+    {
+        std::cerr << "export needs --catalog <file>\n";
+        return false;
+    }
+    if (options.command == "merge" && options.query.groupBy == QueryGroup::Directory)
+    {
+        std::cerr << "merge groups by all, type or ext\n";
+        return false;
+    }
+    if (options.roots.empty() && !options.allMounts && options.command != "mounts" && options.command != "history" &&
+        options.command != "growth" && options.command != "ask" && options.command != "plan")
+    {
+        std::cerr << "No root directories given\n";
+        return false;
+    }
+    return true;
+}
+
+// Function to load the --checkpoint a stopped run of the same command over the same roots left
+// behind; returns false, to start from scratch, when there is none or it does not match
+bool loadCheckpoint(const BatchOptions &options, ScanCheckpoint &checkpoint)
+{
+    if (options.checkpointPath.empty())
+    {
+        return false;
+    }
+    std::string error;
+    if (!checkpoint.load(options.checkpointPath, error))
+    {
+        std::cerr << "Ignoring checkpoint: " << error << '\n';
+        checkpoint = ScanCheckpoint();
+        return false;
+    }
+    if (checkpoint.command.empty())
+    {
+        return false; // first run
+    }
+    bool matches = checkpoint.command == options.command && checkpoint.roots.size() == options.roots.size();
+    for (size_t i = 0; matches && i < options.roots.size(); ++i)
+    {
+        matches = checkpoint.roots[i].path == options.roots[i].string();
+    }
+    if (!matches)
+    {
+        std::cerr << "Ignoring checkpoint " << options.checkpointPath << ": written by another command or for other roots\n";
+        checkpoint = ScanCheckpoint();
+        return false;
+    }
+    std::cerr << "Resuming from checkpoint " << options.checkpointPath << '\n';
+    return true;
+}
+
+// Function to save the checkpoint when the run was stopped, or remove it once a run completes
+void finishCheckpoint(const BatchOptions &options, ScanCheckpoint &checkpoint, ErrorTable &errors)
+{
+    const ScanControl *control = options.scanOptions.control;
+    if (options.checkpointPath.empty() || control == nullptr)
+    {
+        return;
+    }
+    if (control->reason() == ScanControl::Stop::None)
+    {
+        ::unlink(options.checkpointPath.c_str());
+        return;
+    }
+    checkpoint.command = options.command;
+    std::string error;
+    if (!checkpoint.save(options.checkpointPath, error))
+    {
+        std::cerr << "Error: " << error << '\n';
+        errors.record(options.checkpointPath, 0, ScanOp::Write);
+        return;
+    }
+    std::cerr << "Checkpoint saved to " << options.checkpointPath << '\n';
+}
+
+// batch: scan
+void runScanCommand(const BatchOptions &options, ReportWriter &writer, ErrorTable &errors)
+{
+    writer.setColumns({"path", "size", "allocated", "mtime", "type", "extension"});
+    MetricsPhase phase("traversal");
+    ScanCheckpoint checkpoint;
+    const bool resuming = loadCheckpoint(options, checkpoint);
+    std::vector<CheckpointRoot> progress;
+    std::string extension;
+    for (const auto &root : options.roots)
+    {
+        // A resumed run only reports the files the stopped runs had not reached
+        CheckpointRoot &done = progress.emplace_back();
+        done.path = root.string();
+        done.pending = walkRoot(done.path, resuming ? checkpoint.findRoot(done.path) : nullptr, [&](const ScanEntry &entry)
+                                {
+                                    lowercaseInto(extensionOf(entry.name), extension);
+                                    writer.beginRecord();
+                                    writer.addString(entry.path);
+                                    writer.addNumber(entry.size);
+                                    writer.addNumber(entry.allocated);
+                                    writer.addSignedNumber(entry.mtime);
+                                    writer.addString(getFileTypeName(categorizeExtension(extension)));
+                                    writer.addString(extension);
+                                    writer.endRecord();
+                                },
+                                errors, options.scanOptions);
+    }
+    checkpoint.roots = std::move(progress);
+    finishCheckpoint(options, checkpoint, errors);
+}
+
+// batch: breakdown
+void runBreakdownCommand(const BatchOptions &options, ReportWriter &writer, ErrorTable &errors)
+{
+    struct ExtensionTotals
+    {
+        unsigned long long files = 0;
+        unsigned long long bytes = 0;
+        unsigned long long allocated = 0;
+    };
+
+    writer.setColumns({"root", "extension", "type", "files", "bytes", "allocated"});
+    if (options.allMounts)
+    {
+        MetricsPhase phase("traversal");
+        for (auto &result : scanMountsInParallel(discoverMounts(), options.scanOptions))
+        {
+            if (options.sizeBy == SizeBasis::Allocated)
+            {
+                std::sort(result.fileTypes.begin(), result.fileTypes.end(), sortByAllocated);
+            }
+            for (const auto &ft : result.fileTypes)
+            {
+                writer.beginRecord();
+                writer.addString(result.mount.mountPoint);
+                writer.addString(ft.extension);
+                writer.addString(getFileTypeName(categorizeExtension(ft.extension)));
+                writer.addNumber(ft.files);
+                writer.addNumber(ft.size);
+                writer.addNumber(ft.allocated);
+                writer.endRecord();
+            }
+            errors.merge(result.errors);
+        }
+    }
+
+    ScanCheckpoint checkpoint;
+    const bool resuming = loadCheckpoint(options, checkpoint);
+    std::vector<CheckpointRoot> progress;
+    std::string extension;
+    for (const auto &root : options.roots)
+    {
+        const std::string rootName = root.string();
+        const CheckpointRoot *saved = resuming ? checkpoint.findRoot(rootName) : nullptr;
+        std::unordered_map<std::string, ExtensionTotals> totals;
+        if (saved)
+        {
+            for (const auto &ft : saved->totals)
+            {
+                totals[ft.extension] = {ft.files, ft.size, ft.allocated};
+            }
+        }
+        CheckpointRoot &done = progress.emplace_back();
+        done.path = rootName;
+        {
+            MetricsPhase phase("traversal");
+            done.pending = walkRoot(rootName, saved, [&](const ScanEntry &entry)
+                                    {
+                                        lowercaseInto(extensionOf(entry.name), extension);
+                                        ExtensionTotals &bucket = totals[extension];
+                                        ++bucket.files;
+                                        bucket.bytes += entry.size;
+                                        bucket.allocated += entry.allocated;
+                                    },
+                                    errors, options.scanOptions);
+        }
+
+        std::vector<std::pair<std::string, ExtensionTotals>> sorted(totals.begin(), totals.end());
+        const bool byAllocated = options.sizeBy == SizeBasis::Allocated;
+        std::sort(sorted.begin(), sorted.end(), [byAllocated](const auto &a, const auto &b)
+                  { return byAllocated ? a.second.allocated > b.second.allocated : a.second.bytes > b.second.bytes; });
+        for (const auto &[ext, bucket] : sorted)
+        {
+            done.totals.push_back({ext, bucket.bytes, bucket.files, bucket.allocated});
+            writer.beginRecord();
+            writer.addString(rootName);
+            writer.addString(ext);
+            writer.addString(getFileTypeName(categorizeExtension(ext)));
+            writer.addNumber(bucket.files);
+            writer.addNumber(bucket.bytes);
+            writer.addNumber(bucket.allocated);
+            writer.endRecord();
+        }
+    }
+    checkpoint.roots = std::move(progress);
+    finishCheckpoint(options, checkpoint, errors);
+}
+
+// batch: mounts
+void runMountsCommand(const BatchOptions &options, ReportWriter &writer, ErrorTable &errors)
+{
+    writer.setColumns({"mount", "fstype", "source", "device", "capacity", "used", "free", "available"});
+    std::vector<MountInfo> mounts = discoverMounts();
+    for (const auto &root : options.roots)
+    {
+        MountInfo mount;
+        mount.mountPoint = root.string();
+        mounts.push_back(mount);
+    }
+    for (const auto &mount : mounts)
+    {
+        const SpaceStats space = querySpace(mount.mountPoint);
+        if (!space.valid)
+        {
+            errors.record(mount.mountPoint, space.error, ScanOp::Statfs);
+            continue;
+        }
+        writer.beginRecord();
+        writer.addString(mount.mountPoint);
+        writer.addString(mount.fsType);
+        writer.addString(mount.source);
+        writer.addString(mount.backingDevice);
+        writer.addNumber(space.capacity);
+        writer.addNumber(space.capacity - space.free);
+        writer.addNumber(space.free);
+        writer.addNumber(space.available);
+        writer.endRecord();
+    }
+}
+
+// batch: dupes
+void runDupesCommand(const BatchOptions &options, ReportWriter &writer, ErrorTable &errors)
+{
+    writer.setColumns({"group", "hash", "size", "path"});
+    // A resumed run walks the roots again but only hashes what the stopped runs had not
+    DuplicateScanOptions duplicateOptions = options.duplicateOptions;
+    ScanCheckpoint checkpoint;
+    if (!options.checkpointPath.empty())
+    {
+        loadCheckpoint(options, checkpoint);
+        checkpoint.roots.clear();
+        for (const auto &root : options.roots)
+        {
+            checkpoint.roots.push_back({root.string(), {}, {}});
+        }
+        duplicateOptions.checkpoint = &checkpoint;
+    }
+    // Groups are written as they come out of the merge so the report never sits in memory
+    unsigned long long groupNumber = 1;
+    try
+    {
+        forEachDuplicateGroup(options.roots, errors, duplicateOptions,
+                              [&](const std::string &hash, unsigned long long size, const std::vector<std::string> &files)
+                              {
+                                  for (const auto &file : files)
+                                  {
+                                      writer.beginRecord();
+                                      writer.addNumber(groupNumber);
+                                      writer.addString(hash);
+                                      writer.addNumber(size);
+                                      writer.addString(file);
+                                      writer.endRecord();
+                                  }
+                                  ++groupNumber;
+                              });
+    }
+    catch (const std::system_error &e)
+    {
+        std::cerr << "Error: " << e.what() << '\n';
+        errors.record(options.duplicateOptions.tempDir.empty() ? "spill directory" : options.duplicateOptions.tempDir,
+                      e.code().value(), ScanOp::Write);
+    }
+    finishCheckpoint(options, checkpoint, errors);
+}
+
+// batch: export
+void runExportCommand(const BatchOptions &options, ReportWriter &writer, ErrorTable &errors)
+{
+    writer.setColumns({"host", "files", "bytes", "catalog", "catalog_bytes"});
+    std::string host = options.hostId;
+    if (host.empty())
+    {
+        char name[256] = {};
+        ::gethostname(name, sizeof(name) - 1);
+        host = name;
+    }
+    // Paths from many hosts only make sense absolute
+    std::vector<fs::path> roots;
+    std::vector<std::string> rootNames;
+    for (const auto &root : options.roots)
+    {
+        std::error_code ec;
+        roots.push_back(fs::absolute(root, ec).lexically_normal());
+        rootNames.push_back(roots.back().string());
+    }
+
+    HostCatalogWriter catalog;
+    std::string error;
+    if (!catalog.open(options.catalogPath, host, rootNames, error))
+    {
+        std::cerr << "Error: " << error << '\n';
+        errors.record(options.catalogPath, 0, ScanOp::Write);
+        return;
+    }
+    DuplicateScanOptions duplicateOptions = options.duplicateOptions;
+    duplicateOptions.includeUnique = true;
+    bool written = true;
+    try
+    {
+        forEachDuplicateGroup(roots, errors, duplicateOptions,
+                              [&](const std::string &hash, unsigned long long size, const std::vector<std::string> &files)
+                              {
+                                  unsigned char digest[32];
+                                  for (size_t b = 0; b < sizeof(digest); ++b)
+                                  {
+                                      std::from_chars(hash.data() + 2 * b, hash.data() + 2 * b + 2, digest[b], 16);
+                                  }
+                                  for (const auto &file : files)
+                                  {
+                                      written = written && (size == 0 || catalog.add(size, digest, file, error));
+                                  }
+                              });
+    }
+    catch (const std::system_error &e)
+    {
+        std::cerr << "Error: " << e.what() << '\n';
+        errors.record(options.duplicateOptions.tempDir.empty() ? "spill directory" : options.duplicateOptions.tempDir,
+                      e.code().value(), ScanOp::Write);
+        return;
+    }
+    const ScanControl *control = options.scanOptions.control;
+    if (control != nullptr && control->reason() != ScanControl::Stop::None)
+    {
+        std::cerr << "The export was stopped, no catalog written\n";
+        return;
+    }
+    if (!written || !catalog.finish(error))
+    {
+        std::cerr << "Error: " << error << '\n';
+        errors.record(options.catalogPath, 0, ScanOp::Write);
+        return;
+    }
+    writer.beginRecord();
+    writer.addString(host);
+    writer.addNumber(catalog.files());
+    writer.addNumber(catalog.bytes());
+    writer.addString(options.catalogPath);
+    writer.addNumber(catalog.catalogBytes());
+    writer.endRecord();
+}
+
+// Usage of one type, extension or "all" across the merged catalogs
+struct FleetUsage
+{
+    std::string group;
+    unsigned long long files = 0;
+    unsigned long long bytes = 0;
+    unsigned long long redundantBytes = 0; // copies beyond the first anywhere in the fleet
+    unsigned long long crossHostBytes = 0; // of those, first copies on another host
+    std::vector<bool> hosts;
+};
+
+// batch: merge
+void runMergeCommand(const BatchOptions &options, ReportWriter &writer, ErrorTable &errors)
+{
+    std::vector<std::unique_ptr<HostCatalogReader>> catalogs;
+    std::unordered_map<std::string, size_t> catalogOfHost;
+    for (const auto &path : options.roots)
+    {
+        auto catalog = std::make_unique<HostCatalogReader>();
+        std::string error;
+        if (!catalog->open(path.string(), error))
+        {
+            std::cerr << "Error: " << error << '\n';
+            errors.record(path.string(), 0, ScanOp::Read);
+            return;
+        }
+        auto [it, added] = catalogOfHost.emplace(catalog->host(), catalogs.size());
+        if (!added)
+        {
+            std::cerr << "Error: " << path.string() << " and " << options.roots[it->second].string()
+                      << " are both catalogs of host " << catalog->host() << '\n';
+            errors.record(path.string(), 0, ScanOp::Read);
+            return;
+        }
+        catalogs.push_back(std::move(catalog));
+    }
+
+    // Per group of identical content, the first copy is kept and so is the first copy on
+    // every other host as far as that host is concerned
+    std::vector<bool> seen(catalogs.size());
+    const QueryGroup groupBy = options.query.groupBy;
+    std::unordered_map<std::string, FleetUsage> usage;
+    std::string key;
+    unsigned long long groupNumber = 1;
+    writer.setColumns(groupBy == QueryGroup::None
+                          ? std::vector<std::string>{"group", "hash", "size", "host", "path"}
+                          : std::vector<std::string>{"group", "files", "bytes", "redundant_bytes", "cross_host_bytes", "hosts"});
+    mergeHostCatalogs(catalogs, [&](const HostCatalogEntry &entry, const std::vector<std::pair<size_t, std::string>> &members)
+                      {
+                          std::fill(seen.begin(), seen.end(), false);
+                          size_t hostCount = 0;
+                          for (size_t m = 0; m < members.size(); ++m)
+                          {
+                              const size_t host = members[m].first;
+                              if (groupBy != QueryGroup::None)
+                              {
+                                  groupKeyOf(members[m].second, groupBy, key);
+                                  FleetUsage &row = usage[key];
+                                  row.hosts.resize(catalogs.size());
+                                  row.hosts[host] = true;
+                                  ++row.files;
+                                  row.bytes += entry.size;
+                                  row.redundantBytes += m > 0 ? entry.size : 0;
+                                  row.crossHostBytes += m > 0 && !seen[host] ? entry.size : 0;
+                              }
+                              hostCount += !seen[host];
+                              seen[host] = true;
+                          }
+                          if (groupBy != QueryGroup::None || hostCount < 2)
+                          {
+                              return;
+                          }
+                          const std::string hash = picosha2::bytes_to_hex_string(std::begin(entry.digest), std::end(entry.digest));
+                          for (const auto &[catalog, path] : members)
+                          {
+                              writer.beginRecord();
+                              writer.addNumber(groupNumber);
+                              writer.addString(hash);
+                              writer.addNumber(entry.size);
+                              writer.addString(catalogs[catalog]->host());
+                              writer.addString(path);
+                              writer.endRecord();
+                          }
+                          ++groupNumber;
+                      });
+    for (const auto &catalog : catalogs)
+    {
+        if (!catalog->error().empty())
+        {
+            std::cerr << "Error: " << catalog->error() << '\n';
+            errors.record(catalog->path(), 0, ScanOp::Read);
+        }
+    }
+    if (groupBy == QueryGroup::None)
+    {
+        return;
+    }
+
+    std::vector<FleetUsage> rows;
+    for (auto &[group, row] : usage)
+    {
+        row.group = group;
+        rows.push_back(std::move(row));
+    }
+    std::sort(rows.begin(), rows.end(), [](const FleetUsage &a, const FleetUsage &b)
+              { return a.bytes != b.bytes ? a.bytes > b.bytes : a.group < b.group; });
+    for (size_t i = 0; i < rows.size() && (options.limit == 0 || i < options.limit); ++i)
+    {
+        writer.beginRecord();
+        writer.addString(rows[i].group);
+        writer.addNumber(rows[i].files);
+        writer.addNumber(rows[i].bytes);
+        writer.addNumber(rows[i].redundantBytes);
+        writer.addNumber(rows[i].crossHostBytes);
+        writer.addNumber(std::count(rows[i].hosts.begin(), rows[i].hosts.end(), true));
+        writer.endRecord();
+    }
+}
+
+// batch: dupe-dirs
+void runDupeDirsCommand(const BatchOptions &options, ReportWriter &writer, ErrorTable &errors)
+{
+    const auto groups = findDuplicateTrees(options.roots, options.treeCompare, errors, options.duplicateOptions);
+    writer.setColumns({"group", "kind", "path", "bytes", "files", "similarity", "reclaimable_bytes"});
+    for (size_t g = 0; g < groups.size() && (options.limit == 0 || g < options.limit); ++g)
+    {
+        for (const auto &member : groups[g].members)
+        {
+            writer.beginRecord();
+            writer.addNumber(g + 1);
+            writer.addString(groups[g].identical ? "identical" : "similar");
+            writer.addString(member.path);
+            writer.addNumber(member.bytes);
+            writer.addNumber(member.files);
+            writer.addDouble(member.similarity, 3);
+            writer.addNumber(groups[g].reclaimableBytes);
+            writer.endRecord();
+        }
+    }
+}
+
+// batch: similar
+void runSimilarCommand(const BatchOptions &options, ReportWriter &writer, ErrorTable &errors)
+{
+    std::vector<std::string> undecodable;
+    const auto groups = findSimilarImages(options.roots, options.maxDistance, errors, undecodable, options.duplicateOptions);
+    writer.setColumns({"group", "path", "size", "width", "height", "phash", "distance"});
+    unsigned long long groupNumber = 1;
+    for (const auto &group : groups)
+    {
+        for (const auto &image : group)
+        {
+            char hex[17];
+            auto result = std::to_chars(hex, hex + 16, image.hash, 16);
+            const size_t digits = result.ptr - hex;
+            std::memmove(hex + 16 - digits, hex, digits);
+            std::fill(hex, hex + 16 - digits, '0');
+            writer.beginRecord();
+            writer.addNumber(groupNumber);
+            writer.addString(image.path);
+            writer.addNumber(image.size);
+            writer.addNumber(image.width);
+            writer.addNumber(image.height);
+            writer.addString(std::string_view(hex, 16));
+            writer.addNumber(static_cast<unsigned>(__builtin_popcountll(image.hash ^ group.front().hash)));
+            writer.endRecord();
+        }
+        ++groupNumber;
+    }
+    if (!undecodable.empty())
+    {
+        // Unsupported encodings are skipped, not errors
+        std::cerr << undecodable.size() << " images could not be decoded (progressive JPEG, interlaced PNG or damaged)\n";
+    }
+}
+
+// Function to write one catalog row as a file record (path, size, allocated, mtime, atime, type, extension)
+template <typename Writer>
+void writeCatalogRow(const Catalog &catalog, uint32_t row, Writer &writer)
+{
+    writer.beginRecord();
+    writer.addString(catalog.path(row));
+    writer.addNumber(catalog.size[row]);
+    writer.addNumber(catalog.allocated[row]);
+    writer.addSignedNumber(catalog.mtime[row]);
+    writer.addSignedNumber(catalog.atime[row]);
+    writer.addString(getFileTypeName(static_cast<FileType>(catalog.type[row])));
+    writer.addString(catalog.extensions[catalog.extension[row]]);
+    writer.endRecord();
+}
+
+// Function to write the result of a query: the matching files, or their totals per group
+template <typename Writer>
+void writeQueryResult(const Catalog &catalog, const Query &query, Writer &writer, SizeBasis basis = SizeBasis::Apparent)
+{
+    const unsigned workers = std::max(1u, std::thread::hardware_concurrency());
+    if (query.groupBy != QueryGroup::None)
+    {
+        std::vector<QueryAggregate> groups;
+        {
+            MetricsPhase phase("query");
+            groups = aggregateQuery(catalog, query, workers, basis);
+        }
+        writer.setColumns({"group", "files", "bytes", "allocated"});
+        for (const auto &group : groups)
+        {
+            writer.beginRecord();
+            writer.addString(group.group);
+            writer.addNumber(group.files);
+            writer.addNumber(group.bytes);
+            writer.addNumber(group.allocated);
+            writer.endRecord();
+        }
+        return;
+    }
+
+    std::vector<uint32_t> rows;
+    {
+        MetricsPhase phase("query");
+        rows = selectQuery(catalog, query, workers);
+    }
+    writer.setColumns({"path", "size", "allocated", "mtime", "atime", "type", "extension"});
+    for (uint32_t row : rows)
+    {
+        writeCatalogRow(catalog, row, writer);
+    }
+}
+
+// Function to write the largest files matching a query by the chosen size, largest first;
+// limit 0 writes all
+template <typename Writer>
+void writeLargestFiles(const Catalog &catalog, const Query &query, unsigned long long limit, Writer &writer, SizeBasis basis = SizeBasis::Apparent)
+{
+    std::vector<uint32_t> rows;
+    {
+        MetricsPhase phase("query");
+        rows = selectQuery(catalog, query, std::max(1u, std::thread::hardware_concurrency()));
+        const std::vector<unsigned long long> &sizes = basis == SizeBasis::Allocated ? catalog.allocated : catalog.size;
+        auto larger = [&](uint32_t a, uint32_t b)
+        { return sizes[a] > sizes[b]; };
+        if (limit != 0 && limit < rows.size())
+        {
+            std::partial_sort(rows.begin(), rows.begin() + static_cast<std::ptrdiff_t>(limit), rows.end(), larger);
+            rows.resize(limit);
+        }
+        else
+        {
+            std::sort(rows.begin(), rows.end(), larger);
+        }
+    }
+    writer.setColumns({"path", "size", "allocated", "mtime", "atime", "type", "extension"});
+    for (uint32_t row : rows)
+    {
+        writeCatalogRow(catalog, row, writer);
+    }
+}
+
+// batch: query
+void runQueryCommand(const BatchOptions &options, ReportWriter &writer, ErrorTable &errors)
+{
+    const Catalog catalog = buildCatalog(options.roots, errors, options.scanOptions);
+    writeQueryResult(catalog, options.query, writer, options.sizeBy);
+}
+
+// Wire format shared by serve and ask. Every message is a frame: the payload length as 4 bytes
+// little-endian, then the payload. A request is one frame holding the protocol version, the
+// request kind and its arguments. The answer is a header frame with the column names, row
+// frames holding whole records, and an end frame with an error message, empty on success.
+// Integers are varints (zigzag for signed ones) and strings are prefixed with their length.
+constexpr unsigned char SERVE_PROTOCOL_VERSION = 1;
+constexpr size_t SERVE_MAX_FRAME = 16 << 20;
+constexpr size_t SERVE_ROWS_FRAME = 1 << 16;
+constexpr size_t SERVE_MAX_CONNECTIONS = 64;
+
+enum class ServeRequest : unsigned char
+{
+    Status = 1,
+    Query,   // query: Query; files or per-group totals
+    Top,     // query: Query, limit; largest matching files
+    Dupes,   // limit; duplicate groups, most reclaimable first
+    Refresh, // rescan now instead of at the next interval
+};
+
+enum class ServeFrame : unsigned char
+{
+    Header = 'H',
+    Rows = 'R',
+    End = 'E',
+};
+
+enum class ServeCell : unsigned char
+{
+    String,
+    Number,
+    Signed,
+    Double, // precision byte, then the IEEE bits as a varint
+};
+
+// Function to pick the daemon socket: --socket, else $XDG_RUNTIME_DIR/diskmanager.sock, else a
+// per-user name in /tmp
+std::string serveSocketPath(const BatchOptions &options)
+{
+    if (!options.socketPath.empty())
+    {
+        return options.socketPath;
+    }
+    const char *runtime = std::getenv("XDG_RUNTIME_DIR");
+    if (runtime && *runtime)
+    {
+        return std::string(runtime) + "/diskmanager.sock";
+    }
+    return "/tmp/diskmanager-" + std::to_string(::getuid()) + ".sock";
+}
+
+void putFrameString(std::string &out, std::string_view value)
+{
+    putVarint(out, value.size());
+    out.append(value);
+}
+
+bool getFrameString(const unsigned char *&p, const unsigned char *end, std::string &value)
+{
+    unsigned long long length;
+    if (!getVarint(p, end, length) || length > static_cast<unsigned long long>(end - p))
+    {
+        return false;
+    }
+    value.assign(reinterpret_cast<const char *>(p), static_cast<size_t>(length));
+    p += length;
+    return true;
+}
+
+// Function to send a whole buffer; MSG_NOSIGNAL turns a peer that went away into an error
+// instead of SIGPIPE
+bool sendAll(int fd, const void *data, size_t length, int flags)
+{
+    const char *next = static_cast<const char *>(data);
+    while (length > 0)
+    {
+        const ssize_t sent = ::send(fd, next, length, flags | MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        next += sent;
+        length -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+bool receiveAll(int fd, void *data, size_t length)
+{
+    char *next = static_cast<char *>(data);
+    while (length > 0)
+    {
+        const ssize_t received = ::recv(fd, next, length, 0);
+        if (received <= 0)
+        {
+            if (received < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        next += received;
+        length -= static_cast<size_t>(received);
+    }
+    return true;
+}
+
+bool sendFrame(int fd, std::string_view payload)
+{
+    unsigned char length[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        length[i] = static_cast<unsigned char>(payload.size() >> (8 * i));
+    }
+    return sendAll(fd, length, sizeof(length), MSG_MORE) && sendAll(fd, payload.data(), payload.size(), 0);
+}
+
+// Function to receive one frame; false at the end of the stream, on a failed read or for a
+// frame larger than SERVE_MAX_FRAME
+bool receiveFrame(int fd, std::string &payload)
+{
+    unsigned char length[4];
+    if (!receiveAll(fd, length, sizeof(length)))
+    {
+        return false;
+    }
+    const size_t size = length[0] | length[1] << 8 | length[2] << 16 | static_cast<size_t>(length[3]) << 24;
+    if (size > SERVE_MAX_FRAME)
+    {
+        errno = EMSGSIZE;
+        return false;
+    }
+    payload.resize(size);
+    return receiveAll(fd, payload.data(), size);
+}
+
+// Function to append a parsed query, so the daemon does not parse the client's text again
+void encodeQuery(std::string &out, const Query &query)
+{
+    out += static_cast<char>(query.groupBy);
+    putVarint(out, query.predicates.size());
+    for (const auto &predicate : query.predicates)
+    {
+        out += static_cast<char>(predicate.field);
+        out += static_cast<char>(predicate.negate);
+        putVarint(out, zigzagEncode(predicate.low));
+        putVarint(out, zigzagEncode(predicate.high));
+        putVarint(out, predicate.values.size());
+        for (const auto &value : predicate.values)
+        {
+            putFrameString(out, value);
+        }
+    }
+}
+
+bool decodeQuery(const unsigned char *&p, const unsigned char *end, Query &query)
+{
+    unsigned long long count;
+    if (p == end || *p > static_cast<unsigned char>(QueryGroup::Directory))
+    {
+        return false;
+    }
+    query.groupBy = static_cast<QueryGroup>(*p++);
+    if (!getVarint(p, end, count) || count > 256)
+    {
+        return false;
+    }
+    for (unsigned long long i = 0; i < count; ++i)
+    {
+        if (end - p < 2 || p[0] > static_cast<unsigned char>(QueryField::Path) || p[1] > 1)
+        {
+            return false;
+        }
+        QueryPredicate predicate;
+        predicate.field = static_cast<QueryField>(p[0]);
+        predicate.negate = p[1] != 0;
+        p += 2;
+        unsigned long long low, high, values;
+        if (!getVarint(p, end, low) || !getVarint(p, end, high) || !getVarint(p, end, values) || values > 4096)
+        {
+            return false;
+        }
+        predicate.low = zigzagDecode(low);
+        predicate.high = zigzagDecode(high);
+        predicate.values.resize(static_cast<size_t>(values));
+        for (auto &value : predicate.values)
+        {
+            if (!getFrameString(p, end, value))
+            {
+                return false;
+            }
+        }
+        // The engine matches a path term against its first value
+        if (predicate.field == QueryField::Path && predicate.values.size() != 1)
+        {
+            return false;
+        }
+        query.predicates.push_back(std::move(predicate));
+    }
+    return true;
+}
+
+// Report sink on the daemon side. It takes the calls of ReportWriter and encodes them into row
+// frames of about 64 KiB, so a long listing streams to the client without being held in memory.
+class FrameWriter
+{
+public:
+    explicit FrameWriter(int fd) : fd_(fd), rows_(1, static_cast<char>(ServeFrame::Rows)) {}
+
+    void setColumns(std::initializer_list<const char *> columns)
+    {
+        std::string frame(1, static_cast<char>(ServeFrame::Header));
+        putVarint(frame, columns.size());
+        for (const char *column : columns)
+        {
+            putFrameString(frame, column);
+        }
+        send(frame);
+    }
+
+    void beginRecord() {}
+
+    void addString(std::string_view value)
+    {
+        rows_ += static_cast<char>(ServeCell::String);
+        putFrameString(rows_, value);
+    }
+
+    void addNumber(unsigned long long value)
+    {
+        rows_ += static_cast<char>(ServeCell::Number);
+        putVarint(rows_, value);
+    }
+
+    void addSignedNumber(long long value)
+    {
+        rows_ += static_cast<char>(ServeCell::Signed);
+        putVarint(rows_, zigzagEncode(value));
+    }
+
+    void addDouble(double value, int precision)
+    {
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        rows_ += static_cast<char>(ServeCell::Double);
+        rows_ += static_cast<char>(precision);
+        putVarint(rows_, bits);
+    }
+
+    void endRecord()
+    {
+        if (rows_.size() >= SERVE_ROWS_FRAME)
+        {
+            flushRows();
+        }
+    }
+
+    // Function to end the answer; an empty error means success
+    void finish(std::string_view error)
+    {
+        flushRows();
+        std::string frame(1, static_cast<char>(ServeFrame::End));
+        putFrameString(frame, error);
+        send(frame);
+    }
+
+    bool failed() const { return failed_; }
+
+private:
+    void flushRows()
+    {
+        if (rows_.size() > 1)
+        {
+            send(rows_);
+            rows_.resize(1);
+        }
+    }
+
+    void send(const std::string &frame)
+    {
+        if (!failed_ && !sendFrame(fd_, frame))
+        {
+            failed_ = true;
+        }
+    }
+
+    int fd_;
+    std::string rows_;
+    bool failed_ = false;
+};
+
+// Function to decode one cell of a row frame into the writer
+bool decodeServeCell(const unsigned char *&p, const unsigned char *end, ReportWriter &writer, std::string &text)
+{
+    if (p == end)
+    {
+        return false;
+    }
+    const auto cell = static_cast<ServeCell>(*p++);
+    unsigned long long value;
+    switch (cell)
+    {
+    case ServeCell::String:
+        if (!getFrameString(p, end, text))
+        {
+            return false;
+        }
+        writer.addString(text);
+        return true;
+    case ServeCell::Number:
+    case ServeCell::Signed:
+        if (!getVarint(p, end, value))
+        {
+            return false;
+        }
+        if (cell == ServeCell::Number)
+        {
+            writer.addNumber(value);
+        }
+        else
+        {
+            writer.addSignedNumber(zigzagDecode(value));
+        }
+        return true;
+    case ServeCell::Double:
+    {
+        if (p == end)
+        {
+            return false;
+        }
+        const int precision = *p++;
+        if (!getVarint(p, end, value))
+        {
+            return false;
+        }
+        double number;
+        std::memcpy(&number, &value, sizeof(number));
+        writer.addDouble(number, precision);
+        return true;
+    }
+    }
+    return false;
+}
+
+// One generation of the daemon's data. A published generation is never modified: the updater
+// builds the next one beside it and swaps the pointer, while every request keeps answering from
+// the generation it loaded until it is done (read-copy-update, with the shared_ptr count as the
+// grace period). Queries never wait for a rescan and a rescan never waits for queries, beyond
+// the pointer copy itself: C++17's atomic_load/atomic_store on a shared_ptr are not lock-free,
+// libstdc++ guards them with a small pool of mutexes held only for that copy.
+struct ServedCatalog
+{
+    struct DuplicateGroup
+    {
+        std::string hash;
+        unsigned long long size = 0;
+        std::vector<std::string> paths;
+    };
+
+    Catalog catalog;
+    std::vector<DuplicateGroup> duplicates; // most reclaimable bytes first
+    unsigned long long generation = 0;
+    unsigned long long bytes = 0;
+    unsigned long long reclaimable = 0; // bytes freed by keeping one file of every group
+    long long scannedAt = 0;
+    double scanSeconds = 0;
+    size_t errors = 0; // distinct failures of the scan
+};
+
+// The serve command. The accept loop hands every connection to a thread of its own, which
+// answers requests until the client hangs up; an updater thread rescans the roots every
+// --refresh seconds or when asked to. SIGINT and SIGTERM stop them all and remove the socket.
+class QueryDaemon
+{
+public:
+    explicit QueryDaemon(const BatchOptions &options) : options_(options), socketPath_(serveSocketPath(options)) {}
+
+    ~QueryDaemon()
+    {
+        if (listenFd_ >= 0)
+        {
+            ::close(listenFd_);
+            ::unlink(socketPath_.c_str());
+        }
+    }
+
+    const std::string &socketPath() const { return socketPath_; }
+
+    // Function to create the socket, readable and writable by the owner only; returns an errno
+    int listen()
+    {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (socketPath_.size() >= sizeof(address.sun_path))
+        {
+            return ENAMETOOLONG;
+        }
+        std::memcpy(address.sun_path, socketPath_.c_str(), socketPath_.size() + 1);
+        const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            return errno;
+        }
+        const mode_t mask = ::umask(0177);
+        int result = ::bind(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address));
+        if (result < 0 && errno == EADDRINUSE)
+        {
+            // A socket left behind by a daemon that died is replaced, one that still answers is not
+            const int probe = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            const bool alive = probe >= 0 && ::connect(probe, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == 0;
+            if (probe >= 0)
+            {
+                ::close(probe);
+            }
+            if (!alive && ::unlink(socketPath_.c_str()) == 0)
+            {
+                result = ::bind(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address));
+            }
+            else
+            {
+                errno = EADDRINUSE;
+            }
+        }
+        ::umask(mask);
+        if (result < 0 || ::listen(fd, 64) < 0)
+        {
+            const int error = errno;
+            ::close(fd);
+            return error;
+        }
+        listenFd_ = fd;
+        return 0;
+    }
+
+    // Function to serve until SIGINT or SIGTERM
+    void run()
+    {
+        ScanControl::installSignalHandlers();
+        std::signal(SIGTERM, requestScanInterrupt);
+        std::cerr << "Serving " << socketPath_ << '\n';
+        std::thread updater(&QueryDaemon::updateLoop, this);
+
+        std::list<Connection> connections;
+        while (!scanInterruptRequested.load(std::memory_order_relaxed))
+        {
+            // Finished connections are reaped on every turn, so their threads never pile up
+            for (auto it = connections.begin(); it != connections.end();)
+            {
+                if (it->done.load(std::memory_order_acquire))
+                {
+                    it->thread.join();
+                    ::close(it->fd);
+                    it = connections.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+            pollfd listening = {listenFd_, POLLIN, 0};
+            if (::poll(&listening, 1, 200) <= 0)
+            {
+                continue;
+            }
+            const int fd = ::accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0)
+            {
+                continue;
+            }
+            if (connections.size() >= SERVE_MAX_CONNECTIONS)
+            {
+                FrameWriter(fd).finish("too many connections, try again");
+                ::close(fd);
+                continue;
+            }
+            // A client that stops reading or writing is dropped instead of holding a thread forever
+            const timeval timeout = {60, 0};
+            ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            Connection &connection = connections.emplace_back();
+            connection.fd = fd;
+            connection.thread = std::thread([this, &connection]
+                                            {
+                                                serveConnection(connection.fd);
+                                                connection.done.store(true, std::memory_order_release);
+                                            });
+        }
+
+        // Connections blocked in recv are woken by shutting their sockets down
+        for (auto &connection : connections)
+        {
+            ::shutdown(connection.fd, SHUT_RDWR);
+            connection.thread.join();
+            ::close(connection.fd);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        updater.join();
+        std::signal(SIGTERM, SIG_DFL);
+        ScanControl::restoreSignalHandlers();
+    }
+
+private:
+    struct Connection
+    {
+        int fd = -1;
+        std::thread thread;
+        std::atomic<bool> done{false};
+    };
+
+    void updateLoop()
+    {
+        const double interval = options_.refreshInterval > 0 ? options_.refreshInterval : 300.0;
+        for (;;)
+        {
+            scanning_.store(true, std::memory_order_relaxed);
+            rescan();
+            scanning_.store(false, std::memory_order_relaxed);
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait_for(lock, std::chrono::duration<double>(interval), [this]
+                           { return refreshRequested_ || stopping_; });
+            if (stopping_)
+            {
+                return;
+            }
+            refreshRequested_ = false;
+        }
+    }
+
+    // Function to scan the roots into a new generation and publish it. A rescan stopped by a
+    // budget or a signal is thrown away and the previous generation stays in service.
+    void rescan()
+    {
+        ScanControl control;
+        if (options_.timeBudget > 0)
+        {
+            control.setTimeBudget(options_.timeBudget);
+        }
+        if (options_.ioBudget > 0)
+        {
+            control.setByteBudget(options_.ioBudget);
+        }
+        ScanOptions scanOptions = options_.scanOptions;
+        scanOptions.control = &control;
+        // Unchanged files are not read again: their hashes are kept from one rescan to the next
+        DuplicateScanOptions duplicateOptions = options_.duplicateOptions;
+        duplicateOptions.scanOptions = scanOptions;
+        duplicateOptions.checkpoint = &hashCache_;
+        duplicateOptions.keepUsedHashesOnly = true;
+
+        auto next = std::make_shared<ServedCatalog>();
+        ErrorTable errors;
+        const auto start = std::chrono::steady_clock::now();
+        bool walked = false;
+        try
+        {
+            // One walk builds the catalog and feeds the duplicate engine
+            forEachDuplicateGroupOf([&](auto &&onFile)
+                                    {
+                                        next->catalog = buildCatalog(options_.roots, errors, scanOptions, onFile);
+                                        walked = true;
+                                    },
+                                    errors, duplicateOptions,
+                                    [&](const std::string &hash, unsigned long long size, const std::vector<std::string> &paths)
+                                    { next->duplicates.push_back({hash, size, paths}); });
+        }
+        catch (const std::system_error &e)
+        {
+            std::cerr << "Error: duplicate scan failed: " << e.what() << '\n';
+            errors.record(duplicateOptions.tempDir.empty() ? "spill directory" : duplicateOptions.tempDir, e.code().value(),
+                          ScanOp::Write);
+        }
+        if (!walked)
+        {
+            std::cerr << "Rescan failed during the walk, still serving generation " << generation_ << '\n';
+            return;
+        }
+        if (control.reason() != ScanControl::Stop::None)
+        {
+            std::cerr << "Rescan stopped (" << control.reasonName() << "), still serving generation " << generation_ << '\n';
+            return;
+        }
+
+        next->scanSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        next->scannedAt = static_cast<long long>(std::time(nullptr));
+        next->errors = errors.size();
+        for (unsigned long long size : next->catalog.size)
+        {
+            next->bytes += size;
+        }
+        for (const auto &group : next->duplicates)
+        {
+            next->reclaimable += group.size * (group.paths.size() - 1);
+        }
+        std::sort(next->duplicates.begin(), next->duplicates.end(), [](const auto &a, const auto &b)
+                  { return a.size * (a.paths.size() - 1) > b.size * (b.paths.size() - 1); });
+        next->generation = ++generation_;
+        std::cerr << "Generation " << next->generation << ": " << next->catalog.rows() << " files, "
+                  << sizeToString(next->bytes) << ", " << next->duplicates.size() << " duplicate groups, "
+                  << next->errors << " errors, scanned in " << std::fixed << std::setprecision(1) << next->scanSeconds
+                  << std::defaultfloat << " s\n";
+        if (!errors.empty())
+        {
+            errors.summarize(std::cerr, 3);
+        }
+        std::atomic_store(&current_, std::shared_ptr<const ServedCatalog>(std::move(next)));
+    }
+
+    void serveConnection(int fd)
+    {
+        std::string request;
+        while (receiveFrame(fd, request) && answer(fd, request))
+        {
+        }
+    }
+
+    // Function to answer one request; returns false once the client cannot be written to
+    bool answer(int fd, const std::string &request)
+    {
+        FrameWriter writer(fd);
+        const auto *p = reinterpret_cast<const unsigned char *>(request.data());
+        const auto *end = p + request.size();
+        // The whole answer comes from the generation that was current when the request arrived
+        const std::shared_ptr<const ServedCatalog> served = std::atomic_load(&current_);
+        std::string error;
+        if (request.size() < 2 || p[0] != SERVE_PROTOCOL_VERSION)
+        {
+            error = "unsupported protocol version";
+            writer.finish(error);
+            return !writer.failed();
+        }
+        const auto kind = static_cast<ServeRequest>(p[1]);
+        p += 2;
+        Query query;
+        unsigned long long limit = 0;
+        const bool takesQuery = kind == ServeRequest::Query || kind == ServeRequest::Top;
+        const bool takesLimit = kind == ServeRequest::Top || kind == ServeRequest::Dupes;
+        bool malformed = (takesQuery && !decodeQuery(p, end, query)) || (takesLimit && !getVarint(p, end, limit));
+        // Query and top may end with the size basis; older clients leave it out
+        SizeBasis basis = SizeBasis::Apparent;
+        if (!malformed && takesQuery && p < end)
+        {
+            malformed = *p > static_cast<unsigned char>(SizeBasis::Allocated);
+            basis = static_cast<SizeBasis>(*p);
+        }
+        if (malformed)
+        {
+            error = "malformed request";
+        }
+        else if (kind == ServeRequest::Status)
+        {
+            writeStatus(served.get(), writer);
+        }
+        else if (kind == ServeRequest::Refresh)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                refreshRequested_ = true;
+            }
+            wake_.notify_all();
+        }
+        else if (kind != ServeRequest::Query && kind != ServeRequest::Top && kind != ServeRequest::Dupes)
+        {
+            error = "unknown request";
+        }
+        else if (!served)
+        {
+            error = "the first scan has not finished yet";
+        }
+        else if (kind == ServeRequest::Query)
+        {
+            writeQueryResult(served->catalog, query, writer, basis);
+        }
+        else if (kind == ServeRequest::Top)
+        {
+            writeLargestFiles(served->catalog, query, limit, writer, basis);
+        }
+        else
+        {
+            writeDuplicates(*served, limit, writer);
+        }
+        writer.finish(error);
+        return !writer.failed();
+    }
+
+    void writeStatus(const ServedCatalog *served, FrameWriter &writer) const
+    {
+        writer.setColumns({"generation", "state", "files", "bytes", "directories", "duplicate_groups", "reclaimable_bytes",
+                           "scanned_at", "scan_seconds", "errors"});
+        writer.beginRecord();
+        writer.addNumber(served ? served->generation : 0);
+        writer.addString(scanning_.load(std::memory_order_relaxed) ? "scanning" : "idle");
+        writer.addNumber(served ? served->catalog.rows() : 0);
+        writer.addNumber(served ? served->bytes : 0);
+        writer.addNumber(served ? served->catalog.directories.size() : 0);
+        writer.addNumber(served ? served->duplicates.size() : 0);
+        writer.addNumber(served ? served->reclaimable : 0);
+        writer.addSignedNumber(served ? served->scannedAt : 0);
+        writer.addDouble(served ? served->scanSeconds : 0.0, 3);
+        writer.addNumber(served ? served->errors : 0);
+        writer.endRecord();
+    }
+
+    void writeDuplicates(const ServedCatalog &served, unsigned long long limit, FrameWriter &writer) const
+    {
+        writer.setColumns({"group", "hash", "size", "path"});
+        const size_t groups = limit == 0 ? served.duplicates.size() : std::min<size_t>(limit, served.duplicates.size());
+        for (size_t i = 0; i < groups; ++i)
+        {
+            const auto &group = served.duplicates[i];
+            for (const auto &path : group.paths)
+            {
+                writer.beginRecord();
+                writer.addNumber(i + 1);
+                writer.addString(group.hash);
+                writer.addNumber(group.size);
+                writer.addString(path);
+                writer.endRecord();
+            }
+        }
+    }
+
+    const BatchOptions &options_;
+    const std::string socketPath_;
+    int listenFd_ = -1;
+    std::shared_ptr<const ServedCatalog> current_; // only accessed through atomic_load/atomic_store (briefly locked)
+    ScanCheckpoint hashCache_;                     // updater thread only
+    unsigned long long generation_ = 0;            // updater thread only
+    std::atomic<bool> scanning_{false};
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    bool refreshRequested_ = false;
+    bool stopping_ = false;
+};
+
+// batch: serve
+void runServeCommand(const BatchOptions &options, ReportWriter &, ErrorTable &errors)
+{
+    QueryDaemon daemon(options);
+    const int error = daemon.listen();
+    if (error != 0)
+    {
+        if (error == EADDRINUSE)
+        {
+            std::cerr << "Another daemon is already serving " << daemon.socketPath() << '\n';
+        }
+        errors.record(daemon.socketPath(), error, ScanOp::Write);
+        return;
+    }
+    daemon.run();
+}
+
+// batch: ask. Sends one request to a running serve and writes the answer like any other report.
+int runAskCommand(const BatchOptions &options, ReportWriter &writer, ErrorTable &errors)
+{
+    std::string request(1, static_cast<char>(SERVE_PROTOCOL_VERSION));
+    const std::string &kind = options.askRequest;
+    if (kind == "status" || kind == "refresh")
+    {
+        request += static_cast<char>(kind == "status" ? ServeRequest::Status : ServeRequest::Refresh);
+    }
+    else if (kind == "dupes")
+    {
+        request += static_cast<char>(ServeRequest::Dupes);
+        putVarint(request, options.limit);
+    }
+    else
+    {
+        // breakdown is a query grouped by extension unless --group-by asks for another grouping
+        Query query = options.query;
+        if (kind == "breakdown" && query.groupBy == QueryGroup::None)
+        {
+            query.groupBy = QueryGroup::Extension;
+        }
+        request += static_cast<char>(kind == "top" ? ServeRequest::Top : ServeRequest::Query);
+        encodeQuery(request, query);
+        if (kind == "top")
+        {
+            putVarint(request, options.limit);
+        }
+        request += static_cast<char>(options.sizeBy);
+    }
 
-//     // Remove entries with a single file (no duplicates based on size)
-//     for (auto it = duplicateFiles.begin(); it != duplicateFiles.end();)
-//     {
-//         if (it->second.size() < 2)
-//         {
-//             it = duplicateFiles.erase(it);
-//         }
-//         else
-//         {
-//             ++it;
-//         }
-//     }
+    const std::string socketPath = serveSocketPath(options);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path))
+    {
+        errors.record(socketPath, ENAMETOOLONG, ScanOp::Connect);
+        return 1;
+    }
+    std::memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) < 0)
+    {
+        errors.record(socketPath, errno, ScanOp::Connect);
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        std::cerr << "Is diskmanager serve running?\n";
+        return 1;
+    }
+    // A socket in /tmp could have been planted by someone else: only trust our own user or root
+    ucred peer = {};
+    socklen_t peerLength = sizeof(peer);
+    if (::getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &peerLength) < 0 || (peer.uid != ::getuid() && peer.uid != 0))
+    {
+        std::cerr << "Error: " << socketPath << " is served by another user\n";
+        errors.record(socketPath, EPERM, ScanOp::Connect);
+        ::close(fd);
+        return 1;
+    }
 
-//     // Compare files with the same size based on content (if needed)
-//     for (auto &[size, files] : duplicateFiles)
-//     {
-//         if (files.size() > 1)
-//         {
-//             std::sort(files.begin(), files.end());
+    std::vector<std::string> columns;
+    std::string frame;
+    std::string text;
+    bool complete = false;
+    bool malformed = false;
+    int status = 0;
+    if (sendFrame(fd, request))
+    {
+        while (!complete && !malformed && receiveFrame(fd, frame))
+        {
+            const auto *p = reinterpret_cast<const unsigned char *>(frame.data());
+            const auto *end = p + frame.size();
+            if (p == end)
+            {
+                malformed = true;
+                break;
+            }
+            switch (static_cast<ServeFrame>(*p++))
+            {
+            case ServeFrame::Header:
+            {
+                unsigned long long count;
+                malformed = !getVarint(p, end, count) || count == 0 || count > ReportWriter::MAX_COLUMNS;
+                columns.assign(malformed ? 0 : static_cast<size_t>(count), std::string());
+                for (auto &column : columns)
+                {
+                    malformed = malformed || !getFrameString(p, end, column);
+                }
+                if (!malformed)
+                {
+                    writer.setColumns(columns);
+                }
+                break;
+            }
+            case ServeFrame::Rows:
+                while (!malformed && p < end && !columns.empty())
+                {
+                    writer.beginRecord();
+                    for (size_t column = 0; column < columns.size() && !malformed; ++column)
+                    {
+                        malformed = !decodeServeCell(p, end, writer, text);
+                    }
+                    writer.endRecord();
+                }
+                malformed = malformed || columns.empty();
+                break;
+            case ServeFrame::End:
+                malformed = !getFrameString(p, end, text);
+                if (!malformed && !text.empty())
+                {
+                    std::cerr << "Error: " << text << '\n';
+                    status = 1;
+                }
+                complete = true;
+                break;
+            default:
+                malformed = true;
+                break;
+            }
+        }
+    }
+    const int error = errno;
+    ::close(fd);
+    if (!complete)
+    {
+        std::cerr << "Error: " << (malformed ? "malformed answer" : "the connection was closed") << " before the answer was complete\n";
+        errors.record(socketPath, malformed ? 0 : error, ScanOp::Read);
+        return 1;
+    }
+    return status;
+}
 
-//             auto last = std::unique(files.begin(), files.end());
-//             files.erase(last, files.end());
-//         }
-//     }
+// Function to open the history named by --history, reporting failures on stderr
+bool openHistory(const BatchOptions &options, SnapshotHistory &history, ErrorTable &errors)
+{
+    std::string error;
+    if (!history.open(error))
+    {
+        std::cerr << "Error: " << error << '\n';
+        errors.record(options.historyPath, 0, ScanOp::Read);
+        return false;
+    }
+    return true;
+}
+
+// batch: snapshot
+void runSnapshotCommand(const BatchOptions &options, ReportWriter &writer, ErrorTable &errors)
+{
+    SnapshotHistory history(options.historyPath);
+    if (!openHistory(options, history, errors))
+    {
+        return;
+    }
+    const Catalog catalog = buildCatalog(options.roots, errors, options.scanOptions);
+    MetricsPhase phase("snapshot");
+    SnapshotInfo info;
+    unsigned long long changed = 0;
+    unsigned long long removed = 0;
+    std::string error;
+    if (!history.append(catalog, static_cast<long long>(std::time(nullptr)), info, changed, removed, error))
+    {
+        std::cerr << "Error: " << error << '\n';
+        errors.record(options.historyPath, 0, ScanOp::Write);
+        return;
+    }
+    writer.setColumns({"snapshot", "time", "files", "bytes", "changed", "removed", "encoded_bytes"});
+    writer.beginRecord();
+    writer.addNumber(history.snapshots().size() - 1);
+    writer.addSignedNumber(info.time);
+    writer.addNumber(info.files);
+    writer.addNumber(info.bytes);
+    writer.addNumber(changed);
+    writer.addNumber(removed);
+    writer.addNumber(info.length);
+    writer.endRecord();
+}
+
+// batch: history
+void runHistoryCommand(const BatchOptions &options, ReportWriter &writer, ErrorTable &errors)
+{
+    SnapshotHistory history(options.historyPath);
+    if (!openHistory(options, history, errors))
+    {
+        return;
+    }
+    writer.setColumns({"snapshot", "time", "keyframe", "files", "bytes", "encoded_bytes"});
+    for (size_t i = 0; i < history.snapshots().size(); ++i)
+    {
+        const SnapshotInfo &info = history.snapshots()[i];
+        writer.beginRecord();
+        writer.addNumber(i);
+        writer.addSignedNumber(info.time);
+        writer.addNumber(info.keyframe ? 1 : 0);
+        writer.addNumber(info.files);
+        writer.addNumber(info.bytes);
+        writer.addNumber(info.length);
+        writer.endRecord();
+    }
+}
+
+// batch: growth
+void runGrowthCommand(const BatchOptions &options, ReportWriter &writer, ErrorTable &errors)
+{
+    SnapshotHistory history(options.historyPath);
+    if (!openHistory(options, history, errors))
+    {
+        return;
+    }
+    const long long count = static_cast<long long>(history.snapshots().size());
+    const long long from = options.fromSnapshot < 0 ? count + options.fromSnapshot : options.fromSnapshot;
+    const long long to = options.toSnapshot < 0 ? count + options.toSnapshot : options.toSnapshot;
+    if (from < 0 || to < 0 || from >= count || to >= count)
+    {
+        std::cerr << "Error: the history has " << count << " snapshots\n";
+        errors.record(options.historyPath, 0, ScanOp::Read);
+        return;
+    }
+
+    std::vector<GrowthRow> rows;
+    {
+        MetricsPhase phase("growth");
+        const QueryGroup groupBy = options.query.groupBy == QueryGroup::None ? QueryGroup::Directory : options.query.groupBy;
+        rows = computeGrowth(history, history.load(from), history.load(to), groupBy);
+    }
+    const double days = (history.snapshots()[to].time - history.snapshots()[from].time) / 86400.0;
+    writer.setColumns({"group", "bytes_before", "bytes_after", "growth", "growth_per_day", "files_before", "files_after"});
+    for (size_t i = 0; i < rows.size() && (options.limit == 0 || i < options.limit); ++i)
+    {
+        const GrowthRow &row = rows[i];
+        writer.beginRecord();
+        writer.addString(row.group);
+        writer.addNumber(row.bytesBefore);
+        writer.addNumber(row.bytesAfter);
+        writer.addSignedNumber(row.growth());
+        writer.addDouble(days > 0 ? row.growth() / days : 0.0, 1);
+        writer.addNumber(row.filesBefore);
+        writer.addNumber(row.filesAfter);
+        writer.endRecord();
+    }
+}
+
+// batch: chunks
+void runChunksCommand(const BatchOptions &options, ReportWriter &writer, ErrorTable &errors)
+{
+    const QueryGroup groupBy = options.query.groupBy == QueryGroup::None ? QueryGroup::Directory : options.query.groupBy;
+    ChunkGroupStats total;
+    unsigned long long uniqueChunks = 0;
+    const auto groups = estimateChunkDedupe(options.roots, options.chunkSize, groupBy, errors,
+                                            options.duplicateOptions, total, uniqueChunks);
+    writer.setColumns({"group", "files", "bytes", "redundant_bytes", "cross_file_bytes", "savings_ratio"});
+    auto addRow = [&](const ChunkGroupStats &row)
+    {
+        writer.beginRecord();
+        writer.addString(row.group);
+        writer.addNumber(row.files);
+        writer.addNumber(row.bytes);
+        writer.addNumber(row.redundantBytes);
+        writer.addNumber(row.crossFileBytes);
+        writer.addDouble(row.bytes ? static_cast<double>(row.redundantBytes) / row.bytes : 0.0, 4);
+        writer.endRecord();
+    };
+    addRow(total);
+    for (size_t i = 0; i < groups.size() && (options.limit == 0 || i < options.limit); ++i)
+    {
+        addRow(groups[i]);
+    }
+    std::cerr << uniqueChunks << " unique chunks, " << sizeToString(total.bytes - total.redundantBytes)
+              << " after dedupe of " << sizeToString(total.bytes) << '\n';
+}
+
+// batch: compress
+void runCompressCommand(const BatchOptions &options, ReportWriter &writer, ErrorTable &errors)
+{
+    unsigned long long blocksRead = 0;
+    const uint64_t seed = options.seeded ? options.treeSpec.seed
+                                         : static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+    const auto groups = estimateCompression(options.roots, options.sampleRate, seed, errors, options.duplicateOptions, blocksRead);
+    writer.setColumns({"kind", "group", "files", "bytes", "sampled_bytes", "saved_bytes", "saved_low", "saved_high", "savings_ratio"});
+    size_t directories = 0;
+    for (const auto &row : groups)
+    {
+        if (row.kind == CompressionGroupStats::Kind::Directory && options.limit != 0 && directories++ >= options.limit)
+        {
+            continue;
+        }
+        // 95% bounds, clamped to what the group can save; bytes no sample reached widen the top
+        const double margin = 1.96 * std::sqrt(row.variance);
+        const double bytes = static_cast<double>(row.bytes);
+        writer.beginRecord();
+        writer.addString(row.kind == CompressionGroupStats::Kind::Total ? "total"
+                         : row.kind == CompressionGroupStats::Kind::Type ? "type"
+                                                                         : "dir");
+        writer.addString(row.group);
+        writer.addNumber(row.files);
+        writer.addNumber(row.bytes);
+        writer.addNumber(row.sampledBytes);
+        writer.addNumber(static_cast<unsigned long long>(std::llround(std::clamp(row.savedBytes, 0.0, bytes))));
+        writer.addNumber(static_cast<unsigned long long>(std::llround(std::clamp(row.savedBytes - margin, 0.0, bytes))));
+        writer.addNumber(static_cast<unsigned long long>(std::llround(std::clamp(row.savedBytes + margin + row.unsampledBytes, 0.0, bytes))));
+        writer.addDouble(row.bytes ? std::clamp(row.savedBytes / bytes, 0.0, 1.0) : 0.0, 4);
+        writer.endRecord();
+    }
+    if (!groups.empty() && groups[0].bytes > 0)
+    {
+        std::cerr << "Compressed " << blocksRead << " sampled blocks, " << sizeToString(groups[0].sampledBytes) << " of "
+                  << sizeToString(groups[0].bytes) << " (" << std::setprecision(2) << std::fixed
+                  << 100.0 * groups[0].sampledBytes / groups[0].bytes << "%)\n";
+    }
+}
+
+// batch: estimate
+void runEstimateCommand(const BatchOptions &options, ReportWriter &writer, ErrorTable &errors)
+{
+    MetricsPhase phase("estimate");
+    const auto start = std::chrono::steady_clock::now();
+    TreeEstimator estimator(options.roots, options.scanOptions);
+    ScanControl *control = options.scanOptions.control;
+    auto proceed = [control] { return !control || control->proceed(); };
+    std::atomic<bool> stop{false};
+    const unsigned workers = options.duplicateOptions.workers ? options.duplicateOptions.workers
+                                                              : std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> pool;
+    for (unsigned w = 0; w < workers; ++w)
+    {
+        pool.emplace_back([&, w]
+                          {
+                              uint64_t random = mix64(static_cast<uint64_t>(start.time_since_epoch().count()) + w);
+                              while (!stop.load(std::memory_order_relaxed) && proceed() && estimator.sample(random))
+                              {
+                              }
+                          });
+    }
+    if (options.refine)
+    {
+        // The full scan lists what the walks have not reached yet
+        pool.emplace_back([&]
+                          {
+                              while (!stop.load(std::memory_order_relaxed) && proceed() && estimator.scanNext())
+                              {
+                              }
+                          });
+    }
+
+    writer.setColumns({"elapsed_seconds", "group", "bytes", "bytes_low", "bytes_high", "files", "walks", "exact"});
+    auto emit = [&]
+    {
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        size_t directories = 0;
+        for (const auto &row : estimator.report())
+        {
+            const bool directory = row.group.compare(0, 5, "type:") != 0 && row.group != "total";
+            if (directory && options.limit != 0 && directories++ >= options.limit)
+            {
+                continue;
+            }
+            const double bytes = row.value[TreeEstimator::BYTES];
+            const double margin = row.halfWidth[TreeEstimator::BYTES];
+            writer.beginRecord();
+            writer.addDouble(elapsed, 3);
+            writer.addString(row.group);
+            writer.addNumber(static_cast<unsigned long long>(std::llround(bytes)));
+            writer.addNumber(static_cast<unsigned long long>(std::llround(std::max(0.0, bytes - margin))));
+            writer.addNumber(std::isfinite(margin) ? static_cast<unsigned long long>(std::llround(bytes + margin))
+                                                   : std::numeric_limits<unsigned long long>::max());
+            writer.addNumber(static_cast<unsigned long long>(std::llround(row.value[TreeEstimator::FILES])));
+            writer.addNumber(row.walks);
+            writer.addNumber(row.exact ? 1 : 0);
+            writer.endRecord();
+        }
+    };
+
+    // Sample until the time limit, then report; with --refine keep reporting until exact
+    auto waitUntil = [&](std::chrono::steady_clock::time_point deadline)
+    {
+        while (std::chrono::steady_clock::now() < deadline && !estimator.complete() && !(control && control->stopped()))
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+    };
+    auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(options.timeLimit));
+    waitUntil(deadline);
+    if (options.refine)
+    {
+        while (!estimator.complete() && !(control && control->stopped()))
+        {
+            emit();
+            deadline += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(options.refreshInterval > 0 ? options.refreshInterval : 5.0));
+            waitUntil(deadline);
+        }
+    }
+    stop = true;
+    for (auto &thread : pool)
+    {
+        thread.join();
+    }
+    emit();
+    errors.merge(estimator.takeErrors());
+}
+
+// batch: large
+void runLargeCommand(const BatchOptions &options, ReportWriter &writer, ErrorTable &errors)
+{
+    // Welford's running mean and variance, so the first pass keeps no per-file state
+    unsigned long long count = 0;
+    double mean = 0.0;
+    double m2 = 0.0;
+    MetricsPhase statisticsPhase("statistics");
+    for (const auto &root : options.roots)
+    {
+        scanTree(root, [&](const ScanEntry &entry)
+                 {
+                     ++count;
+                     const double size = static_cast<double>(sizeFor(entry, options.sizeBy));
+                     const double delta = size - mean;
+                     mean += delta / count;
+                     m2 += delta * (size - mean);
+                 },
+                 errors, options.scanOptions);
+    }
+
+    // holes: bytes in unwritten regions, measured only for files with fewer blocks than bytes
+    writer.setColumns({"rank", "size", "allocated", "holes", "path"});
+    if (count == 0)
+    {
+        return;
+    }
+    const double stdDev = std::sqrt(m2 / count);
+    std::cerr << "Mean file size: " << sizeToString(mean) << ", Standard Deviation: " << sizeToString(stdDev) << '\n';
+
+    std::vector<LargeFile> largeFiles;
+    MetricsPhase selectionPhase("selection");
+    for (const auto &root : options.roots)
+    {
+        scanTree(root, [&](const ScanEntry &entry)
+                 {
+                     if (sizeFor(entry, options.sizeBy) > mean + stdDev)
+                     {
+                         largeFiles.push_back({std::string(entry.path), entry.size, entry.allocated});
+                     }
+                 },
+                 errors, options.scanOptions);
+    }
+    const bool byAllocated = options.sizeBy == SizeBasis::Allocated;
+    std::sort(largeFiles.begin(), largeFiles.end(), [byAllocated](const LargeFile &a, const LargeFile &b)
+              { return byAllocated ? a.allocated > b.allocated : a.size > b.size; });
+
+    unsigned long long rank = 1;
+    for (const auto &file : largeFiles)
+    {
+        writer.beginRecord();
+        writer.addNumber(rank++);
+        writer.addNumber(file.size);
+        writer.addNumber(file.allocated);
+        writer.addNumber(isSparseCandidate(file.size, file.allocated) ? measureHoleBytes(file.path, file.size, errors) : 0);
+        writer.addString(file.path);
+        writer.endRecord();
+    }
+}
+
+// batch: cold
+void runColdCommand(const BatchOptions &options, ReportWriter &writer, ErrorTable &errors)
+{
+    ColdDataReport report(static_cast<long long>(std::time(nullptr)), options.coldDays, options.ageBy, options.query.groupBy);
+    {
+        MetricsPhase phase("traversal");
+        for (const auto &root : options.roots)
+        {
+            report.beginRoot(root.string());
+            scanTree(root, [&](const ScanEntry &entry)
+                     { report.add(entry); },
+                     errors, options.scanOptions);
+        }
+    }
+
+    if (options.query.groupBy != QueryGroup::None)
+    {
+        writer.setColumns({"group", "size_bucket", "age_bucket", "files", "bytes", "allocated"});
+        for (const auto &[group, cells] : report.heatmap())
+        {
+            for (size_t sizeBucket = 0; sizeBucket < COLD_SIZE_BUCKETS; ++sizeBucket)
+            {
+                for (size_t ageBucket = 0; ageBucket < COLD_AGE_BUCKETS; ++ageBucket)
+                {
+                    const ColdCell &cell = (*cells)[sizeBucket * COLD_AGE_BUCKETS + ageBucket];
+                    if (cell.files == 0)
+                    {
+                        continue;
+                    }
+                    writer.beginRecord();
+                    writer.addString(group);
+                    writer.addString(COLD_SIZE_LABELS[sizeBucket]);
+                    writer.addString(COLD_AGE_LABELS[ageBucket]);
+                    writer.addNumber(cell.files);
+                    writer.addNumber(cell.bytes);
+                    writer.addNumber(cell.allocated);
+                    writer.endRecord();
+                }
+            }
+        }
+        return;
+    }
+
+    // One row per root with its rollups, then the largest cold subtrees
+    {
+        MetricsPhase phase("aggregation");
+        report.rollUp();
+    }
+    writer.setColumns({"path", "files", "bytes", "allocated", "cold_files", "cold_bytes", "cold_allocated", "cold_share", "last_touch", "idle_7d", "idle_30d",
+                       "idle_90d", "idle_180d", "idle_365d", "idle_730d"});
+    auto addRow = [&](const std::string &path, const ColdDirectory &totals)
+    {
+        writer.beginRecord();
+        writer.addString(path);
+        writer.addNumber(totals.files);
+        writer.addNumber(totals.bytes);
+        writer.addNumber(totals.allocated);
+        writer.addNumber(totals.coldFiles);
+        writer.addNumber(totals.coldBytes);
+        writer.addNumber(totals.coldAllocated);
+        writer.addDouble(totals.bytes ? static_cast<double>(totals.coldBytes) / totals.bytes : 0.0, 4);
+        writer.addSignedNumber(totals.lastTouch);
+        // Bytes not touched in N days: every age bucket from the one starting at N up
+        for (size_t edge = 1; edge < std::size(COLD_AGE_DAYS); ++edge)
+        {
+            unsigned long long idle = 0;
+            for (size_t bucket = edge + 1; bucket < COLD_AGE_BUCKETS; ++bucket)
+            {
+                idle += totals.ageBytes[bucket];
+            }
+            writer.addNumber(idle);
+        }
+        writer.endRecord();
+    };
+    for (const auto &root : report.roots())
+    {
+        if (const ColdDirectory *totals = report.directory(root))
+        {
+            addRow(root, *totals);
+        }
+    }
+    const auto subtrees = report.coldSubtrees(options.minColdShare);
+    for (size_t i = 0; i < subtrees.size() && (options.limit == 0 || i < options.limit); ++i)
+    {
+        addRow(subtrees[i].first, *subtrees[i].second);
+    }
+}
+
+// batch: delete-type
+void runDeleteTypeCommand(const BatchOptions &options, ReportWriter &writer, ErrorTable &errors)
+{
+    writer.setColumns({"path", "size", "pattern", "action"});
+    const NameMatcher &selection = options.selection;
+    std::string lowered;
+    std::vector<std::tuple<std::string, unsigned long long, size_t>> matches; // path, size and pattern
+    std::vector<std::pair<unsigned long long, unsigned long long>> totals(selection.size());
+    MetricsPhase selectionPhase("selection");
+    for (const auto &root : options.roots)
+    {
+        scanTree(root, [&](const ScanEntry &entry)
+                 {
+                     const size_t index = selection.match(entry.name, lowered);
+                     if (index != NameMatcher::NO_MATCH)
+                     {
+                         matches.emplace_back(std::string(entry.path), entry.size, index);
+                         ++totals[index].first;
+                         totals[index].second += entry.size;
+                     }
+                 },
+                 errors, options.scanOptions);
+    }
+    printSelectionSummary(std::cerr, selection, totals);
+
+    // Files are moved after the walk so the traversal never sees its own renames
+    MetricsPhase deletionPhase("deletion");
+    if (options.dryRun)
+    {
+        for (const auto &[path, size, index] : matches)
+        {
+            writer.beginRecord();
+            writer.addString(path);
+            writer.addNumber(size);
+            writer.addString(selection.pattern(index));
+            writer.addString("would-move");
+            writer.endRecord();
+        }
+        return;
+    }
+    DeletionPlan plan(options.journalBatch);
+    std::vector<size_t> patternOfMove;
+    std::error_code ec;
+    for (const auto &[path, size, index] : matches)
+    {
+        if (!plan.add(path, ec))
+        {
+            errors.record(path, ec.value(), ScanOp::Stat);
+        }
+        patternOfMove.resize(plan.moves().size(), index);
+    }
+    std::string error;
+    if (!plan.empty() && (!plan.begin(error) || !plan.execute(error, options.scanOptions.control)))
+    {
+        std::cerr << "Error: " << error << '\n';
+        errors.record(DeletionPlan::journalPath(), 0, ScanOp::Write);
+    }
+    for (size_t i = 0; i < plan.moves().size(); ++i)
+    {
+        const PlannedMove &move = plan.moves()[i];
+        if (move.state == PlannedMove::State::Failed)
+        {
+            errors.record(move.source, move.error, ScanOp::Move);
+        }
+        writer.beginRecord();
+        writer.addString(move.source);
+        writer.addNumber(move.size);
+        writer.addString(selection.pattern(patternOfMove[i]));
+        writer.addString(moveStateName(move.state));
+        writer.endRecord();
+    }
+}
+
+// batch: plan
+int runPlanCommand(const BatchOptions &options, ReportWriter &writer, ErrorTable &errors)
+{
+    writer.setColumns({"source", "target", "size", "state"});
+    if (options.planAction == "status" && !DeletionPlan::interrupted())
+    {
+        std::cerr << "No interrupted deletion plan in " << DeletionPlan::journalPath() << '\n';
+        return 0;
+    }
+    DeletionPlan plan(options.journalBatch);
+    std::string error;
+    bool done = plan.load(error);
+    if (done && options.planAction == "replay")
+    {
+        done = plan.execute(error, options.scanOptions.control);
+    }
+    else if (done && options.planAction == "rollback")
+    {
+        done = plan.rollback(error);
+    }
+    if (!done)
+    {
+        std::cerr << "Error: " << error << '\n';
+    }
+    for (const auto &move : plan.moves())
+    {
+        if (move.error != 0 && move.state != PlannedMove::State::Restored)
+        {
+            errors.record(options.planAction == "rollback" ? move.target : move.source, move.error, ScanOp::Move);
+        }
+        writer.beginRecord();
+        writer.addString(move.source);
+        writer.addString(move.target);
+        writer.addNumber(move.size);
+        writer.addString(moveStateName(move.state));
+        writer.endRecord();
+    }
+    return done ? 0 : 1;
+}
+
+// Function to write size bytes of content derived from contentSeed, so equal seeds give equal files
+bool writeSyntheticFile(const std::string &path, unsigned long long contentSeed, unsigned long long size)
+{
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    SplitMix64 rng(contentSeed);
+    unsigned long long buffer[8192];
+    bool ok = true;
+    while (size > 0 && ok)
+    {
+        for (auto &word : buffer)
+        {
+            word = rng.next();
+        }
+        const size_t chunk = static_cast<size_t>(std::min<unsigned long long>(size, sizeof(buffer)));
+        ok = ::write(fd, buffer, chunk) == static_cast<ssize_t>(chunk);
+        size -= chunk;
+    }
+    return ::close(fd) == 0 && ok;
+}
+
+// Totals reported by generateTree
+struct GeneratedTree
+{
+    unsigned long long directories = 0;
+    unsigned long long files = 0;
+    unsigned long long bytes = 0;
+    unsigned long long duplicates = 0;
+    unsigned long long hardLinks = 0;
+};
+
+// Function to build a deterministic synthetic tree under root from spec
+bool generateTree(const fs::path &root, const TreeSpec &spec, GeneratedTree &result)
+{
+    struct RecentFile
+    {
+        std::string path;
+        unsigned long long contentSeed;
+        unsigned long long size;
+    };
+
+    SplitMix64 rng(spec.seed);
+    unsigned totalWeight = 0;
+    for (const auto &ext : spec.extensions)
+    {
+        totalWeight += ext.second;
+    }
+    const double logMin = std::log(static_cast<double>(std::max<unsigned long long>(spec.minSize, 1)));
+    const double logMax = std::log(static_cast<double>(std::max(spec.maxSize, spec.minSize) + 1));
+
+    // Duplicate and hard-link sources come from a bounded window of recent files
+    std::vector<RecentFile> recent(1024);
+    size_t recentCount = 0;
+
+    std::vector<std::pair<std::string, unsigned>> pending = {{root.string(), 0}};
+    while (!pending.empty())
+    {
+        auto [dir, level] = pending.back();
+        pending.pop_back();
+        std::error_code ec;
+        fs::create_directories(dir, ec);
+        if (ec)
+        {
+            std::cerr << "Cannot create " << dir << ": " << ec.message() << '\n';
+            return false;
+        }
+        ++result.directories;
+
+        char name[32];
+        for (unsigned i = 0; i < spec.filesPerDir; ++i)
+        {
+            unsigned pick = totalWeight ? static_cast<unsigned>(rng.next() % totalWeight) : 0;
+            size_t extIndex = 0;
+            while (extIndex + 1 < spec.extensions.size() && pick >= spec.extensions[extIndex].second)
+            {
+                pick -= spec.extensions[extIndex++].second;
+            }
+            std::snprintf(name, sizeof(name), "/f%05u", i);
+            const std::string path = dir + name + spec.extensions[extIndex].first;
 
-//     return duplicateFiles;
-// }
-// Function to detect duplicate files using MD5 hashing
-std::unordered_map<std::string, std::vector<fs::path>> findDuplicateFiles(const fs::path& rootPath) {
-    std::unordered_map<std::string, std::vector<fs::path>> duplicateFiles;
+            const double roll = rng.nextDouble();
+            RecentFile &slot = recent[(recentCount) % recent.size()];
+            if (recentCount > 0 && roll < spec.hardLinkRatio)
+            {
+                const RecentFile &source = recent[rng.next() % std::min(recentCount, recent.size())];
+                if (::link(source.path.c_str(), path.c_str()) == 0)
+                {
+                    ++result.files;
+                    ++result.hardLinks;
+                    continue;
+                }
+            }
 
-    for (const auto& entry : fs::recursive_directory_iterator(rootPath)) {
-        if (fs::is_regular_file(entry)) {
-            std::string md5Hash = computeFileMD5(entry.path());
-            if (!md5Hash.empty()) {
-                duplicateFiles[md5Hash].push_back(entry.path());
+            unsigned long long contentSeed = rng.next();
+            unsigned long long size = static_cast<unsigned long long>(std::exp(logMin + (logMax - logMin) * rng.nextDouble()));
+            if (recentCount > 0 && roll < spec.hardLinkRatio + spec.duplicateRatio)
+            {
+                const RecentFile &source = recent[rng.next() % std::min(recentCount, recent.size())];
+                contentSeed = source.contentSeed;
+                size = source.size;
+                ++result.duplicates;
+            }
+            if (!writeSyntheticFile(path, contentSeed, size))
+            {
+                std::cerr << "Cannot write " << path << ": " << std::strerror(errno) << '\n';
+                return false;
             }
+            slot = {path, contentSeed, size};
+            ++recentCount;
+            ++result.files;
+            result.bytes += size;
         }
-    }
 
-    // Remove entries with a single file (no duplicates based on MD5 hash)
-    for (auto it = duplicateFiles.begin(); it != duplicateFiles.end();) {
-        if (it->second.size() < 2) {
-            it = duplicateFiles.erase(it);
-        } else {
-            ++it;
+        if (level < spec.depth)
+        {
+            for (unsigned i = spec.fanout; i-- > 0;)
+            {
+                std::snprintf(name, sizeof(name), "/d%03u", i);
+                pending.emplace_back(dir + name, level + 1);
+            }
         }
     }
-
-    return duplicateFiles;
+    return true;
 }
-// Function to calculate mean
-double calculateMean(const std::vector<uintmax_t> &fileSizes)
+
+// Resource usage snapshot taken around each benchmark phase
+struct ResourceSample
 {
-    double total = std::accumulate(fileSizes.begin(), fileSizes.end(), 0.0);
-    return total / fileSizes.size();
+    std::chrono::steady_clock::time_point wall;
+    unsigned long long readSyscalls = 0;
+    unsigned long long writeSyscalls = 0;
+    long peakRssKb = 0;
+};
+
+// Function to reset the process's peak RSS (VmHWM) to its current RSS so the next sample reports
+// the peak of one phase; returns false where the kernel does not allow it (before Linux 4.0)
+bool resetPeakRss()
+{
+    std::ofstream clear("/proc/self/clear_refs");
+    return static_cast<bool>(clear << "5" << std::flush);
 }
 
-// Function to calculate standard deviation
-double calculateStandardDeviation(const std::vector<uintmax_t> &fileSizes, double mean)
+// Function to sample wall time, peak RSS since the last resetPeakRss() and the read/write syscall
+// counters in /proc/self/io
+ResourceSample sampleResources()
 {
-    double sumSquaredDifferences = 0.0;
-    for (uintmax_t size : fileSizes)
+    ResourceSample sample;
+    sample.wall = std::chrono::steady_clock::now();
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
     {
-        double diff = static_cast<double>(size) - mean;
-        sumSquaredDifferences += diff * diff;
+        if (line.compare(0, 6, "VmHWM:") == 0)
+        {
+            sample.peakRssKb = std::strtol(line.c_str() + 6, nullptr, 10);
+            break;
+        }
     }
-    double variance = sumSquaredDifferences / fileSizes.size();
-    return std::sqrt(variance);
+    std::ifstream io("/proc/self/io");
+    std::string key;
+    unsigned long long value;
+    while (io >> key >> value)
+    {
+        if (key == "syscr:")
+        {
+            sample.readSyscalls = value;
+        }
+        else if (key == "syscw:")
+        {
+            sample.writeSyscalls = value;
+        }
+    }
+    return sample;
 }
 
-// Function to identify large files
-std::vector<fs::path> findLargeFiles(const fs::path &rootPath, double mean, double stdDev)
+// Measured result of one benchmark phase
+struct BenchResult
 {
-    std::vector<fs::path> largeFiles;
+    std::string phase;
+    double seconds = 0.0;
+    unsigned long long files = 0;
+    unsigned long long bytes = 0;
+    long peakRssKb = 0;
+    unsigned long long syscalls = 0;
+
+    double filesPerSecond() const { return seconds > 0 ? files / seconds : 0.0; }
+    double megabytesPerSecond() const { return seconds > 0 ? bytes / seconds / (1024 * 1024) : 0.0; }
+};
 
-    for (const auto &entry : fs::recursive_directory_iterator(rootPath))
+// Function to time body(), which returns the files and bytes it processed
+template <typename Body>
+BenchResult runBenchPhase(const char *phase, Body &&body)
+{
+    // Without the reset, peak_rss_kb is the whole process's peak up to the end of the phase
+    static bool warned = false;
+    if (!resetPeakRss() && !warned)
     {
-        if (fs::is_regular_file(entry) && fs::file_size(entry) > mean + stdDev)
-        {
-            largeFiles.push_back(entry.path());
-        }
+        std::cerr << "peak RSS cannot be reset here; peak_rss_kb is the process peak so far\n";
+        warned = true;
     }
-    // Sort the largeFiles vector in descending order based on file sizes
-    std::sort(largeFiles.begin(), largeFiles.end(), [](const fs::path &a, const fs::path &b)
-              { return fs::file_size(a) > fs::file_size(b); });
-    return largeFiles;
+    const ResourceSample before = sampleResources();
+    BenchResult result;
+    result.phase = phase;
+    std::tie(result.files, result.bytes) = body();
+    const ResourceSample after = sampleResources();
+    result.seconds = std::chrono::duration<double>(after.wall - before.wall).count();
+    result.peakRssKb = after.peakRssKb;
+    result.syscalls = (after.readSyscalls - before.readSyscalls) + (after.writeSyscalls - before.writeSyscalls);
+    std::cerr << phase << ": " << std::fixed << std::setprecision(3) << result.seconds << " s, "
+              << std::setprecision(0) << result.filesPerSecond() << " files/s, "
+              << std::setprecision(1) << result.megabytesPerSecond() << " MB/s\n";
+    return result;
 }
 
-// case 3
-void traverse_directories(const std::string &directory, std::vector<FileExtension> &file_types, std::vector<std::string> &inaccessibleDirs)
+// Function to parse one flat JSON object ({"key":value,...}) into raw key/value strings
+bool parseFlatJsonObject(std::string_view line, std::unordered_map<std::string, std::string> &fields)
 {
-    try
+    fields.clear();
+    size_t i = line.find('{');
+    if (i == std::string_view::npos)
+    {
+        return false;
+    }
+    ++i;
+    while (i < line.size())
     {
-        for (const auto &entry : fs::recursive_directory_iterator(directory))
+        const size_t keyStart = line.find('"', i);
+        if (keyStart == std::string_view::npos)
+        {
+            break;
+        }
+        const size_t keyEnd = line.find('"', keyStart + 1);
+        const size_t colon = line.find(':', keyEnd);
+        if (keyEnd == std::string_view::npos || colon == std::string_view::npos)
+        {
+            return false;
+        }
+        size_t valueStart = colon + 1;
+        size_t valueEnd;
+        if (valueStart < line.size() && line[valueStart] == '"')
         {
-            try
+            ++valueStart;
+            valueEnd = line.find('"', valueStart);
+            if (valueEnd == std::string_view::npos)
             {
-                if (fs::is_regular_file(entry))
-                {
-                    std::string extension = entry.path().extension().string();
-                    // Convert extension to lowercase for case-insensitivity
-                    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
-                    // Add other file type checks based on your specific use case
-                    // For example, checking for image file extensions like .jpg, .png, etc.
-
-                    // Accumulate space utilization by file type
-                    auto it = std::find_if(file_types.begin(), file_types.end(),
-                                           [&extension](const FileExtension &ft)
-                                           { return ft.extension == extension; });
-
-                    if (it != file_types.end())
-                    {
-                        it->size += fs::file_size(entry);
-                    }
-                    else
-                    {
-                        FileExtension ft;
-                        ft.extension = extension;
-                        ft.size = fs::file_size(entry);
-                        file_types.push_back(ft);
-                    }
-                }
+                return false;
             }
-            catch (const std::exception &e)
+            i = valueEnd + 1;
+        }
+        else
+        {
+            valueEnd = line.find_first_of(",}", valueStart);
+            if (valueEnd == std::string_view::npos)
             {
-                // Handle exceptions while accessing individual files, if needed
-                std::cerr << "Error while accessing file: " << entry.path() << ": " << e.what() << '\n';
-                const fs::path dirPath = directory;
-                inaccessibleDirs.push_back(dirPath.string());
+                return false;
             }
+            i = valueEnd;
         }
+        fields[std::string(line.substr(keyStart + 1, keyEnd - keyStart - 1))] =
+            std::string(line.substr(valueStart, valueEnd - valueStart));
+        i = line.find_first_of(",}", i);
+        if (i == std::string_view::npos || line[i] == '}')
+        {
+            break;
+        }
+        ++i;
     }
-    catch (const std::exception &e)
-    {
-        // Handle the exception while traversing directories, e.g., print an error message
-        const fs::path dirPath = directory;
-        std::cout << "Drive - " << dirPath;
-        // std::cerr << "Error while traversing directories: " << dirPath.string()<< " "<< e.what() << '\n';
-    }
-    std::cout << "\n";
-
-    // Display inaccessible directories
+    return true;
 }
-bool sortBySize(const FileExtension &a, const FileExtension &b)
-{
-    return a.size > b.size;
-}
-// Function to calculate the space utilization breakdown for specific file types
-void calculateSpaceUtilization(const std::string &drive)
+
+// Function to compare results against a baseline written by --save-baseline.
+// Returns false if any phase is slower than the baseline by more than tolerance (a fraction).
+bool compareWithBaseline(const std::vector<BenchResult> &results, const std::string &baselinePath, double tolerance)
 {
-    std::vector<FileExtension> file_types;
-    std::vector<std::string> inaccessibleDirs;
-    traverse_directories(drive, file_types, inaccessibleDirs);
-    std::sort(file_types.begin(), file_types.end(), sortBySize);
+    std::ifstream baseline(baselinePath);
+    if (!baseline)
+    {
+        std::cerr << "Cannot read baseline " << baselinePath << '\n';
+        return false;
+    }
+    std::unordered_map<std::string, double> baselineSeconds;
+    std::unordered_map<std::string, std::string> fields;
+    std::string line;
+    while (std::getline(baseline, line))
+    {
+        if (parseFlatJsonObject(line, fields) && fields.count("phase") && fields.count("seconds"))
+        {
+            baselineSeconds[fields["phase"]] = std::strtod(fields["seconds"].c_str(), nullptr);
+        }
+    }
 
-    // Display the breakdown of space utilization
-    std::cout << "Space Utilization Breakdown:\n";
-    for (const auto &ft : file_types)
+    bool withinTolerance = true;
+    std::cerr << "\nComparison with " << baselinePath << ":\n";
+    for (const auto &result : results)
     {
-        std::cout << "File Type: " << ft.extension << ", Size: " << sizeToString(ft.size) << " \n";
-        if (!inaccessibleDirs.empty())
+        auto it = baselineSeconds.find(result.phase);
+        if (it == baselineSeconds.end() || it->second <= 0)
         {
-            std::cout << "Inaccessible Directories:\n";
-            for (const auto &dir : inaccessibleDirs)
-            {
-                std::cout << dir << "\n";
-            }
-            std::cout << "\n";
+            std::cerr << "  " << result.phase << ": no baseline\n";
+            continue;
         }
+        const double change = (result.seconds - it->second) / it->second;
+        // Sub-millisecond phases are dominated by timer noise, so they never count as regressions
+        const bool regressed = change > tolerance && result.seconds - it->second > 0.005;
+        withinTolerance = withinTolerance && !regressed;
+        std::cerr << "  " << result.phase << ": " << std::showpos << std::setprecision(1) << change * 100 << std::noshowpos
+                  << "% (" << std::setprecision(3) << it->second << " s -> " << result.seconds << " s)"
+                  << (regressed ? "  REGRESSION" : "") << '\n';
     }
+    return withinTolerance;
 }
 
-// Function to categorize files based on their extensions
-FileType categorizeFile(const fs::path &filePath)
+// Function to write benchmark results through writer
+void writeBenchResults(const std::vector<BenchResult> &results, ReportWriter &writer)
 {
-    auto extension = filePath.extension().string();
-    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower); // Convert extension to lowercase
-    if (fileTypeMap.find(extension) != fileTypeMap.end())
+    writer.setColumns({"phase", "seconds", "files", "bytes", "files_per_sec", "mb_per_sec", "peak_rss_kb", "syscalls"});
+    for (const auto &result : results)
     {
-        return fileTypeMap[extension];
+        writer.beginRecord();
+        writer.addString(result.phase);
+        writer.addDouble(result.seconds, 6);
+        writer.addNumber(result.files);
+        writer.addNumber(result.bytes);
+        writer.addDouble(result.filesPerSecond(), 1);
+        writer.addDouble(result.megabytesPerSecond(), 2);
+        writer.addSignedNumber(result.peakRssKb);
+        writer.addNumber(result.syscalls);
+        writer.endRecord();
     }
-    return FileType::Unknown;
 }
 
-// Function to get the name of the file type as a string
-std::string getFileTypeName(FileType type)
+// batch: gen-tree
+void runGenTreeCommand(const BatchOptions &options, ReportWriter &writer, ErrorTable &errors)
 {
-    switch (type)
+    writer.setColumns({"root", "directories", "files", "bytes", "duplicates", "hard_links"});
+    for (const auto &root : options.roots)
     {
-    case FileType::Video:
-        return "Video";
-    case FileType::Image:
-        return "Image";
-    case FileType::Document:
-        return "Document";
-    // Add more cases for other file types
-    default:
-        return "Unknown";
+        GeneratedTree tree;
+        if (!generateTree(root, options.treeSpec, tree))
+        {
+            errors.record(root.string(), 0, ScanOp::Write);
+            continue;
+        }
+        writer.beginRecord();
+        writer.addString(root.string());
+        writer.addNumber(tree.directories);
+        writer.addNumber(tree.files);
+        writer.addNumber(tree.bytes);
+        writer.addNumber(tree.duplicates);
+        writer.addNumber(tree.hardLinks);
+        writer.endRecord();
     }
 }
 
-// Custom recursive directory traversal function
-void traverseDirectory(const fs::path &dirPath, const std::vector<FileType> &fileTypesToScan, std::unordered_map<FileType, uintmax_t> &fileTypeUsage, std::vector<std::string> &inaccessibleDirs)
+// batch: bench. Generates a fresh tree under <root>/tree, then times each engine phase on it.
+// Deletion runs last and moves every file of --delete-ext into <root>/Trash.
+int runBenchCommand(const BatchOptions &options, ReportWriter &writer, ErrorTable &errors)
 {
-    //std::mutex mtx; // Mutex to synchronize access to the shared data structures
-  //  std::vector<std::thread> threads; // Vector to hold thread objects
-    try
+    const fs::path workDir = fs::absolute(options.roots.front());
+    const fs::path treeRoot = workDir / "tree";
+    std::error_code ec;
+    fs::remove_all(treeRoot, ec);
+    fs::remove_all(workDir / TRASH_DIR_NAME, ec);
+
+    GeneratedTree tree;
+    std::cerr << "Generating tree in " << treeRoot << "...\n";
+    if (!generateTree(treeRoot, options.treeSpec, tree))
+    {
+        return 1;
+    }
+    std::cerr << tree.files << " files, " << sizeToString(tree.bytes) << " in " << tree.directories << " directories\n";
+
+    std::vector<BenchResult> results;
+    std::vector<std::string> paths;
+    results.push_back(runBenchPhase("traversal", [&]
+                                    {
+                                        unsigned long long files = 0, bytes = 0;
+                                        scanTree(treeRoot, [&](const ScanEntry &entry)
+                                                 {
+                                                     ++files;
+                                                     bytes += entry.size;
+                                                     paths.emplace_back(entry.path);
+                                                 },
+                                                 errors);
+                                        return std::make_pair(files, bytes);
+                                    }));
+    results.push_back(runBenchPhase("hashing", [&]
+                                    {
+                                        unsigned long long files = 0, bytes = 0;
+                                        for (const auto &path : paths)
+                                        {
+                                            if (!computeFileMD5(path).empty())
+                                            {
+                                                ++files;
+                                                bytes += fs::file_size(path, ec);
+                                            }
+                                        }
+                                        return std::make_pair(files, bytes);
+                                    }));
+    results.push_back(runBenchPhase("aggregation", [&]
+                                    {
+                                        unsigned long long files = 0, bytes = 0;
+                                        std::unordered_map<std::string, unsigned long long> totals;
+                                        std::string extension;
+                                        scanTree(treeRoot, [&](const ScanEntry &entry)
+                                                 {
+                                                     lowercaseInto(extensionOf(entry.name), extension);
+                                                     totals[extension] += entry.size;
+                                                     ++files;
+                                                     bytes += entry.size;
+                                                 },
+                                                 errors);
+                                        return std::make_pair(files, bytes);
+                                    }));
+    results.push_back(runBenchPhase("duplicates", [&]
+                                    {
+                                        unsigned long long files = 0, bytes = 0;
+                                        for (const auto &[hash, group] : findDuplicateFiles(treeRoot, errors))
+                                        {
+                                            files += group.size();
+                                            bytes += group.size() * fs::file_size(group.front(), ec);
+                                        }
+                                        return std::make_pair(files, bytes);
+                                    }));
+
+    const fs::path previousDir = fs::current_path();
+    fs::current_path(workDir);
+    results.push_back(runBenchPhase("deletion", [&]
+                                    {
+                                        unsigned long long files = 0, bytes = 0;
+                                        std::string extension, error;
+                                        DeletionPlan plan(options.journalBatch);
+                                        for (const auto &path : paths)
+                                        {
+                                            lowercaseInto(extensionOf(path), extension);
+                                            if (extension == options.extension)
+                                            {
+                                                plan.add(path, ec);
+                                            }
+                                        }
+                                        if (!plan.empty() && (!plan.begin(error) || !plan.execute(error)))
+                                        {
+                                            std::cerr << "Error: " << error << '\n';
+                                        }
+                                        // Count what execute moved, not what was planned
+                                        for (const auto &move : plan.moves())
+                                        {
+                                            if (move.state == PlannedMove::State::Moved)
+                                            {
+                                                bytes += move.size;
+                                                ++files;
+                                            }
+                                        }
+                                        return std::make_pair(files, bytes);
+                                    }));
+    fs::current_path(previousDir);
+
+    writeBenchResults(results, writer);
+    writer.flush();
+    if (!options.saveBaselinePath.empty())
     {
-        for (const auto &entry : fs::directory_iterator(dirPath))
+        int fd = ::open(options.saveBaselinePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
         {
-            if (fs::is_regular_file(entry))
-            {
-                FileType fileType = categorizeFile(entry.path());
-                if (fileType != FileType::Unknown && std::find(fileTypesToScan.begin(), fileTypesToScan.end(), fileType) != fileTypesToScan.end())
-                {
-                    // std::lock_guard<std::mutex> lock(mtx); // Lock the mutex to safely modify the shared fileTypeUsage map
-                    fileTypeUsage[fileType] += fs::file_size(entry.path());
-                }
-            }
-            else if (fs::is_directory(entry))
-            {
-                traverseDirectory(entry.path(), fileTypesToScan, fileTypeUsage, inaccessibleDirs);
-                //  threads.emplace_back([&]() {
-                //         traverseDirectory(entry.path(), fileTypesToScan, fileTypeUsage, inaccessibleDirs);
-                //     });
-            }
+            std::cerr << "Cannot write baseline " << options.saveBaselinePath << '\n';
+            return 1;
+        }
+        {
+            ReportWriter baseline(fd, ReportWriter::Format::Ndjson);
+            writeBenchResults(results, baseline);
         }
+        ::close(fd);
     }
-    catch (const fs::filesystem_error &e)
+    if (!options.baselinePath.empty() && !compareWithBaseline(results, options.baselinePath, options.tolerance))
     {
-        // Handle the error while iterating through directories
-        // std::cerr << "Error accessing file/directory: " << " - " << e.what() << "\n";
-        //  std::cerr << "Error accessing file/directory: " << dirPath.string() << " - " << e.what() << "\n";
-        inaccessibleDirs.push_back(dirPath.string());
+        return 1;
     }
+    return 0;
 }
 
-// Function to calculate the space utilization breakdown for specific file types
-void calculateSpaceUtilization(const fs::path &drive, const std::vector<FileType> &fileTypesToScan)
+// Function to run one non-interactive subcommand; returns the process exit code
+int runBatch(int argc, char *argv[])
 {
-    fs::space_info spaceInfo;
-    try
+    BatchOptions options;
+    if (!parseBatchOptions(argc, argv, options))
     {
-        spaceInfo = fs::space(drive);
+        printBatchUsage();
+        return 2;
     }
-    catch (const fs::filesystem_error &e)
+
+    int fd = STDOUT_FILENO;
+    if (!options.outputPath.empty())
     {
-        // Handle the error while accessing the main directory
-        std::cerr << "Error accessing the drive: " << drive << " - " << e.what() << "\n";
-        return;
+        fd = ::open(options.outputPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            std::cerr << "Cannot open " << options.outputPath << ": " << std::strerror(errno) << '\n';
+            return 1;
+        }
     }
 
-    std::cout << "Drive: " << drive << "\n";
-    std::cout << "Total Space: " << sizeToString( spaceInfo.capacity) << " \n";
-    std::cout << "Free Space: " << sizeToString( spaceInfo.free) << " \n";
-
-    // Data structure to store space utilization breakdown by file type
-    std::unordered_map<FileType, uintmax_t> fileTypeUsage;
-
-    std::vector<std::string> inaccessibleDirs;
-
-    // Perform custom recursive directory traversal
-    traverseDirectory(drive, fileTypesToScan, fileTypeUsage, inaccessibleDirs);
-
-    // Display space utilization breakdown by file type
-    for (const auto &[type, size] : fileTypeUsage)
+    applyProcessPriority(options.ioprio, options.niceLevel);
+    std::unique_ptr<Throttle> throttle;
+    if (options.throttleLimits.readBytesPerSecond > 0 || options.throttleLimits.metadataOpsPerSecond > 0 ||
+        !options.controlPath.empty())
     {
-        std::cout << getFileTypeName(type) << ": " << sizeToString(size) << " \n";
+        throttle = std::make_unique<Throttle>(options.throttleLimits, options.controlPath);
+        options.scanOptions.throttle = throttle.get();
     }
+    addMountRules(options.scanRules, options.defaultExcludes);
+    options.scanOptions.rules = &options.scanRules;
+    ScanControl control;
+    if (options.timeBudget > 0)
+    {
+        control.setTimeBudget(options.timeBudget);
+    }
+    if (options.ioBudget > 0)
+    {
+        control.setByteBudget(options.ioBudget);
+    }
+    // serve installs its own handlers and gives every rescan a control of its own
+    if (options.command != "gen-tree" && options.command != "bench" && options.command != "serve" && options.command != "ask")
+    {
+        ScanControl::installSignalHandlers();
+        options.scanOptions.control = &control;
+    }
+    options.duplicateOptions.scanOptions = options.scanOptions;
 
-    std::cout << "\n";
-
-    // Display inaccessible directories
-    if (!inaccessibleDirs.empty())
+    ErrorTable errors;
+    bool writeFailed = false;
+    int exitCode = 0;
+    const auto wallStart = std::chrono::steady_clock::now();
+    const double cpuStart = processCpuSeconds();
     {
-        std::cout << "Inaccessible Directories:\n";
-        for (const auto &dir : inaccessibleDirs)
+        ReportWriter writer(fd, options.format);
+        const bool showProgress = options.progress < 0 ? options.command != "bench" && options.command != "serve" &&
+                                                             options.command != "ask" && ::isatty(STDERR_FILENO)
+                                                       : options.progress > 0;
+        std::unique_ptr<ProgressReporter> progress;
+        if (showProgress)
         {
-            std::cout << dir << "\n";
+            progress = std::make_unique<ProgressReporter>();
         }
-        std::cout << "\n";
+        if (options.command == "scan")
+        {
+            runScanCommand(options, writer, errors);
+        }
+        else if (options.command == "breakdown")
+        {
+            runBreakdownCommand(options, writer, errors);
+        }
+        else if (options.command == "dupes")
+        {
+            runDupesCommand(options, writer, errors);
+        }
+        else if (options.command == "large")
+        {
+            runLargeCommand(options, writer, errors);
+        }
+        else if (options.command == "delete-type")
+        {
+            runDeleteTypeCommand(options, writer, errors);
+        }
+        else if (options.command == "cold")
+        {
+            runColdCommand(options, writer, errors);
+        }
+        else if (options.command == "mounts")
+        {
+            runMountsCommand(options, writer, errors);
+        }
+        else if (options.command == "similar")
+        {
+            runSimilarCommand(options, writer, errors);
+        }
+        else if (options.command == "estimate")
+        {
+            runEstimateCommand(options, writer, errors);
+        }
+        else if (options.command == "dupe-dirs")
+        {
+            runDupeDirsCommand(options, writer, errors);
+        }
+        else if (options.command == "query")
+        {
+            runQueryCommand(options, writer, errors);
+        }
+        else if (options.command == "snapshot")
+        {
+            runSnapshotCommand(options, writer, errors);
+        }
+        else if (options.command == "history")
+        {
+            runHistoryCommand(options, writer, errors);
+        }
+        else if (options.command == "growth")
+        {
+            runGrowthCommand(options, writer, errors);
+        }
+        else if (options.command == "chunks")
+        {
+            runChunksCommand(options, writer, errors);
+        }
+        else if (options.command == "compress")
+        {
+            runCompressCommand(options, writer, errors);
+        }
+        else if (options.command == "serve")
+        {
+            runServeCommand(options, writer, errors);
+        }
+        else if (options.command == "ask")
+        {
+            exitCode = runAskCommand(options, writer, errors);
+        }
+        else if (options.command == "plan")
+        {
+            exitCode = runPlanCommand(options, writer, errors);
+        }
+        else if (options.command == "export")
+        {
+            runExportCommand(options, writer, errors);
+        }
+        else if (options.command == "merge")
+        {
+            runMergeCommand(options, writer, errors);
+        }
+        else if (options.command == "gen-tree")
+        {
+            runGenTreeCommand(options, writer, errors);
+        }
+        else if (options.command == "bench")
+        {
+            exitCode = runBenchCommand(options, writer, errors);
+        }
+        progress.reset();
+        writer.flush();
+        writeFailed = writer.failed();
+    }
+    if (fd != STDOUT_FILENO)
+    {
+        ::close(fd);
     }
-}
-
-// Function to delete files of specific types using multi-threading
-void delete_files_of_type(const fs::path&  directory, const std::string& file_type) {
-    std::vector<std::thread> threads;
-
-    try {
-        for (const auto& entry : fs::recursive_directory_iterator(directory)) {
-            try {
-                if (fs::is_regular_file(entry)) {
-                    std::string extension = entry.path().extension().string();
-                    // Convert extension to lowercase for case-insensitivity
-                    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
 
-                    if (extension == file_type) {
-                        std::cout << "Deleting file: " << entry.path() << '\n';
-                        threads.emplace_back([](const fs::directory_entry& e) {
-                            moveToTrash (e);
-                        }, entry);
-                    }
-                }
-            } catch (const std::exception& e) {
-                // Handle exceptions while accessing individual files, if needed
-                std::cerr << "Error while accessing file: " << entry.path() << ": " << e.what() << '\n';
+    if (!options.metricsPath.empty())
+    {
+        const double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+        const double cpuSeconds = processCpuSeconds() - cpuStart;
+        int metricsFd = options.metricsPath == "-" ? STDERR_FILENO
+                                                   : ::open(options.metricsPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (metricsFd < 0)
+        {
+            std::cerr << "Cannot open " << options.metricsPath << ": " << std::strerror(errno) << '\n';
+        }
+        else
+        {
+            {
+                ReportWriter metricsWriter(metricsFd, options.format);
+                writeMetricsSummary(metricsWriter, wallSeconds, cpuSeconds);
+            }
+            if (metricsFd != STDERR_FILENO)
+            {
+                ::close(metricsFd);
             }
         }
-    } catch (const std::exception& e) {
-        // Handle the exception while traversing directories
-        std::cerr << "Error while traversing directory: " << directory << ": " << e.what() << '\n';
     }
 
-    // Wait for all threads to finish
-    for (auto& thread : threads) {
-        thread.join();
+    // Scan errors go to stderr once, after the report has been written
+    errors.summarize(std::cerr);
+    if (writeFailed)
+    {
+        std::cerr << "Failed to write report: " << std::strerror(errno) << '\n';
+        return 1;
+    }
+    if (control.reason() != ScanControl::Stop::None)
+    {
+        std::cerr << "Stopped early (" << control.reasonName() << "), the report is partial\n";
+        return 3;
     }
+    return exitCode != 0 || !errors.empty() ? 1 : 0;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
-    std::vector<std::string> drives = {"C:/","D:/","F:/"}; // Replace with available drives on your system
+    if (argc > 1)
+    {
+        return runBatch(argc, argv);
+    }
+
+    std::vector<MountInfo> mounts = discoverMounts(); // Real filesystems from /proc/self/mountinfo
+    std::vector<std::string> drives;
+    for (const auto &mount : mounts)
+    {
+        drives.push_back(mount.mountPoint);
+    }
     std::unordered_map<std::string, std::vector<fs::path>> duplicateFile;
     std::vector<uintmax_t> fileSizes;
     std::vector<fs::path> largeFiles;
@@ -619,6 +13520,11 @@ int main()
     std::string file_type_to_delete;
     // std::vector<FileExtension> fileExtensionsToScan = { FileExtension::Video, FileExtension::Image, FileExtension::Document };
     fs::path rootPath = fs::current_path();
+    if (DeletionPlan::interrupted())
+    {
+        std::cout << "An earlier deletion was interrupted. Run 'diskmanager plan replay' to finish it or "
+                  << "'diskmanager plan rollback' to undo it before deleting more files.\n";
+    }
     int choice = 1;
     do
     {
@@ -639,37 +13545,60 @@ int main()
         case 1:
             for (const auto &drive : drives)
             {
-                fs::space_info spaceInfo = fs::space(drive);
+                SpaceStats space = querySpace(drive);
                 std::cout << "Drive: " << drive << "\n";
                 //std::cout << std::fixed << std::setprecision(2);
                // double freeSpaceGB = static_cast<double>(spaceInfo.free) / (1024 * 1024 * 1024);
 
-                std::cout << "Free Space: " << sizeToString(spaceInfo.free) << "\n\n";
+                std::cout << "Free Space: " << sizeToString(space.free) << "\n\n";
 //                std::cout << "Free Space: " << freeSpaceGB << " GB\n\n";
             }
             break;
         case 2:
             for (const auto &drive : drives)
             {
-                fs::space_info spaceInfo = fs::space(drive);
+                SpaceStats space = querySpace(drive);
                 std::cout << "Drive: " << drive << "\n";
                 std::cout << std::fixed << std::setprecision(2);
                // double usedSpaceGB = static_cast<double>(spaceInfo.capacity - spaceInfo.free) / (1024 * 1024 * 1024);
-                std::cout << "Used Space: " << sizeToString(spaceInfo.capacity - spaceInfo.free) << "\n\n";
+                std::cout << "Used Space: " << sizeToString(space.capacity - space.free) << "\n\n";
             }
             break;
         case 3:
-            for (const auto &drive : drives)
+        {
+            // Independent devices are scanned in parallel; results are printed once all are done
+            std::vector<MountScanResult> results;
             {
-
-                calculateSpaceUtilization(drive);
+                ProgressReporter progress;
+                ScanOptions scanOptions;
+                scanOptions.rules = &interactiveScanRules();
+                results = scanMountsInParallel(mounts, scanOptions);
+            }
+            for (const auto &result : results)
+            {
+                std::cout << "Drive - " << result.mount.mountPoint << "\n";
+                std::cout << "Space Utilization Breakdown:\n";
+                for (const auto &ft : result.fileTypes)
+                {
+                    std::cout << "File Type: " << ft.extension << ", Size: " << sizeToString(ft.size) << ", Allocated: " << sizeToString(ft.allocated) << " \n";
+                }
+                result.errors.summarize(std::cout);
+                std::cout << "\n";
             }
             break;
+        }
         case 4:
             // Implement the function for detecting duplicate files
             std::cout << "\nFinding duplicate files...\n";
-            duplicateFile = findDuplicateFiles(rootPath);
-            displayDuplicateFiles(duplicateFile);
+            {
+                ErrorTable errors;
+                {
+                    ProgressReporter progress;
+                    duplicateFile = findDuplicateFiles(rootPath, errors);
+                }
+                displayDuplicateFiles(duplicateFile);
+                errors.summarize(std::cout);
+            }
             std::cout << "Do you want to delete duplicate files( y / n)?";
             char dupli;
             std::cin >> dupli;
@@ -679,31 +13608,43 @@ int main()
         case 5:
             // Implement the function for identifying large files
 
-            std::cout << "\nCalculating statistics and finding large files...\n";
-            for (const auto &entry : fs::recursive_directory_iterator(rootPath))
             {
-                if (fs::is_regular_file(entry))
+                std::cout << "Rank by allocated disk space instead of file size (y / n)? ";
+                char byAllocated;
+                std::cin >> byAllocated;
+                const SizeBasis basis = byAllocated == 'y' ? SizeBasis::Allocated : SizeBasis::Apparent;
+
+                std::cout << "\nCalculating statistics and finding large files...\n";
+                ErrorTable errors;
+                fileSizes.clear();
+                scanTree(rootPath, [&](const ScanEntry &entry)
+                         { fileSizes.push_back(sizeFor(entry, basis)); },
+                         errors);
+                if (!fileSizes.empty())
                 {
-                    fileSizes.push_back(fs::file_size(entry));
-                }
-            }
-            if (!fileSizes.empty())
-            {
-                double mean = calculateMean(fileSizes);
-                double stdDev = calculateStandardDeviation(fileSizes, mean);
+                    double mean = calculateMean(fileSizes);
+                    double stdDev = calculateStandardDeviation(fileSizes, mean);
 
-                std::cout << "Mean file size: " <<  sizeToString(mean) << " \n";
-                std::cout << "Standard Deviation: " << sizeToString(stdDev) << " \n";
+                    std::cout << "Mean file size: " <<  sizeToString(mean) << " \n";
+                    std::cout << "Standard Deviation: " << sizeToString(stdDev) << " \n";
 
-                std::cout << "\nFinding large files...\n";
-                largeFiles = findLargeFiles(rootPath, mean, stdDev);
-                for (size_t i = 0; i < largeFiles.size(); ++i)
-                {
-                    double sizeMB = static_cast<double>(fs::file_size(largeFiles[i])) / (1024 * 1024);
-                    std::cout << i + 1 << ". Large file: " << fs::path(largeFiles[i]).filename().string() << " (Size: " << sizeMB << " MB)\n";
+                    std::cout << "\nFinding large files...\n";
+                    largeFiles.clear();
+                    for (const auto &file : findLargeFiles(rootPath, mean, stdDev, basis))
+                    {
+                        largeFiles.emplace_back(file.path);
+                        std::cout << largeFiles.size() << ". Large file: " << largeFiles.back().filename().string() << " (Size: " << sizeToString(file.size)
+                                  << ", Allocated: " << sizeToString(file.allocated);
+                        if (isSparseCandidate(file.size, file.allocated))
+                        {
+                            std::cout << ", Holes: " << sizeToString(measureHoleBytes(file.path, file.size, errors));
+                        }
+                        std::cout << ")\n";
+                    }
                 }
+                errors.summarize(std::cout);
             }
-            else
+            if (fileSizes.empty())
             {
                 std::cout << "No files found in the directory.\n";
             }
@@ -716,9 +13657,9 @@ int main()
         case 6:
             // Implement the function for scanning specific file types
 
-            // for (const auto& drive : drives) {
-            calculateSpaceUtilization("F:/", fileTypesToScan);
-            //    }
+            for (const auto& drive : drives) {
+                calculateSpaceUtilization(drive, fileTypesToScan, interactiveScanRules());
+            }
 
             std::cout << "\nNOTE: If some directories are inaccessible, try running the program as an administrator to access all files.\n";
 
@@ -726,7 +13667,7 @@ int main()
         case 7:
             // Allow users to delete files of specific types
            
-             std::cout << "\nEnter the file type to delete (e.g., .txt, .jpg, etc.): ";
+             std::cout << "\nEnter the file types to delete, separated by commas (e.g., .txt or .log,.tmp,core.*): ";
              std::cin >> file_type_to_delete;
              delete_files_of_type(rootPath, file_type_to_delete);
             break;